@@ -0,0 +1,1350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "pfs.h"
+#include "dir.h"
+#include "utils.h"
+
+/* predictFS benchmarks
+ *   ./pfs_bench io [MiB]   sequential fs_write/fs_read throughput for every disk backend
+ *   ./pfs_bench stripe [MiB] [members] throughput of one image against a RAID-0 of members images
+ *   ./pfs_bench meta [files] directory create/lookup/stat workload for several buffer cache sizes
+ *   ./pfs_bench stat [files] repeated fs_stat over a directory tree, cold then from the inode cache
+ *   ./pfs_bench lookup [files] repeated fs_lookup of paths three directories deep, hits and
+ *                          misses, with and without the dentry cache
+ *   ./pfs_bench cachesim [blocks] [trace] block traces replayed against LRU, CLOCK, 2Q and ARC,
+ *                          then path lookups during a streamed read on the real cache
+ *   ./pfs_bench sched      simulated HDD time of small interleaved writes with and without the write scheduler
+ *   ./pfs_bench writeback  bursts of small overwrites written through and in write-back mode
+ *   ./pfs_bench readahead [MiB] cold sequential and random small reads with readahead on and off
+ *   ./pfs_bench extents [extents] block lookups and small reads of a fragmented file, descending
+ *                          the extent tree against the decoded extent map
+ *   ./pfs_bench append [MiB] extents and time of large, interleaved and fragmented-disk writes
+ *   ./pfs_bench delalloc   write-back mode with and without delayed allocation: interleaved appends and temp files
+ *   ./pfs_bench tiny [files] blocks used and cold reads of files stored in the inode and of files just past it
+ *   ./pfs_bench alloc      heap allocations per warm getattr, read and create of the FUSE ops
+ *   ./pfs_bench format [MiB] time and blocks written to format an image of that size
+ *   ./pfs_bench predict    simulated HDD service time of interleaved appends, with and
+ *                          without a trained prediction layer
+ * Set PFS_STATS_JSON=1 to also dump the full disk statistics of each run.
+ */
+
+#define BENCH_IMAGE "bench.img"
+#define BENCH_CHUNK (128 * 1024)
+
+// Heap allocation counter: pfs_bench is linked with --wrap for the allocator entry
+// points, so every malloc, calloc, realloc and aligned_alloc the library makes is
+// counted here against the calling thread before it reaches the real allocator
+static __thread uint64_t heap_allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    heap_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    heap_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    heap_allocations++;
+    return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size)
+{
+    heap_allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Formats a fresh image big enough for size bytes of file data and mounts it
+static bool bench_mount(FileSystem *fs, DiskBackend backend, size_t size)
+{
+    size_t blocks = (size / BLOCK_SIZE) * 2 + 256;
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open_backend(BENCH_IMAGE, blocks, backend);
+    if (disk == NULL || !fs_format(disk)) return false;
+    memset(fs, 0, sizeof(*fs));
+    return fs_mount(fs, disk);
+}
+
+static void bench_io(size_t mib)
+{
+    const char *names[] = {"file", "direct", "uring", "mmap"};
+    size_t size = mib * 1024 * 1024;
+    char *chunk = malloc(BENCH_CHUNK);
+    memset(chunk, 'x', BENCH_CHUNK);
+
+    printf("%-8s %12s %12s %12s %12s %10s %14s\n", "backend", "write MiB/s", "read MiB/s",
+           "blk writes", "blk reads", "syscalls", "seq/rand wr");
+    for (size_t b = 0; b < sizeof(names) / sizeof(names[0]); b++) {
+        FileSystem fs;
+        if (!bench_mount(&fs, disk_backend_from_name(names[b]), size)) {
+            printf("%-8s setup failed\n", names[b]);
+            continue;
+        }
+        ssize_t inode = fs_create(&fs);
+
+        double start = now_seconds();
+        for (size_t off = 0; off < size; off += BENCH_CHUNK) {
+            fs_write(&fs, inode, chunk, BENCH_CHUNK, off);
+        }
+        disk_sync(fs.disk);
+        double write_time = now_seconds() - start;
+        size_t writes = fs.disk->writes;
+        DiskStats after_write;
+        disk_stats_snapshot(fs.disk, &after_write);
+
+        start = now_seconds();
+        for (size_t off = 0; off < size; off += BENCH_CHUNK) {
+            fs_read(&fs, inode, chunk, BENCH_CHUNK, off);
+        }
+        double read_time = now_seconds() - start;
+
+        DiskStats stats;
+        disk_stats_snapshot(fs.disk, &stats);
+        printf("%-8s %12.1f %12.1f %12zu %12zu %10llu %7llu/%-6llu\n", fs.disk->ops->name,
+               mib / write_time, mib / read_time, writes, fs.disk->reads,
+               (unsigned long long)stats.syscalls,
+               (unsigned long long)after_write.write.sequential, (unsigned long long)after_write.write.random);
+        if (getenv("PFS_STATS_JSON") != NULL) {
+            disk_stats_dump_json(&stats, stdout);
+        }
+        fs_unmount(&fs);
+    }
+    unlink(BENCH_IMAGE);
+    free(chunk);
+}
+
+#define STRIPE_UNIT 16   // Blocks per stripe unit (64 KiB)
+
+// Formats and mounts a disk striped over members images named bench.img.N
+static bool bench_mount_striped(FileSystem *fs, size_t members, size_t size)
+{
+    size_t blocks = (size / BLOCK_SIZE) * 2 + 256;
+    char names[members][32];
+    const char *paths[members];
+    for (size_t m = 0; m < members; m++) {
+        snprintf(names[m], sizeof(names[m]), BENCH_IMAGE ".%zu", m);
+        unlink(names[m]);
+        paths[m] = names[m];
+    }
+    Disk *disk = disk_open_striped(paths, members, blocks, STRIPE_UNIT);
+    if (disk == NULL || !fs_format(disk)) return false;
+    memset(fs, 0, sizeof(*fs));
+    return fs_mount(fs, disk);
+}
+
+static void bench_stripe(size_t mib, size_t max_members)
+{
+    size_t size = mib * 1024 * 1024;
+    char *chunk = malloc(BENCH_CHUNK);
+    memset(chunk, 's', BENCH_CHUNK);
+
+    printf("%-8s %12s %12s %10s\n", "members", "write MiB/s", "read MiB/s", "syscalls");
+    for (size_t members = 1; members <= max_members; members *= 2) {
+        FileSystem fs;
+        if (!bench_mount_striped(&fs, members, size)) {
+            printf("%-8zu setup failed\n", members);
+            continue;
+        }
+        ssize_t inode = fs_create(&fs);
+
+        double start = now_seconds();
+        for (size_t off = 0; off < size; off += BENCH_CHUNK) {
+            fs_write(&fs, inode, chunk, BENCH_CHUNK, off);
+        }
+        disk_sync(fs.disk);
+        double write_time = now_seconds() - start;
+
+        start = now_seconds();
+        for (size_t off = 0; off < size; off += BENCH_CHUNK) {
+            fs_read(&fs, inode, chunk, BENCH_CHUNK, off);
+        }
+        double read_time = now_seconds() - start;
+
+        DiskStats stats;
+        disk_stats_snapshot(fs.disk, &stats);
+        printf("%-8zu %12.1f %12.1f %10llu\n", members, mib / write_time, mib / read_time,
+               (unsigned long long)stats.syscalls);
+        fs_unmount(&fs);
+        for (size_t m = 0; m < members; m++) {
+            char name[32];
+            snprintf(name, sizeof(name), BENCH_IMAGE ".%zu", m);
+            unlink(name);
+        }
+    }
+    free(chunk);
+}
+
+// Adds files entries to the root directory, then looks every name up and stats it
+static void bench_meta_run(size_t files, size_t capacity)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_format(disk) || !cache_enable(disk, capacity) || !fs_mount(&fs, disk)) {
+        printf("%-9zu setup failed\n", capacity);
+        return;
+    }
+
+    char name[28];
+    double start = now_seconds();
+    for (size_t i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "file%zu", i);
+        ssize_t inode = fs_create(&fs);
+        if (inode < 0 || dir_add(&fs, 0, name, inode) < 0) break;
+    }
+    for (size_t i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "file%zu", i);
+        ssize_t inode = dir_lookup(&fs, 0, name);
+        if (inode >= 0) fs_stat(&fs, inode);
+    }
+    double elapsed = now_seconds() - start;
+
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+    uint64_t lookups = stats.cache_hits + stats.cache_misses;
+    printf("%-9zu %10.1f %12zu %12zu %9.1f%%\n", capacity, elapsed * 1e3, disk->reads, disk->writes,
+           lookups ? 100.0 * stats.cache_hits / lookups : 0.0);
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_meta(size_t files)
+{
+    printf("%-9s %10s %12s %12s %10s\n", "cache", "ms", "blk reads", "blk writes", "hit rate");
+    size_t capacities[] = {1, 16, 256, 1024};
+    for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+        bench_meta_run(files, capacities[i]);
+    }
+}
+
+#define STAT_PASSES (3)
+
+// Creates files spread over 16 directories, remounts, then stats every inode
+// STAT_PASSES times: the first pass loads the in-core inode table, the later
+// ones are served from memory
+static void bench_stat(size_t files)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("setup failed\n");
+        return;
+    }
+    char name[28];
+    ssize_t dirs[16];
+    for (size_t d = 0; d < 16; d++) {
+        snprintf(name, sizeof(name), "dir%zu", d);
+        dirs[d] = dir_create(&fs);
+        if (dirs[d] < 0 || dir_add(&fs, 0, name, dirs[d]) < 0) {
+            printf("setup failed\n");
+            fs_unmount(&fs);
+            return;
+        }
+    }
+    for (size_t i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "file%zu", i);
+        ssize_t inode = fs_create(&fs);
+        if (inode < 0 || dir_add(&fs, dirs[i % 16], name, inode) < 0) break;
+    }
+    fs_unmount(&fs);
+
+    // a small buffer cache, so inode-table blocks really come from the disk
+    disk = disk_open(BENCH_IMAGE, 16384);
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !cache_enable(disk, 16) || !fs_mount(&fs, disk)) {
+        printf("remount failed\n");
+        return;
+    }
+    size_t inodes = files + 17;
+    printf("%-6s %10s %12s %12s %12s\n", "pass", "ms", "blk reads", "icache hits", "icache miss");
+    for (size_t pass = 1; pass <= STAT_PASSES; pass++) {
+        size_t reads = disk->reads;
+        InodeCacheStats before = icache_stats(&fs);
+        double start = now_seconds();
+        for (size_t i = 0; i < inodes; i++) {
+            fs_stat(&fs, i);
+        }
+        double elapsed = now_seconds() - start;
+        InodeCacheStats after = icache_stats(&fs);
+        printf("%-6zu %10.2f %12zu %12llu %12llu\n", pass, elapsed * 1e3, disk->reads - reads,
+               (unsigned long long)(after.hits - before.hits), (unsigned long long)(after.misses - before.misses));
+    }
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+#define LOOKUP_PASSES (3)
+
+// Resolves /a/b/c/fileN for every file, plus as many names that do not exist, a
+// few times over, scanning the directories on every lookup or through the dentry cache
+static void bench_lookup_run(size_t files, bool dcache)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("lookup setup failed\n");
+        return;
+    }
+    if (!dcache) {
+        dcache_destroy(fs.dcache);
+        fs.dcache = NULL;
+    }
+    const char *dirs[] = {"a", "b", "c"};
+    ssize_t parent = 0;
+    for (size_t d = 0; d < 3; d++) {
+        ssize_t dir = dir_create(&fs);
+        if (dir < 0 || dir_add(&fs, parent, dirs[d], dir) < 0) {
+            printf("lookup setup failed\n");
+            fs_unmount(&fs);
+            return;
+        }
+        parent = dir;
+    }
+    char path[64];
+    for (size_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "file%zu", i);
+        ssize_t inode = fs_create(&fs);
+        if (inode < 0 || dir_add(&fs, parent, path, inode) < 0) break;
+    }
+
+    for (size_t pass = 1; pass <= LOOKUP_PASSES; pass++) {
+        size_t found = 0;
+        double start = now_seconds();
+        for (size_t i = 0; i < files; i++) {
+            snprintf(path, sizeof(path), "/a/b/c/file%zu", i);
+            if (fs_lookup(&fs, path) >= 0) found++;
+            snprintf(path, sizeof(path), "/a/b/c/missing%zu", i);
+            if (fs_lookup(&fs, path) >= 0) found++;
+        }
+        double elapsed = now_seconds() - start;
+        DcacheStats stats = dcache_stats(&fs);
+        printf("%-6s %-6zu %10.2f %12.2f %8zu %10llu %10llu %10llu\n", dcache ? "on" : "off", pass, elapsed * 1e3,
+               elapsed * 1e9 / (2 * files), found, (unsigned long long)stats.path_hits,
+               (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+    }
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_lookup(size_t files)
+{
+    printf("%-6s %-6s %10s %12s %8s %10s %10s %10s\n", "dcache", "pass", "ms", "ns/lookup", "found",
+           "path hits", "hits", "misses");
+    bench_lookup_run(files, false);
+    bench_lookup_run(files, true);
+}
+
+#define CACHESIM_TRACE  (200000)
+
+static const CachePolicy *bench_policies[] = { &cache_policy_lru, &cache_policy_clock, &cache_policy_2q, &cache_policy_arc };
+#define BENCH_POLICIES (sizeof(bench_policies) / sizeof(bench_policies[0]))
+
+// Hot metadata set of half the cache read at random, each access followed by three blocks of a one-pass scan
+static size_t trace_scan(size_t *trace, size_t capacity)
+{
+    size_t scan = 1000000;
+    for (size_t i = 0; i < CACHESIM_TRACE; i++) {
+        trace[i] = (i % 4 == 0) ? (size_t)rand() % (capacity / 2) : scan++;
+    }
+    return CACHESIM_TRACE;
+}
+
+// A loop over a quarter more blocks than the cache holds
+static size_t trace_loop(size_t *trace, size_t capacity)
+{
+    size_t span = capacity + capacity / 4;
+    for (size_t i = 0; i < CACHESIM_TRACE; i++) trace[i] = i % span;
+    return CACHESIM_TRACE;
+}
+
+// Skewed random accesses over eight times the cache size
+static size_t trace_skewed(size_t *trace, size_t capacity)
+{
+    for (size_t i = 0; i < CACHESIM_TRACE; i++) {
+        double u = (double)rand() / RAND_MAX;
+        trace[i] = (size_t)(8 * capacity * u * u * u);
+    }
+    return CACHESIM_TRACE;
+}
+
+// One block number per line
+static size_t trace_file(size_t **trace, const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror("trace_file: Error opening the trace has failed");
+        return 0;
+    }
+    size_t count = 0, cap = 0;
+    unsigned long long block;
+    while (fscanf(in, "%llu", &block) == 1) {
+        if (count == cap) {
+            cap = cap ? 2 * cap : 65536;
+            size_t *grown = realloc(*trace, cap * sizeof(size_t));
+            if (grown == NULL) break;
+            *trace = grown;
+        }
+        (*trace)[count++] = (size_t)block;
+    }
+    fclose(in);
+    return count;
+}
+
+static void bench_cachesim_trace(const char *label, const size_t *trace, size_t count, size_t capacity)
+{
+    printf("%-8s", label);
+    for (size_t p = 0; p < BENCH_POLICIES; p++) {
+        CacheStats stats;
+        if (!cache_simulate(bench_policies[p], capacity, trace, count, &stats)) {
+            printf(" %9s", "-");
+            continue;
+        }
+        printf(" %8.1f%%", count ? 100.0 * stats.hits / count : 0.0);
+    }
+    printf("\n");
+}
+
+#define SCAN_DIRS       (16)
+#define SCAN_FILES      (1024)
+#define SCAN_MIB        (16)
+#define SCAN_LOOKUPS    (64)    // path lookups after every SCAN_BURST blocks streamed
+#define SCAN_BURST      (512)
+
+// Streams a large file in 4 KiB reads while resolving paths of a directory tree,
+// the way a nightly job reading logs competes with fs_lookup for the buffer cache
+static void bench_cachesim_fs(const CachePolicy *policy, size_t capacity)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    char *chunk = malloc(BLOCK_SIZE);
+    if (chunk == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%-8s setup failed\n", policy->name);
+        free(chunk);
+        return;
+    }
+    char name[28];
+    ssize_t dirs[SCAN_DIRS];
+    for (size_t d = 0; d < SCAN_DIRS; d++) {
+        snprintf(name, sizeof(name), "d%zu", d);
+        dirs[d] = dir_create(&fs);
+        dir_add(&fs, 0, name, dirs[d]);
+    }
+    for (size_t i = 0; i < SCAN_FILES; i++) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        dir_add(&fs, dirs[i % SCAN_DIRS], name, fs_create(&fs));
+    }
+    ssize_t log = fs_create(&fs);
+    dir_add(&fs, 0, "nightly.log", log);
+    memset(chunk, 'l', BLOCK_SIZE);
+    for (size_t b = 0; b < SCAN_MIB * 256; b++) fs_write(&fs, log, chunk, BLOCK_SIZE, b * BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    disk = disk_open(BENCH_IMAGE, 16384);
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !cache_enable_policy(disk, capacity, policy) || !fs_mount(&fs, disk)) {
+        printf("%-8s remount failed\n", policy->name);
+        free(chunk);
+        return;
+    }
+    char path[64];
+    srand(11);
+    // warm the directory blocks, then stream the log between lookups
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < SCAN_FILES; i++) {
+            snprintf(path, sizeof(path), "/d%zu/f%zu", i % SCAN_DIRS, i);
+            fs_lookup(&fs, path);
+        }
+    }
+    size_t reads = disk->reads;
+    CacheStats before = cache_stats(disk);
+    double start = now_seconds();
+    for (size_t b = 0; b < SCAN_MIB * 256; b++) {
+        fs_read(&fs, log, chunk, BLOCK_SIZE, b * BLOCK_SIZE);
+        if (b % SCAN_BURST == 0) {
+            for (size_t l = 0; l < SCAN_LOOKUPS; l++) {
+                size_t i = (size_t)rand() % SCAN_FILES;
+                snprintf(path, sizeof(path), "/d%zu/f%zu", i % SCAN_DIRS, i);
+                fs_lookup(&fs, path);
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    CacheStats after = cache_stats(disk);
+    uint64_t lookups = (after.hits - before.hits) + (after.misses - before.misses);
+    printf("%-8s %10.1f %12zu %9.1f%% %12llu\n", policy->name, elapsed * 1e3, disk->reads - reads,
+           lookups ? 100.0 * (after.hits - before.hits) / lookups : 0.0,
+           (unsigned long long)(after.ghost_hits - before.ghost_hits));
+    fs_unmount(&fs);
+    free(chunk);
+    unlink(BENCH_IMAGE);
+}
+
+// Replays block traces against every replacement policy, then runs the scan workload on the real cache
+static void bench_cachesim(size_t capacity, const char *path)
+{
+    if (capacity < 4) capacity = 4;
+    size_t *trace = malloc(CACHESIM_TRACE * sizeof(size_t));
+    if (trace == NULL) return;
+
+    printf("simulated hit rate, %zu blocks\n%-8s", capacity, "trace");
+    for (size_t p = 0; p < BENCH_POLICIES; p++) printf(" %9s", bench_policies[p]->name);
+    printf("\n");
+    srand(5);
+    bench_cachesim_trace("scan", trace, trace_scan(trace, capacity), capacity);
+    bench_cachesim_trace("loop", trace, trace_loop(trace, capacity), capacity);
+    bench_cachesim_trace("skewed", trace, trace_skewed(trace, capacity), capacity);
+    if (path != NULL) {
+        size_t count = trace_file(&trace, path);
+        bench_cachesim_trace("file", trace, count, capacity);
+    }
+    free(trace);
+
+    printf("\nfs_lookup during a %d MiB stream, %zu block cache\n", SCAN_MIB, capacity / 4);
+    printf("%-8s %10s %12s %10s %12s\n", "policy", "ms", "blk reads", "hit rate", "ghost hits");
+    for (size_t p = 0; p < BENCH_POLICIES; p++) {
+        bench_cachesim_fs(bench_policies[p], capacity / 4);
+    }
+}
+
+#define SCHED_FILES   16
+#define SCHED_WRITES  64    // 4 KiB appends per file
+
+// Appends to SCHED_FILES files round-robin on a simulated HDD, so every fs_write
+// alternates between a data block and an inode-table block
+static void bench_sched_run(size_t capacity)
+{
+    char block[BLOCK_SIZE];
+    memset(block, 'q', sizeof(block));
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open_sim(BENCH_IMAGE, 8192, NULL);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%-9zu setup failed\n", capacity);
+        return;
+    }
+    if (capacity > 0) disk_queue_enable(disk, capacity);
+
+    ssize_t inodes[SCHED_FILES];
+    for (size_t f = 0; f < SCHED_FILES; f++) inodes[f] = fs_create(&fs);
+    disk_stats_reset(disk);
+    double start = now_seconds();
+    for (size_t w = 0; w < SCHED_WRITES; w++) {
+        for (size_t f = 0; f < SCHED_FILES; f++) {
+            fs_write(&fs, inodes[f], block, BLOCK_SIZE, w * BLOCK_SIZE);
+        }
+    }
+    disk_sync(disk);
+    double real = now_seconds() - start;
+
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+    printf("%-9zu %14.2f %10.3f %10llu %10llu %10llu %10llu\n", capacity,
+           stats.write.simulated_ns / 1e6, real * 1e3,
+           (unsigned long long)stats.write.runs, (unsigned long long)stats.write.random,
+           (unsigned long long)stats.absorbed, (unsigned long long)stats.merged);
+    if (getenv("PFS_STATS_JSON") != NULL) {
+        disk_stats_dump_json(&stats, stdout);
+    }
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_sched(void)
+{
+    printf("%-9s %14s %10s %10s %10s %10s %10s\n", "queue", "sim write ms", "real ms",
+           "runs", "random", "absorbed", "merged");
+    size_t capacities[] = {0, 64, 256, 1024};
+    for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+        bench_sched_run(capacities[i]);
+    }
+}
+
+#define WB_FILE_BLOCKS   64
+#define WB_BURSTS        8
+#define WB_BURST_WRITES  512    // 256 byte overwrites per burst
+
+// Bursts of small random overwrites of one file on a simulated HDD, with a pause
+// after every burst long enough for the flusher's age threshold to fire
+static void bench_writeback_run(const char *label, bool writeback)
+{
+    char record[256];
+    memset(record, 'w', sizeof(record));
+    char *fill = calloc(WB_FILE_BLOCKS, BLOCK_SIZE);
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open_sim(BENCH_IMAGE, 8192, NULL);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (fill == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%-10s setup failed\n", label);
+        free(fill);
+        return;
+    }
+    WritebackConfig config = { .interval_ms = 10, .expire_ms = 50, .dirty_ratio = WRITEBACK_DIRTY_RATIO,
+                               .queue_blocks = WRITEBACK_QUEUE_BLOCKS };
+    if (writeback && !fs_writeback_enable(&fs, &config)) {
+        printf("%-10s write-back unavailable\n", label);
+    }
+    ssize_t inode = fs_create(&fs);
+    fs_write(&fs, inode, fill, WB_FILE_BLOCKS * BLOCK_SIZE, 0);
+    fs_sync(&fs);
+    disk_stats_reset(disk);
+
+    srand(7);
+    double start = now_seconds();
+    for (size_t burst = 0; burst < WB_BURSTS; burst++) {
+        for (size_t w = 0; w < WB_BURST_WRITES; w++) {
+            size_t offset = (size_t)rand() % (WB_FILE_BLOCKS * BLOCK_SIZE - sizeof(record));
+            fs_write(&fs, inode, record, sizeof(record), offset);
+        }
+        struct timespec pause = { .tv_sec = 0, .tv_nsec = 100 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+    double sync_start = now_seconds();
+    fs_sync(&fs);
+    double sync_ms = (now_seconds() - sync_start) * 1e3;
+    double real = (sync_start - start) * 1e3 - WB_BURSTS * 100.0;
+
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+    WritebackStats flusher = fs_writeback_stats(&fs);
+    printf("%-10s %12.2f %14.2f %12llu %10llu %10.2f\n", label, real, stats.write.simulated_ns / 1e6,
+           (unsigned long long)stats.write.blocks, (unsigned long long)flusher.expired, sync_ms);
+    if (getenv("PFS_STATS_JSON") != NULL) {
+        disk_stats_dump_json(&stats, stdout);
+    }
+    fs_unmount(&fs);
+    free(fill);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_writeback(void)
+{
+    printf("%-10s %12s %14s %12s %10s %10s\n", "mode", "write ms", "sim write ms", "blk writes", "age flush", "sync ms");
+    bench_writeback_run("through", false);
+    bench_writeback_run("writeback", true);
+}
+
+#define RA_RECORDS_RANDOM 2048   // Records read at random offsets after the sequential runs
+
+// Reads a file of mib MiB back in records of record bytes on a simulated HDD, sequentially
+// or at random offsets, with readahead on or off. Readahead turns one small request per
+// record into windows of up to READAHEAD_MAX_BLOCKS blocks along the extents.
+static void bench_readahead_run(size_t mib, size_t record, bool readahead, bool random)
+{
+    size_t size = mib * 1024 * 1024;
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open_sim(BENCH_IMAGE, (size / BLOCK_SIZE) * 2 + 256, NULL);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    char *chunk = malloc(BENCH_CHUNK);
+    if (chunk == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("readahead setup failed\n");
+        free(chunk);
+        return;
+    }
+    memset(chunk, 'r', BENCH_CHUNK);
+    ssize_t inode = fs_create(&fs);
+    for (size_t done = 0; done < size; done += BENCH_CHUNK) fs_write(&fs, inode, chunk, BENCH_CHUNK, done);
+    fs_unmount(&fs);
+
+    // remount so the file is read cold
+    disk = disk_open_sim(BENCH_IMAGE, (size / BLOCK_SIZE) * 2 + 256, NULL);
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_mount(&fs, disk)) {
+        printf("readahead remount failed\n");
+        free(chunk);
+        return;
+    }
+    if (!readahead) fs_readahead_disable(&fs);
+    disk_stats_reset(disk);
+
+    srand(5);
+    size_t records = random ? RA_RECORDS_RANDOM : size / record;
+    double start = now_seconds();
+    for (size_t r = 0; r < records; r++) {
+        size_t offset = random ? ((size_t)rand() % (size / record)) * record : r * record;
+        fs_read(&fs, inode, chunk, record, offset);
+    }
+    double elapsed = now_seconds() - start;
+
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+    CacheStats cache = cache_stats(disk);
+    ReadaheadStats streams = fs_readahead_stats(&fs);
+    printf("%-6s %-4s %7zuK %10.2f %10llu %10.1f %12.2f %10llu %10llu %10llu\n", random ? "random" : "seq",
+           readahead ? "on" : "off", record / 1024, elapsed * 1e3, (unsigned long long)stats.read.requests,
+           stats.read.requests ? (double)stats.read.blocks / stats.read.requests : 0.0,
+           stats.read.simulated_ns / 1e6, (unsigned long long)streams.windows,
+           (unsigned long long)cache.prefetch_hits, (unsigned long long)streams.covered);
+    if (getenv("PFS_STATS_JSON") != NULL) {
+        disk_stats_dump_json(&stats, stdout);
+    }
+    fs_unmount(&fs);
+    free(chunk);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_readahead(size_t mib)
+{
+    printf("%-6s %-4s %8s %10s %10s %10s %12s %10s %10s %10s\n", "access", "ra", "record", "read ms",
+           "requests", "blk/req", "sim read ms", "windows", "ra hits", "covered");
+    size_t records[] = {4096, 16384};
+    for (size_t i = 0; i < sizeof(records) / sizeof(records[0]); i++) {
+        bench_readahead_run(mib, records[i], false, false);
+        bench_readahead_run(mib, records[i], true, false);
+    }
+    bench_readahead_run(mib, 4096, false, true);
+    bench_readahead_run(mib, 4096, true, true);
+}
+
+#define EXTENT_LOOKUPS (200000)   // Random logical blocks looked up per pass
+
+// Builds a file of extents one-block extents by interleaving its writes with a
+// second file, then looks up random blocks through a copy of the inode (every
+// lookup descends the extent tree) and through the pinned
+// inode (binary search in the decoded map), and times small reads over it.
+static void bench_extents(size_t extents)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, extents * 3 + 256);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("extents setup failed\n");
+        return;
+    }
+    char block[BLOCK_SIZE];
+    memset(block, 'e', sizeof(block));
+    ssize_t inode = fs_create(&fs), other = fs_create(&fs);
+    for (size_t i = 0; i < extents; i++) {
+        fs_write(&fs, inode, block, BLOCK_SIZE, i * BLOCK_SIZE);
+        fs_write(&fs, other, block, BLOCK_SIZE, i * BLOCK_SIZE);
+    }
+
+    Inode *copy = fs_read_inode(&fs, inode);
+    Inode *pinned = icache_get(&fs, inode);
+    if (copy == NULL || pinned == NULL) {
+        printf("extents setup failed\n");
+        fs_free_inode(copy);
+        fs_unmount(&fs);
+        return;
+    }
+    printf("%-8s %8s %12s %12s %12s\n", "lookup", "extents", "ms", "ns/lookup", "blk reads");
+    const Inode *inodes[] = { copy, pinned };
+    const char *labels[] = { "walk", "map" };
+    for (size_t k = 0; k < 2; k++) {
+        size_t reads = disk->reads;
+        uint64_t sum = 0;
+        srand(9);
+        double start = now_seconds();
+        for (size_t i = 0; i < EXTENT_LOOKUPS; i++) {
+            uint32_t logical = (uint32_t)((size_t)rand() % extents);
+            sum += (k == 0) ? extent_lookup(&fs, inodes[k], logical) : icache_extent_run(&fs, inodes[k], logical, NULL);
+        }
+        double elapsed = now_seconds() - start;
+        printf("%-8s %8u %12.2f %12.1f %12zu\n", labels[k], copy->extent_count, elapsed * 1e3,
+               elapsed * 1e9 / EXTENT_LOOKUPS, disk->reads - reads);
+        if (sum == 0) printf("extents lookups found nothing\n");
+    }
+    icache_put(&fs, pinned);
+    fs_free_inode(copy);
+
+    // 4K reads at random offsets and whole-file reads, both served by the map
+    char *file = malloc(extents * BLOCK_SIZE);
+    srand(9);
+    double start = now_seconds();
+    for (size_t i = 0; i < EXTENT_LOOKUPS; i++) {
+        fs_read(&fs, inode, block, BLOCK_SIZE, ((size_t)rand() % extents) * BLOCK_SIZE);
+    }
+    double small = now_seconds() - start;
+    start = now_seconds();
+    for (size_t i = 0; file != NULL && i < 100; i++) {
+        fs_read(&fs, inode, file, extents * BLOCK_SIZE, 0);
+    }
+    double whole = now_seconds() - start;
+    InodeCacheStats icache = icache_stats(&fs);
+    printf("4K read %.1f ns, whole file read %.1f us, extent maps decoded %llu\n", small * 1e9 / EXTENT_LOOKUPS,
+           whole * 1e6 / 100, (unsigned long long)icache.maps);
+    free(file);
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+#define APPEND_RECORD (1024 * 1024)
+#define APPEND_SMALL  (64 * 1024)
+
+static uint32_t append_extents(FileSystem *fs, ssize_t inode)
+{
+    Inode *copy = fs_read_inode(fs, inode);
+    uint32_t extents = (copy != NULL) ? copy->extent_count : 0;
+    fs_free_inode(copy);
+    return extents;
+}
+
+// Writes mib MiB into each of files files, record bytes per fs_write and round robin,
+// and prints the extents of the first file and the write time
+static void bench_append_run(FileSystem *fs, const char *label, size_t mib, size_t files, size_t record, const char *data)
+{
+    ssize_t inodes[2];
+    for (size_t f = 0; f < files; f++) inodes[f] = fs_create(fs);
+    size_t bytes = mib * 1024 * 1024;
+    double start = now_seconds();
+    for (size_t offset = 0; offset < bytes; offset += record) {
+        for (size_t f = 0; f < files; f++) fs_write(fs, inodes[f], data, record, offset);
+    }
+    double elapsed = now_seconds() - start;
+    printf("%-12s %8zu %10u %12.2f %12.1f\n", label, mib * files, append_extents(fs, inodes[0]), elapsed * 1e3,
+           elapsed * 1e6 / (double)(mib * files));
+}
+
+static void bench_append(size_t mib)
+{
+    unlink(BENCH_IMAGE);
+    // room for the files and a fragmented region of the same size
+    Disk *disk = disk_open(BENCH_IMAGE, (mib * 6 + 16) * 256);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    char *data = malloc(APPEND_RECORD);
+    if (data == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("append setup failed\n");
+        free(data);
+        return;
+    }
+    memset(data, 'w', APPEND_RECORD);
+    printf("%-12s %8s %10s %12s %12s\n", "workload", "MiB", "extents", "ms", "us/MiB");
+    bench_append_run(&fs, "1M writes", mib, 1, APPEND_RECORD, data);
+    bench_append_run(&fs, "interleaved", mib, 2, APPEND_SMALL, data);
+
+    // every other small file removed, the free space is a series of 64 KiB holes
+    size_t holes = mib * 1024 * 1024 / APPEND_SMALL;
+    ssize_t *small = malloc(holes * 2 * sizeof(ssize_t));
+    for (size_t i = 0; small != NULL && i < holes * 2; i++) {
+        small[i] = fs_create(&fs);
+        fs_write(&fs, small[i], data, APPEND_SMALL, 0);
+    }
+    for (size_t i = 0; small != NULL && i < holes * 2; i += 2) fs_remove(&fs, small[i]);
+    bench_append_run(&fs, "fragmented", mib, 1, APPEND_RECORD, data);
+    free(small);
+    free(data);
+    fs_unmount(&fs);
+    unlink(BENCH_IMAGE);
+}
+
+#define DA_FILES       (4)      // Files appended to in turn
+#define DA_FILE_MIB    (4)
+#define DA_TEMP_FILES  (200)    // Files written and removed before any write-back
+#define DA_TEMP_BYTES  (256 * 1024)
+
+// Write-back mode with allocation in fs_write or deferred to the write-back: DA_FILES
+// files appended to in turn in 64 KiB records, then short-lived files removed before
+// the flusher gets to them. Reports the extents per file and what reached the disk.
+static void bench_delalloc_run(const char *label, size_t delalloc_blocks)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    char *data = malloc(APPEND_SMALL);
+    if (data == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%-10s setup failed\n", label);
+        free(data);
+        return;
+    }
+    memset(data, 'd', APPEND_SMALL);
+    // long expiry, only fs_sync writes back
+    WritebackConfig config = { .interval_ms = 1000, .expire_ms = 60000, .dirty_ratio = 100,
+                               .queue_blocks = WRITEBACK_QUEUE_BLOCKS, .delalloc_blocks = delalloc_blocks };
+    if (!fs_writeback_enable(&fs, &config)) {
+        printf("%-10s write-back unavailable\n", label);
+    }
+    disk_stats_reset(disk);
+
+    ssize_t inodes[DA_FILES];
+    for (size_t f = 0; f < DA_FILES; f++) inodes[f] = fs_create(&fs);
+    double start = now_seconds();
+    for (size_t offset = 0; offset < DA_FILE_MIB * 1024 * 1024; offset += APPEND_SMALL) {
+        for (size_t f = 0; f < DA_FILES; f++) fs_write(&fs, inodes[f], data, APPEND_SMALL, offset);
+    }
+    fs_sync(&fs);
+    double append_ms = (now_seconds() - start) * 1e3;
+    uint32_t extents = 0;
+    for (size_t f = 0; f < DA_FILES; f++) extents += append_extents(&fs, inodes[f]);
+    DiskStats appended;
+    disk_stats_snapshot(disk, &appended);
+
+    start = now_seconds();
+    for (size_t i = 0; i < DA_TEMP_FILES; i++) {
+        ssize_t temp = fs_create(&fs);
+        for (size_t offset = 0; offset < DA_TEMP_BYTES; offset += APPEND_SMALL) {
+            fs_write(&fs, temp, data, APPEND_SMALL, offset);
+        }
+        fs_remove(&fs, temp);
+    }
+    fs_sync(&fs);
+    double temp_ms = (now_seconds() - start) * 1e3;
+    DiskStats total;
+    disk_stats_snapshot(disk, &total);
+
+    printf("%-10s %12.1f %10.2f %12llu %10.2f %12llu\n", label, (double)extents / DA_FILES, append_ms,
+           (unsigned long long)appended.write.blocks, temp_ms,
+           (unsigned long long)(total.write.blocks - appended.write.blocks));
+    fs_unmount(&fs);
+    free(data);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_delalloc(void)
+{
+    printf("%-10s %12s %10s %12s %10s %12s\n", "alloc", "extents/file", "append ms", "blk writes", "temp ms", "temp writes");
+    bench_delalloc_run("fs_write", 0);
+    bench_delalloc_run("delayed", WRITEBACK_DELALLOC_BLOCKS);
+}
+
+#define TINY_BLOCKS (16384)
+
+static size_t tiny_used_blocks(FileSystem *fs)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < fs->meta_data->blocks; i++) used += get_bit(fs->bitmap->bits, i);
+    return used;
+}
+
+// Writes files of bytes bytes each, then reads them back after a remount: the
+// blocks they took, the time of both phases and what the cold reads cost the disk
+static void bench_tiny_run(size_t files, size_t bytes)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, TINY_BLOCKS);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    ssize_t *inodes = malloc(files * sizeof(ssize_t));
+    if (inodes == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%6zu B setup failed\n", bytes);
+        free(inodes);
+        return;
+    }
+    char data[BLOCK_SIZE];
+    memset(data, 't', sizeof(data));
+    size_t base = tiny_used_blocks(&fs);
+
+    double start = now_seconds();
+    for (size_t i = 0; i < files; i++) {
+        inodes[i] = fs_create(&fs);
+        fs_write(&fs, inodes[i], data, bytes, 0);
+    }
+    fs_sync(&fs);
+    double write_ms = (now_seconds() - start) * 1e3;
+    size_t used = tiny_used_blocks(&fs) - base;
+    fs_unmount(&fs);
+
+    disk = disk_open(BENCH_IMAGE, TINY_BLOCKS);
+    memset(&fs, 0, sizeof(fs));
+    if (disk == NULL || !fs_mount(&fs, disk)) {
+        printf("%6zu B remount failed\n", bytes);
+        free(inodes);
+        return;
+    }
+    disk_stats_reset(disk);
+    start = now_seconds();
+    size_t read = 0;
+    for (size_t i = 0; i < files; i++) {
+        ssize_t n = fs_read(&fs, inodes[i], data, sizeof(data), 0);
+        if (n > 0) read += n;
+    }
+    double read_ms = (now_seconds() - start) * 1e3;
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+
+    printf("%6zu B %12zu %10.2f %10.2f %12llu %10s\n", bytes, used, write_ms, read_ms,
+           (unsigned long long)stats.read.blocks, (read == files * bytes) ? "ok" : "short");
+    fs_unmount(&fs);
+    free(inodes);
+    unlink(BENCH_IMAGE);
+}
+
+// Files that fit in the inode against ones just past it
+static void bench_tiny(size_t files)
+{
+    printf("%8s %12s %10s %10s %12s %10s\n", "size", "data blocks", "write ms", "read ms", "blk reads", "contents");
+    bench_tiny_run(files, 16);
+    bench_tiny_run(files, INODE_INLINE_BYTES);
+    bench_tiny_run(files, INODE_INLINE_BYTES + 1);
+    bench_tiny_run(files, 1024);
+}
+
+// Writes blocks blocks of a database-like file one 4K page at a time in random
+// order, every stride-th page only, so the file has holes when stride is above 1.
+// Reports the extents, the data blocks taken, the write time, random lookups
+// through a copy of the inode (extent tree) and the pinned one (decoded map), and
+// whether a read of the whole file returns every page and zeros in the holes.
+static void bench_sparse_run(size_t blocks, size_t stride)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, blocks * 3 + 256);
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    size_t pages = (blocks + stride - 1) / stride;
+    size_t *order = malloc(pages * sizeof(size_t));
+    char *file = malloc(blocks * BLOCK_SIZE);
+    if (order == NULL || file == NULL || disk == NULL || !fs_format(disk) || !fs_mount(&fs, disk)) {
+        printf("%6zu setup failed\n", stride);
+        free(order);
+        free(file);
+        return;
+    }
+    srand(11);
+    for (size_t i = 0; i < pages; i++) order[i] = i * stride;
+    for (size_t i = pages; i > 1; i--) {
+        size_t j = (size_t)rand() % i, page = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = page;
+    }
+    size_t base = tiny_used_blocks(&fs);
+    ssize_t inode = fs_create(&fs);
+    char page[BLOCK_SIZE];
+    double start = now_seconds();
+    for (size_t i = 0; i < pages; i++) {
+        memset(page, (int)(order[i] % 251) + 1, sizeof(page));
+        fs_write(&fs, inode, page, BLOCK_SIZE, order[i] * BLOCK_SIZE);
+    }
+    double write_ms = (now_seconds() - start) * 1e3;
+    size_t used = tiny_used_blocks(&fs) - base;
+
+    Inode *copy = fs_read_inode(&fs, inode);
+    Inode *pinned = icache_get(&fs, inode);
+    double lookup_ns[2] = { 0, 0 };
+    const Inode *inodes[] = { copy, pinned };
+    for (size_t k = 0; k < 2 && copy != NULL && pinned != NULL; k++) {
+        uint64_t sum = 0;
+        srand(9);
+        start = now_seconds();
+        for (size_t i = 0; i < EXTENT_LOOKUPS; i++) {
+            uint32_t logical = (uint32_t)((size_t)rand() % blocks);
+            sum += (k == 0) ? extent_lookup(&fs, inodes[k], logical) : icache_extent_run(&fs, inodes[k], logical, NULL);
+        }
+        lookup_ns[k] = (now_seconds() - start) * 1e9 / EXTENT_LOOKUPS;
+        if (sum == 0) printf("sparse lookups found nothing\n");
+    }
+    uint32_t extents = (copy != NULL) ? copy->extent_count : 0;
+    if (pinned != NULL) icache_put(&fs, pinned);
+    fs_free_inode(copy);
+
+    size_t length = ((blocks - 1) / stride * stride + 1) * BLOCK_SIZE;   // up to the last page written
+    bool intact = fs_read(&fs, inode, file, length, 0) == (ssize_t)length;
+    for (size_t i = 0; intact && i < length / BLOCK_SIZE; i++) {
+        char expected = (i % stride == 0) ? (char)((i % 251) + 1) : 0;
+        intact = file[i * BLOCK_SIZE] == expected && file[(i + 1) * BLOCK_SIZE - 1] == expected;
+    }
+    printf("%6zu %10u %12zu %10.2f %10.1f %10.1f %10s\n", stride, extents, used, write_ms, lookup_ns[0], lookup_ns[1],
+           intact ? "ok" : "corrupt");
+    fs_unmount(&fs);
+    free(order);
+    free(file);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_sparse(size_t blocks)
+{
+    printf("%6s %10s %12s %10s %10s %10s %10s\n", "stride", "extents", "data blocks", "write ms", "walk ns", "map ns", "contents");
+    bench_sparse_run(blocks, 1);
+    bench_sparse_run(blocks, 2);
+    bench_sparse_run(blocks, 16);
+}
+
+#define ALLOC_FILES (64)
+#define ALLOC_OPS   (2000)
+
+// The library side of the FUSE ops, without the FUSE plumbing
+static void alloc_getattr(pFileSystem *pfs, const char *path, char *buffer)
+{
+    (void)buffer;
+    ssize_t inode = fs_lookup(pfs->fs, path);
+    Inode *pinned = (inode >= 0) ? icache_get(pfs->fs, inode) : NULL;
+    icache_put(pfs->fs, pinned);
+}
+
+static void alloc_read_small(pFileSystem *pfs, const char *path, char *buffer)
+{
+    ssize_t inode = fs_lookup(pfs->fs, path);
+    if (inode >= 0) fs_read(pfs->fs, inode, buffer, 4096, 8192);
+}
+
+static void alloc_read_large(pFileSystem *pfs, const char *path, char *buffer)
+{
+    ssize_t inode = fs_lookup(pfs->fs, path);
+    if (inode >= 0) fs_read(pfs->fs, inode, buffer, BENCH_CHUNK, 0);
+}
+
+static void alloc_read_inode(pFileSystem *pfs, const char *path, char *buffer)
+{
+    (void)buffer;
+    ssize_t inode = fs_lookup(pfs->fs, path);
+    fs_free_inode((inode >= 0) ? fs_read_inode(pfs->fs, inode) : NULL);
+}
+
+static void alloc_create(pFileSystem *pfs, const char *path, char *buffer)
+{
+    (void)path;
+    (void)buffer;
+    ssize_t inode = pfs_create(pfs, "/a/b/scratch.txt");
+    if (inode < 0) return;
+    pfs_remove(pfs, inode);
+    ssize_t dir = fs_lookup(pfs->fs, "/a/b");
+    if (dir >= 0) dir_remove(pfs->fs, dir, "scratch.txt");
+}
+
+// Runs every op once to warm the caches, arenas and pools, then counts the heap
+// allocations of ALLOC_OPS more
+static void bench_alloc(void)
+{
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, 16384);
+    pFileSystem pfs;
+    memset(&pfs, 0, sizeof(pfs));
+    char *buffer = malloc(BENCH_CHUNK);
+    if (buffer == NULL || disk == NULL || !pfs_format(disk) || !pfs_mount(&pfs, disk)) {
+        printf("alloc setup failed\n");
+        free(buffer);
+        return;
+    }
+    memset(buffer, 'a', BENCH_CHUNK);
+    ssize_t a = dir_create(pfs.fs), b = dir_create(pfs.fs);
+    dir_add(pfs.fs, 0, "a", a);
+    dir_add(pfs.fs, a, "b", b);
+    char path[64];
+    for (size_t i = 0; i < ALLOC_FILES; i++) {
+        snprintf(path, sizeof(path), "/a/b/file%zu.dat", i);
+        ssize_t inode = pfs_create(&pfs, path);
+        if (inode >= 0) pfs_write(&pfs, inode, buffer, BENCH_CHUNK, 0);
+    }
+
+    struct {
+        const char *name;
+        void (*op)(pFileSystem *, const char *, char *);
+    } ops[] = {
+        { "getattr", alloc_getattr },
+        { "read 4K", alloc_read_small },
+        { "read 128K", alloc_read_large },
+        { "read_inode", alloc_read_inode },
+        { "create", alloc_create },
+    };
+    printf("%-12s %10s %14s\n", "op", "ops", "allocs/op");
+    for (size_t k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+        for (size_t i = 0; i < ALLOC_FILES; i++) {
+            snprintf(path, sizeof(path), "/a/b/file%zu.dat", i);
+            ops[k].op(&pfs, path, buffer);
+        }
+        uint64_t before = heap_allocations;
+        for (size_t i = 0; i < ALLOC_OPS; i++) {
+            snprintf(path, sizeof(path), "/a/b/file%zu.dat", i % ALLOC_FILES);
+            ops[k].op(&pfs, path, buffer);
+            arena_reset();
+        }
+        printf("%-12s %10d %14.3f\n", ops[k].name, ALLOC_OPS, (double)(heap_allocations - before) / ALLOC_OPS);
+    }
+    pfs_unmount(&pfs);
+    free(buffer);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_format(size_t mib)
+{
+    size_t blocks = mib * 1024 * 1024 / BLOCK_SIZE;
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open(BENCH_IMAGE, blocks);
+    if (disk == NULL) return;
+
+    double start = now_seconds();
+    bool ok = fs_format(disk);
+    double elapsed = now_seconds() - start;
+
+    DiskStats stats;
+    disk_stats_snapshot(disk, &stats);
+    printf("format %zu MiB: %s in %.3f ms, %zu blocks written, %llu system calls\n", mib,
+           ok ? "done" : "failed", elapsed * 1e3, disk->writes, (unsigned long long)stats.syscalls);
+    disk_close(disk);
+    unlink(BENCH_IMAGE);
+}
+
+#define PREDICT_BLOCKS   8192
+#define PREDICT_TRAIN    64     // Files used to teach the prediction layer the growth pattern
+#define PREDICT_FILES    8      // Files appended to concurrently in the measured phase
+#define PREDICT_APPENDS  16     // Every file grows from one block to this many blocks
+
+// Grows PREDICT_FILES .log files by interleaved one-block appends and reads them back on a
+// simulated HDD. Without preallocation the appends interleave on disk and every file read
+// seeks, a confident prediction reserves each file's final size on its first write.
+static void bench_predict_run(const char *label, bool train)
+{
+    pFileSystem pfs;
+    char block[BLOCK_SIZE];
+    static char file[PREDICT_APPENDS * BLOCK_SIZE];
+    char path[32];
+    memset(block, 'p', sizeof(block));
+    memset(&pfs, 0, sizeof(pfs));
+
+    unlink(BENCH_IMAGE);
+    Disk *disk = disk_open_sim(BENCH_IMAGE, PREDICT_BLOCKS, NULL);
+    if (disk == NULL || !pfs_format(disk) || !pfs_mount(&pfs, disk)) {
+        printf("%-10s setup failed\n", label);
+        return;
+    }
+
+    for (size_t i = 0; train && i < PREDICT_TRAIN; i++) {
+        snprintf(path, sizeof(path), "/train%zu.log", i);
+        ssize_t inode = pfs_create(&pfs, path);
+        if (inode < 0) break;
+        for (size_t a = 0; a < PREDICT_APPENDS; a++) {
+            pfs_write(&pfs, inode, block, BLOCK_SIZE, a * BLOCK_SIZE);
+        }
+        pfs_remove(&pfs, inode);
+    }
+
+    ssize_t inodes[PREDICT_FILES];
+    for (size_t f = 0; f < PREDICT_FILES; f++) {
+        snprintf(path, sizeof(path), "/file%zu.log", f);
+        inodes[f] = pfs_create(&pfs, path);
+    }
+    disk_stats_reset(disk);
+    for (size_t a = 0; a < PREDICT_APPENDS; a++) {
+        for (size_t f = 0; f < PREDICT_FILES; f++) {
+            if (inodes[f] >= 0) pfs_write(&pfs, inodes[f], block, BLOCK_SIZE, a * BLOCK_SIZE);
+        }
+    }
+    DiskStats written;
+    disk_stats_snapshot(disk, &written);
+
+    disk_stats_reset(disk);
+    double start = now_seconds();
+    for (size_t f = 0; f < PREDICT_FILES; f++) {
+        if (inodes[f] >= 0) fs_read(pfs.fs, inodes[f], file, sizeof(file), 0);
+    }
+    double real = now_seconds() - start;
+    DiskStats read;
+    disk_stats_snapshot(disk, &read);
+
+    printf("%-10s %14.2f %14.2f %12.3f %7llu/%-6llu\n", label,
+           written.write.simulated_ns / 1e6, read.read.simulated_ns / 1e6, real * 1e3,
+           (unsigned long long)read.read.sequential, (unsigned long long)read.read.random);
+    if (getenv("PFS_STATS_JSON") != NULL) {
+        disk_stats_dump_json(&read, stdout);
+    }
+    pfs_unmount(&pfs);
+    unlink(BENCH_IMAGE);
+}
+
+static void bench_predict(void)
+{
+    printf("%-10s %14s %14s %12s %14s\n", "layout", "sim write ms", "sim read ms", "real ms", "seq/rand rd");
+    bench_predict_run("untrained", false);
+    bench_predict_run("trained", true);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s io [MiB] | stripe [MiB] [members] | meta [files] | stat [files] | lookup [files] | cachesim [blocks] [trace] | sched | writeback | readahead [MiB] | extents [extents] | append [MiB] | delalloc | tiny [files] | sparse [blocks] | alloc | format [MiB] | predict\n", argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "io") == 0) {
+        bench_io(argc > 2 ? strtoul(argv[2], NULL, 10) : 16);
+        return 0;
+    }
+    if (strcmp(argv[1], "stripe") == 0) {
+        bench_stripe(argc > 2 ? strtoul(argv[2], NULL, 10) : 64, argc > 3 ? strtoul(argv[3], NULL, 10) : 4);
+        return 0;
+    }
+    if (strcmp(argv[1], "meta") == 0) {
+        bench_meta(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000);
+        return 0;
+    }
+    if (strcmp(argv[1], "stat") == 0) {
+        bench_stat(argc > 2 ? strtoul(argv[2], NULL, 10) : 2000);
+        return 0;
+    }
+    if (strcmp(argv[1], "lookup") == 0) {
+        bench_lookup(argc > 2 ? strtoul(argv[2], NULL, 10) : 500);
+        return 0;
+    }
+    if (strcmp(argv[1], "cachesim") == 0) {
+        bench_cachesim(argc > 2 ? strtoul(argv[2], NULL, 10) : 1024, argc > 3 ? argv[3] : NULL);
+        return 0;
+    }
+    if (strcmp(argv[1], "sched") == 0) {
+        bench_sched();
+        return 0;
+    }
+    if (strcmp(argv[1], "writeback") == 0) {
+        bench_writeback();
+        return 0;
+    }
+    if (strcmp(argv[1], "readahead") == 0) {
+        bench_readahead(argc > 2 ? strtoul(argv[2], NULL, 10) : 32);
+        return 0;
+    }
+    if (strcmp(argv[1], "extents") == 0) {
+        bench_extents(argc > 2 ? strtoul(argv[2], NULL, 10) : 500);
+        return 0;
+    }
+    if (strcmp(argv[1], "append") == 0) {
+        bench_append(argc > 2 ? strtoul(argv[2], NULL, 10) : 16);
+        return 0;
+    }
+    if (strcmp(argv[1], "delalloc") == 0) {
+        bench_delalloc();
+        return 0;
+    }
+    if (strcmp(argv[1], "tiny") == 0) {
+        bench_tiny(argc > 2 ? strtoul(argv[2], NULL, 10) : 2000);
+        return 0;
+    }
+    if (strcmp(argv[1], "sparse") == 0) {
+        bench_sparse(argc > 2 ? strtoul(argv[2], NULL, 10) : 20000);
+        return 0;
+    }
+    if (strcmp(argv[1], "alloc") == 0) {
+        bench_alloc();
+        return 0;
+    }
+    if (strcmp(argv[1], "format") == 0) {
+        bench_format(argc > 2 ? strtoul(argv[2], NULL, 10) : 1024);
+        return 0;
+    }
+    if (strcmp(argv[1], "predict") == 0) {
+        bench_predict();
+        return 0;
+    }
+    fprintf(stderr, "%s: unknown benchmark '%s'\n", argv[0], argv[1]);
+    return 1;
+}
@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "utils.h"
+
+/* predictFS checks, ./pfs_check (or make check) exits nonzero when one fails
+ *   split     a file written with holes and then filled in, which splits full leaves
+ *             in the middle and grows the root, read back after a remount
+ *   faults    a middle split failing at every write it makes leaves the tree as it
+ *             was, then the tree grows to three levels and is looked up after a remount
+ *   migrate   one generated image of each older format converted and compared, also
+ *             interrupted at every write and finished by the next fs_migrate
+ */
+
+#define CHECK_IMAGE "check.img"
+#define CHECK_BLOCKS (3072)
+#define CHECK_SPLIT_BLOCKS (600)        // Even blocks written first, one extent each
+#define CHECK_TREE_EXTENTS (200000)     // Past the 340 * 510 extents of two levels
+
+#define CHECK(condition, ...) do {                  \
+        if (!(condition)) {                         \
+            fprintf(stderr, "check: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                  \
+            return false;                           \
+        }                                           \
+    } while (0)
+
+// Write fault injection: every write from the countdown-th one on fails, like a crash there
+static const DiskOps *check_ops;
+static DiskOps check_faulty_ops;
+static long check_countdown = -1;
+static bool check_failed;
+
+static ssize_t check_faulty_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    if (write && check_countdown == 0) {
+        check_failed = true;
+        return -1;
+    }
+    if (write && check_countdown > 0) check_countdown--;
+    return check_ops->submit(disk, requests, count, write);
+}
+
+static void check_faults_begin(Disk *disk, long countdown)
+{
+    check_ops = disk->ops;
+    check_faulty_ops = *disk->ops;
+    check_faulty_ops.submit = check_faulty_submit;
+    disk->ops = &check_faulty_ops;
+    check_countdown = countdown;
+    check_failed = false;
+}
+
+// Returns true when a write failed, disk is NULL when it was closed with the faults in place
+static bool check_faults_end(Disk *disk)
+{
+    if (disk != NULL) disk->ops = check_ops;
+    check_countdown = -1;
+    return check_failed;
+}
+
+// Contents of logical block of file, different for every block and file
+static void check_pattern(char *data, uint32_t file, uint32_t block)
+{
+    memset(data, 'a' + (file * 7 + block) % 26, BLOCK_SIZE);
+    memcpy(data, &file, sizeof(file));
+    memcpy(data + sizeof(file), &block, sizeof(block));
+}
+
+static uint32_t check_used(FileSystem *fs)
+{
+    uint32_t used = 0;
+    for (uint32_t b = 0; b < fs->meta_data->blocks; b++) used += get_bit(fs->bitmap->bits, b);
+    return used;
+}
+
+static bool check_mount(FileSystem *fs, bool format)
+{
+    Disk *disk = disk_open(CHECK_IMAGE, CHECK_BLOCKS);
+    CHECK(disk != NULL, "opening %s has failed", CHECK_IMAGE);
+    memset(fs, 0, sizeof(*fs));
+    if ((format && !fs_format(disk)) || !fs_mount(fs, disk)) {
+        disk_close(disk);
+        CHECK(false, "mounting %s has failed", CHECK_IMAGE);
+    }
+    return true;
+}
+
+static bool check_split_read(FileSystem *fs, size_t inode, uint32_t blocks)
+{
+    char data[BLOCK_SIZE], want[BLOCK_SIZE], zero[BLOCK_SIZE];
+    memset(zero, 0, sizeof(zero));
+    // the file ends with the last even block
+    for (uint32_t b = 0; b + 1 < blocks; b++) {
+        // the even blocks and the odd ones of the middle third are written, the rest are holes
+        bool written = (b % 2 == 0) || (b > blocks / 3 && b < 2 * blocks / 3);
+        check_pattern(want, (uint32_t)inode, b);
+        CHECK(fs_read(fs, inode, data, BLOCK_SIZE, (size_t)b * BLOCK_SIZE) == BLOCK_SIZE, "reading block %u has failed", b);
+        CHECK(memcmp(data, written ? want : zero, BLOCK_SIZE) == 0, "block %u reads back wrong", b);
+    }
+    return true;
+}
+
+static bool check_split(void)
+{
+    FileSystem fs;
+    if (!check_mount(&fs, true)) return false;
+    ssize_t inode = fs_create(&fs);
+    CHECK(inode > 0, "creating a file has failed");
+
+    // every other block, the holes keep them one extent each
+    char data[BLOCK_SIZE];
+    uint32_t blocks = 2 * CHECK_SPLIT_BLOCKS;
+    for (uint32_t b = 0; b < blocks; b += 2) {
+        check_pattern(data, (uint32_t)inode, b);
+        CHECK(fs_write(&fs, inode, data, BLOCK_SIZE, (size_t)b * BLOCK_SIZE) == BLOCK_SIZE, "writing block %u has failed", b);
+    }
+    Inode *cached = icache_get(&fs, inode);
+    uint32_t appended = cached->extent_count;
+    icache_put(&fs, cached);
+    CHECK(appended > EXTENTS_PER_INODE + EXTENT_LEAF_ENTRIES, "%u extents do not fill the root leaf", appended);
+
+    // the holes of the middle third, in the middle of the leaves
+    for (uint32_t b = blocks / 3 + 1; b < 2 * blocks / 3; b += 2) {
+        check_pattern(data, (uint32_t)inode, b);
+        CHECK(fs_write(&fs, inode, data, BLOCK_SIZE, (size_t)b * BLOCK_SIZE) == BLOCK_SIZE, "writing block %u has failed", b);
+    }
+    cached = icache_get(&fs, inode);
+    uint32_t filled = cached->extent_count;
+    icache_put(&fs, cached);
+    CHECK(filled > appended, "filling the holes added no extents (%u)", filled);
+    if (!check_split_read(&fs, inode, blocks)) return false;
+    fs_unmount(&fs);
+
+    if (!check_mount(&fs, false)) return false;
+    bool read = check_split_read(&fs, inode, blocks);
+    CHECK(!read || fs_remove(&fs, inode), "removing the file has failed");
+    fs_unmount(&fs);
+    if (read) printf("split     %u extents, %u after filling the middle holes\n", appended, filled);
+    return read;
+}
+
+typedef struct CheckWalk CheckWalk;
+struct CheckWalk {
+    Extent *extents;
+    size_t count;
+    size_t nodes;
+};
+
+static bool check_walk_visit(FileSystem *fs, void *arg, Extent extent, bool node)
+{
+    (void)fs;
+    CheckWalk *walk = arg;
+    if (node) {
+        walk->nodes++;
+        return true;
+    }
+    if (walk->count == CHECK_TREE_EXTENTS) return false;
+    walk->extents[walk->count++] = extent;
+    return true;
+}
+
+static bool check_walk(FileSystem *fs, const Inode *inode, CheckWalk *walk)
+{
+    walk->count = 0;
+    walk->nodes = 0;
+    return inode->extent_block == 0 || extent_tree_walk(fs, inode->extent_block, check_walk_visit, walk);
+}
+
+// Physical block the tree of check_faults maps logical block 2 * i + 1000 to
+static uint32_t check_faults_block(uint32_t i)
+{
+    return 100 + (i * 7) % 2900;
+}
+
+/* The extents of this image only map blocks, none are allocated or written, so
+ * its bitmap is not the one of a real file system */
+static bool check_faults_run(FileSystem *fs, CheckWalk *before, CheckWalk *after)
+{
+    ssize_t number = fs_create(fs);
+    CHECK(number > 0, "creating a file has failed");
+    Inode *inode = icache_get(fs, number);
+    CHECK(inode != NULL, "reading inode %zd has failed", number);
+
+    // the inline extents and a full root leaf, holes in between
+    uint32_t full = EXTENTS_PER_INODE + EXTENT_LEAF_ENTRIES;
+    bool checked = true;
+    for (uint32_t i = 0; i < full && checked; i++) checked = extent_add(fs, inode, 2 * i + 1000, check_faults_block(i), 1);
+    if (!checked) fprintf(stderr, "check: filling the root leaf has failed\n");
+
+    // every write of the split can fail, an insert that fails changes nothing
+    Disk *disk = fs->disk;
+    cache_flush(disk);
+    cache_disable(disk);
+    long failures = 0;
+    for (long k = 0; checked; k++) {
+        uint32_t count = inode->extent_count;
+        uint32_t root = inode->extent_block;
+        uint32_t used = check_used(fs);
+        checked = check_walk(fs, inode, before);
+        check_faults_begin(disk, k);
+        bool added = extent_add(fs, inode, 1000 + 2 * (full / 2) + 1, 3000, 1);
+        bool failed = check_faults_end(disk);
+        if (added) break;
+        failures++;
+        checked = checked && failed && check_walk(fs, inode, after) && count == inode->extent_count &&
+                  root == inode->extent_block && used == check_used(fs) && before->count == after->count &&
+                  memcmp(before->extents, after->extents, before->count * sizeof(Extent)) == 0;
+        if (!checked) fprintf(stderr, "check: a middle split failing at write %ld changed the tree\n", k);
+    }
+    if (checked && failures == 0) {
+        fprintf(stderr, "check: the middle split made no writes\n");
+        checked = false;
+    }
+
+    // appended and in the middle until the root is two levels above the leaves
+    for (uint32_t i = full; i < CHECK_TREE_EXTENTS - 1000 && checked; i++) {
+        checked = extent_add(fs, inode, 2 * i + 1000, check_faults_block(i), 1);
+    }
+    for (uint32_t i = 0; i < 900 && checked; i++) {
+        checked = extent_add(fs, inode, 2 * (i * 61) + 1001, 2000 + i, 1);
+    }
+    if (!checked) fprintf(stderr, "check: growing the tree has failed\n");
+    uint32_t total = inode->extent_count;
+    icache_dirty(inode);
+    icache_put(fs, inode);
+    fs_unmount(fs);
+
+    if (!checked || !check_mount(fs, false)) return false;
+    inode = icache_get(fs, number);
+    CHECK(inode != NULL, "reading inode %zd has failed", number);
+    checked = check_walk(fs, inode, after) && after->count + EXTENTS_PER_INODE == total;
+    for (size_t e = 1; e < after->count && checked; e++) {
+        checked = after->extents[e].logical >= after->extents[e - 1].logical + after->extents[e - 1].length;
+    }
+    if (!checked) fprintf(stderr, "check: the remounted tree does not hold the %u extents in order\n", total);
+    for (uint32_t i = 0; i < CHECK_TREE_EXTENTS - 1000 && checked; i += 97) {
+        checked = icache_extent_run(fs, inode, 2 * i + 1000, NULL) == check_faults_block(i);
+        if (!checked) fprintf(stderr, "check: logical block %u maps to the wrong block\n", 2 * i + 1000);
+    }
+    Block root;
+    if (checked && (disk_read(fs->disk, inode->extent_block, root.data) < 0 || root.node.header.level < 2)) {
+        fprintf(stderr, "check: the root of %u extents is not two levels above the leaves\n", total);
+        checked = false;
+    }
+    icache_put(fs, inode);
+    if (checked) printf("faults    %ld failed middle splits unchanged, %u extents in %zu nodes after a remount\n",
+                        failures, total, after->nodes);
+    return checked;
+}
+
+static bool check_faults(void)
+{
+    FileSystem fs;
+    CheckWalk before = { malloc(CHECK_TREE_EXTENTS * sizeof(Extent)), 0, 0 };
+    CheckWalk after = { malloc(CHECK_TREE_EXTENTS * sizeof(Extent)), 0, 0 };
+    bool checked = before.extents != NULL && after.extents != NULL && check_mount(&fs, true);
+    if (checked) {
+        checked = check_faults_run(&fs, &before, &after);
+        if (fs.disk != NULL && fs.disk->mounted) fs_unmount(&fs);
+    }
+    free(before.extents);
+    free(after.extents);
+    return checked;
+}
+
+/* Older formats, written the way the versions that had them did (see migrate.c) */
+
+#define LEGACY_NODE_MAGIC    (0xe7e7)
+#define LEGACY_NODE_ENTRIES  ((BLOCK_SIZE - sizeof(ExtentNodeHeader)) / sizeof(LegacyExtent))
+#define ORIGINAL_INODES_PER_BLOCK (BLOCK_SIZE / sizeof(OriginalInode))
+#define LEGACY_FILES         (3)
+#define LEGACY_INLINE_INODE  (3)
+#define LEGACY_INLINE_DATA   "inline contents"
+
+typedef struct LegacyExtent LegacyExtent;
+struct LegacyExtent {
+    uint32_t start;
+    uint32_t length;
+};
+
+typedef struct LegacyInode LegacyInode;
+struct LegacyInode {
+    uint32_t valid;
+    uint32_t size;
+    uint32_t extent_count;
+    uint32_t flags;
+    union {
+        struct {
+            LegacyExtent extents[EXTENTS_PER_INODE];
+            uint32_t extent_block;
+        };
+        char inline_data[INODE_INLINE_BYTES];
+    };
+};
+
+typedef struct OriginalInode OriginalInode;
+struct OriginalInode {
+    uint32_t valid;
+    uint32_t size;
+    uint32_t extent_count;
+    LegacyExtent extents[EXTENTS_PER_INODE];
+    uint32_t extent_block;
+};
+
+typedef struct LegacyNode LegacyNode;
+struct LegacyNode {
+    ExtentNodeHeader header;
+    union {
+        LegacyExtent extents[LEGACY_NODE_ENTRIES];
+        ExtentIndex  index[LEGACY_NODE_ENTRIES];
+    };
+};
+
+// A file of a generated image: its inode and where its blocks and overflow blocks went
+typedef struct LegacyFile LegacyFile;
+struct LegacyFile {
+    uint32_t inode;
+    uint32_t extent_count;
+    uint32_t size;
+    LegacyExtent *extents;
+    uint32_t nodes[4];
+    uint32_t node_count;
+};
+
+typedef struct LegacyImage LegacyImage;
+struct LegacyImage {
+    uint32_t magic;
+    uint32_t next;              // Next free block
+    LegacyFile files[LEGACY_FILES];
+};
+
+// Inode numbers past the first table block, V0 ones move to another block when converted
+static const uint32_t legacy_inodes[LEGACY_FILES] = { 1, 110, 300 };
+
+static void legacy_free(LegacyImage *image)
+{
+    for (int f = 0; f < LEGACY_FILES; f++) free(image->files[f].extents);
+}
+
+// Places the extents of file back to back in the file, a free block between each on disk
+static bool legacy_file_write(Disk *disk, LegacyImage *image, LegacyFile *file, uint32_t extent_count, bool single)
+{
+    file->extent_count = extent_count;
+    file->extents = calloc(extent_count, sizeof(LegacyExtent));
+    CHECK(file->extents != NULL, "allocating memory has failed");
+    char data[BLOCK_SIZE];
+    uint32_t logical = 0;
+    for (uint32_t e = 0; e < extent_count; e++) {
+        LegacyExtent *extent = &file->extents[e];
+        extent->start = image->next;
+        extent->length = single ? 1 : 1 + e % 3;
+        for (uint32_t b = 0; b < extent->length; b++, logical++) {
+            check_pattern(data, file->inode, logical);
+            CHECK(disk_write(disk, extent->start + b, data) >= 0, "writing block %u has failed", extent->start + b);
+        }
+        image->next += extent->length + 1;
+    }
+    file->size = logical * BLOCK_SIZE - 123;
+    return true;
+}
+
+// The extents past the inline ones: one flat block for V0 and V1, a tree for V2
+static bool legacy_overflow_write(Disk *disk, LegacyImage *image, LegacyFile *file)
+{
+    const LegacyExtent *rest = file->extents + EXTENTS_PER_INODE;
+    uint32_t count = file->extent_count - EXTENTS_PER_INODE;
+    Block block;
+    if (image->magic != MAGIC_NUMBER_V2) {
+        memset(block.data, 0, BLOCK_SIZE);
+        memcpy(block.data, rest, count * sizeof(LegacyExtent));
+        file->nodes[file->node_count++] = image->next++;
+        return disk_write(disk, file->nodes[0], block.data) >= 0;
+    }
+
+    uint32_t logical = 0;
+    for (uint32_t e = 0; e < EXTENTS_PER_INODE; e++) logical += file->extents[e].length;
+    LegacyNode root;
+    memset(&root, 0, sizeof(root));
+    root.header = (ExtentNodeHeader){ LEGACY_NODE_MAGIC, 1, 0, logical, 0 };
+    for (uint32_t first = 0; first < count; first += LEGACY_NODE_ENTRIES) {
+        LegacyNode *leaf = (LegacyNode *)block.data;
+        memset(leaf, 0, sizeof(*leaf));
+        leaf->header = (ExtentNodeHeader){ LEGACY_NODE_MAGIC, 0, 0, logical, 0 };
+        for (uint32_t e = first; e < count && e < first + LEGACY_NODE_ENTRIES; e++) {
+            leaf->extents[leaf->header.count++] = rest[e];
+            logical += rest[e].length;
+        }
+        leaf->header.end = logical;
+        root.index[root.header.count++] = (ExtentIndex){ leaf->header.first, image->next };
+        file->nodes[file->node_count++] = image->next;
+        CHECK(disk_write(disk, image->next++, block.data) >= 0, "writing a tree leaf has failed");
+    }
+    root.header.end = logical;
+    if (root.header.count == 1) return true;    // a single leaf is the root itself
+    file->nodes[file->node_count++] = image->next;
+    return disk_write(disk, image->next++, (char *)&root) >= 0;
+}
+
+/* Formats the image, then gives it the superblock, inode table and overflow blocks
+ * of format magic: a small file, one with an overflow block or a one-leaf tree,
+ * a large one (a two-level tree for V2) and for V1 and V2 a file in its inode */
+static bool legacy_image_write(LegacyImage *image, uint32_t magic)
+{
+    memset(image, 0, sizeof(*image));
+    image->magic = magic;
+    Disk *disk = disk_open(CHECK_IMAGE, CHECK_BLOCKS);
+    CHECK(disk != NULL, "opening %s has failed", CHECK_IMAGE);
+    bool written = fs_format(disk);
+    Block block;
+    written = written && disk_read(disk, 0, block.data) >= 0;
+    SuperBlock superblock = block.super;
+    image->next = 2 + superblock.inode_blocks + superblock.bitmap_blocks;
+
+    static const uint32_t extent_counts[LEGACY_FILES] = { 2, 43, 303 };
+    for (int f = 0; f < LEGACY_FILES && written; f++) {
+        LegacyFile *file = &image->files[f];
+        file->inode = legacy_inodes[f];
+        uint32_t count = extent_counts[f] + ((magic == MAGIC_NUMBER_V2 && f == 2) ? 300 : 0);
+        written = legacy_file_write(disk, image, file, count, f == 2) &&
+                  (count <= EXTENTS_PER_INODE || legacy_overflow_write(disk, image, file));
+    }
+
+    uint32_t per_block = (magic == MAGIC_NUMBER_V0) ? ORIGINAL_INODES_PER_BLOCK : INODES_PER_BLOCK;
+    for (uint32_t b = 0; b < superblock.inode_blocks && written; b++) {
+        memset(block.data, 0, BLOCK_SIZE);
+        for (uint32_t j = 0; j < per_block; j++) {
+            uint32_t number = b * per_block + j;
+            LegacyFile *file = NULL;
+            for (int f = 0; f < LEGACY_FILES; f++) if (image->files[f].inode == number) file = &image->files[f];
+            uint32_t inline_count = 0;
+            if (file != NULL) inline_count = (file->extent_count < EXTENTS_PER_INODE) ? file->extent_count : EXTENTS_PER_INODE;
+            if (magic == MAGIC_NUMBER_V0) {
+                OriginalInode *inode = &((OriginalInode *)block.data)[j];
+                if (number == 0) inode->valid = INODE_DIR;
+                if (file == NULL) continue;
+                *inode = (OriginalInode){ 1, file->size, file->extent_count, { { 0, 0 } }, file->node_count ? file->nodes[0] : 0 };
+                memcpy(inode->extents, file->extents, inline_count * sizeof(LegacyExtent));
+                continue;
+            }
+            LegacyInode *inode = (LegacyInode *)&block.inodes[j];
+            if (number == 0) inode->valid = INODE_DIR;
+            if (number == LEGACY_INLINE_INODE) {
+                inode->valid = 1;
+                inode->flags = INODE_INLINE;
+                inode->size = sizeof(LEGACY_INLINE_DATA);
+                memcpy(inode->inline_data, LEGACY_INLINE_DATA, sizeof(LEGACY_INLINE_DATA));
+            }
+            if (file == NULL) continue;
+            inode->valid = 1;
+            inode->size = file->size;
+            inode->extent_count = file->extent_count;
+            memcpy(inode->extents, file->extents, inline_count * sizeof(LegacyExtent));
+            inode->extent_block = file->node_count ? file->nodes[file->node_count - 1] : 0;
+        }
+        written = disk_write(disk, 1 + b, block.data) >= 0;
+    }
+
+    superblock.magic_number = magic;
+    superblock.inodes = superblock.inode_blocks * per_block;
+    memset(block.data, 0, BLOCK_SIZE);
+    block.super = superblock;
+    written = written && disk_write(disk, 0, block.data) >= 0 && disk_sync(disk);
+    disk_close(disk);
+    CHECK(written, "writing an image of %s has failed", fs_older_format(magic));
+    return true;
+}
+
+// Compares the converted image with the files legacy_image_write gave it
+static bool legacy_compare(FileSystem *fs, const LegacyImage *image)
+{
+    for (int f = 0; f < LEGACY_FILES; f++) {
+        const LegacyFile *file = &image->files[f];
+        CHECK(fs_stat(fs, file->inode) == file->size, "inode %u has size %zd, not %u", file->inode, fs_stat(fs, file->inode), file->size);
+        char *data = malloc(file->size);
+        char *want = malloc((size_t)file->size + BLOCK_SIZE);
+        bool same = data != NULL && want != NULL && fs_read(fs, file->inode, data, file->size, 0) == file->size;
+        for (uint32_t b = 0; same && (size_t)b * BLOCK_SIZE < file->size; b++) check_pattern(want + (size_t)b * BLOCK_SIZE, file->inode, b);
+        same = same && memcmp(data, want, file->size) == 0;
+        free(data);
+        free(want);
+        CHECK(same, "inode %u reads back wrong", file->inode);
+        for (uint32_t e = 0; e < file->extent_count; e++) {
+            for (uint32_t b = 0; b < file->extents[e].length; b++) {
+                CHECK(get_bit(fs->bitmap->bits, file->extents[e].start + b), "block %u of inode %u is free", file->extents[e].start + b, file->inode);
+            }
+        }
+        for (uint32_t n = 0; n < file->node_count; n++) {
+            CHECK(!get_bit(fs->bitmap->bits, file->nodes[n]), "old overflow block %u of inode %u is still in use", file->nodes[n], file->inode);
+        }
+    }
+    if (image->magic != MAGIC_NUMBER_V0) {
+        char data[sizeof(LEGACY_INLINE_DATA)];
+        CHECK(fs_read(fs, LEGACY_INLINE_INODE, data, sizeof(data), 0) == sizeof(data) && memcmp(data, LEGACY_INLINE_DATA, sizeof(data)) == 0,
+              "the inline file reads back wrong");
+    }
+    return true;
+}
+
+// Converts the image with fs_migrate, then compares it before and after a remount
+static bool legacy_migrate(const LegacyImage *image)
+{
+    FileSystem fs;
+    memset(&fs, 0, sizeof(fs));
+    Disk *disk = disk_open(CHECK_IMAGE, CHECK_BLOCKS);
+    CHECK(disk != NULL, "opening %s has failed", CHECK_IMAGE);
+    if (!fs_migrate(&fs, disk)) {
+        if (disk->mounted) fs_unmount(&fs);
+        else disk_close(disk);
+        CHECK(false, "converting from %s has failed", fs_older_format(image->magic));
+    }
+    bool same = legacy_compare(&fs, image);
+    fs_unmount(&fs);
+    if (!same || !check_mount(&fs, false)) return false;
+    same = legacy_compare(&fs, image);
+    fs_unmount(&fs);
+    return same;
+}
+
+static bool check_migrate_run(uint32_t magic, char *pristine)
+{
+    LegacyImage image;
+    bool checked = legacy_image_write(&image, magic);
+    Disk *disk = checked ? disk_open(CHECK_IMAGE, CHECK_BLOCKS) : NULL;
+    checked = disk != NULL && disk_read_blocks(disk, 0, CHECK_BLOCKS, pristine) >= 0;
+    if (disk != NULL) disk_close(disk);
+    checked = checked && legacy_migrate(&image);
+
+    // the conversion stopping at every write it makes, the next fs_migrate finishes it
+    long k = 0;
+    for (; checked; k++) {
+        disk = disk_open(CHECK_IMAGE, CHECK_BLOCKS);
+        if (disk == NULL || disk_write_blocks(disk, 0, CHECK_BLOCKS, pristine) < 0) {
+            fprintf(stderr, "check: restoring the image of %s has failed\n", fs_older_format(magic));
+            if (disk != NULL) disk_close(disk);
+            checked = false;
+            break;
+        }
+        FileSystem fs;
+        memset(&fs, 0, sizeof(fs));
+        check_faults_begin(disk, k);
+        if (fs_migrate(&fs, disk)) {
+            checked = !check_faults_end(disk);
+            fs_unmount(&fs);
+            break;
+        }
+        // like a crash, what the failed conversion left in the buffer cache does not reach the image
+        disk_close(disk);
+        checked = check_faults_end(NULL) && legacy_migrate(&image);
+        if (!checked) fprintf(stderr, "check: the conversion from %s interrupted at write %ld was not finished\n", fs_older_format(magic), k);
+    }
+    legacy_free(&image);
+    if (checked) printf("migrate   from %s, also finished after each of %ld interruptions\n", fs_older_format(magic), k);
+    return checked;
+}
+
+static bool check_migrate(void)
+{
+    static const uint32_t magics[] = { MAGIC_NUMBER_V0, MAGIC_NUMBER_V1, MAGIC_NUMBER_V2 };
+    char *pristine = aligned_alloc(DISK_ALIGNMENT, (size_t)CHECK_BLOCKS * BLOCK_SIZE);
+    bool checked = pristine != NULL;
+    for (size_t m = 0; m < sizeof(magics) / sizeof(magics[0]) && checked; m++) checked = check_migrate_run(magics[m], pristine);
+    free(pristine);
+    return checked;
+}
+
+int main(void)
+{
+    bool passed = check_split() && check_faults() && check_migrate();
+    remove(CHECK_IMAGE);
+    printf("%s\n", passed ? "all checks passed" : "a check FAILED");
+    return passed ? 0 : 1;
+}
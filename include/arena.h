@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define ARENA_CHUNK_BYTES   (64 * 1024) // Bytes a thread's arena grows by
+#define ARENA_ALIGNMENT     (16)
+
+// Position in the calling thread's arena, arena_release frees everything allocated after it
+typedef struct ArenaMark ArenaMark;
+struct ArenaMark {
+    void   *chunk;
+    size_t used;
+};
+
+// Fixed-size objects carved out of slabs. Freed objects go back on a free list
+// and slabs are only returned when the pool is destroyed.
+typedef struct SlabPool SlabPool;
+struct SlabPool {
+    size_t          object_size;
+    size_t          per_slab;       // Objects carved out of one slab allocation
+    void            *free;          // Free objects, linked through their first word
+    void            *slabs;         // Slabs, linked through their first word
+    size_t          in_use;
+    pthread_mutex_t lock;
+};
+
+// Static initialiser, a pool set up this way needs no slab_pool_init
+#define SLAB_POOL_INITIALIZER(size, count) \
+    { .object_size = (size), .per_slab = (count), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void * arena_alloc(size_t size);
+char * arena_strndup(const char *string, size_t length);
+ArenaMark arena_mark(void);
+void arena_release(ArenaMark mark);
+void arena_reset(void);
+
+bool slab_pool_init(SlabPool *pool, size_t object_size, size_t per_slab);
+void slab_pool_destroy(SlabPool *pool);
+void * slab_alloc(SlabPool *pool);
+void slab_free(SlabPool *pool, void *object);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "disk.h"
+
+// A cached block, handed out referenced by cache_bread/cache_bget
+typedef struct Buffer Buffer;
+struct Buffer {
+    size_t   block;         // Physical block number
+    char     *data;         // BLOCK_SIZE bytes, aligned to DISK_ALIGNMENT
+    uint32_t refs;          // Holders, a referenced buffer is never evicted
+    bool     valid;         // Holds a block
+    bool     dirty;         // Modified since it was read or written back
+    bool     prefetched;    // Loaded by readahead and not read since
+    bool     loading;       // Reserved for a prefetch still being read, lookups wait for it
+    bool     temporary;     // Uncached stand-in handed out when the disk has no cache
+    int32_t  next;          // Next buffer in the hash chain, -1 ends it
+};
+
+/* Replacement policies, see cache_policy.c */
+
+typedef struct PolicyState PolicyState;
+typedef struct CachePolicy CachePolicy;
+struct CachePolicy {
+    const char *name;
+    void    (*hit)(PolicyState *state, int32_t slot);                       // A cached slot was accessed
+    void    (*insert)(PolicyState *state, int32_t slot, size_t block);      // A slot was filled after a miss
+    int32_t (*victim)(PolicyState *state, size_t block, const Buffer *buffers); // Detaches an unpinned slot for block, -1 if none
+};
+
+extern const CachePolicy cache_policy_lru;
+extern const CachePolicy cache_policy_clock;
+extern const CachePolicy cache_policy_2q;
+extern const CachePolicy cache_policy_arc;
+#define CACHE_POLICY_DEFAULT (&cache_policy_arc)
+
+// Counters of one cache (or one simulated run) under its policy
+typedef struct CacheStats CacheStats;
+struct CacheStats {
+    const char *policy;
+    uint64_t   hits;
+    uint64_t   misses;
+    uint64_t   ghost_hits;  // Misses on a block the policy still remembered as recently evicted
+    uint64_t   evictions;
+    uint64_t   prefetched;      // Blocks loaded ahead of their readers by readahead
+    uint64_t   prefetch_hits;   // Prefetched blocks that were read before being evicted
+};
+
+PolicyState * policy_create(size_t capacity);
+void policy_destroy(PolicyState *state);
+uint64_t policy_ghost_hits(const PolicyState *state);
+const CachePolicy * cache_policy_from_name(const char *name);
+bool cache_simulate(const CachePolicy *policy, size_t capacity, const size_t *trace, size_t count, CacheStats *out);
+
+bool cache_enable(Disk *disk, size_t capacity);
+bool cache_enable_policy(Disk *disk, size_t capacity, const CachePolicy *policy);
+CacheStats cache_stats(Disk *disk);
+void cache_disable(Disk *disk);
+bool cache_flush(Disk *disk);
+size_t cache_dirty_count(Disk *disk, size_t *capacity);
+size_t cache_capacity(Disk *disk);
+
+Buffer * cache_bread(Disk *disk, size_t block);
+Buffer * cache_bget(Disk *disk, size_t block);
+void cache_bdirty(Buffer *buffer);
+void cache_bmodify(Disk *disk, Buffer *buffer);
+void cache_bmodified(Disk *disk, Buffer *buffer);
+void cache_brelse(Disk *disk, Buffer *buffer);
+size_t cache_prefetch_reserve(Disk *disk, size_t block, size_t count, BlockVec *vec);
+bool cache_prefetch_complete(Disk *disk, const BlockVec *vec, size_t count, bool read);
+
+/* Hooks of the disk layer, blocks are already validated */
+
+ssize_t cache_read(Disk *disk, size_t block, char *data);
+ssize_t cache_write(Disk *disk, size_t block, const char *data);
+ssize_t cache_readv(Disk *disk, const BlockVec *vec, size_t count);
+ssize_t cache_writev(Disk *disk, const BlockVec *vec, size_t count);
+void cache_invalidate(Disk *disk, size_t block, size_t count);
+bool cache_is_dirty(Disk *disk, size_t block);
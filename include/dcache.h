@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DCACHE_NAME_MAX     (28)    // Longest name plus its terminator, as in a DirEntry
+#define DCACHE_PATH_MAX     (256)   // Longest path kept by the full-path cache, plus its terminator
+#define DCACHE_PATH_DEPTH   (8)     // Most components of a path kept by the full-path cache
+#define DCACHE_PATHS        (4096)  // Full-path slots, direct mapped by the hash of the path
+#define DCACHE_NONE         UINT32_MAX
+
+typedef struct FileSystem FileSystem;
+typedef struct DentryCache DentryCache;
+
+// The dentry that answered one component of a path, and its generation at the time
+typedef struct DcacheRef DcacheRef;
+struct DcacheRef {
+    uint32_t slot;          // DCACHE_NONE when the answer could not be cached
+    uint32_t generation;
+};
+
+typedef struct DcacheStats DcacheStats;
+struct DcacheStats {
+    uint64_t hits;          // (directory, name) lookups answered from memory
+    uint64_t negative_hits; // Of those, names known to be missing
+    uint64_t misses;        // Lookups that scanned the directory
+    uint64_t path_hits;     // fs_lookup calls answered by the full-path cache
+    uint64_t invalidations; // Entries dropped by directory changes
+    uint64_t evictions;     // Unused entries recycled to make room
+    uint64_t cached;        // Entries held right now
+};
+
+DentryCache * dcache_create(size_t capacity);
+void dcache_destroy(DentryCache *dcache);
+
+bool dcache_find(FileSystem *fs, uint32_t parent, const char *name, ssize_t *inode, DcacheRef *ref);
+uint64_t dcache_sequence(FileSystem *fs);
+void dcache_insert(FileSystem *fs, uint32_t parent, const char *name, ssize_t inode, uint64_t sequence, DcacheRef *ref);
+bool dcache_path_find(FileSystem *fs, const char *path, ssize_t *inode);
+void dcache_path_insert(FileSystem *fs, const char *path, ssize_t inode, const DcacheRef *refs, size_t depth);
+
+void dcache_invalidate(FileSystem *fs, uint32_t parent, const char *name);
+void dcache_invalidate_dir(FileSystem *fs, uint32_t dir);
+DcacheStats dcache_stats(FileSystem *fs);
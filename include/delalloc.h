@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "inode.h"
+
+#define DELALLOC_BUCKETS    (256)   // Hash chains of files with data waiting for blocks
+
+typedef struct FileSystem FileSystem;
+typedef struct Delalloc Delalloc;
+
+typedef struct DelallocStats DelallocStats;
+struct DelallocStats {
+    uint64_t buffered;      // Blocks written into memory past the end of a file
+    uint64_t flushed;       // Blocks given disk space and written out
+    uint64_t extents;       // Runs allocated for them
+    uint64_t dropped;       // Blocks removed or truncated before they ever reached the disk
+    uint64_t pressure;      // Flushes forced by the buffered block limit
+    uint64_t pending;       // Blocks waiting right now
+};
+
+bool fs_delalloc_enable(FileSystem *fs, size_t max_blocks);
+void fs_delalloc_disable(FileSystem *fs);
+bool delalloc_extends(FileSystem *fs, size_t inode_number, size_t logical);
+bool delalloc_write(FileSystem *fs, const Inode *inode, size_t inode_number, const char *data, size_t length, size_t offset);
+bool delalloc_read(FileSystem *fs, size_t inode_number, size_t logical, char *data, size_t from, size_t to);
+bool delalloc_flush(FileSystem *fs, size_t inode_number);
+bool delalloc_flush_all(FileSystem *fs);
+void delalloc_drop(FileSystem *fs, size_t inode_number);
+size_t delalloc_pending(FileSystem *fs, size_t *capacity);
+DelallocStats fs_delalloc_stats(FileSystem *fs);
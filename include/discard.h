@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "disk.h"
+#include "inode.h"
+
+#define DISCARD_MAX_RANGES      (256)   // Coalesced ranges kept before the queue is flushed
+#define DISCARD_FLUSH_BLOCKS    (4096)  // Queued blocks (16 MiB) that trigger a flush
+
+typedef struct FileSystem FileSystem;
+
+// Freed block ranges waiting to be punched out of the backing image,
+// kept sorted by start with adjacent and overlapping ranges merged
+typedef struct DiscardQueue DiscardQueue;
+struct DiscardQueue
+{
+    Extent   ranges[DISCARD_MAX_RANGES];
+    size_t   count;         // Ranges in use
+    size_t   blocks;        // Blocks queued across all ranges
+    uint64_t discarded;     // Blocks handed back to the host since mount
+    bool     unsupported;   // Host cannot punch holes, freed ranges are dropped
+};
+
+bool discard_queue(FileSystem *fs, uint32_t start, uint32_t length);
+ssize_t discard_flush(FileSystem *fs);
@@ -7,25 +7,195 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/types.h> 
+#include <sys/uio.h>
+#include <stdint.h>
 
 // Size of each block
 #define BLOCK_SIZE 4096
 
+// Maximum amount of blocks handed to a backend in a single batch
+#define DISK_MAX_IOV 256
+
+// Buffers handed to an O_DIRECT disk must be aligned to this many bytes
+#define DISK_ALIGNMENT BLOCK_SIZE
+
+// Aligned block buffers kept in each disk's buffer pool
+#define DISK_POOL_BLOCKS 512
+
+// Latency histogram buckets: bucket i counts requests that took [2^(i-1), 2^i) ns
+#define DISK_LATENCY_BUCKETS 40
+
+// Seek histogram buckets: bucket 0 is sequential, bucket i is a jump of [2^(i-1), 2^i) blocks
+#define DISK_SEEK_BUCKETS 34
+
+typedef struct DiskOps DiskOps;
+typedef struct BlockPool BlockPool;
+typedef struct WriteQueue WriteQueue;
+typedef struct BufferCache BufferCache;
+
+// Latency model of a simulated device, every non-sequential run pays a seek
+// (base + distance, capped at a full stroke) and the rotational delay, and
+// every run pays its transfer time
+typedef struct DiskModel DiskModel;
+struct DiskModel {
+    double seek_base_us;        // Settle time of any seek
+    double seek_per_block_ns;   // Additional seek time per block of distance
+    double seek_max_us;         // Full-stroke seek time (cap)
+    double rotation_us;         // Average rotational delay (half a revolution)
+    double transfer_mb_s;       // Sustained media transfer rate
+};
+
+// 7200 RPM desktop class hard drive
+#define DISK_MODEL_HDD ((DiskModel){ .seek_base_us = 500.0, .seek_per_block_ns = 4.0, \
+                                     .seek_max_us = 9000.0, .rotation_us = 4166.0, .transfer_mb_s = 150.0 })
+
+// Counters of one direction (reads or writes)
+typedef struct DiskOpStats DiskOpStats;
+struct DiskOpStats {
+    uint64_t requests;      // Batches handed to the backend
+    uint64_t runs;          // Contiguous runs inside those batches
+    uint64_t blocks;        // Blocks moved
+    uint64_t bytes;         // Bytes moved
+    uint64_t sequential;    // Runs starting right after the previous run ended
+    uint64_t random;        // Runs that needed a seek
+    uint64_t latency_ns;    // Total time spent in the backend
+    uint64_t simulated_ns;  // Service time charged by the simulated device model
+    uint64_t latency[DISK_LATENCY_BUCKETS];
+};
+
+// Per-device I/O statistics, every field is a 64-bit counter
+typedef struct DiskStats DiskStats;
+struct DiskStats {
+    DiskOpStats read;
+    DiskOpStats write;
+    uint64_t syscalls;                  // System calls issued by the backend
+    uint64_t queued;                    // Block writes buffered by the write scheduler
+    uint64_t absorbed;                  // Buffered writes replacing a pending write of the same block
+    uint64_t merged;                    // Pending writes merged into the previous run on flush
+    uint64_t flushes;                   // Write scheduler flushes
+    uint64_t cache_hits;                // Blocks served by the buffer cache
+    uint64_t cache_misses;              // Blocks the buffer cache had to fetch or could not serve
+    uint64_t cache_evictions;           // Buffers recycled by the replacement policy
+    uint64_t cache_writebacks;          // Dirty buffers written back to the device
+    uint64_t seek[DISK_SEEK_BUCKETS];   // Distance from the end of the previous run
+};
+
+// Available backends for executing block requests
+typedef enum DiskBackend DiskBackend;
+enum DiskBackend {
+    DISK_BACKEND_FILE,      // Synchronous preadv/pwritev on the image file
+    DISK_BACKEND_URING,     // Batched asynchronous submission through io_uring
+    DISK_BACKEND_MMAP,      // Whole image mapped in memory, blocks served by memcpy
+    DISK_BACKEND_DIRECT,    // O_DIRECT image, bypasses the host page cache
+    DISK_BACKEND_SIM,       // File backend charged with a simulated device latency model
+};
+
 // Structure of the disk
 typedef struct Disk Disk;
 struct Disk {
-    int     fd;         // File Descriptor
-    size_t  blocks;     // Maximum Capacity of blocks
-    size_t  reads;      // Reading operations count
-    size_t  writes;     // Writing operations count
-    bool    mounted;    // Disk mounted status
+    int     fd;             // File Descriptor
+    size_t  blocks;         // Maximum Capacity of blocks
+    size_t  reads;          // Reading operations count (in blocks)
+    size_t  writes;         // Writing operations count (in blocks)
+    bool    mounted;        // Disk mounted status
+    const DiskOps *ops;     // Backend executing the block requests
+    void    *backend;       // Backend private state
+    BlockPool *pool;        // Aligned block buffers borrowed by the fs layer
+    DiskStats stats;        // I/O statistics, read them with disk_stats_snapshot
+    uint64_t  next_block;   // Block right after the previous run (sequential classifier)
+    size_t  stripe_width;   // Blocks in one full stripe across all members, 0 when not striped
+    WriteQueue *queue;      // Elevator write scheduler, NULL when writes go straight to the backend
+    BufferCache *cache;     // Block buffer cache above the scheduler, NULL when disabled
+};
+
+// A single block transfer inside a vectored request
+typedef struct BlockVec BlockVec;
+struct BlockVec {
+    size_t block;       // Physical block number
+    char   *data;       // Buffer of BLOCK_SIZE bytes
+};
+
+// One contiguous run of blocks as handed to a backend
+typedef struct DiskRequest DiskRequest;
+struct DiskRequest {
+    off_t        offset;    // Byte offset of the first block in the image
+    struct iovec *iov;      // Buffers covering the run
+    int          iovcnt;    // Amount of iovecs
+};
+
+// Backend operations, a batch of requests is submitted and completed in one call.
+// sync, block_ptr and discard are optional (discard defaults to punching disk->fd).
+struct DiskOps {
+    const char *name;
+    bool    (*init)(Disk *disk);
+    ssize_t (*submit)(Disk *disk, DiskRequest *requests, size_t count, bool write);
+    bool    (*sync)(Disk *disk);
+    const char * (*block_ptr)(Disk *disk, size_t block);
+    bool    (*discard)(Disk *disk, size_t block, size_t count);
+    void    (*fini)(Disk *disk);
 };
 
+extern const DiskOps disk_file_ops;
+extern const DiskOps disk_uring_ops;
+extern const DiskOps disk_mmap_ops;
+extern const DiskOps disk_direct_ops;
+extern const DiskOps disk_sim_ops;
+extern const DiskOps disk_stripe_ops;
+
+// Unbuffered vectored transfer, used by the write scheduler to reach the backend
+ssize_t disk_vector(Disk *disk, const BlockVec *vec, size_t count, bool write);
+// Validated transfer below the buffer cache, through the write scheduler when enabled
+ssize_t disk_issue(Disk *disk, const BlockVec *vec, size_t count, bool write);
+
+// Synchronous file backend entry points, reused by backends that wrap it
+ssize_t disk_transfer(Disk *disk, int fd, struct iovec *iov, int iovcnt, off_t offset, bool write);
+ssize_t disk_file_submit(Disk *disk, DiskRequest *requests, size_t count, bool write);
+bool disk_file_sync(Disk *disk);
+
 /* Disk Functions Prototypes (Declarations) */
 
 void disk_debug(Disk *disk);
 Disk * disk_open(const char *path, size_t blocks);
+Disk * disk_open_backend(const char *path, size_t blocks, DiskBackend backend);
+Disk * disk_open_sim(const char *path, size_t blocks, const DiskModel *model);
+Disk * disk_open_striped(const char **paths, size_t members, size_t blocks, size_t stripe_blocks);
+Disk * disk_create(size_t blocks, const DiskOps *ops, void *backend);
+DiskBackend disk_backend_from_name(const char *name);
 void disk_close(Disk *disk);
 ssize_t disk_write(Disk *disk, size_t block, char *data);
 ssize_t disk_read(Disk *disk, size_t block, char *data);
-#endif  
\ No newline at end of file
+ssize_t disk_readv(Disk *disk, const BlockVec *vec, size_t count);
+ssize_t disk_writev(Disk *disk, const BlockVec *vec, size_t count);
+ssize_t disk_read_blocks(Disk *disk, size_t block, size_t count, char *data);
+ssize_t disk_write_blocks(Disk *disk, size_t block, size_t count, char *data);
+bool disk_sync(Disk *disk);
+bool disk_writeback(Disk *disk);
+bool disk_zero(Disk *disk, size_t block, size_t count);
+bool disk_discard(Disk *disk, size_t block, size_t count);
+const char * disk_block_ptr(Disk *disk, size_t block);
+char * disk_buffer_get(Disk *disk);
+void disk_buffer_put(Disk *disk, char *buffer);
+bool disk_buffer_usable(Disk *disk, const char *data);
+
+/* Write Scheduler */
+
+bool disk_queue_enable(Disk *disk, size_t capacity);
+bool disk_queue_flush(Disk *disk);
+void disk_queue_disable(Disk *disk);
+ssize_t disk_queue_writev(Disk *disk, const BlockVec *vec, size_t count);
+ssize_t disk_queue_readv(Disk *disk, const BlockVec *vec, size_t count);
+bool disk_queue_contains(Disk *disk, size_t block);
+size_t disk_queue_count(Disk *disk, size_t *capacity);
+
+/* Statistics */
+
+void disk_stats_snapshot(Disk *disk, DiskStats *out);
+void disk_stats_reset(Disk *disk);
+bool disk_stats_dump_json(const DiskStats *stats, FILE *out);
+void disk_stats_runs(Disk *disk, const DiskRequest *requests, size_t count, bool write);
+void disk_stats_latency(Disk *disk, bool write, uint64_t ns);
+void disk_stats_simulated(Disk *disk, bool write, uint64_t ns);
+void disk_stats_syscalls(Disk *disk, uint64_t count);
+void disk_stats_cache(Disk *disk, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t writebacks);
+void disk_stats_scheduler(Disk *disk, uint64_t queued, uint64_t absorbed, uint64_t merged, uint64_t flushes);
+#endif 
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "disk.h"
+#include "inode.h"
+
+#define EXTENT_NODE_MAGIC   (0xe7e8)
+#define EXTENT_TREE_LEVELS  (5)     // Deepest tree walked, far more extents than any disk holds
+
+typedef struct FileSystem FileSystem;
+
+// Entry of an index node: the subtree rooted at block maps logical blocks from first on
+typedef struct ExtentIndex ExtentIndex;
+struct ExtentIndex {
+    uint32_t first;
+    uint32_t block;
+};
+
+typedef struct ExtentNodeHeader ExtentNodeHeader;
+struct ExtentNodeHeader {
+    uint16_t magic;
+    uint16_t level;     // 0 for a leaf of extents, the height above the leaves otherwise
+    uint32_t count;     // Entries in use
+    uint32_t first;     // First logical block mapped below this node
+    uint32_t end;       // Logical block after the last one mapped below this node
+};
+
+#define EXTENT_LEAF_ENTRIES  ((BLOCK_SIZE - sizeof(ExtentNodeHeader)) / sizeof(Extent))
+#define EXTENT_INDEX_ENTRIES ((BLOCK_SIZE - sizeof(ExtentNodeHeader)) / sizeof(ExtentIndex))
+
+// A block of the extent tree of an inode (rooted at its extent_block), holding the
+// extents that follow the ones in the inode
+typedef struct ExtentNode ExtentNode;
+struct ExtentNode {
+    ExtentNodeHeader header;
+    union {
+        Extent      extents[EXTENT_LEAF_ENTRIES];   // Leaf: extents in logical order
+        ExtentIndex index[EXTENT_INDEX_ENTRIES];    // Index node: children in logical order
+    };
+};
+
+// Called for every extent of a tree in logical order (node false) and for the block
+// of every node below the one walked (node true, extent.length 1). Returning false
+// stops the walk.
+typedef bool (*ExtentVisitor)(FileSystem *fs, void *arg, Extent extent, bool node);
+
+bool extent_tree_insert(FileSystem *fs, Inode *inode, Extent extent);
+uint32_t extent_tree_run(FileSystem *fs, uint32_t root, uint32_t logical_block, uint32_t *run);
+bool extent_tree_last(FileSystem *fs, uint32_t root, Extent *last, uint32_t *end);
+bool extent_tree_walk(FileSystem *fs, uint32_t root, ExtentVisitor visit, void *arg);
+bool extent_node_walk(FileSystem *fs, const ExtentNode *node, ExtentVisitor visit, void *arg);
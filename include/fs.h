@@ -5,16 +5,34 @@
 
 #include "disk.h"
 #include "bitmap.h"
+#include "discard.h"
+#include "cache.h"
+#include "icache.h"
+#include "dcache.h"
+#include "writeback.h"
+#include "delalloc.h"
+#include "readahead.h"
+#include "arena.h"
 #include "inode.h"
+#include "extent_tree.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 #include <stdio.h> 
+#include <pthread.h>
 
 // File System Constants
-#define MAGIC_NUMBER (0xf0f03410)
+#define MAGIC_NUMBER (0xf0f03413)
+#define MAGIC_NUMBER_V2 (0xf0f03412) // Extents without logical blocks, see fs_migrate
+#define MAGIC_NUMBER_V1 (0xf0f03411) // Inline data, one flat overflow extent block per inode
+#define MAGIC_NUMBER_V0 (0xf0f03410) // Original layout, 40-byte inodes without inline data
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(Inode))
+#define MOUNT_SCAN_BLOCKS (64)  // Inode table blocks read per request while mounting
+#define FS_CACHE_BLOCKS (1024)  // Buffer cache capacity set up by fs_mount (4 MiB)
+#define FS_ICACHE_INODES (4096) // Unreferenced inodes kept in core by fs_mount
+#define FS_DCACHE_ENTRIES (4096) // Directory names remembered by fs_mount
+#define FS_WRITE_RUNS (16)      // Free runs the blocks allocated by one fs_write may be split across
 
 // File System Structure
 
@@ -33,10 +51,10 @@ union Block {
     
     SuperBlock super;                      // File System Metadata: Contains the SuperBlock structure (Block 0).
     Inode inodes[INODES_PER_BLOCK];        // Inode Table Block: Stores an array of 128 Inode structures (metadata for files).
-    Extent extents[EXTENTS_PER_BLOCK];     // Extents Block: An array of extents stored on a block
+    ExtentNode node;                       // Extent Tree Block: A node of the extent tree of an inode
     char data[BLOCK_SIZE];                 // Data Block: Raw storage for file content.
 
-};
+} __attribute__((aligned(DISK_ALIGNMENT)));  // Aligned so a Block can be handed to an O_DIRECT disk
 
 
 typedef struct FileSystem FileSystem;
@@ -45,6 +63,13 @@ struct FileSystem {
     Bitmap *bitmap;      // Array of free blocks, (In-Memory Bitmap Cache)
     uint32_t *ibitmap;     // Array of free blocks (In-Memory Inodes Bitmap Cache)
     SuperBlock *meta_data;  // Meta data of the file system
+    DiscardQueue *discard;  // Freed ranges not yet punched out of the image (allocated on first free)
+    InodeCache *icache;     // In-core inode table, dirty inodes are written back on sync and unmount
+    DentryCache *dcache;    // Resolved names and paths, NULL when lookups always scan the directories
+    Writeback *writeback;   // Background flusher, NULL unless write-back mode is enabled
+    Readahead *readahead;   // Sequential stream detection and the prefetch worker, NULL when disabled
+    Delalloc *delalloc;     // File data waiting for its blocks, NULL unless write-back mode defers allocation
+    pthread_mutex_t lock;   // Serialises changes to the metadata against each other and the flusher
 };
 
 
@@ -52,6 +77,8 @@ struct FileSystem {
 
 void fs_debug(FileSystem *fs);
 bool fs_format(Disk *disk);
+bool fs_migrate(FileSystem *fs, Disk *disk);
+const char *fs_older_format(uint32_t magic_number);
 bool fs_mount(FileSystem *fs, Disk *disk);
 void fs_unmount(FileSystem *fs);
 ssize_t fs_create(FileSystem *fs);
@@ -60,8 +87,22 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number);
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset);
 Extent fs_allocate(FileSystem *fs, size_t blocks_to_reserve, uint32_t extent_block);
+Extent fs_allocate_aligned(FileSystem *fs, size_t blocks_to_reserve, size_t alignment);
+Extent fs_allocate_range(FileSystem *fs, size_t blocks_to_reserve, uint32_t goal);
 ssize_t fs_lookup(FileSystem *fs, const char *path);
 Inode* fs_read_inode(FileSystem *fs, size_t inode_number);
-uint32_t extent_lookup(FileSystem *fs, Inode *inode, uint32_t logical_block);
-bool extent_add(FileSystem *fs, Inode *inode, uint32_t start, uint32_t length);
-bool fs_truncate(FileSystem *fs, size_t inode_number);
\ No newline at end of file
+void fs_free_inode(Inode *inode);
+bool fs_write_inode(FileSystem *fs, Inode* inode, int inode_number);
+uint32_t extent_lookup(FileSystem *fs, const Inode *inode, uint32_t logical_block);
+uint32_t extent_run(FileSystem *fs, const Inode *inode, uint32_t logical_block, uint32_t *run);
+uint32_t extent_goal(FileSystem *fs, const Inode *inode);
+uint32_t extent_blocks(FileSystem *fs, const Inode *inode);
+const Block *fs_block_view(FileSystem *fs, size_t block, Block *scratch);
+bool extent_add(FileSystem *fs, Inode *inode, uint32_t logical, uint32_t start, uint32_t length);
+bool fs_truncate(FileSystem *fs, size_t inode_number);
+ssize_t fs_trim(FileSystem *fs);
+bool fs_sync(FileSystem *fs);
+bool fs_fsync(FileSystem *fs, size_t inode_number);
+void fs_lock(FileSystem *fs);
+void fs_unlock(FileSystem *fs);
+void fs_unlock_changed(FileSystem *fs);
\ No newline at end of file
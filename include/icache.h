@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "inode.h"
+
+#define ICACHE_SLAB_INODES (128)   // Cached inodes carved out of one slab allocation
+
+typedef struct FileSystem FileSystem;
+typedef struct InodeCache InodeCache;
+
+// Counters of the in-core inode table since mount
+typedef struct InodeCacheStats InodeCacheStats;
+struct InodeCacheStats {
+    uint64_t hits;          // Lookups served from memory
+    uint64_t misses;        // Lookups that read the inode table
+    uint64_t evictions;     // Unreferenced inodes dropped to make room
+    uint64_t writebacks;    // Inode-table blocks written back with dirty inodes
+    uint64_t maps;          // Extent maps decoded
+    uint64_t cached;        // Inodes held right now
+};
+
+InodeCache * icache_create(size_t capacity);
+void icache_destroy(InodeCache *icache);
+bool icache_flush(FileSystem *fs);
+bool icache_flush_inode(FileSystem *fs, size_t inode_number);
+
+Inode * icache_get(FileSystem *fs, size_t inode_number);
+void icache_dirty(Inode *inode);
+void icache_put(FileSystem *fs, Inode *inode);
+uint32_t icache_extent_run(FileSystem *fs, const Inode *inode, uint32_t logical_block, uint32_t *run);
+void icache_extents_begin(FileSystem *fs);
+void icache_extents_end(FileSystem *fs, Inode *inode, const Extent *added);
+InodeCacheStats icache_stats(FileSystem *fs);
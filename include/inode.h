@@ -6,10 +6,11 @@ typedef struct Extent Extent;
 struct Extent {
     uint32_t start; // First physical Block
     uint32_t length; // Amount of contiguous allocated blocks 
+    uint32_t logical; // File block the extent starts at, extents are kept in logical order
 };
 
-#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(Extent))
 #define EXTENTS_PER_INODE (3)
+#define INODE_INLINE_BYTES (48)  // File data that fits in the inode itself
 
 
 // Inode Status
@@ -17,6 +18,9 @@ struct Extent {
 #define INODE_FILE 1
 #define INODE_DIR 2
 
+// Inode Flags
+#define INODE_INLINE 0x1         // The data lives in inline_data, no blocks are allocated
+
 
 // struct
 
@@ -28,8 +32,14 @@ struct Inode
                                          // 2 Indicates a Directory Inode
     uint32_t size;                       // File size in bytes.
     uint32_t extent_count;               // Count of allocated extents
-    Extent extents[EXTENTS_PER_INODE];   // First Direct Extents
-    uint32_t extent_block;               // Extents Block Physical Block
+    uint32_t flags;                      // INODE_INLINE
+    union {
+        struct {
+            Extent extents[EXTENTS_PER_INODE];   // First Direct Extents
+            uint32_t extent_block;               // Extents Block Physical Block
+        };
+        char inline_data[INODE_INLINE_BYTES];    // Contents of a small file, no extents then
+    };
     // FUSE related fields needed (perms, time)
     
 };
@@ -13,6 +13,8 @@
 #define HIGH_CONFIDENCE (0.70f)
 #define LOW_CONFIDENCE  (0.40f)
 
+#define PFS_LIVE_SLAB (64)  // Live-file entries carved out of one slab
+
 
 typedef struct BucketStats BucketStats;
 struct BucketStats {
@@ -39,6 +41,7 @@ struct LiveFileEntry {
     uint32_t first_write_size; // size after first write (0 = not written)
     char extension[16]; // file extension name
     uint32_t bucket_index;
+    LiveFileEntry *next; // next tracked file
 };
 
 
@@ -46,14 +49,15 @@ typedef struct pFileSystem pFileSystem;
 struct pFileSystem {
     FileSystem *fs; // filesystem instance
     ExtensionEntry *entries; // extension entries stats array (from disk)
-    LiveFileEntry *live_files; // currently open files being tracked
+    LiveFileEntry *live_files; // currently open files being tracked, linked through next
     size_t live_count; // number of active file entries 
-    size_t live_capacity; // capacity of file entries in the array
+    SlabPool live_pool; // the entries are carved out of slabs instead of a growing array
     bool dirty; // if data needs to be written to disk
 };
 
 
 bool pfs_mount(pFileSystem *pfs, Disk *disk);
+bool pfs_migrate(pFileSystem *pfs, Disk *disk);
 bool pfs_format(Disk *disk);
 bool pfs_unmount(pFileSystem *pfs);
 ssize_t pfs_create(pFileSystem *pfs, const char *path);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "inode.h"
+
+#define READAHEAD_MIN_BLOCKS    (4)     // Window of a stream that was just detected
+#define READAHEAD_MAX_BLOCKS    (128)   // Largest window (512 KiB)
+#define READAHEAD_STREAMS       (64)    // Inodes tracked at once, direct mapped by inode number
+#define READAHEAD_QUEUE_RUNS    (64)    // Runs waiting for the worker, and most runs of one window
+#define READAHEAD_RUN_BLOCKS    (READAHEAD_MAX_BLOCKS + READAHEAD_MIN_BLOCKS)   // Longest run, a window stretched to its extent end
+
+typedef struct FileSystem FileSystem;
+typedef struct Readahead Readahead;
+
+typedef struct ReadaheadStats ReadaheadStats;
+struct ReadaheadStats {
+    uint64_t sequential;    // Reads continuing a stream
+    uint64_t random;        // Reads breaking one
+    uint64_t windows;       // Readahead windows started
+    uint64_t runs;          // Contiguous physical runs in those windows
+    uint64_t blocks;        // Blocks in those runs
+    uint64_t inline_runs;   // Runs the reader read itself, synchronous windows and runs it caught up with
+    uint64_t covered;       // Sequential reads spanning the window, nothing prefetched for them
+};
+
+bool fs_readahead_enable(FileSystem *fs);
+void fs_readahead_disable(FileSystem *fs);
+void fs_readahead(FileSystem *fs, size_t inode_number, const Inode *inode, size_t offset, size_t length);
+ReadaheadStats fs_readahead_stats(FileSystem *fs);
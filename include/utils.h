@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include "arena.h"
 
 static inline void flip_bit(uint32_t *bitmap, int offset) 
 {
@@ -77,13 +78,15 @@ static inline char* extract_extension(const char *filename)
     return extension+1;
 }
 
+// The parent path is allocated from the calling thread's arena, it lives until the
+// caller releases the arena (or the FUSE op resets it)
 static inline char* extract_parentdir(const char *path) 
 {
     char *last_slash = strrchr(path, '/');
-    char *parentdir = malloc((last_slash - path) + 1);
-    memcpy(parentdir, path, last_slash - path);
-    parentdir[last_slash-path] = '\0';
-    return parentdir;
+    if (last_slash == NULL) {
+        return NULL;
+    }
+    return arena_strndup(path, last_slash - path);
 }
 
 #endif
\ No newline at end of file
@@ -13,4 +13,8 @@ int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int vfs_unlink(const char *path);
 int vfs_mkdir(const char *path, mode_t mode);
 int vfs_rmdir(const char *path);
-int vfs_truncate(const char *path, off_t size);
\ No newline at end of file
+int vfs_truncate(const char *path, off_t size);
+int vfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int vfs_flush(const char *path, struct fuse_file_info *fi);
+void *vfs_init(struct fuse_conn_info *conn);
+void vfs_destroy(void *private_data);
\ No newline at end of file
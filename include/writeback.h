@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define WRITEBACK_INTERVAL_MS   (250)   // Flusher wake-up period
+#define WRITEBACK_EXPIRE_MS     (1000)  // Oldest unwritten change before a write-back is forced
+#define WRITEBACK_DIRTY_RATIO   (50)    // Percent of dirty cache and queue slots that forces a write-back
+#define WRITEBACK_QUEUE_BLOCKS  (4096)  // Write queue set up for data blocks when the disk has none (16 MiB)
+#define WRITEBACK_DELALLOC_BLOCKS (4096) // File blocks kept in memory before their allocation is forced (16 MiB)
+
+typedef struct FileSystem FileSystem;
+typedef struct Writeback Writeback;
+
+typedef struct WritebackConfig WritebackConfig;
+struct WritebackConfig {
+    uint32_t interval_ms;
+    uint32_t expire_ms;
+    uint32_t dirty_ratio;   // Percent
+    size_t   queue_blocks;
+    size_t   delalloc_blocks; // 0 allocates in fs_write as in write-through mode
+};
+
+typedef struct WritebackStats WritebackStats;
+struct WritebackStats {
+    uint64_t wakeups;       // Flusher wake-ups
+    uint64_t expired;       // Write-backs forced by the age of the oldest change
+    uint64_t ratio;         // Write-backs forced by the dirty ratio
+    uint64_t syncs;         // fs_sync and fs_fsync calls
+};
+
+bool fs_writeback_enable(FileSystem *fs, const WritebackConfig *config);
+void fs_writeback_disable(FileSystem *fs);
+void fs_writeback_dirtied(FileSystem *fs);
+bool fs_writeback(FileSystem *fs, bool durable);
+WritebackStats fs_writeback_stats(FileSystem *fs);
@@ -104,7 +104,7 @@ int main() {
     Inode *inode_check = fs_read_inode(pfs2.fs, pred);
     if (inode_check) {
         printf("predicted file extent_count=%u\n", inode_check->extent_count);
-        free(inode_check);
+        fs_free_inode(inode_check);
     }
     pfs_remove(&pfs2, pred);
 
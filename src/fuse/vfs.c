@@ -6,6 +6,9 @@
 
 static pFileSystem *pfs = NULL;
 
+// Temporaries of a request (parent paths) come from the calling thread's arena,
+// the ops that take them reset it on their way out.
+
 
 int vfs_getattr(const char *path, struct stat *st) 
 {
@@ -19,7 +22,7 @@ int vfs_getattr(const char *path, struct stat *st)
     {
         ssize_t flag = fs_lookup(pfs->fs, path);
         if (flag == -1) return -ENOENT;
-        Inode* inode = fs_read_inode(pfs->fs, flag);
+        Inode* inode = icache_get(pfs->fs, flag);
         if (inode == NULL) 
         {
             return -EIO;
@@ -34,7 +37,7 @@ int vfs_getattr(const char *path, struct stat *st)
             st->st_nlink = 1;
         }
         st->st_size = inode->size;
-        free(inode);
+        icache_put(pfs->fs, inode);
 
     }
     return 0;
@@ -49,7 +52,7 @@ int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
     if (dir_inode_num < 0) {
         return -ENOENT;
     }
-    Inode *inode = fs_read_inode(pfs->fs, (size_t)dir_inode_num);
+    Inode *inode = icache_get(pfs->fs, (size_t)dir_inode_num);
     if (inode == NULL) {
         return -EIO;
     }
@@ -62,12 +65,12 @@ int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
                 filler(buf, entry.name, NULL, 0);
             }
         }
-        free(inode);
+        icache_put(pfs->fs, inode);
         return 0;
     }
     else {
         // not a directory
-        free(inode);
+        icache_put(pfs->fs, inode);
         return -ENOTDIR;
     }
 }
@@ -116,11 +119,11 @@ int vfs_unlink(const char *path) {
     char *parentdir = extract_parentdir(path);
     ssize_t dir_inode = fs_lookup(pfs->fs, parentdir);
     if (dir_inode < 0) {
-        free(parentdir);
+        arena_reset();
         return -ENOENT;
     }
     dir_remove(pfs->fs, dir_inode, extract_filename(path));
-    free(parentdir);
+    arena_reset();
     return 0;
 }
 
@@ -132,15 +135,15 @@ int vfs_mkdir(const char *path, mode_t mode) {
     char *parentdir = extract_parentdir(path);
     ssize_t dir_inode = fs_lookup(pfs->fs, parentdir);
     if (dir_inode < 0) {
-        free(parentdir);
+        arena_reset();
         return -ENOENT;
     }
     int flag = dir_add(pfs->fs, dir_inode, extract_filename(path), inode);
     if (flag < 0) {
-        free(parentdir);
+        arena_reset();
         return -EIO;
     }
-    free(parentdir);
+    arena_reset();
     return 0;
 
 }
@@ -150,26 +153,26 @@ int vfs_rmdir(const char *path) {
     if (inode < 0) {
         return -ENOENT;
     }
-    Inode *inode_dir = fs_read_inode(pfs->fs, inode);
-    if (inode_dir->size > 0) {
-        free(inode_dir);
+    ssize_t size = fs_stat(pfs->fs, inode);
+    if (size < 0) {
+        return -EIO;
+    }
+    if (size > 0) {
         return -ENOTEMPTY;
     }
     ssize_t flag = fs_remove(pfs->fs, inode);
     if (flag < 0) {
-        free(inode_dir);
         return -EIO;
     }
     
     char *parentdir = extract_parentdir(path);
     ssize_t dir_inode = fs_lookup(pfs->fs, parentdir);
     if (dir_inode < 0) {
-        free(parentdir);
+        arena_reset();
         return -ENOENT;
     }
     dir_remove(pfs->fs, dir_inode, extract_filename(path));
-    free(parentdir);
-    free(inode_dir);
+    arena_reset();
     return 0;
 }
 
@@ -183,6 +186,50 @@ int vfs_truncate(const char *path, off_t size) {
     return 0;
 }
 
+int vfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    ssize_t inode = fs_lookup(pfs->fs, path);
+    if (inode < 0) {
+        return -ENOENT;
+    }
+    if (!fs_fsync(pfs->fs, inode)) return -EIO;
+    return 0;
+}
+
+// Called by FUSE on every close of a file descriptor, so a close is durable like an fsync
+int vfs_flush(const char *path, struct fuse_file_info *fi) {
+    return vfs_fsync(path, 0, fi);
+}
+
+// Called by FUSE once the daemon is running, threads started before fuse_main
+// would not survive its fork. PFS_WRITEBACK buffers writes in memory behind a
+// background flusher.
+void *vfs_init(struct fuse_conn_info *conn) {
+    if (getenv("PFS_WRITEBACK") != NULL && !fs_writeback_enable(pfs->fs, NULL)) {
+        fprintf(stderr, "vfs_init: Warning write-back mode is unavailable, writes go through\n");
+    }
+    return NULL;
+}
+
+// Called by FUSE on unmount: optionally dumps the disk statistics to the
+// file named by PFS_STATS_JSON, then flushes and releases the filesystem
+void vfs_destroy(void *private_data) {
+    const char *stats_path = getenv("PFS_STATS_JSON");
+    if (stats_path != NULL) {
+        FILE *out = fopen(stats_path, "w");
+        if (out == NULL) {
+            perror("vfs_destroy: Error opening the stats file has failed");
+        } else {
+            DiskStats stats;
+            disk_stats_snapshot(pfs->fs->disk, &stats);
+            disk_stats_dump_json(&stats, out);
+            fclose(out);
+        }
+    }
+    pfs_unmount(pfs);
+    free(pfs);
+    pfs = NULL;
+}
+
 // registered ops
 static struct fuse_operations ops = {
     .getattr = vfs_getattr,
@@ -194,15 +241,33 @@ static struct fuse_operations ops = {
     .unlink = vfs_unlink,
     .mkdir = vfs_mkdir,
     .rmdir = vfs_rmdir,
-    .truncate = vfs_truncate
+    .truncate = vfs_truncate,
+    .fsync = vfs_fsync,
+    .flush = vfs_flush,
+    .init = vfs_init,
+    .destroy = vfs_destroy
 };
 
 int main(int argc, char *argv[]) 
 {
-    Disk *disk = disk_open("disk.img", 1000);
-    pfs_format(disk);
+    // PFS_DISK_BACKEND selects the block backend (see disk_backend_from_name)
+    Disk *disk = disk_open_backend("disk.img", 1000, disk_backend_from_name(getenv("PFS_DISK_BACKEND")));
+    // PFS_WRITE_QUEUE buffers that many block writes in the elevator write scheduler
+    if (disk != NULL && getenv("PFS_WRITE_QUEUE") != NULL) {
+        disk_queue_enable(disk, strtoul(getenv("PFS_WRITE_QUEUE"), NULL, 10));
+    }
+    // PFS_CACHE_POLICY picks the buffer cache replacement policy (lru, clock, 2q, arc)
+    if (disk != NULL && getenv("PFS_CACHE_POLICY") != NULL) {
+        cache_enable_policy(disk, FS_CACHE_BLOCKS, cache_policy_from_name(getenv("PFS_CACHE_POLICY")));
+    }
+    // PFS_MIGRATE keeps the existing image, converting it first when it has an older format
     pfs = calloc(1, sizeof(pFileSystem));
-    pfs_mount(pfs, disk);
+    if (getenv("PFS_MIGRATE") != NULL) {
+        if (!pfs_migrate(pfs, disk)) return 1;
+    } else {
+        pfs_format(disk);
+        pfs_mount(pfs, disk);
+    }
     return fuse_main(argc, argv, &ops, NULL);
 }
 
@@ -10,7 +10,7 @@
 #include "dir.h"
 
 
-#define MAGIC_NUMBER (0xf0f03410)
+#define MAGIC_NUMBER (0xf0f03413)
 #define UINT32_MAX 0xFFFFFFFFU
 
 static struct inode_operations predictfs_inode_ops;
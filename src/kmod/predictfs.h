@@ -7,7 +7,7 @@
 
 
 // File System Constants
-#define MAGIC_NUMBER (0xf0f03410)
+#define MAGIC_NUMBER (0xf0f03413)
 #define INODES_PER_BLOCK (PFS_BLOCK_SIZE / sizeof(Inode))
 
 
@@ -0,0 +1,203 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Arenas and slab pools
+ * Request-scoped temporaries (path pieces, I/O vectors) come from a per-thread
+ * bump arena instead of the heap: a function takes a mark, allocates what it
+ * needs and releases back to the mark before returning, and the FUSE ops reset
+ * the whole arena when a request is done. The chunks of an arena stay with the
+ * thread, so once it has seen its largest request it stops calling malloc, and
+ * no two threads ever share an allocator lock. They are freed when the thread
+ * exits. Objects that outlive a request but are allocated and freed at a high
+ * rate (inode copies, live-file entries, prefetch vectors) come from slab
+ * pools of fixed-size objects. */
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t     size;        // Usable bytes in data
+    size_t     used;
+    char       data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+typedef struct Arena Arena;
+struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *current;
+};
+
+static __thread Arena thread_arena;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+// Thread exit: the chunks of the thread's arena go back to the heap
+static void arena_free_chunks(void *first)
+{
+    for (ArenaChunk *chunk = first; chunk != NULL; ) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static void arena_key_create(void)
+{
+    pthread_key_create(&arena_key, arena_free_chunks);
+}
+
+static size_t arena_round(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+/* Allocates size bytes from the calling thread's arena, valid until the arena is
+ * released past it or reset. NULL when a new chunk cannot be allocated. */
+void * arena_alloc(size_t size)
+{
+    Arena *arena = &thread_arena;
+    size = arena_round(size == 0 ? 1 : size);
+
+    ArenaChunk *chunk = arena->current;
+    if (chunk != NULL && chunk->size - chunk->used >= size) {
+        void *object = chunk->data + chunk->used;
+        chunk->used += size;
+        return object;
+    }
+    // the chunks after the current one are free, take the next one that fits
+    ArenaChunk **link = (chunk != NULL) ? &chunk->next : &arena->first;
+    while (*link != NULL && (*link)->size < size) link = &(*link)->next;
+    if (*link == NULL) {
+        size_t bytes = (size > ARENA_CHUNK_BYTES) ? size : ARENA_CHUNK_BYTES;
+        ArenaChunk *grown = malloc(sizeof(ArenaChunk) + bytes);
+        if (grown == NULL) {
+            perror("arena_alloc: Error growing the arena has failed");
+            return NULL;
+        }
+        grown->next = NULL;
+        grown->size = bytes;
+        *link = grown;
+        if (arena->first == grown) {
+            pthread_once(&arena_once, arena_key_create);
+            pthread_setspecific(arena_key, grown);
+        }
+    }
+    // a chunk that is too small is skipped for this request, and reused by the next
+    arena->current = *link;
+    arena->current->used = size;
+    return arena->current->data;
+}
+
+/* Copies length bytes of string into the arena with a terminator */
+char * arena_strndup(const char *string, size_t length)
+{
+    char *copy = arena_alloc(length + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* Current position of the calling thread's arena */
+ArenaMark arena_mark(void)
+{
+    ArenaMark mark = { .chunk = thread_arena.current, .used = 0 };
+    if (thread_arena.current != NULL) mark.used = thread_arena.current->used;
+    return mark;
+}
+
+/* Frees everything allocated since mark was taken */
+void arena_release(ArenaMark mark)
+{
+    Arena *arena = &thread_arena;
+    if (mark.chunk == NULL) {
+        // taken before the first allocation of the thread
+        arena->current = NULL;
+        return;
+    }
+    arena->current = mark.chunk;
+    arena->current->used = mark.used;
+}
+
+/* Frees everything in the calling thread's arena, the chunks are kept */
+void arena_reset(void)
+{
+    thread_arena.current = NULL;
+}
+
+/* Sets up an empty pool of object_size objects, per_slab of them per slab */
+bool slab_pool_init(SlabPool *pool, size_t object_size, size_t per_slab)
+{
+    if (pool == NULL || object_size == 0 || per_slab == 0) {
+        fprintf(stderr, "slab_pool_init: Error pool, object size or slab size is invalid\n");
+        return false;
+    }
+    memset(pool, 0, sizeof(SlabPool));
+    pool->object_size = object_size;
+    pool->per_slab = per_slab;
+    pthread_mutex_init(&pool->lock, NULL);
+    return true;
+}
+
+/* Frees every slab of the pool, objects still in use go with them */
+void slab_pool_destroy(SlabPool *pool)
+{
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->slabs != NULL) {
+        void *slab = pool->slabs;
+        pool->slabs = *(void **)slab;
+        free(slab);
+    }
+    pool->free = NULL;
+    pool->in_use = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Objects are at least a pointer wide and keep the arena alignment
+static size_t slab_stride(const SlabPool *pool)
+{
+    size_t size = (pool->object_size < sizeof(void *)) ? sizeof(void *) : pool->object_size;
+    return arena_round(size);
+}
+
+/* Hands out an object of the pool, a new slab is carved up when the free list is empty */
+void * slab_alloc(SlabPool *pool)
+{
+    if (pool == NULL) return NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free == NULL) {
+        size_t stride = slab_stride(pool);
+        // the first ARENA_ALIGNMENT bytes of a slab link it into the slab list
+        char *slab = malloc(ARENA_ALIGNMENT + stride * pool->per_slab);
+        if (slab == NULL) {
+            perror("slab_alloc: Error allocating a slab has failed");
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        for (size_t i = pool->per_slab; i > 0; i--) {
+            void *object = slab + ARENA_ALIGNMENT + (i - 1) * stride;
+            *(void **)object = pool->free;
+            pool->free = object;
+        }
+    }
+    void *object = pool->free;
+    pool->free = *(void **)object;
+    pool->in_use++;
+    pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+
+/* Returns an object obtained from slab_alloc to its pool */
+void slab_free(SlabPool *pool, void *object)
+{
+    if (pool == NULL || object == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    *(void **)object = pool->free;
+    pool->free = object;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
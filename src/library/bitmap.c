@@ -19,15 +19,10 @@ bool format_bitmap(Disk *disk, uint32_t inode_blocks, uint32_t bitmap_blocks)
         return false;
     }
 
-    // Formatting the bitmap blocks
-    for(size_t i = (inode_blocks+1); i <= (bitmap_blocks+inode_blocks); i++) 
-    {
-        Block buffer;
-        memset(buffer.data, 0, BLOCK_SIZE);
-        if (disk_write(disk, i, buffer.data) < 0) {
-            perror("format_bitmap: writing to disk failed.");
-            return false;
-        }
+    // The bitmap blocks live right after the inode table and start out all free
+    if (!disk_zero(disk, inode_blocks + 1, bitmap_blocks)) {
+        perror("format_bitmap: zeroing the bitmap blocks failed.");
+        return false;
     }
     return true;
 }
@@ -38,13 +33,11 @@ bool save_bitmap(FileSystem *fs)
         perror("save_bitmap: Error invalid fs");
         return false;
     }
-    // Bitmap blocks live right after the inode table (inode_blocks+1+i)
-    // writes to disk from the buffer byte after byte (using char casting) up to bitmap_blocks
-    for (uint32_t i = 0; i < fs->meta_data->bitmap_blocks; i++) {
-        if (disk_write(fs->disk, fs->meta_data->inode_blocks+1+i, (char *)fs->bitmap->bits+i*BLOCK_SIZE) < 0) {
-            perror("save_bitmap: Failed to write bitmap block to disk");
-            return false;
-        }
+    // Bitmap blocks live right after the inode table (inode_blocks+1) and the
+    // in-memory bitmap is one flat buffer, so the whole thing goes out in a single call
+    if (disk_write_blocks(fs->disk, fs->meta_data->inode_blocks+1, fs->meta_data->bitmap_blocks, (char *)fs->bitmap->bits) < 0) {
+        perror("save_bitmap: Failed to write bitmap blocks to disk");
+        return false;
     }
     return true;
 }
@@ -57,13 +50,11 @@ bool load_bitmap(FileSystem *fs)
         return false;
     }
 
-    // Bitmap blocks live right after the inode table (inode_blocks+1+i)
-    // reads the bitmap block from the disk one by one and copies it into the bitmap buffer one byte at a time (we cast the bitmap to char to be able to do that)
-    for (uint32_t i = 0; i < fs->meta_data->bitmap_blocks; i++) {
-        if (disk_read(fs->disk, fs->meta_data->inode_blocks+1+i, (char *)fs->bitmap->bits+i*BLOCK_SIZE) < 0) {
-            perror("load_bitmap: Failed to read bitmap block from disk");
-            return false;
-        }
+    // Bitmap blocks live right after the inode table (inode_blocks+1)
+    // reads all bitmap blocks straight into the bitmap buffer with a single call
+    if (disk_read_blocks(fs->disk, fs->meta_data->inode_blocks+1, fs->meta_data->bitmap_blocks, (char *)fs->bitmap->bits) < 0) {
+        perror("load_bitmap: Failed to read bitmap blocks from disk");
+        return false;
     }
     return true;
 }
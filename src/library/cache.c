@@ -0,0 +1,604 @@
+#include "cache.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Buffer Cache
+ * A fixed set of block buffers between the file system and the device,
+ * indexed by a chained hash on the block number and recycled by a pluggable
+ * replacement policy (ARC by default, see cache_policy.c).
+ * Single block reads and writes (inode table, extent blocks, directory and
+ * pfs metadata) populate the cache and writes stay dirty in memory until the
+ * buffer is evicted, the cache is flushed (disk_sync) or the disk is closed.
+ * Vectored data transfers stay coherent with cached copies but do not
+ * populate the cache, and the scan resistant policies keep blocks read once
+ * (a file streamed in small reads) from displacing the hot metadata.
+ * Dirty buffers leave through the write scheduler when one is enabled.
+ * Readahead reserves whole runs with cache_prefetch_reserve, buffers being
+ * loaded are hashed up front and lookups wait for them. The first read of a
+ * prefetched block counts as the reference its insertion stood for, so
+ * a file streamed once through readahead still looks read once. */
+
+struct BufferCache {
+    Buffer          *buffers;
+    char            *slab;      // capacity aligned blocks backing the buffers
+    size_t          capacity;
+    int32_t         *heads;     // Hash buckets, -1 is empty
+    size_t          mask;
+    size_t          unused;     // Slots never filled yet, handed out before any eviction
+    int32_t         *spare;     // Slots emptied by a failed load
+    size_t          spare_count;
+    const CachePolicy *policy;
+    PolicyState     *state;
+    CacheStats      stats;
+    size_t          loading;    // Buffers reserved by cache_prefetch_reserve and not read yet
+    pthread_mutex_t lock;
+    pthread_cond_t  loaded;     // Signalled when a prefetch completes
+};
+
+static size_t cache_hash(size_t block, size_t mask)
+{
+    return (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 23) & mask;
+}
+
+// Buffer holding block or NULL, the caller holds the lock
+static Buffer * cache_find(BufferCache *cache, size_t block)
+{
+    for (int32_t i = cache->heads[cache_hash(block, cache->mask)]; i >= 0; i = cache->buffers[i].next) {
+        if (cache->buffers[i].block == block) return &cache->buffers[i];
+    }
+    return NULL;
+}
+
+// cache_find that waits for a prefetch still loading the block. The caller holds the lock.
+static Buffer * cache_find_ready(BufferCache *cache, size_t block)
+{
+    Buffer *buffer = cache_find(cache, block);
+    while (buffer != NULL && buffer->loading) {
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+        buffer = cache_find(cache, block);
+    }
+    return buffer;
+}
+
+static void cache_link(BufferCache *cache, Buffer *buffer)
+{
+    size_t bucket = cache_hash(buffer->block, cache->mask);
+    buffer->next = cache->heads[bucket];
+    cache->heads[bucket] = (int32_t)(buffer - cache->buffers);
+}
+
+static void cache_unlink(BufferCache *cache, Buffer *buffer)
+{
+    int32_t index = (int32_t)(buffer - cache->buffers);
+    int32_t *link = &cache->heads[cache_hash(buffer->block, cache->mask)];
+    while (*link >= 0 && *link != index) link = &cache->buffers[*link].next;
+    if (*link == index) *link = buffer->next;
+    buffer->next  = -1;
+    buffer->valid = false;
+}
+
+static bool cache_writeback(Disk *disk, Buffer *buffer)
+{
+    BlockVec vec = { .block = buffer->block, .data = buffer->data };
+    if (disk_issue(disk, &vec, 1, true) < 0) {
+        fprintf(stderr, "cache_writeback: Error writing back block %zu failed\n", buffer->block);
+        return false;
+    }
+    buffer->dirty = false;
+    buffer->prefetched = false;
+    disk_stats_cache(disk, 0, 0, 0, 1);
+    return true;
+}
+
+// Records an access to a cached buffer with the policy. The caller holds the lock.
+static void cache_touch(BufferCache *cache, Buffer *buffer)
+{
+    if (buffer->prefetched) {
+        buffer->prefetched = false;
+        cache->stats.prefetch_hits++;
+        return;
+    }
+    cache->policy->hit(cache->state, (int32_t)(buffer - cache->buffers));
+}
+
+// Empty slot for block: a never used one, then one left by a failed load, then
+// the policy's victim, written back when dirty. The caller holds the lock.
+static Buffer * cache_victim(Disk *disk, BufferCache *cache, size_t block)
+{
+    if (cache->unused < cache->capacity) return &cache->buffers[cache->unused++];
+    if (cache->spare_count > 0) return &cache->buffers[cache->spare[--cache->spare_count]];
+
+    int32_t slot = cache->policy->victim(cache->state, block, cache->buffers);
+    if (slot < 0) return NULL;
+    Buffer *buffer = &cache->buffers[slot];
+    if (buffer->dirty && !cache_writeback(disk, buffer)) {
+        cache->policy->insert(cache->state, slot, buffer->block);
+        return NULL;
+    }
+    cache_unlink(cache, buffer);
+    cache->stats.evictions++;
+    disk_stats_cache(disk, 0, 0, 1, 0);
+    return buffer;
+}
+
+// Referenced buffer of block, loading it from the device when read is set. The caller
+// holds the lock, which is dropped during the read: the buffer is hashed as loading
+// first, like a prefetch, so lookups of the block wait for it and nothing evicts it.
+static Buffer * cache_get_locked(Disk *disk, BufferCache *cache, size_t block, bool read)
+{
+    Buffer *buffer = cache_find_ready(cache, block);
+    if (buffer != NULL) {
+        buffer->refs++;
+        cache_touch(cache, buffer);
+        cache->stats.hits++;
+        disk_stats_cache(disk, 1, 0, 0, 0);
+        return buffer;
+    }
+
+    buffer = cache_victim(disk, cache, block);
+    if (buffer == NULL) {
+        fprintf(stderr, "cache_bread: Error every buffer is referenced or dirty and unwritable\n");
+        return NULL;
+    }
+    buffer->block      = block;
+    buffer->valid      = true;
+    buffer->dirty      = false;
+    buffer->prefetched = false;
+    buffer->refs       = 1;
+    cache_link(cache, buffer);
+    if (read) {
+        BlockVec vec = { .block = block, .data = buffer->data };
+        buffer->loading = true;
+        cache->loading++;
+        pthread_mutex_unlock(&cache->lock);
+        bool ok = disk_issue(disk, &vec, 1, false) >= 0;
+        pthread_mutex_lock(&cache->lock);
+        buffer->loading = false;
+        cache->loading--;
+        pthread_cond_broadcast(&cache->loaded);
+        if (!ok) {
+            cache_unlink(cache, buffer);
+            buffer->refs = 0;
+            cache->spare[cache->spare_count++] = (int32_t)(buffer - cache->buffers);
+            return NULL;
+        }
+    }
+    cache->policy->insert(cache->state, (int32_t)(buffer - cache->buffers), block);
+    cache->stats.misses++;
+    disk_stats_cache(disk, 0, 1, 0, 0);
+    return buffer;
+}
+
+/* Puts a buffer cache of capacity blocks between the disk users and the device */
+bool cache_enable(Disk *disk, size_t capacity)
+{
+    return cache_enable_policy(disk, capacity, CACHE_POLICY_DEFAULT);
+}
+
+/* cache_enable with a given replacement policy, NULL takes the default */
+bool cache_enable_policy(Disk *disk, size_t capacity, const CachePolicy *policy)
+{
+    if (disk == NULL || capacity == 0 || capacity > INT32_MAX / 2) {
+        fprintf(stderr, "cache_enable: Error invalid disk or capacity\n");
+        return false;
+    }
+    if (disk->cache != NULL) return true;
+
+    BufferCache *cache = calloc(1, sizeof(BufferCache));
+    if (cache == NULL) return false;
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+
+    cache->buffers = calloc(capacity, sizeof(Buffer));
+    cache->slab    = aligned_alloc(DISK_ALIGNMENT, capacity * BLOCK_SIZE);
+    cache->heads   = malloc(buckets * sizeof(int32_t));
+    cache->spare   = malloc(capacity * sizeof(int32_t));
+    cache->state   = policy_create(capacity);
+    if (cache->buffers == NULL || cache->slab == NULL || cache->heads == NULL || cache->spare == NULL || cache->state == NULL) {
+        perror("cache_enable: failed to allocate the buffer cache");
+        free(cache->buffers);
+        free(cache->slab);
+        free(cache->heads);
+        free(cache->spare);
+        policy_destroy(cache->state);
+        free(cache);
+        return false;
+    }
+    cache->policy = (policy != NULL) ? policy : CACHE_POLICY_DEFAULT;
+    cache->stats.policy = cache->policy->name;
+    for (size_t i = 0; i < buckets; i++) cache->heads[i] = -1;
+    for (size_t i = 0; i < capacity; i++) {
+        cache->buffers[i].data = cache->slab + i * BLOCK_SIZE;
+        cache->buffers[i].next = -1;
+    }
+    cache->capacity = capacity;
+    cache->mask     = buckets - 1;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    disk->cache = cache;
+    return true;
+}
+
+static int cache_compare(const void *a, const void *b)
+{
+    size_t x = ((const BlockVec *)a)->block, y = ((const BlockVec *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/* Writes every dirty buffer back in one vectored request sorted by block */
+bool cache_flush(Disk *disk)
+{
+    if (disk == NULL || disk->cache == NULL) return true;
+    BufferCache *cache = disk->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    BlockVec *vec = malloc(cache->capacity * sizeof(BlockVec));
+    if (vec == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        perror("cache_flush: failed to allocate the flush vector");
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        Buffer *buffer = &cache->buffers[i];
+        if (buffer->valid && buffer->dirty) {
+            vec[count].block = buffer->block;
+            vec[count].data  = buffer->data;
+            count++;
+        }
+    }
+    qsort(vec, count, sizeof(BlockVec), cache_compare);
+
+    bool ok = (count == 0) || disk_issue(disk, vec, count, true) >= 0;
+    if (ok) {
+        for (size_t i = 0; i < cache->capacity; i++) cache->buffers[i].dirty = false;
+        disk_stats_cache(disk, 0, 0, 0, count);
+    }
+    free(vec);
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
+}
+
+/* Dirty buffers, and the capacity of the cache through capacity when it is not NULL */
+size_t cache_dirty_count(Disk *disk, size_t *capacity)
+{
+    if (capacity != NULL) *capacity = 0;
+    if (disk == NULL || disk->cache == NULL) return 0;
+    BufferCache *cache = disk->cache;
+    size_t dirty = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->capacity; i++) {
+        if (cache->buffers[i].valid && cache->buffers[i].dirty) dirty++;
+    }
+    if (capacity != NULL) *capacity = cache->capacity;
+    pthread_mutex_unlock(&cache->lock);
+    return dirty;
+}
+
+/* Buffers in the cache, 0 without one */
+size_t cache_capacity(Disk *disk)
+{
+    return (disk != NULL && disk->cache != NULL) ? disk->cache->capacity : 0;
+}
+
+/* Flushes and removes the cache */
+void cache_disable(Disk *disk)
+{
+    if (disk == NULL || disk->cache == NULL) return;
+    BufferCache *cache = disk->cache;
+    if (!cache_flush(disk)) {
+        fprintf(stderr, "cache_disable: Error dirty buffers could not be written back\n");
+    }
+    disk->cache = NULL;
+    pthread_cond_destroy(&cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buffers);
+    free(cache->slab);
+    free(cache->heads);
+    free(cache->spare);
+    policy_destroy(cache->state);
+    free(cache);
+}
+
+/* Hit, miss and eviction counters of the cache since it was enabled */
+CacheStats cache_stats(Disk *disk)
+{
+    CacheStats stats = {0};
+    if (disk == NULL || disk->cache == NULL) return stats;
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    stats = cache->stats;
+    stats.ghost_hits = policy_ghost_hits(cache->state);
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
+
+// Stand-in buffer for a disk without a cache, released (and written when dirty) by cache_brelse
+static Buffer * cache_temporary(Disk *disk, size_t block, bool read)
+{
+    Buffer *buffer = calloc(1, sizeof(Buffer));
+    if (buffer == NULL) return NULL;
+    buffer->data = disk_buffer_get(disk);
+    if (buffer->data == NULL || (read && disk_read(disk, block, buffer->data) < 0)) {
+        disk_buffer_put(disk, buffer->data);
+        free(buffer);
+        return NULL;
+    }
+    buffer->block     = block;
+    buffer->valid     = true;
+    buffer->refs      = 1;
+    buffer->temporary = true;
+    buffer->next      = -1;
+    return buffer;
+}
+
+static Buffer * cache_acquire(Disk *disk, size_t block, bool read)
+{
+    if (disk == NULL || block >= disk->blocks) {
+        fprintf(stderr, "cache_bread: Error invalid disk or block %zu\n", block);
+        return NULL;
+    }
+    if (disk->cache == NULL) return cache_temporary(disk, block, read);
+
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    Buffer *buffer = cache_get_locked(disk, cache, block, read);
+    pthread_mutex_unlock(&cache->lock);
+    return buffer;
+}
+
+/* Referenced buffer holding the contents of block, release it with cache_brelse */
+Buffer * cache_bread(Disk *disk, size_t block)
+{
+    return cache_acquire(disk, block, true);
+}
+
+/* Referenced buffer for block without reading it, for callers that overwrite the whole block */
+Buffer * cache_bget(Disk *disk, size_t block)
+{
+    return cache_acquire(disk, block, false);
+}
+
+/* Marks a referenced buffer as modified, it is written back later */
+void cache_bdirty(Buffer *buffer)
+{
+    if (buffer != NULL) buffer->dirty = true;
+}
+
+/* Locks a referenced buffer for a change to part of its contents, so that no
+ * write-back copies it half-updated. End the change with cache_bmodified. */
+void cache_bmodify(Disk *disk, Buffer *buffer)
+{
+    if (disk == NULL || buffer == NULL || buffer->temporary) return;
+    pthread_mutex_lock(&disk->cache->lock);
+}
+
+/* Marks the buffer locked by cache_bmodify as dirty and unlocks it */
+void cache_bmodified(Disk *disk, Buffer *buffer)
+{
+    if (disk == NULL || buffer == NULL) return;
+    buffer->dirty = true;
+    if (!buffer->temporary) pthread_mutex_unlock(&disk->cache->lock);
+}
+
+/* Drops a reference obtained from cache_bread/cache_bget */
+void cache_brelse(Disk *disk, Buffer *buffer)
+{
+    if (disk == NULL || buffer == NULL) return;
+    if (buffer->temporary) {
+        if (buffer->dirty && disk_write(disk, buffer->block, buffer->data) < 0) {
+            fprintf(stderr, "cache_brelse: Error writing block %zu failed\n", buffer->block);
+        }
+        disk_buffer_put(disk, buffer->data);
+        free(buffer);
+        return;
+    }
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    if (buffer->refs > 0) buffer->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Reserves buffers for the uncached blocks of [block, block + count) and
+ * hashes them as loading, anyone looking them up waits until the load is
+ * completed with cache_prefetch_complete. At most a quarter of the cache is
+ * reserved per call and half of it in total, so readahead cannot push out
+ * the working set. vec
+ * receives the reserved blocks and their buffers, returns how many. */
+size_t cache_prefetch_reserve(Disk *disk, size_t block, size_t count, BlockVec *vec)
+{
+    if (disk == NULL || disk->cache == NULL || vec == NULL) return 0;
+    if (block >= disk->blocks || count > disk->blocks - block) {
+        fprintf(stderr, "cache_prefetch_reserve: Error blocks %zu..%zu out of bounds\n", block, block + count - 1);
+        return 0;
+    }
+    BufferCache *cache = disk->cache;
+    if (count > cache->capacity / 4) count = cache->capacity / 4;
+    if (count > DISK_MAX_IOV) count = DISK_MAX_IOV;
+
+    size_t reserved = 0;
+    pthread_mutex_lock(&cache->lock);
+    // half of the buffers at most wait for prefetches, the rest stay usable
+    if (cache->loading + count > cache->capacity / 2) {
+        count = (cache->loading < cache->capacity / 2) ? cache->capacity / 2 - cache->loading : 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (cache_find(cache, block + i) != NULL) continue;
+        Buffer *buffer = cache_victim(disk, cache, block + i);
+        if (buffer == NULL) break;
+        buffer->block      = block + i;
+        buffer->valid      = true;
+        buffer->dirty      = false;
+        buffer->loading    = true;
+        buffer->refs       = 1;
+        cache_link(cache, buffer);
+        vec[reserved].block = buffer->block;
+        vec[reserved].data  = buffer->data;
+        reserved++;
+    }
+    cache->loading += reserved;
+    pthread_mutex_unlock(&cache->lock);
+    return reserved;
+}
+
+/* Reads the buffers reserved by cache_prefetch_reserve from the device (without
+ * holding the cache lock) and wakes up their waiters. When read is false the
+ * reservation is cancelled and the buffers are dropped. Returns false on a read error. */
+bool cache_prefetch_complete(Disk *disk, const BlockVec *vec, size_t count, bool read)
+{
+    if (disk == NULL || disk->cache == NULL || count == 0) return true;
+    BufferCache *cache = disk->cache;
+    bool ok = read && disk_issue(disk, vec, count, false) >= 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; i++) {
+        int32_t slot = (int32_t)((vec[i].data - cache->slab) / BLOCK_SIZE);
+        Buffer *buffer = &cache->buffers[slot];
+        buffer->loading = false;
+        buffer->refs    = 0;
+        if (!ok) {
+            cache_unlink(cache, buffer);
+            cache->spare[cache->spare_count++] = slot;
+            continue;
+        }
+        buffer->prefetched = true;
+        cache->policy->insert(cache->state, slot, buffer->block);
+    }
+    cache->loading -= count;
+    if (ok) cache->stats.prefetched += count;
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+    return ok || !read;
+}
+
+/* Single block read through the cache */
+ssize_t cache_read(Disk *disk, size_t block, char *data)
+{
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    Buffer *buffer = cache_get_locked(disk, cache, block, true);
+    if (buffer != NULL) {
+        memcpy(data, buffer->data, BLOCK_SIZE);
+        buffer->refs--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return (buffer != NULL) ? BLOCK_SIZE : -1;
+}
+
+/* Single block write into the cache, the block reaches the device on write-back */
+ssize_t cache_write(Disk *disk, size_t block, const char *data)
+{
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    Buffer *buffer = cache_get_locked(disk, cache, block, false);
+    if (buffer != NULL) {
+        memcpy(buffer->data, data, BLOCK_SIZE);
+        buffer->dirty = true;
+        buffer->refs--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return (buffer != NULL) ? BLOCK_SIZE : -1;
+}
+
+/* Vectored read: cached blocks are copied, the others are read from the device without caching them */
+ssize_t cache_readv(Disk *disk, const BlockVec *vec, size_t count)
+{
+    BufferCache *cache = disk->cache;
+    ArenaMark mark = arena_mark();
+    BlockVec *rest = arena_alloc(count * sizeof(BlockVec));
+    if (rest == NULL && count > 0) {
+        perror("disk_readv: failed to allocate the read vector");
+        return -1;
+    }
+
+    size_t missing = 0;
+    uint64_t hits = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; i++) {
+        Buffer *buffer = cache_find_ready(cache, vec[i].block);
+        if (buffer != NULL) {
+            memcpy(vec[i].data, buffer->data, BLOCK_SIZE);
+            cache_touch(cache, buffer);
+            hits++;
+        } else {
+            rest[missing++] = vec[i];
+        }
+    }
+    cache->stats.hits += hits;
+    cache->stats.misses += missing;
+    pthread_mutex_unlock(&cache->lock);
+    disk_stats_cache(disk, hits, missing, 0, 0);
+
+    ssize_t moved = (missing > 0) ? disk_issue(disk, rest, missing, false) : 0;
+    arena_release(mark);
+    return (moved < 0) ? -1 : (ssize_t)(count * BLOCK_SIZE);
+}
+
+/* Vectored write: cached copies are refreshed (and are clean again), the blocks go to the device.
+ * The refreshed buffers stay pinned until the write is queued, so none of them is evicted
+ * and read back from the device before the new contents reach it. */
+ssize_t cache_writev(Disk *disk, const BlockVec *vec, size_t count)
+{
+    BufferCache *cache = disk->cache;
+    ArenaMark mark = arena_mark();
+    Buffer **pinned = arena_alloc(count * sizeof(Buffer *));
+    if (pinned == NULL && count > 0) {
+        perror("disk_writev: failed to allocate the pinned buffers");
+        return -1;
+    }
+
+    size_t pins = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < count; i++) {
+        Buffer *buffer = cache_find_ready(cache, vec[i].block);
+        if (buffer != NULL) {
+            memcpy(buffer->data, vec[i].data, BLOCK_SIZE);
+            buffer->dirty = false;
+            buffer->refs++;
+            pinned[pins++] = buffer;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    ssize_t moved = disk_issue(disk, vec, count, true);
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < pins; i++) {
+        pinned[i]->refs--;
+        if (moved < 0) pinned[i]->dirty = true;    // the cached copy is the only one left
+    }
+    pthread_mutex_unlock(&cache->lock);
+    arena_release(mark);
+    return moved;
+}
+
+/* Forgets the contents of a discarded range, cached copies read back as zeroes */
+void cache_invalidate(Disk *disk, size_t block, size_t count)
+{
+    if (disk == NULL || disk->cache == NULL) return;
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    while (cache->loading > 0) pthread_cond_wait(&cache->loaded, &cache->lock);
+    for (size_t i = 0; i < cache->capacity; i++) {
+        Buffer *buffer = &cache->buffers[i];
+        if (buffer->valid && buffer->block >= block && buffer->block - block < count) {
+            memset(buffer->data, 0, BLOCK_SIZE);
+            buffer->dirty = false;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* True when the cached copy of block is newer than the device */
+bool cache_is_dirty(Disk *disk, size_t block)
+{
+    BufferCache *cache = disk->cache;
+    pthread_mutex_lock(&cache->lock);
+    Buffer *buffer = cache_find(cache, block);
+    bool dirty = buffer != NULL && buffer->dirty;
+    pthread_mutex_unlock(&cache->lock);
+    return dirty;
+}
@@ -0,0 +1,420 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Buffer Cache Replacement Policies
+ * A policy orders the buffers of a cache and picks the one to recycle on a
+ * miss. Nodes [0, capacity) are the buffer slots, nodes [capacity, 2 * capacity)
+ * are ghost entries remembering the block numbers of recently evicted buffers
+ * (ARC and 2Q use them to tell a block that comes back from one that is only
+ * streamed through). Lists run from head (most recent) to tail (next to go).
+ *   lru    one list, hits move to the head
+ *   clock  second chance bits swept by a hand
+ *   2q     first accesses in a FIFO (A1in) whose evictions are remembered
+ *          (A1out), blocks seen again go to the LRU main list (Am)
+ *   arc    recency (T1) and frequency (T2) lists sized adaptively from
+ *          hits on their ghosts (B1, B2)
+ * Pinned buffers (refs > 0) are skipped when a victim is chosen. */
+
+enum { LIST_NONE, LIST_T1, LIST_T2, LIST_B1, LIST_B2, LIST_COUNT };
+
+// 2Q reuses the ARC lists: A1in = T1, Am = T2, A1out = B1
+#define TWOQ_IN_PERCENT  (25)   // Kin, share of the slots for first accesses
+#define TWOQ_OUT_PERCENT (50)   // Kout, ghosts remembered, in percent of the slots
+
+typedef struct PolicyList PolicyList;
+struct PolicyList {
+    int32_t head;
+    int32_t tail;
+    size_t  size;
+};
+
+struct PolicyState {
+    size_t     capacity;
+    int32_t    *prev;           // 2 * capacity nodes
+    int32_t    *next;
+    uint8_t    *list;           // List holding each node, LIST_NONE when detached
+    size_t     *block;          // Block of each node
+    PolicyList lists[LIST_COUNT];
+    int32_t    *ghost_heads;    // Hash of the ghost nodes by block
+    int32_t    *ghost_chain;
+    size_t     ghost_mask;
+    int32_t    ghost_free;      // Unused ghost nodes, linked through next
+    size_t     target;          // ARC: preferred size of T1
+    size_t     hand;            // CLOCK hand
+    uint8_t    *referenced;     // CLOCK second chance bits
+    uint64_t   ghost_hits;      // Misses on a block a ghost still remembered
+};
+
+PolicyState * policy_create(size_t capacity)
+{
+    PolicyState *state = calloc(1, sizeof(PolicyState));
+    if (state == NULL) return NULL;
+    size_t nodes = 2 * capacity;
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+
+    state->capacity    = capacity;
+    state->prev        = malloc(nodes * sizeof(int32_t));
+    state->next        = malloc(nodes * sizeof(int32_t));
+    state->list        = calloc(nodes, sizeof(uint8_t));
+    state->block       = calloc(nodes, sizeof(size_t));
+    state->ghost_heads = malloc(buckets * sizeof(int32_t));
+    state->ghost_chain = malloc(nodes * sizeof(int32_t));
+    state->referenced  = calloc(capacity, sizeof(uint8_t));
+    if (state->prev == NULL || state->next == NULL || state->list == NULL || state->block == NULL ||
+        state->ghost_heads == NULL || state->ghost_chain == NULL || state->referenced == NULL) {
+        perror("policy_create: failed to allocate the replacement state");
+        policy_destroy(state);
+        return NULL;
+    }
+    state->ghost_mask = buckets - 1;
+    for (size_t i = 0; i < buckets; i++) state->ghost_heads[i] = -1;
+    for (int i = 0; i < LIST_COUNT; i++) state->lists[i] = (PolicyList){ -1, -1, 0 };
+
+    // every ghost node starts on the free list
+    state->ghost_free = -1;
+    for (size_t i = nodes; i > capacity; i--) {
+        state->next[i - 1] = state->ghost_free;
+        state->ghost_free = (int32_t)(i - 1);
+    }
+    return state;
+}
+
+void policy_destroy(PolicyState *state)
+{
+    if (state == NULL) return;
+    free(state->prev);
+    free(state->next);
+    free(state->list);
+    free(state->block);
+    free(state->ghost_heads);
+    free(state->ghost_chain);
+    free(state->referenced);
+    free(state);
+}
+
+uint64_t policy_ghost_hits(const PolicyState *state)
+{
+    return state ? state->ghost_hits : 0;
+}
+
+static void list_push(PolicyState *state, int list, int32_t node)
+{
+    PolicyList *l = &state->lists[list];
+    state->prev[node] = -1;
+    state->next[node] = l->head;
+    if (l->head >= 0) state->prev[l->head] = node;
+    else l->tail = node;
+    l->head = node;
+    l->size++;
+    state->list[node] = (uint8_t)list;
+}
+
+static void list_remove(PolicyState *state, int32_t node)
+{
+    PolicyList *l = &state->lists[state->list[node]];
+    if (state->prev[node] >= 0) state->next[state->prev[node]] = state->next[node];
+    else l->head = state->next[node];
+    if (state->next[node] >= 0) state->prev[state->next[node]] = state->prev[node];
+    else l->tail = state->prev[node];
+    l->size--;
+    state->list[node] = LIST_NONE;
+}
+
+// Oldest unpinned buffer of a resident list, -1 when every one is pinned
+static int32_t list_victim(const PolicyState *state, int list, const Buffer *buffers)
+{
+    for (int32_t node = state->lists[list].tail; node >= 0; node = state->prev[node]) {
+        if (buffers[node].refs == 0) return node;
+    }
+    return -1;
+}
+
+static size_t ghost_hash(const PolicyState *state, size_t block)
+{
+    return (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 29) & state->ghost_mask;
+}
+
+static int32_t ghost_find(const PolicyState *state, size_t block)
+{
+    for (int32_t node = state->ghost_heads[ghost_hash(state, block)]; node >= 0; node = state->ghost_chain[node]) {
+        if (state->block[node] == block) return node;
+    }
+    return -1;
+}
+
+static void ghost_drop(PolicyState *state, int32_t node)
+{
+    if (node < 0) return;
+    int32_t *link = &state->ghost_heads[ghost_hash(state, state->block[node])];
+    while (*link != node) link = &state->ghost_chain[*link];
+    *link = state->ghost_chain[node];
+    list_remove(state, node);
+    state->next[node] = state->ghost_free;
+    state->ghost_free = node;
+}
+
+// Remembers an evicted block at the head of a ghost list
+static void ghost_add(PolicyState *state, int list, size_t block)
+{
+    if (state->ghost_free < 0) {
+        int oldest = state->lists[LIST_B2].size > 0 ? LIST_B2 : LIST_B1;
+        ghost_drop(state, state->lists[oldest].tail);
+    }
+    int32_t node = state->ghost_free;
+    state->ghost_free = state->next[node];
+    state->block[node] = block;
+    size_t bucket = ghost_hash(state, block);
+    state->ghost_chain[node] = state->ghost_heads[bucket];
+    state->ghost_heads[bucket] = node;
+    list_push(state, list, node);
+}
+
+// Detaches a resident slot, remembering its block on ghost_list unless that is LIST_NONE
+static int32_t evict(PolicyState *state, int32_t slot, int ghost_list)
+{
+    if (slot < 0) return -1;
+    list_remove(state, slot);
+    if (ghost_list != LIST_NONE) ghost_add(state, ghost_list, state->block[slot]);
+    return slot;
+}
+
+/* LRU */
+
+static void lru_hit(PolicyState *state, int32_t slot)
+{
+    list_remove(state, slot);
+    list_push(state, LIST_T1, slot);
+}
+
+static void lru_insert(PolicyState *state, int32_t slot, size_t block)
+{
+    state->block[slot] = block;
+    list_push(state, LIST_T1, slot);
+}
+
+static int32_t lru_victim(PolicyState *state, size_t block, const Buffer *buffers)
+{
+    (void)block;
+    return evict(state, list_victim(state, LIST_T1, buffers), LIST_NONE);
+}
+
+/* CLOCK */
+
+static void clock_hit(PolicyState *state, int32_t slot)
+{
+    state->referenced[slot] = 1;
+}
+
+static void clock_insert(PolicyState *state, int32_t slot, size_t block)
+{
+    state->block[slot] = block;
+    state->referenced[slot] = 1;
+}
+
+static int32_t clock_victim(PolicyState *state, size_t block, const Buffer *buffers)
+{
+    (void)block;
+    for (size_t step = 0; step < 2 * state->capacity + 1; step++) {
+        int32_t slot = (int32_t)state->hand;
+        state->hand = (state->hand + 1) % state->capacity;
+        if (buffers[slot].refs > 0) continue;
+        if (state->referenced[slot]) {
+            state->referenced[slot] = 0;
+            continue;
+        }
+        return slot;
+    }
+    return -1;
+}
+
+/* 2Q */
+
+static void twoq_hit(PolicyState *state, int32_t slot)
+{
+    // a hit in A1in is a correlated reference and does not promote the block
+    if (state->list[slot] == LIST_T2) {
+        list_remove(state, slot);
+        list_push(state, LIST_T2, slot);
+    }
+}
+
+static void twoq_insert(PolicyState *state, int32_t slot, size_t block)
+{
+    state->block[slot] = block;
+    int32_t ghost = ghost_find(state, block);
+    if (ghost >= 0) {
+        ghost_drop(state, ghost);
+        state->ghost_hits++;
+        list_push(state, LIST_T2, slot);
+    } else {
+        list_push(state, LIST_T1, slot);
+    }
+}
+
+static int32_t twoq_victim(PolicyState *state, size_t block, const Buffer *buffers)
+{
+    (void)block;
+    size_t in_limit  = state->capacity * TWOQ_IN_PERCENT / 100;
+    size_t out_limit = state->capacity * TWOQ_OUT_PERCENT / 100;
+    if (in_limit == 0) in_limit = 1;
+    if (out_limit == 0) out_limit = 1;
+
+    int32_t slot = -1;
+    if (state->lists[LIST_T1].size > in_limit || state->lists[LIST_T2].size == 0) {
+        slot = evict(state, list_victim(state, LIST_T1, buffers), LIST_B1);
+    }
+    if (slot < 0) slot = evict(state, list_victim(state, LIST_T2, buffers), LIST_NONE);
+    if (slot < 0) slot = evict(state, list_victim(state, LIST_T1, buffers), LIST_B1);
+    while (state->lists[LIST_B1].size > out_limit) ghost_drop(state, state->lists[LIST_B1].tail);
+    return slot;
+}
+
+/* ARC */
+
+static void arc_hit(PolicyState *state, int32_t slot)
+{
+    list_remove(state, slot);
+    list_push(state, LIST_T2, slot);
+}
+
+static void arc_insert(PolicyState *state, int32_t slot, size_t block)
+{
+    state->block[slot] = block;
+    int32_t ghost = ghost_find(state, block);
+    if (ghost >= 0) {
+        ghost_drop(state, ghost);
+        state->ghost_hits++;
+        list_push(state, LIST_T2, slot);
+    } else {
+        list_push(state, LIST_T1, slot);
+    }
+}
+
+// REPLACE of the ARC paper: evicts from T1 while it is above its target
+static int32_t arc_replace(PolicyState *state, bool in_b2, const Buffer *buffers)
+{
+    size_t t1 = state->lists[LIST_T1].size;
+    bool from_t1 = t1 > 0 && ((in_b2 && t1 == state->target) || t1 > state->target);
+    int32_t slot = from_t1 ? evict(state, list_victim(state, LIST_T1, buffers), LIST_B1)
+                           : evict(state, list_victim(state, LIST_T2, buffers), LIST_B2);
+    if (slot >= 0) return slot;
+    return from_t1 ? evict(state, list_victim(state, LIST_T2, buffers), LIST_B2)
+                   : evict(state, list_victim(state, LIST_T1, buffers), LIST_B1);
+}
+
+static int32_t arc_victim(PolicyState *state, size_t block, const Buffer *buffers)
+{
+    size_t c  = state->capacity;
+    size_t b1 = state->lists[LIST_B1].size, b2 = state->lists[LIST_B2].size;
+    int32_t ghost = ghost_find(state, block);
+
+    // a ghost hit moves the target towards the list that would have kept the block
+    if (ghost >= 0 && state->list[ghost] == LIST_B1) {
+        size_t delta = (b1 > 0 && b2 > b1) ? b2 / b1 : 1;
+        state->target = (state->target + delta > c) ? c : state->target + delta;
+        return arc_replace(state, false, buffers);
+    }
+    if (ghost >= 0 && state->list[ghost] == LIST_B2) {
+        size_t delta = (b2 > 0 && b1 > b2) ? b1 / b2 : 1;
+        state->target = (state->target > delta) ? state->target - delta : 0;
+        return arc_replace(state, true, buffers);
+    }
+
+    // a new block: keep T1 + B1 and the whole directory within their bounds
+    size_t t1 = state->lists[LIST_T1].size, t2 = state->lists[LIST_T2].size;
+    if (t1 + b1 >= c) {
+        if (t1 < c) {
+            ghost_drop(state, state->lists[LIST_B1].tail);
+        } else {
+            int32_t slot = evict(state, list_victim(state, LIST_T1, buffers), LIST_NONE);
+            if (slot >= 0) return slot;
+        }
+    } else if (t1 + t2 + b1 + b2 >= 2 * c) {
+        ghost_drop(state, state->lists[LIST_B2].tail);
+    }
+    return arc_replace(state, false, buffers);
+}
+
+const CachePolicy cache_policy_lru   = { "lru",   lru_hit,   lru_insert,   lru_victim };
+const CachePolicy cache_policy_clock = { "clock", clock_hit, clock_insert, clock_victim };
+const CachePolicy cache_policy_2q    = { "2q",    twoq_hit,  twoq_insert,  twoq_victim };
+const CachePolicy cache_policy_arc   = { "arc",   arc_hit,   arc_insert,   arc_victim };
+
+/* Maps a policy name (lru, clock, 2q, arc) to its policy, NULL or unknown names give the default */
+const CachePolicy * cache_policy_from_name(const char *name)
+{
+    const CachePolicy *policies[] = { &cache_policy_lru, &cache_policy_clock, &cache_policy_2q, &cache_policy_arc };
+    if (name == NULL) return CACHE_POLICY_DEFAULT;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcasecmp(name, policies[i]->name) == 0) return policies[i];
+    }
+    fprintf(stderr, "cache_policy_from_name: unknown policy '%s', using %s\n", name, CACHE_POLICY_DEFAULT->name);
+    return CACHE_POLICY_DEFAULT;
+}
+
+/* Replays a trace of block numbers against a cache of capacity blocks under
+ * policy and reports hits, misses, ghost hits and evictions. No I/O is done. */
+bool cache_simulate(const CachePolicy *policy, size_t capacity, const size_t *trace, size_t count, CacheStats *out)
+{
+    if (policy == NULL || capacity == 0 || out == NULL || (trace == NULL && count > 0)) {
+        fprintf(stderr, "cache_simulate: Error invalid policy, capacity, trace or output\n");
+        return false;
+    }
+    PolicyState *state = policy_create(capacity);
+    Buffer *buffers = calloc(capacity, sizeof(Buffer));     // never pinned
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+    int32_t *heads = malloc(buckets * sizeof(int32_t));
+    int32_t *chain = malloc(capacity * sizeof(int32_t));
+    if (state == NULL || buffers == NULL || heads == NULL || chain == NULL) {
+        perror("cache_simulate: failed to allocate the simulated cache");
+        policy_destroy(state);
+        free(buffers);
+        free(heads);
+        free(chain);
+        return false;
+    }
+    for (size_t i = 0; i < buckets; i++) heads[i] = -1;
+
+    memset(out, 0, sizeof(*out));
+    out->policy = policy->name;
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t block = trace[i];
+        size_t bucket = (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 23) & (buckets - 1);
+        int32_t slot = heads[bucket];
+        while (slot >= 0 && buffers[slot].block != block) slot = chain[slot];
+        if (slot >= 0) {
+            out->hits++;
+            policy->hit(state, slot);
+            continue;
+        }
+
+        out->misses++;
+        if (used < capacity) {
+            slot = (int32_t)used++;
+        } else {
+            slot = policy->victim(state, block, buffers);
+            size_t old = (size_t)((buffers[slot].block * 0x9E3779B97F4A7C15ULL) >> 23) & (buckets - 1);
+            int32_t *link = &heads[old];
+            while (*link != slot) link = &chain[*link];
+            *link = chain[slot];
+            out->evictions++;
+        }
+        buffers[slot].block = block;
+        chain[slot] = heads[bucket];
+        heads[bucket] = slot;
+        policy->insert(state, slot, block);
+    }
+    out->ghost_hits = policy_ghost_hits(state);
+
+    policy_destroy(state);
+    free(buffers);
+    free(heads);
+    free(chain);
+    return true;
+}
@@ -0,0 +1,345 @@
+#include "fs.h"
+#include "dcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Dentry Cache
+ * Remembers what a name resolves to in a directory, (directory inode, name)
+ * to inode number, including names that are known to be missing (negative
+ * entries), so resolving a path no longer scans every directory on the way.
+ * Entries live in a fixed table, hashed by directory and name and recycled
+ * in LRU order. On top of it whole paths are cached in a direct-mapped table:
+ * a path slot keeps the dentries that resolved each of its components with
+ * their generation, and a dentry bumps its generation whenever it is dropped
+ * or recycled, so a path is only trusted while every dentry it went through
+ * is unchanged. dir_add drops the entry of the name it adds, dir_remove the
+ * one it removes and removing a directory every entry inside it. Each drop
+ * also bumps a sequence number: a lookup that scanned a directory only caches
+ * its answer if nothing was dropped while it was scanning. */
+
+typedef struct Dentry Dentry;
+struct Dentry {
+    uint32_t parent;                // Directory inode, DCACHE_NONE when unused
+    uint32_t inode;                 // Inode the name resolves to, DCACHE_NONE for a missing name
+    uint32_t generation;            // Bumped every time the entry is dropped or recycled
+    char     name[DCACHE_NAME_MAX];
+    Dentry   *next;                 // Hash chain, or free list link
+    Dentry   *older;                // LRU order
+    Dentry   *newer;
+};
+
+typedef struct DcachePath DcachePath;
+struct DcachePath {
+    uint64_t  hash;                 // Hash of path, 0 when the slot is empty
+    ssize_t   inode;                // What the path resolved to, -1 when missing
+    size_t    depth;                // Components in refs
+    DcacheRef refs[DCACHE_PATH_DEPTH];
+    char      path[DCACHE_PATH_MAX];
+};
+
+struct DentryCache {
+    Dentry          *entries;
+    Dentry          **heads;    // Hash buckets
+    size_t          mask;
+    size_t          capacity;
+    size_t          count;
+    Dentry          *free;
+    Dentry          *oldest;    // Next eviction candidate
+    Dentry          *newest;
+    DcachePath      *paths;
+    uint64_t        sequence;   // Bumped by every invalidation
+    DcacheStats     stats;
+    pthread_mutex_t lock;
+};
+
+// FNV-1a
+static uint64_t dcache_hash_string(const char *string, uint64_t hash)
+{
+    for (; *string != '\0'; string++) {
+        hash ^= (unsigned char)*string;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static size_t dcache_bucket(DentryCache *dcache, uint32_t parent, const char *name)
+{
+    uint64_t hash = dcache_hash_string(name, 0xcbf29ce484222325ULL ^ (parent * 0x9E3779B97F4A7C15ULL));
+    return (size_t)(hash ^ (hash >> 29)) & dcache->mask;
+}
+
+/* Creates an empty dentry cache holding up to capacity names */
+DentryCache * dcache_create(size_t capacity)
+{
+    if (capacity == 0) {
+        fprintf(stderr, "dcache_create: Error capacity must be at least one entry\n");
+        return NULL;
+    }
+    DentryCache *dcache = calloc(1, sizeof(DentryCache));
+    if (dcache == NULL) {
+        perror("dcache_create: Error allocating the dentry cache has failed");
+        return NULL;
+    }
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+    dcache->entries = calloc(capacity, sizeof(Dentry));
+    dcache->heads = calloc(buckets, sizeof(Dentry *));
+    dcache->paths = calloc(DCACHE_PATHS, sizeof(DcachePath));
+    if (dcache->entries == NULL || dcache->heads == NULL || dcache->paths == NULL) {
+        perror("dcache_create: Error allocating the dentry tables has failed");
+        free(dcache->entries);
+        free(dcache->heads);
+        free(dcache->paths);
+        free(dcache);
+        return NULL;
+    }
+    for (size_t i = capacity; i > 0; i--) {
+        Dentry *entry = &dcache->entries[i - 1];
+        entry->parent = DCACHE_NONE;
+        entry->next = dcache->free;
+        dcache->free = entry;
+    }
+    dcache->mask     = buckets - 1;
+    dcache->capacity = capacity;
+    pthread_mutex_init(&dcache->lock, NULL);
+    return dcache;
+}
+
+void dcache_destroy(DentryCache *dcache)
+{
+    if (dcache == NULL) return;
+    pthread_mutex_destroy(&dcache->lock);
+    free(dcache->entries);
+    free(dcache->heads);
+    free(dcache->paths);
+    free(dcache);
+}
+
+static Dentry * dcache_lookup(DentryCache *dcache, uint32_t parent, const char *name)
+{
+    for (Dentry *entry = dcache->heads[dcache_bucket(dcache, parent, name)]; entry != NULL; entry = entry->next) {
+        if (entry->parent == parent && strcmp(entry->name, name) == 0) return entry;
+    }
+    return NULL;
+}
+
+static void dcache_lru_remove(DentryCache *dcache, Dentry *entry)
+{
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else dcache->oldest = entry->newer;
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else dcache->newest = entry->older;
+    entry->older = entry->newer = NULL;
+}
+
+static void dcache_lru_append(DentryCache *dcache, Dentry *entry)
+{
+    entry->older = dcache->newest;
+    entry->newer = NULL;
+    if (dcache->newest != NULL) dcache->newest->newer = entry;
+    else dcache->oldest = entry;
+    dcache->newest = entry;
+}
+
+static void dcache_touch(DentryCache *dcache, Dentry *entry)
+{
+    if (dcache->newest == entry) return;
+    dcache_lru_remove(dcache, entry);
+    dcache_lru_append(dcache, entry);
+}
+
+// Takes an entry out of the hash and the LRU, paths that went through it stop matching
+static void dcache_unlink(DentryCache *dcache, Dentry *entry)
+{
+    Dentry **link = &dcache->heads[dcache_bucket(dcache, entry->parent, entry->name)];
+    while (*link != NULL && *link != entry) link = &(*link)->next;
+    if (*link == entry) *link = entry->next;
+    dcache_lru_remove(dcache, entry);
+    entry->parent = DCACHE_NONE;
+    entry->generation++;
+    entry->next = NULL;
+    dcache->count--;
+}
+
+static void dcache_ref(DentryCache *dcache, Dentry *entry, DcacheRef *ref)
+{
+    if (ref == NULL) return;
+    ref->slot = (uint32_t)(entry - dcache->entries);
+    ref->generation = entry->generation;
+}
+
+/* Looks name up in directory parent. On a hit *inode is the inode it resolves
+ * to, -1 for a name known to be missing, and ref (when not NULL) the entry. */
+bool dcache_find(FileSystem *fs, uint32_t parent, const char *name, ssize_t *inode, DcacheRef *ref)
+{
+    if (fs == NULL || fs->dcache == NULL || name == NULL) return false;
+    DentryCache *dcache = fs->dcache;
+    pthread_mutex_lock(&dcache->lock);
+    Dentry *entry = dcache_lookup(dcache, parent, name);
+    if (entry == NULL) {
+        dcache->stats.misses++;
+        pthread_mutex_unlock(&dcache->lock);
+        return false;
+    }
+    dcache_touch(dcache, entry);
+    dcache_ref(dcache, entry, ref);
+    *inode = (entry->inode == DCACHE_NONE) ? -1 : (ssize_t)entry->inode;
+    dcache->stats.hits++;
+    if (entry->inode == DCACHE_NONE) dcache->stats.negative_hits++;
+    pthread_mutex_unlock(&dcache->lock);
+    return true;
+}
+
+/* Current invalidation sequence, taken before scanning a directory for dcache_insert */
+uint64_t dcache_sequence(FileSystem *fs)
+{
+    if (fs == NULL || fs->dcache == NULL) return 0;
+    pthread_mutex_lock(&fs->dcache->lock);
+    uint64_t sequence = fs->dcache->sequence;
+    pthread_mutex_unlock(&fs->dcache->lock);
+    return sequence;
+}
+
+/* Caches the answer of a directory scan (inode -1 for a missing name) unless an
+ * entry was dropped since sequence was taken, ref (when not NULL) receives the
+ * entry or DCACHE_NONE */
+void dcache_insert(FileSystem *fs, uint32_t parent, const char *name, ssize_t inode, uint64_t sequence, DcacheRef *ref)
+{
+    if (ref != NULL) ref->slot = DCACHE_NONE;
+    if (fs == NULL || fs->dcache == NULL || name == NULL || strlen(name) >= DCACHE_NAME_MAX) return;
+    DentryCache *dcache = fs->dcache;
+    pthread_mutex_lock(&dcache->lock);
+    if (sequence != dcache->sequence) {
+        pthread_mutex_unlock(&dcache->lock);
+        return;
+    }
+    Dentry *entry = dcache_lookup(dcache, parent, name);
+    if (entry == NULL) {
+        if (dcache->free != NULL) {
+            entry = dcache->free;
+            dcache->free = entry->next;
+        } else {
+            entry = dcache->oldest;
+            dcache_unlink(dcache, entry);
+            dcache->stats.evictions++;
+        }
+        entry->parent = parent;
+        strcpy(entry->name, name);
+        size_t bucket = dcache_bucket(dcache, parent, name);
+        entry->next = dcache->heads[bucket];
+        dcache->heads[bucket] = entry;
+        dcache_lru_append(dcache, entry);
+        dcache->count++;
+    } else {
+        dcache_touch(dcache, entry);
+    }
+    entry->inode = (inode < 0) ? DCACHE_NONE : (uint32_t)inode;
+    dcache_ref(dcache, entry, ref);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+static DcachePath * dcache_path_slot(DentryCache *dcache, const char *path, uint64_t *hash)
+{
+    *hash = dcache_hash_string(path, 0xcbf29ce484222325ULL);
+    if (*hash == 0) *hash = 1;
+    return &dcache->paths[(*hash ^ (*hash >> 32)) & (DCACHE_PATHS - 1)];
+}
+
+/* Answers a whole path when it was resolved before and none of the dentries it
+ * went through changed since. *inode is -1 for a path known to be missing. */
+bool dcache_path_find(FileSystem *fs, const char *path, ssize_t *inode)
+{
+    if (fs == NULL || fs->dcache == NULL || path == NULL) return false;
+    DentryCache *dcache = fs->dcache;
+    uint64_t hash;
+    pthread_mutex_lock(&dcache->lock);
+    DcachePath *slot = dcache_path_slot(dcache, path, &hash);
+    if (slot->hash != hash || strcmp(slot->path, path) != 0) {
+        pthread_mutex_unlock(&dcache->lock);
+        return false;
+    }
+    for (size_t i = 0; i < slot->depth; i++) {
+        if (dcache->entries[slot->refs[i].slot].generation != slot->refs[i].generation) {
+            slot->hash = 0;
+            pthread_mutex_unlock(&dcache->lock);
+            return false;
+        }
+    }
+    // the dentries under a hot path stay away from the eviction end
+    for (size_t i = 0; i < slot->depth; i++) {
+        dcache_touch(dcache, &dcache->entries[slot->refs[i].slot]);
+    }
+    *inode = slot->inode;
+    dcache->stats.path_hits++;
+    pthread_mutex_unlock(&dcache->lock);
+    return true;
+}
+
+/* Remembers what path resolved to through the dentries in refs, one per component.
+ * Paths that are too long or deep, or had a component that was not cached, are skipped. */
+void dcache_path_insert(FileSystem *fs, const char *path, ssize_t inode, const DcacheRef *refs, size_t depth)
+{
+    if (fs == NULL || fs->dcache == NULL || path == NULL) return;
+    if (depth == 0 || depth > DCACHE_PATH_DEPTH || strlen(path) >= DCACHE_PATH_MAX) return;
+    for (size_t i = 0; i < depth; i++) {
+        if (refs[i].slot == DCACHE_NONE) return;
+    }
+    DentryCache *dcache = fs->dcache;
+    uint64_t hash;
+    pthread_mutex_lock(&dcache->lock);
+    DcachePath *slot = dcache_path_slot(dcache, path, &hash);
+    slot->hash  = hash;
+    slot->inode = inode;
+    slot->depth = depth;
+    memcpy(slot->refs, refs, depth * sizeof(DcacheRef));
+    strcpy(slot->path, path);
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Drops what is known about name in directory parent, called once the directory changed */
+void dcache_invalidate(FileSystem *fs, uint32_t parent, const char *name)
+{
+    if (fs == NULL || fs->dcache == NULL || name == NULL) return;
+    DentryCache *dcache = fs->dcache;
+    pthread_mutex_lock(&dcache->lock);
+    dcache->sequence++;
+    Dentry *entry = dcache_lookup(dcache, parent, name);
+    if (entry != NULL) {
+        dcache_unlink(dcache, entry);
+        entry->next = dcache->free;
+        dcache->free = entry;
+        dcache->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Drops every entry inside directory dir, called when the directory is removed */
+void dcache_invalidate_dir(FileSystem *fs, uint32_t dir)
+{
+    if (fs == NULL || fs->dcache == NULL) return;
+    DentryCache *dcache = fs->dcache;
+    pthread_mutex_lock(&dcache->lock);
+    dcache->sequence++;
+    for (size_t i = 0; i < dcache->capacity && dcache->count > 0; i++) {
+        Dentry *entry = &dcache->entries[i];
+        if (entry->parent != dir) continue;
+        dcache_unlink(dcache, entry);
+        entry->next = dcache->free;
+        dcache->free = entry;
+        dcache->stats.invalidations++;
+    }
+    pthread_mutex_unlock(&dcache->lock);
+}
+
+/* Snapshot of the dentry cache counters */
+DcacheStats dcache_stats(FileSystem *fs)
+{
+    DcacheStats stats = {0};
+    if (fs == NULL || fs->dcache == NULL) return stats;
+    pthread_mutex_lock(&fs->dcache->lock);
+    stats = fs->dcache->stats;
+    stats.cached = fs->dcache->count;
+    pthread_mutex_unlock(&fs->dcache->lock);
+    return stats;
+}
@@ -0,0 +1,403 @@
+#include "fs.h"
+#include "delalloc.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Delayed allocation
+ * In write-back mode the data written past the mapped end of a regular file
+ * gets no disk blocks in fs_write. It is kept in memory as block-sized pages
+ * against its logical blocks, and blocks are only allocated when it is
+ * flushed (by the write-back flusher, fs_sync, fs_fsync and therefore a FUSE
+ * close, unmount, or once max_blocks are buffered) and the final size of the
+ * burst is known: the whole tail goes into as few extents as the free space
+ * allows, right after the last extent of the file. A file removed or
+ * truncated before that never touches the bitmap or the disk. The pages of a
+ * file are one run from the first block written on, a hole left before it
+ * stays unmapped. A write that would leave a gap after the run, or lands in
+ * the hole before it, has the run flushed first (see delalloc_extends).
+ * Pages are added, filled and flushed under the fs lock, readers copy out of
+ * them under the table lock. */
+
+typedef struct DelayedFile DelayedFile;
+struct DelayedFile {
+    DelayedFile *next;
+    size_t      inode;
+    size_t      base;       // First logical block waiting, at or past the end of the mapped blocks
+    size_t      count;      // Pages in use, for the blocks from base on
+    size_t      capacity;
+    char        **pages;    // BLOCK_SIZE pages aligned to DISK_ALIGNMENT, zeroes where nothing was written
+};
+
+struct Delalloc {
+    DelayedFile     *buckets[DELALLOC_BUCKETS];
+    size_t          max_blocks;
+    char            **spare;        // Pages of flushed and dropped files kept for reuse, up to max_blocks
+    size_t          spare_count;
+    pthread_mutex_t lock;
+    DelallocStats   stats;
+};
+
+// Link pointing at the file of inode in its chain, or at the NULL ending the chain. Table lock held.
+static DelayedFile ** delalloc_link(Delalloc *delalloc, size_t inode)
+{
+    DelayedFile **link = &delalloc->buckets[inode % DELALLOC_BUCKETS];
+    while (*link != NULL && (*link)->inode != inode) link = &(*link)->next;
+    return link;
+}
+
+// A page for one block, recycled when a flushed or dropped file left one
+static char * delalloc_page_get(Delalloc *delalloc)
+{
+    char *page = NULL;
+    pthread_mutex_lock(&delalloc->lock);
+    if (delalloc->spare_count > 0) page = delalloc->spare[--delalloc->spare_count];
+    pthread_mutex_unlock(&delalloc->lock);
+    return (page != NULL) ? page : aligned_alloc(DISK_ALIGNMENT, BLOCK_SIZE);
+}
+
+// Keeps pages for reuse up to max_blocks, the rest go back to the heap
+static void delalloc_free_pages(Delalloc *delalloc, char **pages, size_t count)
+{
+    size_t i = 0;
+    pthread_mutex_lock(&delalloc->lock);
+    for (; i < count && delalloc->spare_count < delalloc->max_blocks; i++) {
+        delalloc->spare[delalloc->spare_count++] = pages[i];
+    }
+    pthread_mutex_unlock(&delalloc->lock);
+    for (; i < count; i++) free(pages[i]);
+}
+
+/* Whether a write from block logical on may go into the pages of a file: it has
+ * none waiting, or logical is one of them or the block right after them */
+bool delalloc_extends(FileSystem *fs, size_t inode_number, size_t logical)
+{
+    Delalloc *delalloc = (fs != NULL) ? fs->delalloc : NULL;
+    if (delalloc == NULL) return false;
+    pthread_mutex_lock(&delalloc->lock);
+    DelayedFile *file = *delalloc_link(delalloc, inode_number);
+    bool extends = file == NULL || (logical >= file->base && logical <= file->base + file->count);
+    pthread_mutex_unlock(&delalloc->lock);
+    return extends;
+}
+
+/* Keeps length bytes of data at offset of a regular file in memory until they get
+ * blocks. Every block from the first one written on must be unmapped, and the
+ * write must extend the pages waiting (delalloc_extends). Called under the fs
+ * lock, flushes everything once more than max_blocks are buffered. */
+bool delalloc_write(FileSystem *fs, const Inode *inode, size_t inode_number, const char *data, size_t length, size_t offset)
+{
+    Delalloc *delalloc = fs->delalloc;
+    if (delalloc == NULL || inode == NULL) {
+        fprintf(stderr, "delalloc_write: Error delayed allocation is not enabled\n");
+        return false;
+    }
+    if (length == 0) return true;
+    size_t first = offset / BLOCK_SIZE;
+    size_t last  = (offset + length - 1) / BLOCK_SIZE;
+
+    pthread_mutex_lock(&delalloc->lock);
+    DelayedFile *file = *delalloc_link(delalloc, inode_number);
+    pthread_mutex_unlock(&delalloc->lock);
+    if (file == NULL) {
+        if (first < extent_blocks(fs, inode)) {
+            fprintf(stderr, "delalloc_write: Error block %zu of inode %zu is mapped already\n", first, inode_number);
+            return false;
+        }
+        // only fs lock holders add files, so nobody else can add this one meanwhile
+        file = calloc(1, sizeof(DelayedFile));
+        if (file == NULL) {
+            perror("delalloc_write: Error allocating a delayed file has failed");
+            return false;
+        }
+        file->inode = inode_number;
+        file->base  = first;
+        pthread_mutex_lock(&delalloc->lock);
+        *delalloc_link(delalloc, inode_number) = file;
+        pthread_mutex_unlock(&delalloc->lock);
+    }
+    if (first < file->base || first > file->base + file->count) {
+        fprintf(stderr, "delalloc_write: Error block %zu of inode %zu does not extend the blocks waiting\n", first, inode_number);
+        return false;
+    }
+
+    // the missing pages are set up before readers can see them
+    size_t needed = last - file->base + 1;
+    size_t added  = (needed > file->count) ? needed - file->count : 0;
+    char **fresh  = NULL;
+    if (added > 0) {
+        fresh = malloc(added * sizeof(char *));
+        if (fresh == NULL) {
+            perror("delalloc_write: Error allocating pages has failed");
+            return false;
+        }
+        for (size_t i = 0; i < added; i++) {
+            fresh[i] = delalloc_page_get(delalloc);
+            if (fresh[i] == NULL) {
+                perror("delalloc_write: Error allocating pages has failed");
+                delalloc_free_pages(delalloc, fresh, i);
+                free(fresh);
+                return false;
+            }
+        }
+    }
+    char **grown = file->pages;
+    size_t capacity = file->capacity;
+    if (needed > capacity) {
+        capacity = (capacity == 0) ? 16 : capacity;
+        while (capacity < needed) capacity *= 2;
+        grown = malloc(capacity * sizeof(char *));
+        if (grown == NULL) {
+            perror("delalloc_write: Error allocating pages has failed");
+            delalloc_free_pages(delalloc, fresh, added);
+            free(fresh);
+            return false;
+        }
+        if (file->count > 0) memcpy(grown, file->pages, file->count * sizeof(char *));
+    }
+
+    pthread_mutex_lock(&delalloc->lock);
+    char **old = (grown != file->pages) ? file->pages : NULL;
+    file->pages    = grown;
+    file->capacity = capacity;
+    size_t existing = file->count;
+    for (size_t i = 0; i < added; i++) file->pages[file->count++] = fresh[i];
+    for (size_t block = first; block <= last; block++) {
+        size_t from = (block == first) ? offset % BLOCK_SIZE : 0;
+        size_t to   = (block == last) ? (offset + length - 1) % BLOCK_SIZE + 1 : BLOCK_SIZE;
+        char *page  = file->pages[block - file->base];
+        if (block - file->base >= existing) {
+            memset(page, 0, from);
+            memset(page + to, 0, BLOCK_SIZE - to);
+        }
+        memcpy(page + from, data, to - from);
+        data += to - from;
+    }
+    delalloc->stats.buffered += added;
+    delalloc->stats.pending  += added;
+    bool pressure = delalloc->stats.pending > delalloc->max_blocks;
+    if (pressure) delalloc->stats.pressure++;
+    pthread_mutex_unlock(&delalloc->lock);
+    free(old);
+    free(fresh);
+
+    return pressure ? delalloc_flush_all(fs) : true;
+}
+
+/* Copies bytes from..to of a logical block waiting in memory into data.
+ * False when the block has no page, it is mapped or a hole then. */
+bool delalloc_read(FileSystem *fs, size_t inode_number, size_t logical, char *data, size_t from, size_t to)
+{
+    Delalloc *delalloc = (fs != NULL) ? fs->delalloc : NULL;
+    if (delalloc == NULL) return false;
+    pthread_mutex_lock(&delalloc->lock);
+    DelayedFile *file = *delalloc_link(delalloc, inode_number);
+    bool found = file != NULL && logical >= file->base && logical < file->base + file->count;
+    if (found) memcpy(data, file->pages[logical - file->base] + from, to - from);
+    pthread_mutex_unlock(&delalloc->lock);
+    return found;
+}
+
+// Gives the pages of a file disk blocks and writes them, fs lock held. Each run
+// is written before it is added to the extents, so a reader sees either the page
+// or a block holding its data. Pages stay when the disk is full.
+static bool delalloc_flush_file(FileSystem *fs, Delalloc *delalloc, DelayedFile *file)
+{
+    Inode *inode = icache_get(fs, file->inode);
+    if (inode == NULL) {
+        fprintf(stderr, "delalloc_flush: Error reading inode %zu has failed\n", file->inode);
+        return false;
+    }
+    bool ok = true;
+    size_t done = 0;
+    size_t runs = 0;
+    uint32_t goal = extent_goal(fs, inode);
+    while (done < file->count) {
+        Extent extent = fs_allocate_range(fs, file->count - done, goal);
+        if (extent.start == 0) {
+            fprintf(stderr, "delalloc_flush: Error no space left for %zu blocks of inode %zu\n",
+                    file->count - done, file->inode);
+            ok = false;
+            break;
+        }
+        for (size_t k = 0; k < extent.length; k += DISK_MAX_IOV) {
+            BlockVec queued[DISK_MAX_IOV];
+            size_t count = (extent.length - k < DISK_MAX_IOV) ? extent.length - k : DISK_MAX_IOV;
+            for (size_t j = 0; j < count; j++) {
+                queued[j].block = extent.start + k + j;
+                queued[j].data  = file->pages[done + k + j];
+            }
+            if (disk_writev(fs->disk, queued, count) < 0) {
+                fprintf(stderr, "delalloc_flush: Error writing blocks of inode %zu has failed\n", file->inode);
+                ok = false;
+            }
+        }
+        // the blocks are the file's now even if writing them failed, the mapping stays in step
+        if (!extent_add(fs, inode, (uint32_t)(file->base + done), extent.start, extent.length)) {
+            for (uint32_t j = 0; j < extent.length; j++) set_bit(fs->bitmap->bits, extent.start + j, 0);
+            ok = false;
+            break;
+        }
+        icache_dirty(inode);
+        done += extent.length;
+        goal  = extent.start + extent.length;
+        runs++;
+    }
+    icache_put(fs, inode);
+    fs->bitmap->dirty = true;
+
+    pthread_mutex_lock(&delalloc->lock);
+    char **flushed = NULL;
+    bool unlinked = (done == file->count);
+    if (unlinked) {
+        *delalloc_link(delalloc, file->inode) = file->next;
+        flushed = file->pages;
+    } else if (done > 0) {
+        flushed = malloc(done * sizeof(char *));
+        if (flushed != NULL) memcpy(flushed, file->pages, done * sizeof(char *));
+        memmove(file->pages, file->pages + done, (file->count - done) * sizeof(char *));
+        file->base  += done;
+        file->count -= done;
+    }
+    delalloc->stats.flushed += done;
+    delalloc->stats.extents += runs;
+    delalloc->stats.pending -= done;
+    pthread_mutex_unlock(&delalloc->lock);
+
+    if (flushed != NULL) delalloc_free_pages(delalloc, flushed, done);
+    free(flushed);
+    if (unlinked) free(file);
+    return ok;
+}
+
+/* Allocates and writes the blocks of one file waiting in memory */
+bool delalloc_flush(FileSystem *fs, size_t inode_number)
+{
+    if (fs == NULL || fs->delalloc == NULL) return true;
+    Delalloc *delalloc = fs->delalloc;
+    fs_lock(fs);
+    pthread_mutex_lock(&delalloc->lock);
+    DelayedFile *file = *delalloc_link(delalloc, inode_number);
+    pthread_mutex_unlock(&delalloc->lock);
+    bool ok = (file == NULL) || delalloc_flush_file(fs, delalloc, file);
+    fs_unlock_changed(fs);
+    return ok;
+}
+
+/* Allocates and writes the blocks of every file waiting in memory */
+bool delalloc_flush_all(FileSystem *fs)
+{
+    if (fs == NULL || fs->delalloc == NULL) return true;
+    Delalloc *delalloc = fs->delalloc;
+    bool ok = true;
+    fs_lock(fs);
+    for (size_t b = 0; b < DELALLOC_BUCKETS; b++) {
+        // only fs lock holders change the chains, and a flush unlinks nothing but its own file
+        pthread_mutex_lock(&delalloc->lock);
+        DelayedFile *file = delalloc->buckets[b];
+        pthread_mutex_unlock(&delalloc->lock);
+        while (file != NULL) {
+            DelayedFile *next = file->next;
+            ok = delalloc_flush_file(fs, delalloc, file) && ok;
+            file = next;
+        }
+    }
+    fs_unlock_changed(fs);
+    return ok;
+}
+
+/* Forgets the pages of a file being removed or truncated, fs lock held */
+void delalloc_drop(FileSystem *fs, size_t inode_number)
+{
+    if (fs == NULL || fs->delalloc == NULL) return;
+    Delalloc *delalloc = fs->delalloc;
+    pthread_mutex_lock(&delalloc->lock);
+    DelayedFile **link = delalloc_link(delalloc, inode_number);
+    DelayedFile *file = *link;
+    if (file != NULL) {
+        *link = file->next;
+        delalloc->stats.dropped += file->count;
+        delalloc->stats.pending -= file->count;
+    }
+    pthread_mutex_unlock(&delalloc->lock);
+    if (file == NULL) return;
+    delalloc_free_pages(delalloc, file->pages, file->count);
+    free(file->pages);
+    free(file);
+}
+
+/* Blocks waiting in memory, and in capacity the limit that forces a flush */
+size_t delalloc_pending(FileSystem *fs, size_t *capacity)
+{
+    if (capacity != NULL) *capacity = 0;
+    if (fs == NULL || fs->delalloc == NULL) return 0;
+    pthread_mutex_lock(&fs->delalloc->lock);
+    size_t pending = fs->delalloc->stats.pending;
+    if (capacity != NULL) *capacity = fs->delalloc->max_blocks;
+    pthread_mutex_unlock(&fs->delalloc->lock);
+    return pending;
+}
+
+/* Defers the allocation of the blocks written past the end of regular files
+ * until they are flushed, forcing a flush once max_blocks are waiting */
+bool fs_delalloc_enable(FileSystem *fs, size_t max_blocks)
+{
+    if (fs == NULL || fs->disk == NULL || !fs->disk->mounted) {
+        fprintf(stderr, "fs_delalloc_enable: Error file system is not mounted\n");
+        return false;
+    }
+    if (max_blocks == 0) {
+        fprintf(stderr, "fs_delalloc_enable: Error the buffered block limit must be positive\n");
+        return false;
+    }
+    if (fs->delalloc != NULL) return true;
+    Delalloc *delalloc = calloc(1, sizeof(Delalloc));
+    if (delalloc == NULL) {
+        perror("fs_delalloc_enable: Error allocating the delayed file table has failed");
+        return false;
+    }
+    delalloc->max_blocks = max_blocks;
+    delalloc->spare = malloc(max_blocks * sizeof(char *));
+    if (delalloc->spare == NULL) {
+        perror("fs_delalloc_enable: Error allocating the page list has failed");
+        free(delalloc);
+        return false;
+    }
+    pthread_mutex_init(&delalloc->lock, NULL);
+    fs_lock(fs);
+    fs->delalloc = delalloc;
+    fs_unlock(fs);
+    return true;
+}
+
+/* Flushes what is waiting and goes back to allocating in fs_write */
+void fs_delalloc_disable(FileSystem *fs)
+{
+    if (fs == NULL || fs->delalloc == NULL) return;
+    fs_lock(fs);
+    if (!delalloc_flush_all(fs)) {
+        fprintf(stderr, "fs_delalloc_disable: Error data that could not be flushed is lost\n");
+    }
+    Delalloc *delalloc = fs->delalloc;
+    for (size_t b = 0; b < DELALLOC_BUCKETS; b++) {
+        while (delalloc->buckets[b] != NULL) delalloc_drop(fs, delalloc->buckets[b]->inode);
+    }
+    fs->delalloc = NULL;
+    fs_unlock(fs);
+    for (size_t i = 0; i < delalloc->spare_count; i++) free(delalloc->spare[i]);
+    free(delalloc->spare);
+    pthread_mutex_destroy(&delalloc->lock);
+    free(delalloc);
+}
+
+/* Snapshot of the delayed allocation counters */
+DelallocStats fs_delalloc_stats(FileSystem *fs)
+{
+    DelallocStats stats = {0};
+    if (fs == NULL || fs->delalloc == NULL) return stats;
+    pthread_mutex_lock(&fs->delalloc->lock);
+    stats = fs->delalloc->stats;
+    pthread_mutex_unlock(&fs->delalloc->lock);
+    return stats;
+}
@@ -7,7 +7,7 @@
 
 
 // Allocates a new directory inode and returns its inode number
-ssize_t dir_create(FileSystem *fs)
+static ssize_t dir_create_locked(FileSystem *fs)
 {
     // Validation check
     if (fs == NULL || fs->disk == NULL) {
@@ -33,31 +33,41 @@ ssize_t dir_create(FileSystem *fs)
 
     if (inode_num == -1) return -1; // no free inodes
 
-    // Locate and write the inode
-    uint32_t block_idx = 1 + (inode_num / INODES_PER_BLOCK);
-    uint32_t offset = inode_num % INODES_PER_BLOCK;
-
-    Block buffer;
-    if (disk_read(fs->disk, block_idx, buffer.data) < 0) return -1;
-
-    Inode *target = &buffer.inodes[offset];
+    // Initialise the in-core inode, written back with the inode cache
+    Inode *target = icache_get(fs, inode_num);
+    if (target == NULL) {
+        set_bit(ibitmap, inode_num, 0);
+        return -1;
+    }
     target->valid = INODE_DIR;
     target->size = 0;
+    target->flags = 0;
 
     for(size_t i = 0; i < EXTENTS_PER_INODE; i++) 
     {
         target->extents[i].start = 0;
         target->extents[i].length = 0;
+        target->extents[i].logical = 0;
     }
     target->extent_count = 0;
     target->extent_block = 0;
 
-    if (disk_write(fs->disk, block_idx, buffer.data) < 0) return -1;
+    icache_dirty(target);
+    icache_put(fs, target);
     return (ssize_t)inode_num;
 }
 
+// dir_create under the fs lock
+ssize_t dir_create(FileSystem *fs)
+{
+    fs_lock(fs);
+    ssize_t inode = dir_create_locked(fs);
+    fs_unlock_changed(fs);
+    return inode;
+}
+
 // Adds a named entry (file or subdir) into a directory, returns 0 on success or -1 on failure
-int dir_add(FileSystem *fs, size_t dir_inode, const char *name, size_t inode_number)
+static int dir_add_locked(FileSystem *fs, size_t dir_inode, const char *name, size_t inode_number)
 {
     // Validation check
     if (fs == NULL || fs->disk == NULL || name == NULL) {
@@ -73,39 +83,33 @@ int dir_add(FileSystem *fs, size_t dir_inode, const char *name, size_t inode_num
         return -1;
     }
 
-    // Read the directory inode and confirm it's a directory
-    uint32_t inode_block_idx = 1 + (dir_inode / INODES_PER_BLOCK);
-    uint32_t inode_offset = dir_inode % INODES_PER_BLOCK;
-
-    Block inode_buf;
-    if (disk_read(fs->disk, inode_block_idx, inode_buf.data) < 0) {
+    // Pin the directory inode and confirm it's a directory
+    Inode *target = icache_get(fs, dir_inode);
+    if (target == NULL) {
         return -1;
     }
-    Inode *target = &inode_buf.inodes[inode_offset];
 
     if (target->valid != INODE_DIR)
     {
         perror("dir_add: Inode given is not a directory.");
+        icache_put(fs, target);
         return -1;
     }
 
 
-    if (target->extent_count == 0 && target->extent_block == 0) {
-        perror("dir_add: Inode extents given is empty.");
-        return -1;
-    }
-
     // Scan existing entries for duplicates and find a free slot
     ssize_t available_slot = -1;
     for (size_t i = 0; i < target->size; i += 32)
     {
         DirEntry entry;
         if (fs_read(fs, dir_inode, (char *)&entry, sizeof(DirEntry), i) < 0) {
+            icache_put(fs, target);
             return -1;
         }
 
         if (strcmp(entry.name, name) == 0) // duplicate
         {
+            icache_put(fs, target);
             return -1;
         }
         if (entry.inode_number == UINT32_MAX && available_slot == -1) // save the first empty slot
@@ -122,14 +126,37 @@ int dir_add(FileSystem *fs, size_t dir_inode, const char *name, size_t inode_num
     new_entry.inode_number = inode_number;
     strncpy(new_entry.name, name, 28);
     if (fs_write(fs, dir_inode, (char *)&new_entry, sizeof(DirEntry), write_offset) < 0) {
+        icache_put(fs, target);
         return -1;
     }
+    icache_put(fs, target);
+    // the name may be cached as missing
+    dcache_invalidate(fs, (uint32_t)dir_inode, name);
     return 0;
 }
 
+// dir_add under the fs lock, so two adds cannot pick the same free slot
+int dir_add(FileSystem *fs, size_t dir_inode, const char *name, size_t inode_number)
+{
+    fs_lock(fs);
+    int added = dir_add_locked(fs, dir_inode, name, inode_number);
+    fs_unlock_changed(fs);
+    return added;
+}
+
 // Searches a directory for a named entry and returns its inode number, -1 if not found
 ssize_t dir_lookup(FileSystem *fs, size_t dir_inode, const char *name)
 {
+    return dir_lookup_ref(fs, dir_inode, name, NULL);
+}
+
+/* dir_lookup through the dentry cache: names resolved before (found or not) are
+ * answered from memory, the answer of a directory scan is cached. ref (when not
+ * NULL) receives the dentry that holds the answer, for the full-path cache. */
+ssize_t dir_lookup_ref(FileSystem *fs, size_t dir_inode, const char *name, DcacheRef *ref)
+{
+    if (ref != NULL) ref->slot = DCACHE_NONE;
+
     // Validation check
     if (fs == NULL || fs->disk == NULL || name == NULL) {
         perror("dir_lookup: Error fs, disk or name is invalid (NULL)");
@@ -145,38 +172,45 @@ ssize_t dir_lookup(FileSystem *fs, size_t dir_inode, const char *name)
         return -1;
     }
 
-    // Read the directory inode and confirm it's a directory
-    uint32_t inode_block_idx = 1 + (dir_inode / INODES_PER_BLOCK);
-    uint32_t inode_offset = dir_inode % INODES_PER_BLOCK;
+    ssize_t found;
+    if (dcache_find(fs, (uint32_t)dir_inode, name, &found, ref)) return found;
+    uint64_t sequence = dcache_sequence(fs);
 
-    Block inode_buf;
-    if (disk_read(fs->disk, inode_block_idx, inode_buf.data) < 0) {
+    // Pin the directory inode and confirm it's a directory
+    Inode *target = icache_get(fs, dir_inode);
+    if (target == NULL) {
         return -1;
     }
-    Inode *target = &inode_buf.inodes[inode_offset];
 
     if (target->valid != INODE_DIR)
     {
         perror("dir_lookup: Inode given is not a directory.");
+        icache_put(fs, target);
         return -1;
     }
 
     // Scan entries for a name match, skipping deleted slots
+    found = -1;
     for (size_t i = 0; i < target->size; i += 32)
     {
         DirEntry entry;
         if (fs_read(fs, dir_inode, (char *)&entry, sizeof(DirEntry), i) < 0) {
+            icache_put(fs, target);
             return -1;
         }
         if (entry.inode_number != UINT32_MAX && strcmp(entry.name, name) == 0) {
-            return (ssize_t)entry.inode_number;
+            found = (ssize_t)entry.inode_number;
+            break;
         }
     }
-    return -1;
+    icache_put(fs, target);
+    // a missing name is cached too, until dir_add adds it
+    dcache_insert(fs, (uint32_t)dir_inode, name, found, sequence, ref);
+    return found;
 }
 
 // Removes a named entry from a directory and returns its inode number, -1 if not found
-ssize_t dir_remove(FileSystem *fs, size_t inode_dir, const char *name)
+static ssize_t dir_remove_locked(FileSystem *fs, size_t inode_dir, const char *name)
 {
     // Validation check
     if (fs == NULL || fs->disk == NULL || name == NULL) {
@@ -193,19 +227,16 @@ ssize_t dir_remove(FileSystem *fs, size_t inode_dir, const char *name)
         return -1;
     }
 
-    // Read the directory inode and confirm it's a directory
-    uint32_t inode_block_idx = 1 + (inode_dir / INODES_PER_BLOCK);
-    uint32_t inode_offset = inode_dir % INODES_PER_BLOCK;
-
-    Block inode_buf;
-    if (disk_read(fs->disk, inode_block_idx, inode_buf.data) < 0) {
+    // Pin the directory inode and confirm it's a directory
+    Inode *target = icache_get(fs, inode_dir);
+    if (target == NULL) {
         return -1;
     }
-    Inode *target = &inode_buf.inodes[inode_offset];
 
     if (target->valid != INODE_DIR)
     {
         perror("dir_remove: Inode given is not a directory.");
+        icache_put(fs, target);
         return -1;
     }
 
@@ -214,6 +245,7 @@ ssize_t dir_remove(FileSystem *fs, size_t inode_dir, const char *name)
     {
         DirEntry entry;
         if (fs_read(fs, inode_dir, (char *)&entry, sizeof(DirEntry), i) < 0) {
+            icache_put(fs, target);
             return -1;
         }
         if (entry.inode_number != UINT32_MAX && strcmp(entry.name, name) == 0) {
@@ -221,10 +253,23 @@ ssize_t dir_remove(FileSystem *fs, size_t inode_dir, const char *name)
             memset(&entry, 0, sizeof(DirEntry));
             entry.inode_number = UINT32_MAX; // mark slot as deleted
             if (fs_write(fs, inode_dir, (char *)&entry, sizeof(DirEntry), i) < 0) {
+                icache_put(fs, target);
                 return -1;
             }
+            icache_put(fs, target);
+            dcache_invalidate(fs, (uint32_t)inode_dir, name);
             return removed_inode;
         }
     }
+    icache_put(fs, target);
     return -1;
 }
+
+// dir_remove under the fs lock
+ssize_t dir_remove(FileSystem *fs, size_t inode_dir, const char *name)
+{
+    fs_lock(fs);
+    ssize_t removed = dir_remove_locked(fs, inode_dir, name);
+    fs_unlock_changed(fs);
+    return removed;
+}
@@ -0,0 +1,119 @@
+#include "discard.h"
+#include "fs.h"
+#include "utils.h"
+
+/* Discard Queue
+ * Extents released by fs_remove/fs_truncate are queued here instead of being
+ * punched one by one. The queue coalesces neighbouring ranges and is flushed
+ * with fallocate(FALLOC_FL_PUNCH_HOLE) on unmount, once it holds
+ * DISCARD_FLUSH_BLOCKS blocks or runs out of slots, or through fs_trim. */
+
+// Index of the first range starting after start
+static size_t discard_position(const DiscardQueue *queue, uint32_t start)
+{
+    size_t low = 0, high = queue->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (queue->ranges[mid].start <= start) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Queues a freed range, merging it with the ranges it touches. Flushes when full.
+bool discard_queue(FileSystem *fs, uint32_t start, uint32_t length)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("discard_queue: Error fs or disk is invalid (NULL)");
+        return false;
+    }
+    if (length == 0) return true;
+    if (fs->discard == NULL) {
+        fs->discard = calloc(1, sizeof(DiscardQueue));
+        if (fs->discard == NULL) {
+            perror("discard_queue: Failed to allocate the discard queue");
+            return false;
+        }
+    }
+    DiscardQueue *queue = fs->discard;
+    if (queue->unsupported) return true;
+    if (queue->count == DISCARD_MAX_RANGES && discard_flush(fs) < 0) {
+        return false;
+    }
+
+    uint32_t end = start + length;
+    size_t pos = discard_position(queue, start);
+
+    // absorb the previous range when it reaches start
+    if (pos > 0 && queue->ranges[pos - 1].start + queue->ranges[pos - 1].length >= start) {
+        pos--;
+        Extent *prev = &queue->ranges[pos];
+        if (prev->start + prev->length > end) end = prev->start + prev->length;
+        start = prev->start;
+        queue->blocks -= prev->length;
+    } else {
+        memmove(&queue->ranges[pos + 1], &queue->ranges[pos], (queue->count - pos) * sizeof(Extent));
+        queue->count++;
+    }
+
+    // absorb every following range that starts inside or right after the merged one
+    size_t next = pos + 1;
+    while (next < queue->count && queue->ranges[next].start <= end) {
+        Extent *range = &queue->ranges[next];
+        if (range->start + range->length > end) end = range->start + range->length;
+        queue->blocks -= range->length;
+        next++;
+    }
+    if (next > pos + 1) {
+        memmove(&queue->ranges[pos + 1], &queue->ranges[next], (queue->count - next) * sizeof(Extent));
+        queue->count -= next - pos - 1;
+    }
+
+    queue->ranges[pos].start  = start;
+    queue->ranges[pos].length = end - start;
+    queue->blocks += end - start;
+
+    if (queue->blocks >= DISCARD_FLUSH_BLOCKS) {
+        return discard_flush(fs) >= 0;
+    }
+    return true;
+}
+
+// Punches every queued range, skipping blocks that were reallocated since they were
+// freed. Returns the amount of blocks discarded or -1 if the host refused a punch.
+ssize_t discard_flush(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL || fs->bitmap == NULL) {
+        perror("discard_flush: Error fs is invalid");
+        return -1;
+    }
+    DiscardQueue *queue = fs->discard;
+    if (queue == NULL || queue->count == 0) return 0;
+
+    ssize_t discarded = 0;
+    bool supported = true;
+    for (size_t i = 0; i < queue->count && supported; i++) {
+        uint32_t block = queue->ranges[i].start;
+        uint32_t end   = block + queue->ranges[i].length;
+        while (block < end && supported) {
+            // split the range into runs that are still free in the bitmap
+            while (block < end && get_bit(fs->bitmap->bits, block)) block++;
+            uint32_t run = block;
+            while (block < end && !get_bit(fs->bitmap->bits, block)) block++;
+            if (block > run) {
+                supported = disk_discard(fs->disk, run, block - run);
+                if (supported) discarded += block - run;
+            }
+        }
+    }
+
+    queue->count  = 0;
+    queue->blocks = 0;
+    queue->discarded += discarded;
+    if (!supported) {
+        queue->unsupported = true;
+        fprintf(stderr, "discard_flush: Host filesystem cannot punch holes, freed blocks stay allocated\n");
+        return -1;
+    }
+    return discarded;
+}
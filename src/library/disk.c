@@ -1,9 +1,48 @@
-
+#define _GNU_SOURCE
 #include "disk.h"
+#include "cache.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h> 
+#include <errno.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Fixed set of aligned block buffers, handed out as a stack
+struct BlockPool {
+    char    *slab;              // DISK_POOL_BLOCKS aligned blocks
+    char    *free_list[DISK_POOL_BLOCKS];
+    size_t  free_count;
+    pthread_mutex_t lock;
+};
+
+static BlockPool * pool_create(void)
+{
+    BlockPool *pool = calloc(1, sizeof(BlockPool));
+    if (pool == NULL) return NULL;
+    pool->slab = aligned_alloc(DISK_ALIGNMENT, (size_t)DISK_POOL_BLOCKS * BLOCK_SIZE);
+    if (pool->slab == NULL) {
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < DISK_POOL_BLOCKS; i++) {
+        pool->free_list[i] = pool->slab + (DISK_POOL_BLOCKS - 1 - i) * BLOCK_SIZE;
+    }
+    pool->free_count = DISK_POOL_BLOCKS;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+static void pool_destroy(BlockPool *pool)
+{
+    if (pool == NULL) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slab);
+    free(pool);
+}
 
 /* Disk Functions Definitions */
 
@@ -14,18 +53,79 @@ void disk_debug(Disk *disk) {
 
     printf("--------Disk Metadata--------\n");
     printf("Disk is %s\n", (disk->mounted) ? "Mounted" : "Not Mounted");
+    printf("Disk backend: %s\n", (disk->ops != NULL) ? disk->ops->name : "none");
+    if (disk->stripe_width > 0) {
+        printf("Full stripe: %zu blocks\n", disk->stripe_width);
+    }
     if (disk->mounted) {
         printf("Sum of write operations on the disk: %ld\n", disk->writes);
         printf("Sum of read operations on the disk: %ld\n", disk->reads);
+
+        DiskStats stats;
+        disk_stats_snapshot(disk, &stats);
+        printf("Bytes written: %llu, bytes read: %llu, system calls: %llu\n",
+               (unsigned long long)stats.write.bytes, (unsigned long long)stats.read.bytes,
+               (unsigned long long)stats.syscalls);
+        printf("Sequential/random runs: writes %llu/%llu, reads %llu/%llu\n",
+               (unsigned long long)stats.write.sequential, (unsigned long long)stats.write.random,
+               (unsigned long long)stats.read.sequential, (unsigned long long)stats.read.random);
+        if (disk->cache != NULL) {
+            uint64_t lookups = stats.cache_hits + stats.cache_misses;
+            printf("Buffer cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu write-backs\n",
+                   (unsigned long long)stats.cache_hits, (unsigned long long)stats.cache_misses,
+                   lookups ? 100.0 * stats.cache_hits / lookups : 0.0,
+                   (unsigned long long)stats.cache_evictions, (unsigned long long)stats.cache_writebacks);
+        }
+        if (disk->queue != NULL) {
+            printf("Write scheduler: %llu queued, %llu absorbed, %llu merged, %llu flushes\n",
+                   (unsigned long long)stats.queued, (unsigned long long)stats.absorbed,
+                   (unsigned long long)stats.merged, (unsigned long long)stats.flushes);
+        }
+        if (stats.read.simulated_ns + stats.write.simulated_ns > 0) {
+            printf("Simulated service time: writes %.3f ms, reads %.3f ms\n",
+                   stats.write.simulated_ns / 1e6, stats.read.simulated_ns / 1e6);
+        }
     }
 }
 
 /* Opens the file and returns the pointer to the virtual disk*/
 Disk * disk_open(const char *path, size_t blocks) {
+    return disk_open_backend(path, blocks, DISK_BACKEND_FILE);
+}
+
+/* Maps a backend name ("file", "uring", "mmap", "direct", "sim") to its id, unknown names fall back to the file backend */
+DiskBackend disk_backend_from_name(const char *name) {
+    if (name != NULL && strcmp(name, "sim") == 0) {
+        return DISK_BACKEND_SIM;
+    }
+    if (name != NULL && strcmp(name, "direct") == 0) {
+        return DISK_BACKEND_DIRECT;
+    }
+    if (name != NULL && strcmp(name, "uring") == 0) {
+        return DISK_BACKEND_URING;
+    }
+    if (name != NULL && strcmp(name, "mmap") == 0) {
+        return DISK_BACKEND_MMAP;
+    }
+    return DISK_BACKEND_FILE;
+}
+
+/* Opens the file with the requested backend, a backend that cannot be set up falls back to the file one */
+Disk * disk_open_backend(const char *path, size_t blocks, DiskBackend backend) {
 
     // Attempt to open the file and receive the proccess id (fd)
     // if the file does not exist, a new one will be created.
-    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    int flags = O_RDWR | O_CREAT;
+    if (backend == DISK_BACKEND_DIRECT) {
+        flags |= O_DIRECT;
+    }
+    int fd = open(path, flags, 0666);
+    if (fd < 0 && backend == DISK_BACKEND_DIRECT && errno == EINVAL) {
+        // the host filesystem (tmpfs for instance) does not support O_DIRECT
+        fprintf(stderr, "disk_open: O_DIRECT is not supported for %s, falling back to %s\n", path, disk_file_ops.name);
+        backend = DISK_BACKEND_FILE;
+        fd = open(path, O_RDWR | O_CREAT, 0666);
+    }
     if (fd < 0) {
         perror("disk_open: failed to open/create disk image");
         return NULL;
@@ -47,94 +147,497 @@ Disk * disk_open(const char *path, size_t blocks) {
         return NULL;
     }
 
+    disk->pool = pool_create();
+    if (disk->pool == NULL) {
+        perror("disk_open: failed to allocate the block buffer pool");
+        close(fd);
+        free(disk);
+        return NULL;
+    }
+
     // final construction 
     disk->fd      = fd;
     disk->blocks  = blocks;
+    switch (backend) {
+        case DISK_BACKEND_URING:  disk->ops = &disk_uring_ops;  break;
+        case DISK_BACKEND_MMAP:   disk->ops = &disk_mmap_ops;   break;
+        case DISK_BACKEND_DIRECT: disk->ops = &disk_direct_ops; break;
+        case DISK_BACKEND_SIM:    disk->ops = &disk_sim_ops;    break;
+        default:                  disk->ops = &disk_file_ops;   break;
+    }
+
+    if (disk->ops->init != NULL && !disk->ops->init(disk)) {
+        fprintf(stderr, "disk_open: %s backend is unavailable, falling back to %s\n",
+                disk->ops->name, disk_file_ops.name);
+        disk->ops = &disk_file_ops;
+    }
 
     return disk;
 }
 
+/* Wraps a backend that manages its own files into a Disk (fd is -1), used by composite
+ * disks. The backend state is already set up, ops->fini releases it on disk_close. */
+Disk * disk_create(size_t blocks, const DiskOps *ops, void *backend) {
+    Disk *disk = (Disk *)calloc(1, sizeof(Disk));
+    if (disk == NULL) {
+        return NULL;
+    }
+    disk->pool = pool_create();
+    if (disk->pool == NULL) {
+        perror("disk_create: failed to allocate the block buffer pool");
+        free(disk);
+        return NULL;
+    }
+    disk->fd      = -1;
+    disk->blocks  = blocks;
+    disk->ops     = ops;
+    disk->backend = backend;
+    return disk;
+}
+
  void disk_close(Disk *disk) {
     // error checks
     if (disk == NULL) {
         return;
     }
+    cache_disable(disk);
+    disk_queue_disable(disk);
+    if (disk->ops != NULL && disk->ops->fini != NULL) {
+        disk->ops->fini(disk);
+    }
     if (disk->fd >= 0) {
         if (close(disk->fd) < 0) {
             perror("disk_close: Error closing the disk");
         }
     }
     // unmount the disk and free it from the memory
+    pool_destroy(disk->pool);
     disk->mounted = false;
     disk->fd = -1; 
     free(disk);
 }
 
-ssize_t disk_write(Disk *disk, size_t block, char *data) {
+// Moves one contiguous byte range described by iov with a single positional call,
+// retrying on short transfers. Returns bytes moved or -1 on failure.
+ssize_t disk_transfer(Disk *disk, int fd, struct iovec *iov, int iovcnt, off_t offset, bool write)
+{
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t moved = write ? pwritev(fd, iov, iovcnt, offset)
+                              : preadv(fd, iov, iovcnt, offset);
+        disk_stats_syscalls(disk, 1);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            perror(write ? "disk_writev: pwritev system call failed" : "disk_readv: preadv system call failed");
+            return -1;
+        }
+        if (moved == 0) {
+            fprintf(stderr, "%s: unexpectedly hit End-of-File (EOF) at offset %lld\n",
+                    write ? "disk_writev" : "disk_readv", (long long)offset);
+            return -1;
+        }
+        total  += moved;
+        offset += moved;
+
+        // skip the iovecs that are fully done and trim the partially done one
+        while (iovcnt > 0 && (size_t)moved >= iov->iov_len) {
+            moved -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + moved;
+            iov->iov_len -= moved;
+        }
+    }
+    return total;
+}
+
+// Synchronous backend: one preadv/pwritev per request, in order
+ssize_t disk_file_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    ssize_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        ssize_t moved = disk_transfer(disk, disk->fd, requests[i].iov, requests[i].iovcnt, requests[i].offset, write);
+        if (moved < 0) return -1;
+        total += moved;
+    }
+    return total;
+}
+
+bool disk_file_sync(Disk *disk)
+{
+    disk_stats_syscalls(disk, 1);
+    if (fsync(disk->fd) < 0) {
+        perror("disk_sync: fsync has failed");
+        return false;
+    }
+    return true;
+}
+
+const DiskOps disk_file_ops = {
+    .name      = "file",
+    .init      = NULL,
+    .submit    = disk_file_submit,
+    .sync      = disk_file_sync,
+    .block_ptr = NULL,
+    .discard   = NULL,
+    .fini      = NULL,
+};
+
+// O_DIRECT backend: same calls as the file backend, but the kernel rejects
+// unaligned transfers with a bare EINVAL, so they are caught here first
+static ssize_t direct_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    for (size_t i = 0; i < count; i++) {
+        for (int v = 0; v < requests[i].iovcnt; v++) {
+            const struct iovec *iov = &requests[i].iov[v];
+            if ((uintptr_t)iov->iov_base % DISK_ALIGNMENT != 0 || iov->iov_len % DISK_ALIGNMENT != 0) {
+                fprintf(stderr, "%s: buffer %p (%zu bytes) is not aligned to %d bytes as O_DIRECT requires, "
+                        "borrow buffers with disk_buffer_get\n",
+                        write ? "disk_writev" : "disk_readv", iov->iov_base, iov->iov_len, DISK_ALIGNMENT);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+    }
+    return disk_file_submit(disk, requests, count, write);
+}
+
+const DiskOps disk_direct_ops = {
+    .name      = "direct",
+    .init      = NULL,
+    .submit    = direct_submit,
+    .sync      = disk_file_sync,
+    .block_ptr = NULL,
+    .discard   = NULL,
+    .fini      = NULL,
+};
+
+static void disk_count(Disk *disk, size_t blocks, bool write)
+{
+    // operation counts are kept in blocks
+    if (write) {
+        __atomic_add_fetch(&disk->writes, blocks, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&disk->reads, blocks, __ATOMIC_RELAXED);
+    }
+}
+
+// Hands a batch to the backend, accounting and timing it for the statistics
+static ssize_t disk_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    struct timespec start, end;
+    disk_stats_runs(disk, requests, count, write);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ssize_t moved = disk->ops->submit(disk, requests, count, write);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)(end.tv_nsec - start.tv_nsec);
+    disk_stats_latency(disk, write, ns);
+    return moved;
+}
+
+// Checks the disk, the vector and the bounds of every block of a vectored request
+static bool disk_vector_valid(Disk *disk, const BlockVec *vec, size_t count, bool write)
+{
+    const char *name = write ? "disk_writev" : "disk_readv";
     if (disk == NULL) {
-        perror("disk_write: disk is invalid");
-        return -1;
+        fprintf(stderr, "%s: disk is invalid (NULL pointer)\n", name);
+        return false;
     }
-    if (block >= disk->blocks) {
-        perror("disk_write: block size is invalid");
-        return -1;
+    if (vec == NULL && count > 0) {
+        fprintf(stderr, "%s: block vector is invalid (NULL pointer)\n", name);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (vec[i].block >= disk->blocks) {
+            fprintf(stderr, "%s: block number %zu out of bounds (max %zu)\n",
+                    name, vec[i].block, disk->blocks - 1);
+            return false;
+        }
     }
+    return true;
+}
 
-    // position the offset in the file at desired block location
-    off_t offset = (off_t)block * BLOCK_SIZE;
-    if (lseek(disk->fd, offset, SEEK_SET) < 0) {
-        perror("disk_write: lseek has failed");
+// Walks the request, merging entries whose blocks are consecutive into one
+// run so a whole extent costs a single system call. Runs are handed to the
+// backend in batches of up to DISK_MAX_IOV blocks, bypassing the write scheduler.
+ssize_t disk_vector(Disk *disk, const BlockVec *vec, size_t count, bool write)
+{
+    if (!disk_vector_valid(disk, vec, count, write)) {
         return -1;
     }
 
-    // attempt to write the data into the disk
-    ssize_t written_bytes = write(disk->fd, data, BLOCK_SIZE);
-    if (written_bytes != BLOCK_SIZE) {
-        if (written_bytes < 0) {
-            perror("disk_write: write system call failed");
-        } else {
-            fprintf(stderr, "disk_write: short write (%zd bytes written instead of %d)\n", written_bytes, BLOCK_SIZE);
+    struct iovec iov[DISK_MAX_IOV];
+    DiskRequest requests[DISK_MAX_IOV];
+    ssize_t total = 0;
+    size_t i = 0;
+    while (i < count) {
+        // fill one batch, starting a new request whenever the block numbers jump
+        size_t batch = 0;
+        size_t queued = 0;
+        while (i + batch < count && batch < DISK_MAX_IOV) {
+            const BlockVec *entry = &vec[i + batch];
+            if (batch == 0 || entry->block != vec[i + batch - 1].block + 1) {
+                requests[queued].offset = (off_t)entry->block * BLOCK_SIZE;
+                requests[queued].iov    = &iov[batch];
+                requests[queued].iovcnt = 0;
+                queued++;
+            }
+            iov[batch].iov_base = entry->data;
+            iov[batch].iov_len  = BLOCK_SIZE;
+            requests[queued - 1].iovcnt++;
+            batch++;
         }
+
+        ssize_t moved = disk_submit(disk, requests, queued, write);
+        if (moved < 0) return -1;
+        total += moved;
+        i += batch;
+    }
+
+    disk_count(disk, count, write);
+    return total;
+}
+
+ssize_t disk_issue(Disk *disk, const BlockVec *vec, size_t count, bool write) {
+    if (disk->queue != NULL) {
+        return write ? disk_queue_writev(disk, vec, count) : disk_queue_readv(disk, vec, count);
+    }
+    return disk_vector(disk, vec, count, write);
+}
+
+// Routes a validated vector through the buffer cache when enabled
+static ssize_t disk_route(Disk *disk, const BlockVec *vec, size_t count, bool write) {
+    if (disk->cache != NULL) {
+        return write ? cache_writev(disk, vec, count) : cache_readv(disk, vec, count);
+    }
+    return disk_issue(disk, vec, count, write);
+}
+
+// Moves count blocks starting at block to/from one flat buffer of count*BLOCK_SIZE bytes
+static ssize_t disk_run(Disk *disk, size_t block, size_t count, char *data, bool write)
+{
+    const char *name = write ? "disk_write_blocks" : "disk_read_blocks";
+    if (disk == NULL || data == NULL) {
+        fprintf(stderr, "%s: disk or buffer is invalid (NULL pointer)\n", name);
+        return -1;
+    }
+    if (block >= disk->blocks || count > disk->blocks - block) {
+        fprintf(stderr, "%s: blocks %zu..%zu out of bounds (max %zu)\n",
+                name, block, block + count - 1, disk->blocks - 1);
         return -1;
     }
-    // success
-    // write operation count is incremented
-    disk->writes++;
-    return written_bytes;
+    if (count == 0) return 0;
+
+    // with a cache or a write scheduler the run goes block by block through them,
+    // so reads see cached and pending writes
+    if (disk->cache != NULL || disk->queue != NULL) {
+        BlockVec vec[DISK_MAX_IOV];
+        for (size_t done = 0; done < count; ) {
+            size_t batch = (count - done < DISK_MAX_IOV) ? count - done : DISK_MAX_IOV;
+            for (size_t i = 0; i < batch; i++) {
+                vec[i].block = block + done + i;
+                vec[i].data  = data + (done + i) * BLOCK_SIZE;
+            }
+            ssize_t moved = disk_route(disk, vec, batch, write);
+            if (moved < 0) return -1;
+            done += batch;
+        }
+        return (ssize_t)(count * BLOCK_SIZE);
+    }
+
+    struct iovec iov = { .iov_base = data, .iov_len = count * BLOCK_SIZE };
+    DiskRequest request = { .offset = (off_t)block * BLOCK_SIZE, .iov = &iov, .iovcnt = 1 };
+    ssize_t moved = disk_submit(disk, &request, 1, write);
+    if (moved < 0) return -1;
+
+    disk_count(disk, count, write);
+    return moved;
+}
+
+ssize_t disk_readv(Disk *disk, const BlockVec *vec, size_t count) {
+    if (!disk_vector_valid(disk, vec, count, false)) return -1;
+    return disk_route(disk, vec, count, false);
+}
+
+ssize_t disk_writev(Disk *disk, const BlockVec *vec, size_t count) {
+    if (!disk_vector_valid(disk, vec, count, true)) return -1;
+    return disk_route(disk, vec, count, true);
+}
+
+ssize_t disk_read_blocks(Disk *disk, size_t block, size_t count, char *data) {
+    return disk_run(disk, block, count, data, false);
+}
+
+ssize_t disk_write_blocks(Disk *disk, size_t block, size_t count, char *data) {
+    return disk_run(disk, block, count, data, true);
+}
+
+// Single blocks are metadata (inode table, extent, directory and pfs blocks) and populate the cache
+ssize_t disk_write(Disk *disk, size_t block, char *data) {
+    BlockVec vec = { .block = block, .data = data };
+    if (!disk_vector_valid(disk, &vec, 1, true)) return -1;
+    if (disk->cache != NULL) return cache_write(disk, block, data);
+    return disk_issue(disk, &vec, 1, true);
 }
 
 ssize_t disk_read(Disk *disk, size_t block, char *data) {
+    BlockVec vec = { .block = block, .data = data };
+    if (!disk_vector_valid(disk, &vec, 1, false)) return -1;
+    if (disk->cache != NULL) return cache_read(disk, block, data);
+    return disk_issue(disk, &vec, 1, false);
+}
+
+/* Makes every completed write durable in the backing image */
+bool disk_sync(Disk *disk) {
     if (disk == NULL) {
-        perror("disk_read: disk is invalid (NULL pointer)");
-        return -1;
+        fprintf(stderr, "disk_sync: disk is invalid (NULL pointer)\n");
+        return false;
     }
-    if (block >= disk->blocks) {
-        fprintf(stderr, "disk_read: block number %zu out of bounds (max %zu)\n", 
-                block, disk->blocks - 1);
-        return -1;
+    if (!disk_writeback(disk)) return false;
+    if (disk->ops->sync == NULL) return true;
+    return disk->ops->sync(disk);
+}
+
+/* Hands the dirty cached blocks and the pending scheduled writes to the backend
+ * without waiting for them to become durable */
+bool disk_writeback(Disk *disk) {
+    if (disk == NULL) {
+        fprintf(stderr, "disk_writeback: disk is invalid (NULL pointer)\n");
+        return false;
     }
-    off_t offset = (off_t)block * BLOCK_SIZE;
+    return cache_flush(disk) && disk_queue_flush(disk);
+}
 
-    if (lseek(disk->fd, offset, SEEK_SET) < 0) {
-        perror("disk_read: lseek has failed");
-        return -1;
+// Validates a block range for the space management calls
+static bool disk_range_valid(Disk *disk, size_t block, size_t count, const char *name)
+{
+    if (disk == NULL) {
+        fprintf(stderr, "%s: disk is invalid (NULL pointer)\n", name);
+        return false;
+    }
+    if (block >= disk->blocks || count > disk->blocks - block) {
+        fprintf(stderr, "%s: blocks %zu..%zu out of bounds (max %zu)\n",
+                name, block, block + count - 1, disk->blocks - 1);
+        return false;
+    }
+    return true;
+}
+
+/* Zeroes count blocks starting at block without writing them when the host filesystem
+ * allows it: punching a hole first (keeps the image thin, ZERO_RANGE still reserves the
+ * space), then FALLOC_FL_ZERO_RANGE, and only then zeroed writes. */
+bool disk_zero(Disk *disk, size_t block, size_t count) {
+    if (count == 0) return true;
+    if (!disk_range_valid(disk, block, count, "disk_zero")) return false;
+
+    if (disk_discard(disk, block, count)) {
+        return true;
+    }
+    if (disk->fd >= 0) {
+        disk_stats_syscalls(disk, 1);
+        if (fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == 0) {
+            return true;
+        }
     }
 
-    // attempt to read the data from the disk into the buffer data
-    ssize_t bytes_read = read(disk->fd, data, BLOCK_SIZE);
-    if (bytes_read != BLOCK_SIZE) {
-        if (bytes_read < 0) {
-            perror("disk_read: system read call failed");
-        } else if (bytes_read == 0) {
-            fprintf(stderr, "disk_read: read failed, unexpectedly hit End-of-File (EOF)\n");
-        } else { 
-            fprintf(stderr, "disk_read: short read (%zd bytes read instead of %d)\n", 
-                    bytes_read, BLOCK_SIZE);
+    // no space management on the host, write the zeroes (one aligned buffer repeated per batch)
+    char *zero = disk_buffer_get(disk);
+    if (zero == NULL) {
+        perror("disk_zero: failed to allocate a zero block");
+        return false;
+    }
+    memset(zero, 0, BLOCK_SIZE);
+    BlockVec vec[DISK_MAX_IOV];
+    bool ok = true;
+    for (size_t done = 0; ok && done < count; ) {
+        size_t batch = (count - done < DISK_MAX_IOV) ? count - done : DISK_MAX_IOV;
+        for (size_t i = 0; i < batch; i++) {
+            vec[i].block = block + done + i;
+            vec[i].data  = zero;
         }
-        return -1; 
+        ok = disk_writev(disk, vec, batch) >= 0;
+        done += batch;
+    }
+    disk_buffer_put(disk, zero);
+    return ok;
+}
+
+/* Hands count blocks starting at block back to the host by punching a hole, the blocks read
+ * back as zeroes afterwards. Best effort: returns false when the host cannot deallocate. */
+bool disk_discard(Disk *disk, size_t block, size_t count) {
+    if (count == 0) return true;
+    if (!disk_range_valid(disk, block, count, "disk_discard")) return false;
+    cache_invalidate(disk, block, count);
+    if (!disk_queue_flush(disk)) return false;  // a pending write must not land on the hole later
+
+    if (disk->ops->discard != NULL) {
+        return disk->ops->discard(disk, block, count);
+    }
+    disk_stats_syscalls(disk, 1);
+    return fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) == 0;
+}
+
+/* Zero-copy read-only view of a block, NULL when the backend cannot serve blocks in place.
+ * The pointer stays valid until the disk is closed; writes must still go through disk_write. */
+const char * disk_block_ptr(Disk *disk, size_t block) {
+    if (disk == NULL || disk->ops->block_ptr == NULL || block >= disk->blocks) {
+        return NULL;
+    }
+    if ((disk->cache != NULL && cache_is_dirty(disk, block)) ||
+        (disk->queue != NULL && disk_queue_contains(disk, block))) {
+        return NULL;    // the image is behind a cached or pending write, the caller reads it instead
+    }
+    const char *ptr = disk->ops->block_ptr(disk, block);
+    if (ptr != NULL) {
+        disk_count(disk, 1, false);
+    }
+    return ptr;
+}
+
+/* Borrows a BLOCK_SIZE buffer aligned to DISK_ALIGNMENT, valid for every backend.
+ * Falls back to the heap once the pool is drained. */
+char * disk_buffer_get(Disk *disk) {
+    if (disk == NULL || disk->pool == NULL) {
+        return NULL;
+    }
+    BlockPool *pool = disk->pool;
+    char *buffer = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count > 0) {
+        buffer = pool->free_list[--pool->free_count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (buffer == NULL) {
+        buffer = aligned_alloc(DISK_ALIGNMENT, BLOCK_SIZE);
     }
+    return buffer;
+}
 
-    // increment the read operations and return the buffer
-    disk->reads++;
-    return bytes_read; 
-}
\ No newline at end of file
+/* True when data can be handed to the disk as a block buffer as it is. Every
+ * backend takes any address except O_DIRECT, which needs DISK_ALIGNMENT. */
+bool disk_buffer_usable(Disk *disk, const char *data) {
+    if (disk == NULL || data == NULL) {
+        return false;
+    }
+    return disk->ops != &disk_direct_ops || (uintptr_t)data % DISK_ALIGNMENT == 0;
+}
+
+/* Returns a buffer obtained from disk_buffer_get */
+void disk_buffer_put(Disk *disk, char *buffer) {
+    if (disk == NULL || disk->pool == NULL || buffer == NULL) {
+        return;
+    }
+    BlockPool *pool = disk->pool;
+    bool pooled = buffer >= pool->slab && buffer < pool->slab + (size_t)DISK_POOL_BLOCKS * BLOCK_SIZE;
+    if (!pooled) {
+        free(buffer);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->free_list[pool->free_count++] = buffer;
+    pthread_mutex_unlock(&pool->lock);
+}
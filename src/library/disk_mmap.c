@@ -0,0 +1,143 @@
+#include "disk.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Memory-mapped Disk Backend
+ * The whole image is mapped shared, block requests become memcpy into the
+ * mapping and blocks can be handed out in place through disk_block_ptr.
+ * Written blocks are tracked in a dirty bitmap so disk_sync only msyncs the
+ * ranges that actually changed. */
+
+typedef struct MappedImage MappedImage;
+struct MappedImage {
+    char     *base;         // Start of the mapping
+    size_t   size;          // Length of the mapping in bytes
+    uint64_t *dirty;        // One bit per block written since the last sync
+    size_t   dirty_words;
+};
+
+static bool mmap_init(Disk *disk)
+{
+    MappedImage *image = calloc(1, sizeof(MappedImage));
+    if (image == NULL) return false;
+
+    image->size = disk->blocks * BLOCK_SIZE;
+    image->dirty_words = (disk->blocks + 63) / 64;
+    image->dirty = calloc(image->dirty_words, sizeof(uint64_t));
+    if (image->dirty == NULL) {
+        free(image);
+        return false;
+    }
+
+    image->base = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (image->base == MAP_FAILED) {
+        perror("mmap_init: mapping the disk image failed");
+        free(image->dirty);
+        free(image);
+        return false;
+    }
+    disk->backend = image;
+    return true;
+}
+
+static void mmap_fini(Disk *disk)
+{
+    MappedImage *image = disk->backend;
+    if (image == NULL) return;
+    if (munmap(image->base, image->size) < 0) {
+        perror("mmap_fini: unmapping the disk image failed");
+    }
+    free(image->dirty);
+    free(image);
+    disk->backend = NULL;
+}
+
+static void mmap_mark_dirty(MappedImage *image, size_t first, size_t last)
+{
+    for (size_t block = first; block <= last; block++) {
+        __atomic_or_fetch(&image->dirty[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static ssize_t mmap_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    MappedImage *image = disk->backend;
+    ssize_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = (size_t)requests[i].offset;
+        for (int v = 0; v < requests[i].iovcnt; v++) {
+            size_t length = requests[i].iov[v].iov_len;
+            if (offset + length > image->size) {
+                fprintf(stderr, "mmap_submit: request at offset %zu runs past the end of the image\n", offset);
+                return -1;
+            }
+            if (write) {
+                memcpy(image->base + offset, requests[i].iov[v].iov_base, length);
+                mmap_mark_dirty(image, offset / BLOCK_SIZE, (offset + length - 1) / BLOCK_SIZE);
+            } else {
+                memcpy(requests[i].iov[v].iov_base, image->base + offset, length);
+            }
+            offset += length;
+            total  += length;
+        }
+    }
+    return total;
+}
+
+// msyncs every run of dirty blocks, clearing the bits as it goes
+static bool mmap_sync(Disk *disk)
+{
+    MappedImage *image = disk->backend;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    bool ok = true;
+
+    size_t block = 0;
+    while (block < disk->blocks) {
+        uint64_t word = __atomic_load_n(&image->dirty[block / 64], __ATOMIC_RELAXED);
+        if (word == 0 && block % 64 == 0) {
+            block += 64;
+            continue;
+        }
+        if (!(word & (1ULL << (block % 64)))) {
+            block++;
+            continue;
+        }
+
+        // collect the run of dirty blocks
+        size_t first = block;
+        while (block < disk->blocks &&
+               (__atomic_fetch_and(&image->dirty[block / 64], ~(1ULL << (block % 64)), __ATOMIC_RELAXED)
+                & (1ULL << (block % 64)))) {
+            block++;
+        }
+
+        // msync needs a page aligned start
+        size_t start = (first * BLOCK_SIZE) & ~(page - 1);
+        size_t end   = block * BLOCK_SIZE;
+        disk_stats_syscalls(disk, 1);
+        if (msync(image->base + start, end - start, MS_SYNC) < 0) {
+            perror("disk_sync: msync has failed");
+            mmap_mark_dirty(image, first, block - 1);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static const char * mmap_block_ptr(Disk *disk, size_t block)
+{
+    MappedImage *image = disk->backend;
+    return image->base + block * BLOCK_SIZE;
+}
+
+const DiskOps disk_mmap_ops = {
+    .name      = "mmap",
+    .init      = mmap_init,
+    .submit    = mmap_submit,
+    .sync      = mmap_sync,
+    .block_ptr = mmap_block_ptr,
+    .discard   = NULL,
+    .fini      = mmap_fini,
+};
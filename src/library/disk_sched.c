@@ -0,0 +1,221 @@
+#include "disk.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Write Scheduler
+ * An elevator in front of the backend: block writes are copied into a fixed
+ * set of pending slots (a later write of a pending block replaces it in place)
+ * and reach the device only on flush, sorted by block number so neighbouring
+ * blocks leave as one run. The queue flushes when it runs out of slots, on
+ * disk_sync/disk_close and before space is zeroed or discarded. Reads are
+ * served from the pending slots first so a block always reads back with its
+ * latest contents. */
+
+struct WriteQueue {
+    char            *slab;      // capacity aligned block buffers
+    size_t          *blocks;    // Block number held by every used slot
+    BlockVec        *sorted;    // capacity entries, the flush sorts the slots in it
+    size_t          capacity;
+    size_t          count;      // Used slots
+    uint32_t        *index;     // Open addressing block -> slot + 1, 0 is empty
+    size_t          index_mask;
+    pthread_mutex_t lock;
+};
+
+static size_t queue_hash(size_t block, size_t mask)
+{
+    return (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 17) & mask;
+}
+
+// Slot holding block or -1, the caller holds the lock
+static ssize_t queue_find(const WriteQueue *queue, size_t block)
+{
+    for (size_t i = queue_hash(block, queue->index_mask); queue->index[i] != 0; i = (i + 1) & queue->index_mask) {
+        size_t slot = queue->index[i] - 1;
+        if (queue->blocks[slot] == block) return (ssize_t)slot;
+    }
+    return -1;
+}
+
+static char * queue_buffer(const WriteQueue *queue, size_t slot)
+{
+    return queue->slab + slot * BLOCK_SIZE;
+}
+
+static int queue_compare(const void *a, const void *b)
+{
+    size_t x = ((const BlockVec *)a)->block, y = ((const BlockVec *)b)->block;
+    return (x > y) - (x < y);
+}
+
+// Writes every pending slot in block order and empties the queue, the caller holds the lock
+static bool queue_flush_locked(Disk *disk, WriteQueue *queue)
+{
+    if (queue->count == 0) return true;
+
+    BlockVec *vec = queue->sorted;
+    for (size_t slot = 0; slot < queue->count; slot++) {
+        vec[slot].block = queue->blocks[slot];
+        vec[slot].data  = queue_buffer(queue, slot);
+    }
+    qsort(vec, queue->count, sizeof(BlockVec), queue_compare);
+
+    uint64_t merged = 0;
+    for (size_t i = 1; i < queue->count; i++) {
+        if (vec[i].block == vec[i - 1].block + 1) merged++;
+    }
+
+    if (disk_vector(disk, vec, queue->count, true) < 0) return false;
+
+    disk_stats_scheduler(disk, 0, 0, merged, 1);
+    queue->count = 0;
+    memset(queue->index, 0, (queue->index_mask + 1) * sizeof(uint32_t));
+    return true;
+}
+
+/* Buffers the writes of disk in a scheduler of capacity blocks */
+bool disk_queue_enable(Disk *disk, size_t capacity)
+{
+    if (disk == NULL || capacity == 0 || capacity > UINT32_MAX / 2) {
+        fprintf(stderr, "disk_queue_enable: Error invalid disk or capacity\n");
+        return false;
+    }
+    if (disk->queue != NULL) return true;
+
+    WriteQueue *queue = calloc(1, sizeof(WriteQueue));
+    if (queue == NULL) return false;
+    size_t buckets = 1;
+    while (buckets < capacity * 2) buckets <<= 1;
+
+    queue->slab   = aligned_alloc(DISK_ALIGNMENT, capacity * BLOCK_SIZE);
+    queue->blocks = malloc(capacity * sizeof(size_t));
+    queue->sorted = malloc(capacity * sizeof(BlockVec));
+    queue->index  = calloc(buckets, sizeof(uint32_t));
+    if (queue->slab == NULL || queue->blocks == NULL || queue->sorted == NULL || queue->index == NULL) {
+        perror("disk_queue_enable: failed to allocate the write queue");
+        free(queue->slab);
+        free(queue->blocks);
+        free(queue->sorted);
+        free(queue->index);
+        free(queue);
+        return false;
+    }
+    queue->capacity   = capacity;
+    queue->index_mask = buckets - 1;
+    pthread_mutex_init(&queue->lock, NULL);
+    disk->queue = queue;
+    return true;
+}
+
+/* Issues every pending write to the backend */
+bool disk_queue_flush(Disk *disk)
+{
+    if (disk == NULL || disk->queue == NULL) return true;
+    WriteQueue *queue = disk->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool ok = queue_flush_locked(disk, queue);
+    pthread_mutex_unlock(&queue->lock);
+    return ok;
+}
+
+/* Pending writes, and the capacity of the queue through capacity when it is not NULL */
+size_t disk_queue_count(Disk *disk, size_t *capacity)
+{
+    if (capacity != NULL) *capacity = 0;
+    if (disk == NULL || disk->queue == NULL) return 0;
+    WriteQueue *queue = disk->queue;
+    pthread_mutex_lock(&queue->lock);
+    size_t count = queue->count;
+    if (capacity != NULL) *capacity = queue->capacity;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+/* Flushes and removes the scheduler, writes go straight to the backend again */
+void disk_queue_disable(Disk *disk)
+{
+    if (disk == NULL || disk->queue == NULL) return;
+    WriteQueue *queue = disk->queue;
+    if (!disk_queue_flush(disk)) {
+        fprintf(stderr, "disk_queue_disable: Error pending writes could not be flushed\n");
+    }
+    disk->queue = NULL;
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->slab);
+    free(queue->blocks);
+    free(queue->sorted);
+    free(queue->index);
+    free(queue);
+}
+
+/* Buffers the blocks of vec, the blocks are already validated. Returns bytes queued or -1. */
+ssize_t disk_queue_writev(Disk *disk, const BlockVec *vec, size_t count)
+{
+    WriteQueue *queue = disk->queue;
+    uint64_t queued = 0, absorbed = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < count; i++) {
+        ssize_t slot = queue_find(queue, vec[i].block);
+        if (slot >= 0) {
+            absorbed++;
+        } else {
+            if (queue->count == queue->capacity && !queue_flush_locked(disk, queue)) {
+                pthread_mutex_unlock(&queue->lock);
+                return -1;
+            }
+            slot = (ssize_t)queue->count++;
+            queue->blocks[slot] = vec[i].block;
+            size_t h = queue_hash(vec[i].block, queue->index_mask);
+            while (queue->index[h] != 0) h = (h + 1) & queue->index_mask;
+            queue->index[h] = (uint32_t)slot + 1;
+        }
+        memcpy(queue_buffer(queue, slot), vec[i].data, BLOCK_SIZE);
+        queued++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    disk_stats_scheduler(disk, queued, absorbed, 0, 0);
+    return (ssize_t)(count * BLOCK_SIZE);
+}
+
+/* Serves the pending blocks of vec from the queue and reads the others from the backend */
+ssize_t disk_queue_readv(Disk *disk, const BlockVec *vec, size_t count)
+{
+    WriteQueue *queue = disk->queue;
+    ArenaMark mark = arena_mark();
+    BlockVec *rest = arena_alloc(count * sizeof(BlockVec));
+    if (rest == NULL && count > 0) {
+        perror("disk_readv: failed to allocate the read vector");
+        return -1;
+    }
+
+    size_t missing = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (size_t i = 0; i < count; i++) {
+        ssize_t slot = queue_find(queue, vec[i].block);
+        if (slot >= 0) {
+            memcpy(vec[i].data, queue_buffer(queue, slot), BLOCK_SIZE);
+        } else {
+            rest[missing++] = vec[i];
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    ssize_t moved = (missing > 0) ? disk_vector(disk, rest, missing, false) : 0;
+    arena_release(mark);
+    return (moved < 0) ? -1 : (ssize_t)(count * BLOCK_SIZE);
+}
+
+/* True when block has a pending write */
+bool disk_queue_contains(Disk *disk, size_t block)
+{
+    WriteQueue *queue = disk->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool pending = queue_find(queue, block) >= 0;
+    pthread_mutex_unlock(&queue->lock);
+    return pending;
+}
@@ -0,0 +1,157 @@
+#include "disk.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Disk Statistics
+ * All counters are plain 64-bit words updated with relaxed atomics, so the
+ * I/O paths never take a lock for bookkeeping. A snapshot copies the words
+ * one by one and may therefore mix values of concurrent requests. */
+
+#define STATS_WORDS (sizeof(DiskStats) / sizeof(uint64_t))
+
+_Static_assert(sizeof(DiskStats) % sizeof(uint64_t) == 0, "DiskStats must only hold 64-bit counters");
+
+static void stat_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+// Index of the log2 bucket holding value: 0 for 0, i for [2^(i-1), 2^i)
+static size_t log2_bucket(uint64_t value, size_t buckets)
+{
+    size_t bucket = (value == 0) ? 0 : (size_t)(64 - __builtin_clzll(value));
+    return (bucket < buckets) ? bucket : buckets - 1;
+}
+
+/* Accounts the runs of a batch about to be handed to the backend: sizes, the
+ * sequential/random split and the seek distance of every run. Done before the
+ * submit because backends may trim the iovecs while retrying short transfers. */
+void disk_stats_runs(Disk *disk, const DiskRequest *requests, size_t count, bool write)
+{
+    DiskOpStats *op = write ? &disk->stats.write : &disk->stats.read;
+    stat_add(&op->requests, 1);
+    stat_add(&op->runs, count);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t bytes = 0;
+        for (int v = 0; v < requests[i].iovcnt; v++) bytes += requests[i].iov[v].iov_len;
+        uint64_t first = (uint64_t)requests[i].offset / BLOCK_SIZE;
+        uint64_t blocks = bytes / BLOCK_SIZE;
+
+        // distance from where the previous run left the head
+        uint64_t previous = __atomic_exchange_n(&disk->next_block, first + blocks, __ATOMIC_RELAXED);
+        uint64_t distance = (first > previous) ? first - previous : previous - first;
+        stat_add((distance == 0) ? &op->sequential : &op->random, 1);
+        stat_add(&disk->stats.seek[log2_bucket(distance, DISK_SEEK_BUCKETS)], 1);
+
+        stat_add(&op->blocks, blocks);
+        stat_add(&op->bytes, bytes);
+    }
+}
+
+/* Accounts the time a batch spent in the backend */
+void disk_stats_latency(Disk *disk, bool write, uint64_t ns)
+{
+    DiskOpStats *op = write ? &disk->stats.write : &disk->stats.read;
+    stat_add(&op->latency_ns, ns);
+    stat_add(&op->latency[log2_bucket(ns, DISK_LATENCY_BUCKETS)], 1);
+}
+
+/* Accounts the service time a simulated device model charged for a batch */
+void disk_stats_simulated(Disk *disk, bool write, uint64_t ns)
+{
+    DiskOpStats *op = write ? &disk->stats.write : &disk->stats.read;
+    stat_add(&op->simulated_ns, ns);
+}
+
+void disk_stats_syscalls(Disk *disk, uint64_t count)
+{
+    stat_add(&disk->stats.syscalls, count);
+}
+
+/* Accounts the work of the buffer cache */
+void disk_stats_cache(Disk *disk, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t writebacks)
+{
+    if (hits)       stat_add(&disk->stats.cache_hits, hits);
+    if (misses)     stat_add(&disk->stats.cache_misses, misses);
+    if (evictions)  stat_add(&disk->stats.cache_evictions, evictions);
+    if (writebacks) stat_add(&disk->stats.cache_writebacks, writebacks);
+}
+
+/* Accounts the work of the write scheduler */
+void disk_stats_scheduler(Disk *disk, uint64_t queued, uint64_t absorbed, uint64_t merged, uint64_t flushes)
+{
+    if (queued)   stat_add(&disk->stats.queued, queued);
+    if (absorbed) stat_add(&disk->stats.absorbed, absorbed);
+    if (merged)   stat_add(&disk->stats.merged, merged);
+    if (flushes)  stat_add(&disk->stats.flushes, flushes);
+}
+
+void disk_stats_snapshot(Disk *disk, DiskStats *out)
+{
+    if (disk == NULL || out == NULL) return;
+    uint64_t *from = (uint64_t *)&disk->stats;
+    uint64_t *to = (uint64_t *)out;
+    for (size_t i = 0; i < STATS_WORDS; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void disk_stats_reset(Disk *disk)
+{
+    if (disk == NULL) return;
+    uint64_t *words = (uint64_t *)&disk->stats;
+    for (size_t i = 0; i < STATS_WORDS; i++) {
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void dump_histogram(FILE *out, const uint64_t *buckets, size_t count)
+{
+    // trailing empty buckets are left out
+    size_t used = count;
+    while (used > 0 && buckets[used - 1] == 0) used--;
+    fputc('[', out);
+    for (size_t i = 0; i < used; i++) {
+        fprintf(out, "%s%llu", (i > 0) ? ", " : "", (unsigned long long)buckets[i]);
+    }
+    fputc(']', out);
+}
+
+static void dump_op(FILE *out, const char *name, const DiskOpStats *op)
+{
+    fprintf(out, "  \"%s\": {\n", name);
+    fprintf(out, "    \"requests\": %llu,\n", (unsigned long long)op->requests);
+    fprintf(out, "    \"runs\": %llu,\n", (unsigned long long)op->runs);
+    fprintf(out, "    \"blocks\": %llu,\n", (unsigned long long)op->blocks);
+    fprintf(out, "    \"bytes\": %llu,\n", (unsigned long long)op->bytes);
+    fprintf(out, "    \"sequential\": %llu,\n", (unsigned long long)op->sequential);
+    fprintf(out, "    \"random\": %llu,\n", (unsigned long long)op->random);
+    fprintf(out, "    \"latency_ns\": %llu,\n", (unsigned long long)op->latency_ns);
+    fprintf(out, "    \"simulated_ns\": %llu,\n", (unsigned long long)op->simulated_ns);
+    fprintf(out, "    \"latency_log2_ns\": ");
+    dump_histogram(out, op->latency, DISK_LATENCY_BUCKETS);
+    fprintf(out, "\n  },\n");
+}
+
+/* Writes the snapshot as a JSON object. Histograms are arrays of log2 buckets. */
+bool disk_stats_dump_json(const DiskStats *stats, FILE *out)
+{
+    if (stats == NULL || out == NULL) return false;
+    fprintf(out, "{\n");
+    dump_op(out, "read", &stats->read);
+    dump_op(out, "write", &stats->write);
+    fprintf(out, "  \"syscalls\": %llu,\n", (unsigned long long)stats->syscalls);
+    uint64_t lookups = stats->cache_hits + stats->cache_misses;
+    fprintf(out, "  \"cache\": { \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, \"writebacks\": %llu, \"hit_rate\": %.4f },\n",
+            (unsigned long long)stats->cache_hits, (unsigned long long)stats->cache_misses,
+            (unsigned long long)stats->cache_evictions, (unsigned long long)stats->cache_writebacks,
+            lookups ? (double)stats->cache_hits / lookups : 0.0);
+    fprintf(out, "  \"scheduler\": { \"queued\": %llu, \"absorbed\": %llu, \"merged\": %llu, \"flushes\": %llu },\n",
+            (unsigned long long)stats->queued, (unsigned long long)stats->absorbed,
+            (unsigned long long)stats->merged, (unsigned long long)stats->flushes);
+    fprintf(out, "  \"seek_log2_blocks\": ");
+    dump_histogram(out, stats->seek, DISK_SEEK_BUCKETS);
+    fprintf(out, "\n}\n");
+    return !ferror(out);
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "disk.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* Striped Disk (RAID-0)
+ * Logical blocks are spread over several member images in stripe units of
+ * `unit` blocks: unit k lives on member k % members at member unit k / members.
+ * A batch is split into per-member runs and, when it touches more than one
+ * member, the runs are handed to one long-lived worker thread per member so a
+ * large extent is transferred by all devices in parallel. */
+
+typedef struct StripeWork StripeWork;
+typedef struct StripeSet StripeSet;
+
+// Worker thread serving one member
+typedef struct StripeSlot StripeSlot;
+struct StripeSlot {
+    StripeSet   *set;
+    size_t      member;
+    pthread_t   thread;
+    bool        running;
+    StripeWork  *work;      // Work handed to the worker, NULL when idle
+};
+
+struct StripeSet {
+    int     *fds;           // Member image descriptors
+    size_t  members;        // Amount of members
+    size_t  unit;           // Blocks per stripe unit
+    size_t  member_blocks;  // Capacity of every member in blocks
+
+    StripeSlot      *slots;     // One worker per member
+    size_t          pending;    // Queued works not completed yet
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  start;      // Signalled when work is queued or on shutdown
+    pthread_cond_t  done;       // Signalled when the last pending work completes
+    pthread_mutex_t dispatch;   // One parallel batch at a time, others run inline
+};
+
+// Share of a batch handed to one member
+struct StripeWork {
+    Disk         *disk;
+    int          fd;
+    bool         write;
+    DiskRequest  *requests;     // Member-local runs
+    size_t       count;
+    struct iovec *iov;          // Pieces of the caller's buffers
+    size_t       iovcnt;
+    off_t        next_offset;   // Byte right after the last run, to extend it
+    ssize_t      moved;
+};
+
+// Position of a logical block on its member
+static void stripe_map(const StripeSet *set, size_t block, size_t *member, size_t *member_block)
+{
+    size_t unit = block / set->unit;
+    *member = unit % set->members;
+    *member_block = (unit / set->members) * set->unit + block % set->unit;
+}
+
+// Appends one buffer piece at member byte offset, extending the last run when it is contiguous
+static void stripe_append(StripeWork *work, off_t offset, char *base, size_t len)
+{
+    DiskRequest *last = (work->count > 0) ? &work->requests[work->count - 1] : NULL;
+    if (last == NULL || work->next_offset != offset || last->iovcnt >= IOV_MAX) {
+        last = &work->requests[work->count++];
+        last->offset = offset;
+        last->iov    = &work->iov[work->iovcnt];
+        last->iovcnt = 0;
+    }
+    work->iov[work->iovcnt].iov_base = base;
+    work->iov[work->iovcnt].iov_len  = len;
+    work->iovcnt++;
+    last->iovcnt++;
+    work->next_offset = offset + (off_t)len;
+}
+
+static void *stripe_run(void *arg)
+{
+    StripeWork *work = arg;
+    work->moved = 0;
+    for (size_t i = 0; i < work->count; i++) {
+        ssize_t moved = disk_transfer(work->disk, work->fd, work->requests[i].iov,
+                                      work->requests[i].iovcnt, work->requests[i].offset, work->write);
+        if (moved < 0) {
+            work->moved = -1;
+            break;
+        }
+        work->moved += moved;
+    }
+    return NULL;
+}
+
+// Worker of one member: waits for queued work, runs it and reports completion
+static void *stripe_worker(void *arg)
+{
+    StripeSlot *slot = arg;
+    StripeSet *set = slot->set;
+    pthread_mutex_lock(&set->lock);
+    for (;;) {
+        while (!set->stop && slot->work == NULL) pthread_cond_wait(&set->start, &set->lock);
+        if (set->stop) break;
+        StripeWork *work = slot->work;
+        pthread_mutex_unlock(&set->lock);
+
+        stripe_run(work);
+
+        pthread_mutex_lock(&set->lock);
+        slot->work = NULL;
+        if (--set->pending == 0) pthread_cond_signal(&set->done);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return NULL;
+}
+
+static ssize_t stripe_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    StripeSet *set = disk->backend;
+    size_t unit_bytes = set->unit * BLOCK_SIZE;
+
+    // every piece is one caller iovec cut at stripe unit boundaries
+    size_t bound = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t bytes = 0;
+        for (int v = 0; v < requests[i].iovcnt; v++) bytes += requests[i].iov[v].iov_len;
+        bound += (size_t)requests[i].iovcnt + bytes / unit_bytes + 1;
+    }
+
+    // the member requests only live for this call, they come from the thread's arena
+    ArenaMark mark = arena_mark();
+    StripeWork *works = arena_alloc(set->members * sizeof(StripeWork));
+    struct iovec *iov = arena_alloc(set->members * bound * sizeof(struct iovec));
+    DiskRequest *runs = arena_alloc(set->members * bound * sizeof(DiskRequest));
+    if (works == NULL || iov == NULL || runs == NULL) {
+        perror("stripe_submit: failed to allocate the member requests");
+        arena_release(mark);
+        return -1;
+    }
+    memset(works, 0, set->members * sizeof(StripeWork));
+    for (size_t m = 0; m < set->members; m++) {
+        works[m].disk     = disk;
+        works[m].fd       = set->fds[m];
+        works[m].write    = write;
+        works[m].requests = &runs[m * bound];
+        works[m].iov      = &iov[m * bound];
+    }
+
+    // cut every request at stripe unit boundaries and route the pieces
+    for (size_t i = 0; i < count; i++) {
+        off_t pos = requests[i].offset;
+        for (int v = 0; v < requests[i].iovcnt; v++) {
+            char *base = requests[i].iov[v].iov_base;
+            size_t left = requests[i].iov[v].iov_len;
+            while (left > 0) {
+                size_t block = (size_t)pos / BLOCK_SIZE;
+                size_t to_boundary = unit_bytes - (size_t)pos % unit_bytes;
+                size_t len = (left < to_boundary) ? left : to_boundary;
+
+                size_t member, member_block;
+                stripe_map(set, block, &member, &member_block);
+                off_t offset = (off_t)member_block * BLOCK_SIZE + pos % BLOCK_SIZE;
+                stripe_append(&works[member], offset, base, len);
+
+                base += len;
+                pos  += (off_t)len;
+                left -= len;
+            }
+        }
+    }
+
+    // hand the busy members to their workers and serve the last one from the caller;
+    // when another batch owns the workers every member is served inline
+    size_t busy = 0, last = 0;
+    for (size_t m = 0; m < set->members; m++) {
+        if (works[m].count > 0) {
+            busy++;
+            last = m;
+        }
+    }
+    if (busy > 1 && set->slots != NULL && pthread_mutex_trylock(&set->dispatch) == 0) {
+        pthread_mutex_lock(&set->lock);
+        for (size_t m = 0; m < set->members; m++) {
+            if (works[m].count == 0 || m == last) continue;
+            set->slots[m].work = &works[m];
+            set->pending++;
+        }
+        pthread_cond_broadcast(&set->start);
+        pthread_mutex_unlock(&set->lock);
+
+        stripe_run(&works[last]);
+
+        pthread_mutex_lock(&set->lock);
+        while (set->pending > 0) pthread_cond_wait(&set->done, &set->lock);
+        pthread_mutex_unlock(&set->lock);
+        pthread_mutex_unlock(&set->dispatch);
+    } else {
+        for (size_t m = 0; m < set->members; m++) {
+            if (works[m].count > 0) stripe_run(&works[m]);
+        }
+    }
+
+    ssize_t total = 0;
+    for (size_t m = 0; m < set->members; m++) {
+        if (works[m].count == 0) continue;
+        if (works[m].moved < 0 || total < 0) total = -1;
+        else total += works[m].moved;
+    }
+
+    arena_release(mark);
+    return total;
+}
+
+static bool stripe_sync(Disk *disk)
+{
+    StripeSet *set = disk->backend;
+    bool ok = true;
+    for (size_t m = 0; m < set->members; m++) {
+        disk_stats_syscalls(disk, 1);
+        if (fsync(set->fds[m]) < 0) {
+            perror("disk_sync: fsync of a stripe member failed");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Punches the logical range out of every member, merging the units a member holds back to back
+static bool stripe_discard(Disk *disk, size_t block, size_t count)
+{
+    StripeSet *set = disk->backend;
+    size_t start[set->members], length[set->members];
+    memset(length, 0, sizeof(length));
+    bool ok = true;
+
+    size_t end = block + count;
+    while (block < end && ok) {
+        size_t len = set->unit - block % set->unit;
+        if (len > end - block) len = end - block;
+        size_t member, member_block;
+        stripe_map(set, block, &member, &member_block);
+
+        if (length[member] > 0 && start[member] + length[member] != member_block) {
+            disk_stats_syscalls(disk, 1);
+            ok = fallocate(set->fds[member], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           (off_t)start[member] * BLOCK_SIZE, (off_t)length[member] * BLOCK_SIZE) == 0;
+            length[member] = 0;
+        }
+        if (length[member] == 0) start[member] = member_block;
+        length[member] += len;
+        block += len;
+    }
+    for (size_t m = 0; m < set->members && ok; m++) {
+        if (length[m] == 0) continue;
+        disk_stats_syscalls(disk, 1);
+        ok = fallocate(set->fds[m], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       (off_t)start[m] * BLOCK_SIZE, (off_t)length[m] * BLOCK_SIZE) == 0;
+    }
+    return ok;
+}
+
+// Stops and joins the workers, the set falls back to serving members inline
+static void stripe_stop_workers(StripeSet *set)
+{
+    if (set->slots == NULL) return;
+    pthread_mutex_lock(&set->lock);
+    set->stop = true;
+    pthread_cond_broadcast(&set->start);
+    pthread_mutex_unlock(&set->lock);
+    for (size_t m = 0; m < set->members; m++) {
+        if (set->slots[m].running) pthread_join(set->slots[m].thread, NULL);
+    }
+    free(set->slots);
+    set->slots = NULL;
+}
+
+static bool stripe_start_workers(StripeSet *set)
+{
+    set->slots = calloc(set->members, sizeof(StripeSlot));
+    if (set->slots == NULL) return false;
+    for (size_t m = 0; m < set->members; m++) {
+        set->slots[m].set    = set;
+        set->slots[m].member = m;
+        set->slots[m].running = pthread_create(&set->slots[m].thread, NULL, stripe_worker, &set->slots[m]) == 0;
+        if (!set->slots[m].running) {
+            stripe_stop_workers(set);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void stripe_release(StripeSet *set)
+{
+    stripe_stop_workers(set);
+    pthread_mutex_destroy(&set->lock);
+    pthread_mutex_destroy(&set->dispatch);
+    pthread_cond_destroy(&set->start);
+    pthread_cond_destroy(&set->done);
+    for (size_t m = 0; m < set->members; m++) {
+        if (set->fds[m] >= 0 && close(set->fds[m]) < 0) {
+            perror("disk_close: Error closing a stripe member");
+        }
+    }
+    free(set->fds);
+    free(set);
+}
+
+static void stripe_fini(Disk *disk)
+{
+    if (disk->backend == NULL) return;
+    stripe_release(disk->backend);
+    disk->backend = NULL;
+}
+
+const DiskOps disk_stripe_ops = {
+    .name      = "stripe",
+    .init      = NULL,
+    .submit    = stripe_submit,
+    .sync      = stripe_sync,
+    .block_ptr = NULL,
+    .discard   = stripe_discard,
+    .fini      = stripe_fini,
+};
+
+/* Opens a disk of `blocks` logical blocks striped over the member images in units of
+ * stripe_blocks blocks. Every member is created/resized to hold its share. */
+Disk * disk_open_striped(const char **paths, size_t members, size_t blocks, size_t stripe_blocks)
+{
+    if (paths == NULL || members == 0 || stripe_blocks == 0 || blocks == 0) {
+        fprintf(stderr, "disk_open_striped: Error invalid member list or stripe unit\n");
+        return NULL;
+    }
+
+    StripeSet *set = calloc(1, sizeof(StripeSet));
+    if (set == NULL) return NULL;
+    set->fds = malloc(members * sizeof(int));
+    if (set->fds == NULL) {
+        free(set);
+        return NULL;
+    }
+    set->members = members;
+    set->unit    = stripe_blocks;
+    size_t units = (blocks + stripe_blocks - 1) / stripe_blocks;
+    set->member_blocks = ((units + members - 1) / members) * stripe_blocks;
+    for (size_t m = 0; m < members; m++) set->fds[m] = -1;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_mutex_init(&set->dispatch, NULL);
+    pthread_cond_init(&set->start, NULL);
+    pthread_cond_init(&set->done, NULL);
+
+    for (size_t m = 0; m < members; m++) {
+        set->fds[m] = open(paths[m], O_RDWR | O_CREAT, 0666);
+        if (set->fds[m] < 0 || ftruncate(set->fds[m], (off_t)set->member_blocks * BLOCK_SIZE) < 0) {
+            fprintf(stderr, "disk_open_striped: failed to set up member %s: %s\n", paths[m], strerror(errno));
+            stripe_release(set);
+            return NULL;
+        }
+    }
+
+    if (members > 1 && !stripe_start_workers(set)) {
+        fprintf(stderr, "disk_open_striped: worker threads are unavailable, members are served one by one\n");
+    }
+
+    Disk *disk = disk_create(blocks, &disk_stripe_ops, set);
+    if (disk == NULL) {
+        stripe_release(set);
+        return NULL;
+    }
+    disk->stripe_width = stripe_blocks * members;
+    return disk;
+}
@@ -0,0 +1,240 @@
+#include "disk.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* io_uring Disk Backend
+ * A whole batch of block requests is queued on the submission ring and handed
+ * to the kernel with a single io_uring_enter, then all completions are reaped
+ * together. The rings are driven through the raw system calls so no extra
+ * library is needed. */
+
+typedef struct Uring Uring;
+struct Uring {
+    int      ring_fd;               // io_uring instance
+    void     *sq_ring;              // Submission ring mapping
+    size_t   sq_ring_size;
+    void     *cq_ring;              // Completion ring mapping (may alias sq_ring)
+    size_t   cq_ring_size;
+    struct io_uring_sqe *sqes;      // Submission queue entries
+    size_t   sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t lock;           // One batch in flight per ring
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap(Uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->ring_fd >= 0) close(ring->ring_fd);
+}
+
+static bool uring_init(Disk *disk)
+{
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (ring == NULL) return false;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = uring_setup(DISK_MAX_IOV, &params);
+    if (ring->ring_fd < 0) {
+        perror("uring_init: io_uring_setup failed");
+        free(ring);
+        return false;
+    }
+
+    // map the rings, newer kernels share one mapping for both of them
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        perror("uring_init: mapping the submission ring failed");
+        uring_unmap(ring);
+        free(ring);
+        return false;
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+        ring->cq_ring_size = ring->sq_ring_size;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            perror("uring_init: mapping the completion ring failed");
+            uring_unmap(ring);
+            free(ring);
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("uring_init: mapping the submission entries failed");
+        uring_unmap(ring);
+        free(ring);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    disk->backend = ring;
+    return true;
+}
+
+static void uring_fini(Disk *disk)
+{
+    Uring *ring = disk->backend;
+    if (ring == NULL) return;
+    uring_unmap(ring);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+    disk->backend = NULL;
+}
+
+// Finishes a request the kernel only partially served, skipping the moved bytes
+static ssize_t uring_finish_short(Disk *disk, DiskRequest *request, size_t moved, bool write)
+{
+    DiskRequest rest = *request;
+    rest.offset += moved;
+    while (rest.iovcnt > 0 && moved >= rest.iov->iov_len) {
+        moved -= rest.iov->iov_len;
+        rest.iov++;
+        rest.iovcnt--;
+    }
+    if (rest.iovcnt > 0) {
+        rest.iov->iov_base = (char *)rest.iov->iov_base + moved;
+        rest.iov->iov_len -= moved;
+    }
+    return disk_file_ops.submit(disk, &rest, 1, write);
+}
+
+static ssize_t uring_submit(Disk *disk, DiskRequest *requests, size_t count, bool write)
+{
+    Uring *ring = disk->backend;
+    if (count == 0) return 0;
+
+    // remember how large every request is, short completions are resumed synchronously
+    size_t expected[DISK_MAX_IOV];
+    for (size_t i = 0; i < count; i++) {
+        expected[i] = 0;
+        for (int v = 0; v < requests[i].iovcnt; v++) expected[i] += requests[i].iov[v].iov_len;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+
+    // queue the whole batch
+    unsigned tail = *ring->sq_tail;
+    for (size_t i = 0; i < count; i++) {
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd        = disk->fd;
+        sqe->addr      = (uint64_t)(uintptr_t)requests[i].iov;
+        sqe->len       = (uint32_t)requests[i].iovcnt;
+        sqe->off       = (uint64_t)requests[i].offset;
+        sqe->user_data = i;
+        ring->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // submit and reap until every submitted request has completed
+    size_t to_submit = count;
+    size_t submitted = 0;
+    size_t completed = 0;
+    ssize_t total = 0;
+    bool failed = false;
+    while (to_submit > 0 || completed < submitted) {
+        int ret = uring_enter(ring->ring_fd, (unsigned)to_submit, 1, IORING_ENTER_GETEVENTS);
+        disk_stats_syscalls(disk, 1);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("uring_submit: io_uring_enter failed");
+            failed = true;
+            // drop what the kernel did not take so nothing points at the caller's buffers later
+            __atomic_store_n(ring->sq_tail, __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            to_submit = 0;
+            continue;
+        }
+        submitted += (size_t)ret;
+        to_submit -= (size_t)ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned ctail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != ctail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t i = (size_t)cqe->user_data;
+            if (cqe->res < 0) {
+                fprintf(stderr, "uring_submit: %s of %zu bytes at offset %lld failed: %s\n",
+                        write ? "write" : "read", expected[i], (long long)requests[i].offset, strerror(-cqe->res));
+                failed = true;
+            } else if ((size_t)cqe->res < expected[i]) {
+                ssize_t rest = uring_finish_short(disk, &requests[i], (size_t)cqe->res, write);
+                if (rest < 0) failed = true;
+                else total += cqe->res + rest;
+            } else {
+                total += cqe->res;
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&ring->lock);
+    return failed ? -1 : total;
+}
+
+static bool uring_sync(Disk *disk)
+{
+    return disk_file_ops.sync(disk);
+}
+
+const DiskOps disk_uring_ops = {
+    .name      = "uring",
+    .init      = uring_init,
+    .submit    = uring_submit,
+    .sync      = uring_sync,
+    .block_ptr = NULL,
+    .discard   = NULL,
+    .fini      = uring_fini,
+};
@@ -0,0 +1,501 @@
+#include "extent_tree.h"
+#include "fs.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Extent tree
+ * The extents of a file that do not fit in its inode live in a B+tree rooted at
+ * the inode's extent_block. Leaves hold extents tagged with the logical block
+ * they start at, index nodes hold the first logical block and the block of each
+ * child, and every node records the logical range mapped below it, so a lookup
+ * descends one node per level with a binary search in each and the end of the
+ * file is known from the root alone. Logical blocks between two extents are a
+ * hole. A new extent goes to the leaf its logical block belongs to and is merged
+ * with a neighbour it continues both in the file and on disk. A full node is
+ * split in half, except at the very end of the tree, where an appended file
+ * would leave every leaf half full: there the new entry starts an empty right
+ * sibling. When the root itself is split the tree grows a level. Nodes go
+ * through disk_read/disk_write, so hot ones stay in the buffer cache. */
+
+static bool extent_node_valid(const ExtentNode *node, uint32_t block)
+{
+    uint32_t capacity = (node->header.level == 0) ? EXTENT_LEAF_ENTRIES : EXTENT_INDEX_ENTRIES;
+    if (node->header.magic != EXTENT_NODE_MAGIC || node->header.count > capacity ||
+        node->header.level >= EXTENT_TREE_LEVELS) {
+        fprintf(stderr, "extent_tree: Error block %u is not a valid extent tree node\n", block);
+        return false;
+    }
+    return true;
+}
+
+// Read-only view of a node, see fs_block_view. NULL on failure.
+static const ExtentNode *extent_node_view(FileSystem *fs, uint32_t block, ExtentNode *scratch)
+{
+    const Block *view = fs_block_view(fs, block, (Block *)scratch);
+    if (view == NULL) {
+        fprintf(stderr, "extent_tree: Error reading node %u has failed\n", block);
+        return NULL;
+    }
+    const ExtentNode *node = (const ExtentNode *)view->data;
+    return extent_node_valid(node, block) ? node : NULL;
+}
+
+// Writable copy of a node in a buffer from the disk pool
+static bool extent_node_read(FileSystem *fs, uint32_t block, ExtentNode *node)
+{
+    if (disk_read(fs->disk, block, (char *)node) < 0) {
+        fprintf(stderr, "extent_tree: Error reading node %u has failed\n", block);
+        return false;
+    }
+    return extent_node_valid(node, block);
+}
+
+static bool extent_node_write(FileSystem *fs, uint32_t block, ExtentNode *node)
+{
+    if (disk_write(fs->disk, block, (char *)node) < 0) {
+        fprintf(stderr, "extent_tree: Error writing node %u has failed\n", block);
+        return false;
+    }
+    return true;
+}
+
+// Sets up an empty node of level
+static void extent_node_init(ExtentNode *node, uint16_t level)
+{
+    memset(node, 0, BLOCK_SIZE);
+    node->header.magic = EXTENT_NODE_MAGIC;
+    node->header.level = level;
+}
+
+// Logical range of a leaf from its extents
+static void extent_leaf_bounds(ExtentNode *leaf)
+{
+    uint32_t count = leaf->header.count;
+    leaf->header.first = (count > 0) ? leaf->extents[0].logical : 0;
+    leaf->header.end = (count > 0) ? leaf->extents[count - 1].logical + leaf->extents[count - 1].length : 0;
+}
+
+// Extents of a leaf starting before logical_block, which is where an extent starting there goes
+static uint32_t extent_leaf_position(const ExtentNode *leaf, uint32_t logical_block)
+{
+    uint32_t low = 0, high = leaf->header.count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (leaf->extents[middle].logical < logical_block) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Child of an index node logical_block belongs to: the last one starting at or before it
+static uint32_t extent_index_child(const ExtentNode *node, uint32_t logical_block)
+{
+    uint32_t low = 1, high = node->header.count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (node->index[middle].first <= logical_block) low = middle + 1;
+        else high = middle;
+    }
+    return low - 1;
+}
+
+// End of the range mapped below the node at block, 0 when it cannot be read
+static uint32_t extent_node_end(FileSystem *fs, uint32_t block)
+{
+    ExtentNode *scratch = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (scratch == NULL) return 0;
+    const ExtentNode *node = extent_node_view(fs, block, scratch);
+    uint32_t end = (node != NULL) ? node->header.end : 0;
+    disk_buffer_put(fs->disk, (char *)scratch);
+    return end;
+}
+
+// First tree for an inode: a single leaf
+static bool extent_tree_create(FileSystem *fs, Inode *inode, Extent extent)
+{
+    Extent root = fs_allocate(fs, 1, 0);
+    if (root.start == 0) {
+        fprintf(stderr, "extent_tree_insert: Error allocating the root node has failed\n");
+        return false;
+    }
+    ExtentNode *node = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (node == NULL) {
+        perror("extent_tree_insert: Error borrowing a block buffer has failed");
+        set_bit(fs->bitmap->bits, root.start, 0);
+        return false;
+    }
+    extent_node_init(node, 0);
+    node->extents[0] = extent;
+    node->header.count = 1;
+    extent_leaf_bounds(node);
+    bool written = extent_node_write(fs, root.start, node);
+    disk_buffer_put(fs->disk, (char *)node);
+    if (!written) {
+        set_bit(fs->bitmap->bits, root.start, 0);
+        return false;
+    }
+    inode->extent_block = root.start;
+    inode->extent_count++;
+    return true;
+}
+
+// Puts entry (an Extent in a leaf, an ExtentIndex otherwise) at position of a full
+// node, moving the upper half of the node into sibling. When the entry goes after
+// the last one of the tree it starts the sibling on its own instead.
+static void extent_node_split(ExtentNode *node, ExtentNode *sibling, uint32_t position, const void *entry, bool rightmost)
+{
+    bool leaf = (node->header.level == 0);
+    size_t size = leaf ? sizeof(Extent) : sizeof(ExtentIndex);
+    uint32_t count = node->header.count;
+    uint32_t keep = (rightmost && position == count) ? count : count / 2;
+
+    extent_node_init(sibling, node->header.level);
+    char *entries = leaf ? (char *)node->extents : (char *)node->index;
+    char *moved = leaf ? (char *)sibling->extents : (char *)sibling->index;
+    memcpy(moved, entries + keep * size, (count - keep) * size);
+    sibling->header.count = count - keep;
+    node->header.count = keep;
+
+    // both halves have room now, the entry goes into the one it belongs to
+    ExtentNode *target = node;
+    if (position > keep || keep == count) {
+        target = sibling;
+        position -= keep;
+    }
+    char *slots = leaf ? (char *)target->extents : (char *)target->index;
+    memmove(slots + (position + 1) * size, slots + position * size, (target->header.count - position) * size);
+    memcpy(slots + position * size, entry, size);
+    target->header.count++;
+}
+
+// End of the range mapped below the child at block of an index node being split:
+// the nodes of the insert are not written yet, so one of them is taken from memory
+static uint32_t extent_child_end(FileSystem *fs, uint32_t block, ExtentNode *const *nodes, const uint32_t *blocks, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i] == block) return nodes[i]->header.end;
+    }
+    return extent_node_end(fs, block);
+}
+
+// Inserts into the tree whose path (root first) to the leaf extent belongs to is
+// loaded in path, slot holding the child taken at each index node. Every node is
+// changed in memory first. The new nodes are written before anything refers to
+// them, then the path from the leaf up, so no node is written before every node
+// below it is. When a write fails the nodes of the path written already get their
+// old contents back and the new nodes are freed, the tree stays as it was.
+static bool extent_tree_insert_path(FileSystem *fs, Inode *inode, ExtentNode **path, const uint32_t *blocks,
+                                    const uint32_t *slot, size_t depth, Extent extent)
+{
+    ExtentNode *leaf = path[depth - 1];
+    uint32_t count = leaf->header.count;
+    uint32_t position = extent_leaf_position(leaf, extent.logical);
+    Extent *left = (position > 0) ? &leaf->extents[position - 1] : NULL;
+    Extent *right = (position < count) ? &leaf->extents[position] : NULL;
+    uint32_t end = extent.logical + extent.length;
+    if ((left != NULL && left->logical + left->length > extent.logical) || (right != NULL && end > right->logical)) {
+        fprintf(stderr, "extent_tree_insert: Error blocks %u..%u are mapped already\n", extent.logical, end - 1);
+        return false;
+    }
+    bool join_left = (left != NULL && left->logical + left->length == extent.logical &&
+                      left->start + left->length == extent.start);
+    bool join_right = (right != NULL && end == right->logical && extent.start + extent.length == right->start);
+
+    // full nodes from the leaf up are split, a split root gets a new root above it
+    size_t full = 0;
+    if (!join_left && !join_right && count == EXTENT_LEAF_ENTRIES) {
+        full = 1;
+        while (full < depth && path[depth - 1 - full]->header.count == EXTENT_INDEX_ENTRIES) full++;
+    }
+    if (full == depth && depth + 1 > EXTENT_TREE_LEVELS) {
+        fprintf(stderr, "extent_tree_insert: Error the tree is %zu levels deep already\n", depth);
+        return false;
+    }
+    size_t fresh_count = full + (full == depth ? 1 : 0);
+    uint32_t fresh[EXTENT_TREE_LEVELS + 1];
+    for (size_t i = 0; i < fresh_count; i++) {
+        Extent node = fs_allocate(fs, 1, 0);
+        if (node.start == 0) {
+            fprintf(stderr, "extent_tree_insert: Error allocating a node has failed\n");
+            for (size_t j = 0; j < i; j++) set_bit(fs->bitmap->bits, fresh[j], 0);
+            return false;
+        }
+        fresh[i] = node.start;
+    }
+
+    // the new nodes (a sibling per split level, then the new root) and a copy of
+    // every node of the path but the root to put back
+    ExtentNode *nodes[EXTENT_TREE_LEVELS + 1] = { NULL };
+    ExtentNode *saved[EXTENT_TREE_LEVELS] = { NULL };
+    bool borrowed = true;
+    for (size_t i = 0; i < fresh_count && borrowed; i++) {
+        nodes[i] = (ExtentNode *)disk_buffer_get(fs->disk);
+        borrowed = nodes[i] != NULL;
+    }
+    for (size_t d = 1; d < depth && borrowed; d++) {
+        saved[d] = (ExtentNode *)disk_buffer_get(fs->disk);
+        borrowed = saved[d] != NULL;
+        if (borrowed) memcpy(saved[d], path[d], BLOCK_SIZE);
+    }
+    uint32_t extent_count = inode->extent_count;
+    bool written = borrowed;
+    if (!borrowed) perror("extent_tree_insert: Error borrowing a block buffer has failed");
+
+    bool rightmost = true;
+    for (size_t d = 0; d + 1 < depth; d++) rightmost = rightmost && slot[d] + 1 == path[d]->header.count;
+
+    // the leaf
+    ExtentIndex pending = { 0, 0 };
+    if (!written) {
+        // nothing is changed
+    } else if (join_left && join_right) {
+        left->length += extent.length + right->length;
+        memmove(right, right + 1, (count - position - 1) * sizeof(Extent));
+        leaf->header.count--;
+        inode->extent_count--;
+    } else if (join_left) {
+        left->length += extent.length;
+    } else if (join_right) {
+        right->start = extent.start;
+        right->logical = extent.logical;
+        right->length += extent.length;
+    } else if (full == 0) {
+        memmove(&leaf->extents[position + 1], &leaf->extents[position], (count - position) * sizeof(Extent));
+        leaf->extents[position] = extent;
+        leaf->header.count++;
+        inode->extent_count++;
+    } else {
+        extent_node_split(leaf, nodes[0], position, &extent, rightmost);
+        extent_leaf_bounds(nodes[0]);
+        pending = (ExtentIndex){ nodes[0]->header.first, fresh[0] };
+        inode->extent_count++;
+    }
+    extent_leaf_bounds(leaf);
+
+    // the index nodes above, bottom up: the child taken may start elsewhere now,
+    // and the sibling split off below it needs an entry of its own
+    for (size_t d = depth - 1; written && d-- > 0; ) {
+        ExtentNode *node = path[d];
+        size_t level = depth - 1 - d;
+        node->index[slot[d]].first = path[d + 1]->header.first;
+        if (end > node->header.end) node->header.end = end;
+        if (level < full) {
+            ExtentNode *sibling = nodes[level];
+            extent_node_split(node, sibling, slot[d] + 1, &pending, rightmost);
+            sibling->header.first = sibling->index[0].first;
+            sibling->header.end = node->header.end;
+            uint32_t last = node->index[node->header.count - 1].block;
+            node->header.end = (last == blocks[d + 1]) ? path[d + 1]->header.end
+                                                       : extent_child_end(fs, last, nodes, fresh, level);
+            pending = (ExtentIndex){ sibling->header.first, fresh[level] };
+        } else if (level == full && full > 0) {
+            uint32_t at = slot[d] + 1;
+            memmove(&node->index[at + 1], &node->index[at], (node->header.count - at) * sizeof(ExtentIndex));
+            node->index[at] = pending;
+            node->header.count++;
+        }
+        node->header.first = node->index[0].first;
+    }
+    if (written && full == depth) {
+        // the root was split too, the tree grows a level
+        ExtentNode *root = path[0];
+        ExtentNode *grown = nodes[full];
+        uint32_t pending_end = nodes[full - 1]->header.end;
+        extent_node_init(grown, (uint16_t)(root->header.level + 1));
+        grown->index[0] = (ExtentIndex){ root->header.first, blocks[0] };
+        grown->index[1] = pending;
+        grown->header.count = 2;
+        grown->header.first = root->header.first;
+        grown->header.end = (pending_end > root->header.end) ? pending_end : root->header.end;
+    }
+
+    for (size_t i = 0; i < fresh_count && written; i++) written = extent_node_write(fs, fresh[i], nodes[i]);
+    size_t rewritten = depth;   // path nodes from here on are written
+    while (written && rewritten > 0) {
+        written = extent_node_write(fs, blocks[rewritten - 1], path[rewritten - 1]);
+        if (written) rewritten--;
+    }
+
+    if (written) {
+        if (full == depth) inode->extent_block = fresh[full];
+    } else {
+        for (size_t d = rewritten; d < depth && borrowed; d++) {
+            if (!extent_node_write(fs, blocks[d], saved[d])) {
+                fprintf(stderr, "extent_tree_insert: Error node %u could not be restored\n", blocks[d]);
+            }
+        }
+        for (size_t i = 0; i < fresh_count; i++) set_bit(fs->bitmap->bits, fresh[i], 0);
+        inode->extent_count = extent_count;
+    }
+    for (size_t i = 0; i < fresh_count; i++) {
+        if (nodes[i] != NULL) disk_buffer_put(fs->disk, (char *)nodes[i]);
+    }
+    for (size_t d = 1; d < depth; d++) {
+        if (saved[d] != NULL) disk_buffer_put(fs->disk, (char *)saved[d]);
+    }
+    return written;
+}
+
+/* Adds extent to the extent tree of an inode in logical order, merged with a
+ * neighbour it continues both in the file and on disk, and keeps extent_count in
+ * step. The tree is created on first use. Fails for blocks mapped already. */
+bool extent_tree_insert(FileSystem *fs, Inode *inode, Extent extent)
+{
+    if (inode->extent_block == 0) return extent_tree_create(fs, inode, extent);
+
+    ExtentNode *path[EXTENT_TREE_LEVELS];
+    uint32_t blocks[EXTENT_TREE_LEVELS];
+    uint32_t slot[EXTENT_TREE_LEVELS];
+    size_t depth = 0;
+    uint32_t block = inode->extent_block;
+    bool loaded = false;
+    while (depth < EXTENT_TREE_LEVELS) {
+        ExtentNode *node = (ExtentNode *)disk_buffer_get(fs->disk);
+        if (node == NULL) {
+            perror("extent_tree_insert: Error borrowing a block buffer has failed");
+            break;
+        }
+        path[depth] = node;
+        blocks[depth] = block;
+        depth++;
+        if (!extent_node_read(fs, block, node)) break;
+        if (depth > 1 && node->header.level + 1 != path[depth - 2]->header.level) {
+            fprintf(stderr, "extent_tree_insert: Error node %u is on the wrong level\n", block);
+            break;
+        }
+        if (node->header.level == 0) {
+            loaded = true;
+            break;
+        }
+        if (node->header.count == 0) {
+            fprintf(stderr, "extent_tree_insert: Error index node %u is empty\n", block);
+            break;
+        }
+        slot[depth - 1] = extent_index_child(node, extent.logical);
+        block = node->index[slot[depth - 1]].block;
+    }
+    bool inserted = loaded && extent_tree_insert_path(fs, inode, path, blocks, slot, depth, extent);
+    for (size_t i = 0; i < depth; i++) disk_buffer_put(fs->disk, (char *)path[i]);
+    return inserted;
+}
+
+/* Physical block of logical_block in the tree rooted at root and through run (when
+ * not NULL) the blocks left in its extent. 0 for a block the tree does not map, run
+ * is then the length of the hole up to the next extent, or 0 past the last one. */
+uint32_t extent_tree_run(FileSystem *fs, uint32_t root, uint32_t logical_block, uint32_t *run)
+{
+    if (run != NULL) *run = 0;
+    ExtentNode *scratch = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (scratch == NULL) {
+        perror("extent_tree_run: Error borrowing a block buffer has failed");
+        return 0;
+    }
+    uint32_t found = 0;
+    uint32_t next = 0;      // first logical block mapped after the subtree descended into, 0 for none
+    uint32_t block = root;
+    for (size_t depth = 0; depth < EXTENT_TREE_LEVELS; depth++) {
+        const ExtentNode *node = extent_node_view(fs, block, scratch);
+        if (node == NULL || node->header.count == 0) break;
+        if (depth == 0 && logical_block >= node->header.end) break;   // past the last extent
+        if (node->header.level == 0) {
+            uint32_t position = extent_leaf_position(node, logical_block + 1);
+            const Extent *extent = (position > 0) ? &node->extents[position - 1] : NULL;
+            if (extent != NULL && logical_block < extent->logical + extent->length) {
+                if (run != NULL) *run = extent->logical + extent->length - logical_block;
+                found = extent->start + (logical_block - extent->logical);
+            } else {
+                if (position < node->header.count) next = node->extents[position].logical;
+                if (run != NULL && next != 0) *run = next - logical_block;
+            }
+            break;
+        }
+        uint32_t child = extent_index_child(node, logical_block);
+        if (child + 1 < node->header.count) next = node->index[child + 1].first;
+        block = node->index[child].block;
+    }
+    disk_buffer_put(fs->disk, (char *)scratch);
+    return found;
+}
+
+/* Last extent of the tree rooted at root and the logical block after it */
+bool extent_tree_last(FileSystem *fs, uint32_t root, Extent *last, uint32_t *end)
+{
+    ExtentNode *scratch = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (scratch == NULL) {
+        perror("extent_tree_last: Error borrowing a block buffer has failed");
+        return false;
+    }
+    bool found = false;
+    uint32_t block = root;
+    for (size_t depth = 0; depth < EXTENT_TREE_LEVELS; depth++) {
+        const ExtentNode *node = extent_node_view(fs, block, scratch);
+        if (node == NULL || node->header.count == 0) break;
+        if (depth == 0 && end != NULL) *end = node->header.end;
+        if (node->header.level == 0) {
+            if (last != NULL) *last = node->extents[node->header.count - 1];
+            found = true;
+            break;
+        }
+        block = node->index[node->header.count - 1].block;
+    }
+    disk_buffer_put(fs->disk, (char *)scratch);
+    return found;
+}
+
+static bool extent_node_walk_depth(FileSystem *fs, const ExtentNode *node, ExtentVisitor visit, void *arg, size_t depth)
+{
+    if (node->header.level == 0) {
+        for (uint32_t i = 0; i < node->header.count; i++) {
+            if (!visit(fs, arg, node->extents[i], false)) return false;
+        }
+        return true;
+    }
+    if (depth + 1 >= EXTENT_TREE_LEVELS) {
+        fprintf(stderr, "extent_tree: Error the tree is deeper than %d levels\n", EXTENT_TREE_LEVELS);
+        return false;
+    }
+    ExtentNode *scratch = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (scratch == NULL) {
+        perror("extent_tree: Error borrowing a block buffer has failed");
+        return false;
+    }
+    bool walked = true;
+    for (uint32_t i = 0; i < node->header.count && walked; i++) {
+        uint32_t block = node->index[i].block;
+        walked = visit(fs, arg, (Extent){ block, 1, 0 }, true);
+        const ExtentNode *child = walked ? extent_node_view(fs, block, scratch) : NULL;
+        if (child != NULL && child->header.level + 1 != node->header.level) {
+            fprintf(stderr, "extent_tree: Error node %u is on the wrong level\n", block);
+            child = NULL;
+        }
+        walked = child != NULL && extent_node_walk_depth(fs, child, visit, arg, depth + 1);
+    }
+    disk_buffer_put(fs->disk, (char *)scratch);
+    return walked;
+}
+
+/* Visits the extents below a node already in memory in logical order, and the
+ * blocks of the nodes under it. False when a node cannot be read or is not valid,
+ * or when visit stops the walk. */
+bool extent_node_walk(FileSystem *fs, const ExtentNode *node, ExtentVisitor visit, void *arg)
+{
+    if (!extent_node_valid(node, 0)) return false;
+    return extent_node_walk_depth(fs, node, visit, arg, 0);
+}
+
+/* Visits the root block, every other node block and every extent of the tree
+ * rooted at root, see extent_node_walk */
+bool extent_tree_walk(FileSystem *fs, uint32_t root, ExtentVisitor visit, void *arg)
+{
+    if (!visit(fs, arg, (Extent){ root, 1, 0 }, true)) return false;
+    ExtentNode *scratch = (ExtentNode *)disk_buffer_get(fs->disk);
+    if (scratch == NULL) {
+        perror("extent_tree_walk: Error borrowing a block buffer has failed");
+        return false;
+    }
+    const ExtentNode *node = extent_node_view(fs, root, scratch);
+    bool walked = node != NULL && extent_node_walk_depth(fs, node, visit, arg, 0);
+    disk_buffer_put(fs->disk, (char *)scratch);
+    return walked;
+}
@@ -24,7 +24,7 @@ void fs_debug(FileSystem *fs) {
 
     printf("SuperBlock\n");
     SuperBlock *super = fs->meta_data;
-    bool magic_number = (super->magic_number == 0xf0f03410);
+    bool magic_number = (super->magic_number == MAGIC_NUMBER);
     printf("\tMagic Number is %s\n", (magic_number) ? "Valid" : "Invalid");
     printf("\tTotal Blocks: %d\n", super->blocks);
     printf("\tInode Blocks: %d\n", super->inode_blocks);
@@ -96,14 +96,17 @@ bool fs_format(Disk *disk)
         return false;
     }
 
-    // Clean the inode table
-    for (uint32_t i = 1; i <= superblock.inode_blocks; i++) {
-        if (disk_write(disk, i, block_buffer.data) < 0) {
-            perror("fs_format: Failed to clear inode table blocks");
-            return false;
-        }
+    // Clean the inode table, without writing it out when the image can be zeroed in place
+    if (!disk_zero(disk, 1, superblock.inode_blocks)) {
+        perror("fs_format: Failed to clear inode table blocks");
+        return false;
     }
 
+    // Give the data region of a previous format back to the host, the image stays sparse
+    // (best effort, stale data blocks are unreachable once the bitmap is clear anyway)
+    size_t data_start = superblock.inode_blocks + superblock.bitmap_blocks + 2;
+    disk_discard(disk, data_start, superblock.blocks - data_start);
+
     // Set The Inode 0 as root dir
     Block buffer;
     memset(buffer.data, 0, BLOCK_SIZE);
@@ -119,6 +122,44 @@ bool fs_format(Disk *disk)
     return true;
 }
 
+// Names the layouts fs_migrate converts from, NULL for any other magic number
+const char *fs_older_format(uint32_t magic_number)
+{
+    switch (magic_number) {
+    case MAGIC_NUMBER_V0: return "the original format with 40-byte inodes";
+    case MAGIC_NUMBER_V1: return "inline data and a single overflow extent block";
+    case MAGIC_NUMBER_V2: return "extents without logical blocks";
+    default:              return NULL;
+    }
+}
+
+// Extent tree visitor marking the extents and the nodes as used
+static bool mount_mark_extent(FileSystem *fs, void *arg, Extent extent, bool node)
+{
+    (void)arg; (void)node;
+    for (uint32_t e = 0; e < extent.length; e++) {
+        set_bit(fs->bitmap->bits, extent.start + e, 1);
+    }
+    return true;
+}
+
+// Reads a batch of extent tree roots in one request and marks everything below them as used
+static bool mount_mark_extent_blocks(FileSystem *fs, BlockVec *queued, size_t count)
+{
+    if (disk_readv(fs->disk, queued, count) < 0) {
+        perror("fs_mount: Error reading from disk has failed");
+        return false;
+    }
+    for (size_t q = 0; q < count; q++)
+    {
+        if (!extent_node_walk(fs, (const ExtentNode *)queued[q].data, mount_mark_extent, NULL)) {
+            fprintf(stderr, "fs_mount: Error extent tree at block %u is damaged\n", (uint32_t)queued[q].block);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool fs_mount(FileSystem *fs, Disk *disk) {
     if (fs == NULL || disk == NULL) {
         perror("fs_mount: Error fs or disk is invalid (NULL)"); 
@@ -136,6 +177,11 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
     }
 
     SuperBlock superblock = block_buffer.super;
+    if (fs_older_format(superblock.magic_number) != NULL) {
+        fprintf(stderr, "fs_mount: Error Disk has an older format (0x%x, %s), mount it with fs_migrate to convert it.\n",
+                superblock.magic_number, fs_older_format(superblock.magic_number));
+        return false;
+    }
     if (superblock.magic_number != MAGIC_NUMBER) {
         fprintf(stderr, 
                 "fs_mount: Error Disk magic number (0x%x) is invalid. Expected (0x%x).\n"
@@ -150,6 +196,18 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
     }
 
     fs->disk = disk;
+    fs->discard = NULL;
+    fs->icache = NULL;
+    fs->dcache = NULL;
+    fs->writeback = NULL;
+    fs->delalloc = NULL;
+
+    // recursive, so the directory code can call fs_write while holding it
+    pthread_mutexattr_t lock_attr;
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs->lock, &lock_attr);
+    pthread_mutexattr_destroy(&lock_attr);
     // Allocate memory for the SuperBlock metadata and copy it
     fs->meta_data = (SuperBlock *)malloc(sizeof(SuperBlock));
     if (fs->meta_data == NULL) return false;
@@ -168,7 +226,7 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
         free(fs->meta_data);
         return false;
     }
-    fs->bitmap->bits = calloc(bitmap_words, sizeof(uint32_t));
+    fs->bitmap->bits = aligned_alloc(DISK_ALIGNMENT, bitmap_words * sizeof(uint32_t));
     if (fs->bitmap->bits == NULL) {
         perror("fs_mount: Failed to allocate bitmap array");
         free(fs->bitmap);
@@ -192,23 +250,63 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
         for(uint32_t k=0; k < meta_data_blocks; k++) {
             set_bit(fs->bitmap->bits, k, 1);
         }
+    }
 
-        // Scan Inodes to mark data blocks
-        // Loop through Inode Blocks (starts at block 1)
-        for (size_t i = 1; i <= fs->meta_data->inode_blocks; i++)
-        {
-            Block inode_buffer;
-            if (disk_read(fs->disk, i, inode_buffer.data) < 0) {
-                free(fs->meta_data);
-                free(fs->bitmap->bits);
-                free(fs->bitmap);
-                return false;
-            }
+    // Inodes Bitmap
+    // ibitmap in it's initial form iterates through all the inodes and read if valid or not
+    uint32_t ibitmap_words = (total_inodes + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    uint32_t *ibitmap = calloc(ibitmap_words, sizeof(uint32_t));
+    if (ibitmap == NULL) {
+        perror("fs_mount: Failed to allocate memory for ibitmap array");
+        free(fs->meta_data);
+        free(fs->bitmap->bits);
+        free(fs->bitmap);
+        return false;
+
+    }
+    fs->ibitmap = ibitmap;
 
-            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) 
+    // Scan the inode table in one pass, a chunk of inode blocks at a time.
+    // Every chunk is one request, and the extents blocks it references are
+    // queued together so the backend can serve them as a single batch.
+    Block *inode_chunk = aligned_alloc(DISK_ALIGNMENT, MOUNT_SCAN_BLOCKS * sizeof(Block));
+    Block *extent_blocks = bitmap_loaded_valid ? NULL : aligned_alloc(DISK_ALIGNMENT, DISK_MAX_IOV * sizeof(Block));
+    if (inode_chunk == NULL || (!bitmap_loaded_valid && extent_blocks == NULL)) {
+        perror("fs_mount: Failed to allocate inode scan buffers");
+        free(inode_chunk);
+        free(extent_blocks);
+        free(fs->meta_data);
+        free(fs->bitmap->bits);
+        free(fs->bitmap);
+        free(fs->ibitmap);
+        return false;
+    }
+
+    bool scanned = true;
+    uint32_t current_inode_id = 0;
+    for (size_t first = 1; first <= fs->meta_data->inode_blocks && scanned; first += MOUNT_SCAN_BLOCKS)
+    {
+        size_t chunk = fs->meta_data->inode_blocks - first + 1;
+        if (chunk > MOUNT_SCAN_BLOCKS) chunk = MOUNT_SCAN_BLOCKS;
+        if (disk_read_blocks(fs->disk, first, chunk, inode_chunk->data) < 0) {
+            perror("fs_mount: Error reading the inode table has failed");
+            scanned = false;
+            break;
+        }
+
+        BlockVec queued[DISK_MAX_IOV];
+        size_t queued_count = 0;
+        for (size_t c = 0; c < chunk && scanned; c++)
+        {
+            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++, current_inode_id++) 
             {
-                Inode *inode = &inode_buffer.inodes[j];
+                if (current_inode_id >= total_inodes) break;
+                Inode *inode = &inode_chunk[c].inodes[j];
                 if (!inode->valid) continue; // check if inode is valid, if not we skip
+                set_bit(fs->ibitmap, current_inode_id, 1);
+                if (bitmap_loaded_valid) continue;
+                if (inode->flags & INODE_INLINE) continue; // no blocks, the data is in the inode
+
                 // Check Extents
                 for (uint32_t e = 0; e < inode->extent_count && e < EXTENTS_PER_INODE; e++)
                 {
@@ -216,70 +314,62 @@ bool fs_mount(FileSystem *fs, Disk *disk) {
                         set_bit(fs->bitmap->bits, inode->extents[e].start + b, 1);
                     }
                 }
-                
-                // iterate the extents block
+
+                // queue the extent tree root, flushing the queue once it is full
                 if (inode->extent_block != 0) 
                 {
-                    Block extents_buf;
-                    if (disk_read(fs->disk, inode->extent_block, extents_buf.data) < 0) {
-                        perror("fs_mount: Error reading from disk has failed");
-                        free(fs->meta_data);
-                        free(fs->bitmap->bits);
-                        free(fs->bitmap);
-                        return false;
-                    }
-
-                    for (size_t k = 0; k < EXTENTS_PER_BLOCK; k++)
-                    {
-                        Extent *extent = &extents_buf.extents[k];
-                        for (uint32_t e = 0; e < extent->length; e++) {
-                            set_bit(fs->bitmap->bits, extent->start + e, 1);
-                        }
+                    set_bit(fs->bitmap->bits, inode->extent_block, 1);
+                    queued[queued_count].block = inode->extent_block;
+                    queued[queued_count].data  = extent_blocks[queued_count].data;
+                    queued_count++;
+                    if (queued_count == DISK_MAX_IOV) {
+                        scanned = mount_mark_extent_blocks(fs, queued, queued_count);
+                        queued_count = 0;
                     }
                 }
             }
         }
+        if (scanned && queued_count > 0) {
+            scanned = mount_mark_extent_blocks(fs, queued, queued_count);
+        }
     }
+    free(inode_chunk);
+    free(extent_blocks);
 
-    // Inodes Bitmap
-    // ibitmap in it's initial form iterates through all the inodes and read if valid or not
-    uint32_t ibitmap_words = (total_inodes + BITS_PER_WORD - 1) / BITS_PER_WORD;
-    uint32_t *ibitmap = calloc(ibitmap_words, sizeof(uint32_t));
-    if (ibitmap == NULL) {
-        perror("fs_mount: Failed to allocate memory for ibitmap array");
+    if (!scanned) {
         free(fs->meta_data);
         free(fs->bitmap->bits);
         free(fs->bitmap);
+        free(fs->ibitmap);
         return false;
+    }
+    
+    // inodes are served from the in-core inode table
+    fs->icache = icache_create(FS_ICACHE_INODES);
+    if (fs->icache == NULL) {
+        free(fs->meta_data);
+        free(fs->bitmap->bits);
+        free(fs->bitmap);
+        free(fs->ibitmap);
+        return false;
+    }
 
+    // metadata goes through a buffer cache unless the caller set one up already
+    if (disk->cache == NULL && !cache_enable(disk, FS_CACHE_BLOCKS)) {
+        fprintf(stderr, "fs_mount: Warning buffer cache is unavailable, metadata is read from the disk\n");
     }
-    fs->ibitmap = ibitmap;
 
-    uint32_t current_inode_id = 0;
-    for (size_t i = 1; i <= fs->meta_data->inode_blocks; i++)
-    {
-        Block inode_buffer;
-        if (disk_read(fs->disk, i, inode_buffer.data) < 0) {
-            // Error handling (free memory and return false)
-            free(fs->meta_data);
-            free(fs->bitmap->bits);
-            free(fs->bitmap);
-            free(fs->ibitmap);
-            return false;
-        }
+    // resolved names and paths are remembered, fs_lookup scans directories without it
+    fs->dcache = dcache_create(FS_DCACHE_ENTRIES);
+    if (fs->dcache == NULL) {
+        fprintf(stderr, "fs_mount: Warning dentry cache is unavailable\n");
+    }
 
-        for (size_t j = 0; j < INODES_PER_BLOCK; j++)
-        {
-            if (current_inode_id >= total_inodes) break;
-            if (inode_buffer.inodes[j].valid) {
-                set_bit(fs->ibitmap, current_inode_id, 1);
-            }
-            current_inode_id++;
-        }
-        
+    // sequential reads are prefetched into the buffer cache
+    if (!fs_readahead_enable(fs)) {
+        fprintf(stderr, "fs_mount: Warning readahead is unavailable\n");
     }
-    
-    
+
     disk->mounted=true;
     return true;
 }
@@ -299,11 +389,41 @@ void fs_unmount(FileSystem *fs) {
         // Continue cleanup in case memory was still allocated
     }
 
+    // No write-back or readahead may run while the file system is torn down
+    fs_writeback_disable(fs);
+    fs_readahead_disable(fs);
+
+    // Write the dirty in-core inodes back into the inode table
+    if (fs->icache != NULL) {
+        if (fs->disk != NULL && fs->meta_data != NULL && !icache_flush(fs)) {
+            fprintf(stderr, "fs_unmount: Error writing back dirty inodes has failed\n");
+        }
+        icache_destroy(fs->icache);
+        fs->icache = NULL;
+    }
+
+    dcache_destroy(fs->dcache);
+    fs->dcache = NULL;
+
     // Flush dirty bitmap before freeing meta_data (save_bitmap needs it)
     if (fs->bitmap != NULL && fs->bitmap->dirty) {
         save_bitmap(fs);
     }
 
+    // Hand the blocks freed since the last trim back to the host
+    if (fs->discard != NULL) {
+        if (fs->disk != NULL && fs->bitmap != NULL) {
+            discard_flush(fs);
+        }
+        free(fs->discard);
+        fs->discard = NULL;
+    }
+
+    // Make everything written so far durable before the disk goes away
+    if (fs->disk != NULL) {
+        disk_sync(fs->disk);
+    }
+
     // Memory Cleanup
     if (fs->meta_data != NULL) {
         free(fs->meta_data);
@@ -324,6 +444,7 @@ void fs_unmount(FileSystem *fs) {
     if (fs->disk != NULL) {
         disk_close(fs->disk); 
         fs->disk = NULL;
+        pthread_mutex_destroy(&fs->lock);
     }
 }
 
@@ -333,12 +454,12 @@ void fs_unmount(FileSystem *fs) {
 Extent fs_allocate(FileSystem *fs, size_t blocks_to_reserve, uint32_t desired_extent_block) {
     if (fs == NULL || fs->meta_data == NULL || fs->bitmap == NULL || fs->disk == NULL) {
         perror("fs_allocate: Error fs, metadata, bitmap, or disk is invalid (NULL)");
-        return (Extent){0, 0};
+        return (Extent){0, 0, 0};
     }
 
     if (!(fs->disk->mounted)) {
         fprintf(stderr, "fs_allocate: Error disk is not mounted\n");
-        return (Extent){0, 0};
+        return (Extent){0, 0, 0};
     }
 
     uint32_t *bitmap      = fs->bitmap->bits;
@@ -346,7 +467,7 @@ Extent fs_allocate(FileSystem *fs, size_t blocks_to_reserve, uint32_t desired_ex
     size_t meta_blocks    = 2 + fs->meta_data->inode_blocks + fs->meta_data->bitmap_blocks;
 
     if (blocks_to_reserve == 0 || desired_extent_block >= total_blocks) {
-        return (Extent){0, 0};
+        return (Extent){0, 0, 0};
     }
 
     // try desired location first — enables merging with the last extent
@@ -361,7 +482,7 @@ Extent fs_allocate(FileSystem *fs, size_t blocks_to_reserve, uint32_t desired_ex
     if (desired_free) {
         for (size_t i = desired_extent_block; i < desired_extent_block + blocks_to_reserve; i++)
             set_bit(bitmap, i, 1);
-        return (Extent){desired_extent_block, blocks_to_reserve};
+        return (Extent){desired_extent_block, blocks_to_reserve, 0};
     }
 
     // fall back to best-fit scan
@@ -394,15 +515,113 @@ Extent fs_allocate(FileSystem *fs, size_t blocks_to_reserve, uint32_t desired_ex
     if (found_any) {
         for (size_t j = 0; j < blocks_to_reserve; j++)
             set_bit(bitmap, best_start + j, 1);
-        return (Extent){ best_start, blocks_to_reserve };
+        return (Extent){ best_start, blocks_to_reserve, 0 };
     }
 
     fprintf(stderr, "fs_allocate: Not enough contiguous space for %zu blocks.\n", blocks_to_reserve);
-    return (Extent){0, 0};
+    return (Extent){0, 0, 0};
 }
 
 
-ssize_t fs_create(FileSystem *fs) {
+// Allocates contiguous disk blocks starting on a multiple of alignment (first fit), so a
+// large file lines up with full stripes of a striped disk. Falls back to fs_allocate.
+Extent fs_allocate_aligned(FileSystem *fs, size_t blocks_to_reserve, size_t alignment) {
+    if (fs == NULL || fs->meta_data == NULL || fs->bitmap == NULL || fs->disk == NULL) {
+        perror("fs_allocate_aligned: Error fs, metadata, bitmap, or disk is invalid (NULL)");
+        return (Extent){0, 0, 0};
+    }
+    if (alignment <= 1 || blocks_to_reserve == 0) {
+        return fs_allocate(fs, blocks_to_reserve, 0);
+    }
+
+    uint32_t *bitmap      = fs->bitmap->bits;
+    size_t total_blocks   = fs->meta_data->blocks;
+    size_t meta_blocks    = 2 + fs->meta_data->inode_blocks + fs->meta_data->bitmap_blocks;
+
+    size_t start = (meta_blocks + alignment - 1) / alignment * alignment;
+    while (start + blocks_to_reserve <= total_blocks) {
+        size_t used = start;
+        while (used < start + blocks_to_reserve && !get_bit(bitmap, used)) used++;
+        if (used == start + blocks_to_reserve) {
+            for (size_t j = start; j < start + blocks_to_reserve; j++)
+                set_bit(bitmap, j, 1);
+            return (Extent){ start, blocks_to_reserve, 0 };
+        }
+        // the run is broken at used, the next candidate is the boundary after it
+        start = (used / alignment + 1) * alignment;
+    }
+    return fs_allocate(fs, blocks_to_reserve, 0);
+}
+
+// Allocates up to blocks_to_reserve contiguous blocks for a file growing at goal:
+// the blocks starting at goal when all of them are free, so the file keeps extending
+// its last extent, otherwise the smallest free run that holds them all, otherwise
+// the largest free run there is. Only that last case returns fewer blocks than asked.
+// The bitmap is scanned once, skipping whole words. Returns {0,0} when the disk is full.
+Extent fs_allocate_range(FileSystem *fs, size_t blocks_to_reserve, uint32_t goal) {
+    if (fs == NULL || fs->meta_data == NULL || fs->bitmap == NULL || fs->disk == NULL) {
+        perror("fs_allocate_range: Error fs, metadata, bitmap, or disk is invalid (NULL)");
+        return (Extent){0, 0, 0};
+    }
+    uint32_t *bitmap      = fs->bitmap->bits;
+    size_t total_blocks   = fs->meta_data->blocks;
+    size_t meta_blocks    = 2 + fs->meta_data->inode_blocks + fs->meta_data->bitmap_blocks;
+    if (blocks_to_reserve == 0) {
+        return (Extent){0, 0, 0};
+    }
+
+    if (goal >= meta_blocks && goal + blocks_to_reserve <= total_blocks) {
+        size_t used = goal;
+        while (used < goal + blocks_to_reserve && !get_bit(bitmap, used)) used++;
+        if (used == goal + blocks_to_reserve) {
+            for (size_t j = goal; j < used; j++) set_bit(bitmap, j, 1);
+            return (Extent){ goal, blocks_to_reserve, 0 };
+        }
+    }
+
+    size_t best_start     = 0;
+    size_t best_length    = 0;      // 0 while no free run holds the whole range
+    size_t largest_start  = 0;
+    size_t largest_length = 0;
+    size_t run_start      = 0;
+    size_t run_length     = 0;
+    for (size_t i = meta_blocks; i <= total_blocks; ) {
+        bool whole_word = (i % BITS_PER_WORD == 0 && i + BITS_PER_WORD <= total_blocks);
+        if (i < total_blocks && !get_bit(bitmap, i)) {
+            if (run_length == 0) run_start = i;
+            size_t step = (whole_word && bitmap[i / BITS_PER_WORD] == 0) ? BITS_PER_WORD : 1;
+            run_length += step;
+            i += step;
+            continue;
+        }
+        // a free run ends at i (or at the end of the disk)
+        if (run_length >= blocks_to_reserve && (best_length == 0 || run_length < best_length)) {
+            best_start  = run_start;
+            best_length = run_length;
+            if (run_length == blocks_to_reserve) break; // exact fit, stop early
+        }
+        if (run_length > largest_length) {
+            largest_start  = run_start;
+            largest_length = run_length;
+        }
+        run_length = 0;
+        i += (whole_word && bitmap[i / BITS_PER_WORD] == UINT32_MAX) ? BITS_PER_WORD : 1;
+    }
+
+    Extent extent = { 0, 0, 0 };
+    if (best_length > 0) {
+        extent = (Extent){ best_start, blocks_to_reserve, 0 };
+    } else if (largest_length > 0) {
+        extent = (Extent){ largest_start, largest_length, 0 };
+    } else {
+        fprintf(stderr, "fs_allocate_range: No free blocks left for %zu blocks.\n", blocks_to_reserve);
+        return extent;
+    }
+    for (size_t j = extent.start; j < (size_t)extent.start + extent.length; j++) set_bit(bitmap, j, 1);
+    return extent;
+}
+
+static ssize_t fs_create_locked(FileSystem *fs) {
     // Validation check
     if (fs == NULL || fs->disk == NULL) {
         perror("fs_create: Error fs or disk is invalid (NULL)"); 
@@ -431,36 +650,144 @@ ssize_t fs_create(FileSystem *fs) {
         return -1;
     }
 
-    uint32_t block_idx = 1 + (inode_num / INODES_PER_BLOCK);
-    uint32_t offset = inode_num % INODES_PER_BLOCK;
-
-    Block buffer;
-    if (disk_read(fs->disk, block_idx, buffer.data) < 0) {
+    Inode *target = icache_get(fs, inode_num);
+    if (target == NULL) {
         set_bit(ibitmap, inode_num, 0);
         return -1;
     }
 
-
-    Inode *target = &buffer.inodes[offset];
     target->valid = 1;
     target->size = 0;
 
-    // Zeroing Out Extents
+    // Zeroing Out Extents (and the inline data sharing their space)
     target->extent_count = 0;
-    target->extent_block = 0;
-    for (size_t i = 0; i < EXTENTS_PER_INODE; i++) {
-        target->extents[i].start = 0;
-        target->extents[i].length = 0;
+    target->flags = 0;
+    memset(target->inline_data, 0, INODE_INLINE_BYTES);
+    icache_dirty(target);
+    icache_put(fs, target);
+    return (ssize_t)inode_num;
+}
+
+// fs_create under the fs lock
+ssize_t fs_create(FileSystem *fs)
+{
+    fs_lock(fs);
+    ssize_t inode = fs_create_locked(fs);
+    fs_unlock_changed(fs);
+    return inode;
+}
+
+// Gives the borrowed buffers of a vectored request back to the disk pool,
+// borrowed is NULL when every buffer came from the pool
+static void release_buffers(FileSystem *fs, BlockVec *queued, const bool *borrowed, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (borrowed == NULL || borrowed[i]) disk_buffer_put(fs->disk, queued[i].data);
     }
-    
-    if (disk_write(fs->disk, block_idx, buffer.data) < 0) {
-        set_bit(ibitmap, inode_num, 0);
-        return -1;
+}
+
+// A block of a write window that keeps existing bytes around the new ones
+typedef struct PartialBlock PartialBlock;
+struct PartialBlock {
+    size_t     index;       // Position in the window
+    size_t     from;        // Byte range of the block the write covers
+    size_t     to;
+    const char *source;
+};
+
+// Block right after the last extent of an inode, where its next blocks should go
+// so that the last extent simply grows. 0 when the inode has no extents yet.
+uint32_t extent_goal(FileSystem *fs, const Inode *inode)
+{
+    if (inode->extent_count == 0) return 0;
+    if (inode->extent_count <= EXTENTS_PER_INODE) {
+        const Extent *last = &inode->extents[inode->extent_count - 1];
+        return last->start + last->length;
+    }
+    Extent last;
+    if (!extent_tree_last(fs, inode->extent_block, &last, NULL)) return 0;
+    return last.start + last.length;
+}
+
+// Logical block after the last one the extents of an inode map, holes included
+uint32_t extent_blocks(FileSystem *fs, const Inode *inode)
+{
+    if (inode->extent_count == 0) return 0;
+    if (inode->extent_count <= EXTENTS_PER_INODE) {
+        const Extent *last = &inode->extents[inode->extent_count - 1];
+        return last->logical + last->length;
+    }
+    // the root of the extent tree knows where the file ends
+    const Extent *last = &inode->extents[EXTENTS_PER_INODE - 1];
+    uint32_t end = last->logical + last->length;
+    extent_tree_last(fs, inode->extent_block, NULL, &end);
+    return end;
+}
+
+// Allocates the blocks fs_write is about to fill from logical on (past the mapped
+// end of a file or in a hole) in as few runs as the free space allows (at most max),
+// right after the block mapped before them when there is one, and adds them to the
+// inode. Returns the amount of runs.
+static size_t fs_write_allocate(FileSystem *fs, Inode *target, uint32_t logical, size_t blocks, Extent *runs, size_t max)
+{
+    uint32_t before = (logical > 0) ? icache_extent_run(fs, target, logical - 1, NULL) : 0;
+    uint32_t goal = (before != 0) ? before + 1 : extent_goal(fs, target);
+    size_t count = 0;
+    while (blocks > 0 && count < max) {
+        Extent extent = fs_allocate_range(fs, blocks, goal);
+        if (extent.start == 0) break;
+        if (!extent_add(fs, target, logical, extent.start, extent.length)) {
+            fprintf(stderr, "fs_write: Error adding extent has failed.\n");
+            for (uint32_t j = 0; j < extent.length; j++) set_bit(fs->bitmap->bits, extent.start + j, 0);
+            break;
+        }
+        runs[count++] = extent;
+        blocks -= extent.length;
+        logical += extent.length;
+        goal = extent.start + extent.length;
     }
-    return (ssize_t)inode_num;
+    if (count > 0) icache_dirty(target);
+    return count;
+}
+
+// Drops the inline data of a file, it owns no blocks to give back
+static void inline_clear(Inode *target)
+{
+    target->flags &= ~INODE_INLINE;
+    memset(target->inline_data, 0, INODE_INLINE_BYTES);
 }
 
-ssize_t fs_write(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset) 
+// Moves the data of an inline file to a block of its own (or into the delayed
+// allocation buffers) so a write past INODE_INLINE_BYTES can map it as usual
+static bool fs_inline_promote(FileSystem *fs, size_t inode_number, Inode *target)
+{
+    char saved[INODE_INLINE_BYTES];
+    size_t size = target->size;
+    memcpy(saved, target->inline_data, size);
+    inline_clear(target);
+    icache_dirty(target);
+    if (size == 0) return true;
+    if (fs->delalloc != NULL) return delalloc_write(fs, target, inode_number, saved, size, 0);
+
+    Extent run;
+    if (fs_write_allocate(fs, target, 0, 1, &run, 1) != 1) {
+        fprintf(stderr, "fs_write: Error extent allocation has failed.\n");
+        return false;
+    }
+    char *buffer = disk_buffer_get(fs->disk);
+    if (buffer == NULL) {
+        perror("fs_write: Error borrowing a block buffer has failed");
+        return false;
+    }
+    memset(buffer, 0, BLOCK_SIZE);
+    memcpy(buffer, saved, size);
+    bool written = disk_write(fs->disk, run.start, buffer) >= 0;
+    disk_buffer_put(fs->disk, buffer);
+    if (!written) fprintf(stderr, "fs_write: Error writing to disk has failed.\n");
+    return written;
+}
+
+static ssize_t fs_write_locked(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset) 
 {
     // Validation check
      if (fs == NULL || fs->disk == NULL) {
@@ -484,128 +811,251 @@ ssize_t fs_write(FileSystem *fs, size_t inode_number, const char *data, size_t l
     size_t end_byte = offset + length;                  // absolute end position in file
     size_t end_logical_block = (end_byte > 0) ? ((end_byte-1) / BLOCK_SIZE) : 0;
 
-    // Locate the inode: block 0 is the superblock, so inode blocks start at 1
-    uint32_t inode_block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    uint32_t inode_offset_in_block = inode_number % INODES_PER_BLOCK;
-
-    // Read the block containing our inode and get a pointer to it
-    Block inode_buffer;
-    if (disk_read(fs->disk, inode_block_idx, inode_buffer.data) < 0)
+    // Pin the in-core inode, extents and size are updated in place
+    Inode *target = icache_get(fs, inode_number);
+    if (target == NULL)
     {
         fprintf(stderr, "fs_write: Error writing has failed.\n");
         return -1;
     }
-    Inode *target = &inode_buffer.inodes[inode_offset_in_block];
 
-    // Walk through each logical block that this write touches
-    size_t bytes_written = 0;
-    for (size_t i = start_logical_block; i <= end_logical_block; i++)
-    {
-        // Determine the byte range within this block we need to write
-        // First block may start mid-block, all others start at 0
-        size_t block_start = 0;
-        if (i == start_logical_block) {
-            block_start = start_block_offset;
+    // A small regular file keeps its bytes in the inode and costs no block,
+    // the first write that reaches past INODE_INLINE_BYTES moves them out
+    bool inlined = (target->flags & INODE_INLINE) != 0;
+    if (target->valid == INODE_FILE && (inlined || (target->size == 0 && target->extent_count == 0 && length > 0))) {
+        if (end_byte <= INODE_INLINE_BYTES) {
+            if (!inlined) inline_clear(target);
+            memcpy(target->inline_data + offset, data, length);
+            target->flags |= INODE_INLINE;
+            if (end_byte > target->size) target->size = end_byte;
+            icache_dirty(target);
+            icache_put(fs, target);
+            return length;
         }
-
-        // Last block may end mid-block, all others go to BLOCK_SIZE
-        size_t block_end = BLOCK_SIZE;
-        if (i == end_logical_block) {
-            block_end = end_byte % BLOCK_SIZE;
-            if (block_end == 0) block_end = BLOCK_SIZE;
+        if (inlined && !fs_inline_promote(fs, inode_number, target)) {
+            icache_put(fs, target);
+            return -1;
         }
+    }
 
-        // Extents traverse
-        uint32_t phys = extent_lookup(fs, target, i);
-        // new block
-        if (phys == 0) {
-            Extent extent = fs_allocate(fs, 1, 0);
-            if (extent.start == 0) {
-                fprintf(stderr, "fs_write: Error extent allocation has failed.\n");
-                return -1;
+    // The range is served in windows of up to DISK_MAX_IOV blocks, written in one
+    // vectored request. Each block is classified: one the write covers completely
+    // goes out straight from the caller's buffer, one allocated by this write is
+    // zero-filled around the new bytes, and only a partially covered block of
+    // existing data (at most the first and the last of the range) is read first.
+    // Blocks allocated by this write that have not been filled yet, in file order
+    Extent fresh_runs[FS_WRITE_RUNS];
+    size_t fresh_count = 0;
+    size_t fresh_next = 0;
+    bool delayed = false;
+
+    size_t bytes_written = 0;
+    for (size_t first = start_logical_block; first <= end_logical_block; first += DISK_MAX_IOV)
+    {
+        size_t last = first + DISK_MAX_IOV - 1;
+        if (last > end_logical_block) last = end_logical_block;
+
+        BlockVec queued[DISK_MAX_IOV];
+        bool borrowed[DISK_MAX_IOV];
+        PartialBlock partial[2];
+        size_t queued_count = 0;
+        size_t partial_count = 0;
+        for (size_t i = first; i <= last; )
+        {
+            // Extents traverse, one lookup queues the whole run of an extent
+            uint32_t run;
+            uint32_t phys;
+            bool fresh = (fresh_next < fresh_count);
+            if (fresh) {
+                phys = fresh_runs[fresh_next].start;
+                run  = fresh_runs[fresh_next].length;
+            } else {
+                phys = icache_extent_run(fs, target, i, &run);
             }
-            bool extent_added = extent_add(fs, target, extent.start, extent.length);
-            if (!extent_added) {
-                fprintf(stderr, "fs_write: Error adding extent has failed.\n");
-                return -1;
+            // delayed allocation: past the mapped end the rest of the range waits
+            // in memory for its blocks. Blocks waiting already that the range does
+            // not continue are flushed first and the block looked up again, so a
+            // hole in between is neither buffered nor allocated.
+            if (phys == 0 && run == 0 && fs->delalloc != NULL && target->valid == INODE_FILE &&
+                !delalloc_extends(fs, inode_number, i)) {
+                if (!delalloc_flush(fs, inode_number)) {
+                    fprintf(stderr, "fs_write: Error flushing the buffered data has failed.\n");
+                    release_buffers(fs, queued, borrowed, queued_count);
+                    icache_put(fs, target);
+                    return -1;
+                }
+                continue;
+            }
+            if (phys == 0 && run == 0 && fs->delalloc != NULL && target->valid == INODE_FILE) {
+                size_t from = (i == start_logical_block) ? offset : i * BLOCK_SIZE;
+                if (!delalloc_write(fs, target, inode_number, data + (from - offset), end_byte - from, from)) {
+                    fprintf(stderr, "fs_write: Error buffering the data has failed.\n");
+                    release_buffers(fs, queued, borrowed, queued_count);
+                    icache_put(fs, target);
+                    return -1;
+                }
+                bytes_written += end_byte - from;
+                delayed = true;
+                break;
+            }
+            // past the mapped end the rest of the range is allocated at once, in a
+            // hole the part of the range it covers
+            if (phys == 0) {
+                size_t blocks = end_logical_block - i + 1;
+                if (run != 0 && run < blocks) blocks = run;
+                fresh_count = fs_write_allocate(fs, target, (uint32_t)i, blocks, fresh_runs, FS_WRITE_RUNS);
+                fresh_next = 0;
+                if (fresh_count == 0) {
+                    fprintf(stderr, "fs_write: Error extent allocation has failed.\n");
+                    release_buffers(fs, queued, borrowed, queued_count);
+                    icache_put(fs, target);
+                    return -1;
+                }
+                continue;
+            }
+            if (run > last - i + 1) run = last - i + 1;
+            if (fresh) {
+                fresh_runs[fresh_next].start  += run;
+                fresh_runs[fresh_next].length -= run;
+                if (fresh_runs[fresh_next].length == 0) fresh_next++;
+            }
+            for (uint32_t j = 0; j < run; j++, i++) {
+                // First block may start mid-block, last block may end mid-block
+                size_t block_start = (i == start_logical_block) ? start_block_offset : 0;
+                size_t block_end = BLOCK_SIZE;
+                if (i == end_logical_block) {
+                    block_end = end_byte % BLOCK_SIZE;
+                    if (block_end == 0) block_end = BLOCK_SIZE;
+                }
+                const char *source = data + (i * BLOCK_SIZE + block_start - offset);
+                bool full = (block_start == 0 && block_end == BLOCK_SIZE);
+                bytes_written += block_end - block_start;
+
+                BlockVec *vec = &queued[queued_count];
+                vec->block = phys + j;
+                if (full && disk_buffer_usable(fs->disk, source)) {
+                    // the disk layers only read a buffer being written, never modify it
+                    vec->data = (char *)source;
+                    borrowed[queued_count++] = false;
+                    continue;
+                }
+                vec->data = disk_buffer_get(fs->disk);
+                if (vec->data == NULL) {
+                    perror("fs_write: Error borrowing a block buffer has failed");
+                    release_buffers(fs, queued, borrowed, queued_count);
+                    icache_put(fs, target);
+                    return -1;
+                }
+                borrowed[queued_count] = true;
+                if (full) {
+                    memcpy(vec->data, source, BLOCK_SIZE);
+                } else if (fresh) {
+                    // nothing to keep, whatever a previous file left there is cleared
+                    memset(vec->data, 0, BLOCK_SIZE);
+                    memcpy(vec->data + block_start, source, block_end - block_start);
+                } else {
+                    partial[partial_count++] = (PartialBlock){ queued_count, block_start, block_end, source };
+                }
+                queued_count++;
             }
-            phys = extent.start;
         }
 
-        Block buffer;
-        if (disk_read(fs->disk, phys, buffer.data) < 0) 
-        {
-            fprintf(stderr, "fs_write: Error reading from disk has failed.\n");
-            return -1;
+        if (partial_count > 0) {
+            BlockVec reads[2];
+            for (size_t p = 0; p < partial_count; p++) reads[p] = queued[partial[p].index];
+            if (disk_readv(fs->disk, reads, partial_count) < 0) {
+                fprintf(stderr, "fs_write: Error reading from disk has failed.\n");
+                release_buffers(fs, queued, borrowed, queued_count);
+                icache_put(fs, target);
+                return -1;
+            }
+            for (size_t p = 0; p < partial_count; p++) {
+                memcpy(reads[p].data + partial[p].from, partial[p].source, partial[p].to - partial[p].from);
+            }
         }
 
-        memcpy(buffer.data + block_start, data + bytes_written, block_end - block_start);
-        
-        if (disk_write(fs->disk, phys, buffer.data) < 0) {
+        ssize_t flushed = disk_writev(fs->disk, queued, queued_count);
+        release_buffers(fs, queued, borrowed, queued_count);
+        if (flushed < 0) {
             fprintf(stderr, "fs_write: Error writing to disk has failed.\n");
+            icache_put(fs, target);
             return -1;
         }
-        bytes_written += (block_end - block_start);
+        if (delayed) break;
     }
 
-    // Update file size if we extended past the previous end
+    // Update file size if we extended past the previous end, the new size and
+    // pointers reach the inode table when the inode cache is flushed
     if (end_byte > target->size) {
         target->size = end_byte;
+        icache_dirty(target);
     }
-
-    // Write the modified inode (updated pointers + size) back to disk
-    if (disk_write(fs->disk, inode_block_idx, inode_buffer.data) < 0)
-    {
-        fprintf(stderr, "fs_write: Error writing has failed.\n");
-        return -1;
-    }
+    icache_put(fs, target);
 
     // For now we save the bitmap after every single write until a solution comes up
     fs->bitmap->dirty = true;
     return bytes_written;
 }
 
-ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) 
+// fs_write under the fs lock
+ssize_t fs_write(FileSystem *fs, size_t inode_number, const char *data, size_t length, size_t offset)
 {
-    // Validation check
-     if (fs == NULL || fs->disk == NULL) {
-        perror("fs_read: Error fs or disk is invalid (NULL)"); 
-        return -1;
-    }
-    if (!fs->disk->mounted) { 
-        fprintf(stderr, "fs_read: Error disk is not mounted, cannot procceed t\n");
-        return -1;
+    fs_lock(fs);
+    ssize_t written = fs_write_locked(fs, inode_number, data, length, offset);
+    fs_unlock_changed(fs);
+    return written;
+}
+
+// Reads from the data of a pinned inode, see fs_read
+// An unmapped block is either waiting in memory for its allocation, was flushed
+// since it was looked up, or is a hole that reads as zeros
+static bool fs_read_unmapped(FileSystem *fs, size_t inode_number, const Inode *target, size_t logical,
+                             char *data, size_t from, size_t to)
+{
+    if (fs->delalloc == NULL) {
+        memset(data, 0, to - from);
+        return true;
     }
-    if (inode_number >= fs->meta_data->inodes) {
-        // Inode number is invalid (too high)
-        fprintf(stderr, "fs_read: Error inode_number is out of bounds, cannot procceed t\n");
-        return -1;
+    if (delalloc_read(fs, inode_number, logical, data, from, to)) return true;
+    uint32_t phys = icache_extent_run(fs, target, logical, NULL);
+    if (phys == 0) {
+        memset(data, 0, to - from);
+        return true;
     }
+    Buffer *buffer = cache_bread(fs->disk, phys);
+    if (buffer == NULL) return false;
+    memcpy(data, buffer->data + from, to - from);
+    cache_brelse(fs->disk, buffer);
+    return true;
+}
 
+static ssize_t fs_read_pinned(FileSystem *fs, size_t inode_number, const Inode *target, char *data, size_t length, size_t offset)
+{
     // Figure out which logical blocks this read spans
     size_t start_logical_block = offset / BLOCK_SIZE;
     size_t start_block_offset = offset % BLOCK_SIZE;   // byte offset within the first block
 
-    // Locate the inode: block 0 is the superblock, so inode blocks start at 1
-    uint32_t inode_block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    uint32_t inode_offset_in_block = inode_number % INODES_PER_BLOCK;
-
-    // Read the block containing our inode and get a pointer to it
-    Block inode_buffer;
-    if (disk_read(fs->disk, inode_block_idx, inode_buffer.data) < 0)
-    {
-        fprintf(stderr, "fs_read: Error reading has failed.\n");
-        return -1;
-    }
-
-    Inode *target = &inode_buffer.inodes[inode_offset_in_block];
-
     if (!target->valid) 
     {
         fprintf(stderr, "fs_read: Inode is invalid.\n");
         return -1;
     }
 
+    // The data of an inline file is read under the fs lock, a write may be moving it out
+    if (target->flags & INODE_INLINE) {
+        fs_lock(fs);
+        bool inlined = (target->flags & INODE_INLINE) != 0;
+        if (inlined) {
+            if (offset >= target->size) length = 0;
+            else {
+                if (offset + length > target->size) length = target->size - offset;
+                memcpy(data, target->inline_data + offset, length);
+            }
+        }
+        fs_unlock(fs);
+        if (inlined) return length;
+    }
+
     if (offset >= target->size) return 0;
     if (offset + length > target->size) length = target->size - offset;
 
@@ -613,39 +1063,179 @@ ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length,
     size_t end_byte = offset + length;                  // absolute end position in file
     size_t end_logical_block = (end_byte > 0) ? ((end_byte-1) / BLOCK_SIZE) : 0;
 
-    size_t bytes_read = 0;
+    // A read inside one block (directory entries, small records) goes through the
+    // buffer cache, so scanning the same block entry by entry reads it once
+    if (start_logical_block == end_logical_block) {
+        uint32_t phys = icache_extent_run(fs, target, start_logical_block, NULL);
+        if (phys == 0) {
+            if (!fs_read_unmapped(fs, inode_number, target, start_logical_block, data,
+                                  start_block_offset, start_block_offset + length)) {
+                fprintf(stderr, "fs_read: Error reading from disk has failed.\n");
+                return -1;
+            }
+            return length;
+        }
+        const char *source = disk_block_ptr(fs->disk, phys);
+        if (source != NULL) {
+            memcpy(data, source + start_block_offset, length);
+            return length;
+        }
+        Buffer *buffer = cache_bread(fs->disk, phys);
+        if (buffer == NULL) {
+            fprintf(stderr, "fs_read: Error reading from disk has failed.\n");
+            return -1;
+        }
+        memcpy(data, buffer->data + start_block_offset, length);
+        cache_brelse(fs->disk, buffer);
+        return length;
+    }
 
-    for (size_t i = start_logical_block; i <= end_logical_block; i++) 
+    // The range is served in windows of up to DISK_MAX_IOV blocks. Blocks the
+    // disk can expose in place are copied straight from it, the rest of a
+    // window is queued into one vectored request: a block the read covers
+    // completely is read straight into the caller's buffer, only the partial
+    // head and tail blocks go through pool buffers.
+    size_t bytes_read = 0;
+    for (size_t first = start_logical_block; first <= end_logical_block; first += DISK_MAX_IOV)
     {
-        size_t block_start = (i == start_logical_block) ? start_block_offset : 0;
-        size_t block_end = BLOCK_SIZE;
-        if (i == end_logical_block) {
-            block_end = end_byte % BLOCK_SIZE;
-            if (block_end == 0) block_end = BLOCK_SIZE;
-        }
+        size_t last = first + DISK_MAX_IOV - 1;
+        if (last > end_logical_block) last = end_logical_block;
 
         // Extents traverse
-        uint32_t phys = extent_lookup(fs, target, i);
-        // new block
-        if (phys == 0) {
-            memset(data + bytes_read, 0, block_end - block_start);
+        const char *source[DISK_MAX_IOV];
+        bool in_place[DISK_MAX_IOV];
+        BlockVec queued[DISK_MAX_IOV];
+        bool borrowed[DISK_MAX_IOV];
+        size_t queued_count = 0;
+        for (size_t i = first; i <= last; ) {
+            // one lookup covers the whole run of an extent or a hole, past the
+            // mapped extents the rest of the window is unmapped
+            uint32_t run;
+            uint32_t phys = icache_extent_run(fs, target, i, &run);
+            if ((phys == 0 && run == 0) || run > last - i + 1) run = last - i + 1;
+            for (uint32_t j = 0; j < run; j++, i++) {
+                uint32_t block = (phys != 0) ? phys + j : 0;
+                source[i - first] = (block != 0) ? disk_block_ptr(fs->disk, block) : NULL;
+                in_place[i - first] = false;
+                if (block == 0 || source[i - first] != NULL) continue;
+
+                bool full = (i != start_logical_block || start_block_offset == 0) &&
+                            (i != end_logical_block || end_byte % BLOCK_SIZE == 0);
+                char *destination = full ? data + (i * BLOCK_SIZE - offset) : NULL;
+                queued[queued_count].block = block;
+                if (full && disk_buffer_usable(fs->disk, destination)) {
+                    queued[queued_count].data = destination;
+                    borrowed[queued_count] = false;
+                    in_place[i - first] = true;
+                } else {
+                    queued[queued_count].data = disk_buffer_get(fs->disk);
+                    if (queued[queued_count].data == NULL) {
+                        perror("fs_read: Error borrowing a block buffer has failed");
+                        release_buffers(fs, queued, borrowed, queued_count);
+                        return -1;
+                    }
+                    borrowed[queued_count] = true;
+                }
+                source[i - first] = queued[queued_count].data;
+                queued_count++;
+            }
         }
-        else {
-            Block buffer;
-            if (disk_read(fs->disk, phys, buffer.data) < 0) 
-            {
-                fprintf(stderr, "fs_read: Error reading from disk has failed.\n");
-                return -1;
+        if (disk_readv(fs->disk, queued, queued_count) < 0) 
+        {
+            fprintf(stderr, "fs_read: Error reading from disk has failed.\n");
+            release_buffers(fs, queued, borrowed, queued_count);
+            return -1;
+        }
+
+        for (size_t i = first; i <= last; i++) 
+        {
+            size_t block_start = (i == start_logical_block) ? start_block_offset : 0;
+            size_t block_end = BLOCK_SIZE;
+            if (i == end_logical_block) {
+                block_end = end_byte % BLOCK_SIZE;
+                if (block_end == 0) block_end = BLOCK_SIZE;
             }
-            memcpy(data + bytes_read, buffer.data + block_start, block_end - block_start);
+
+            if (source[i - first] == NULL) {
+                if (!fs_read_unmapped(fs, inode_number, target, i, data + bytes_read, block_start, block_end)) {
+                    fprintf(stderr, "fs_read: Error reading from disk has failed.\n");
+                    release_buffers(fs, queued, borrowed, queued_count);
+                    return -1;
+                }
+            }
+            else if (!in_place[i - first]) {
+                memcpy(data + bytes_read, source[i - first] + block_start, block_end - block_start);
+            }
+            bytes_read += (block_end - block_start);
         }
-        bytes_read += (block_end - block_start);
+        release_buffers(fs, queued, borrowed, queued_count);
+    }
+    return bytes_read;
+}
+
+ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) 
+{
+    // Validation check
+     if (fs == NULL || fs->disk == NULL) {
+        perror("fs_read: Error fs or disk is invalid (NULL)"); 
+        return -1;
+    }
+    if (!fs->disk->mounted) { 
+        fprintf(stderr, "fs_read: Error disk is not mounted, cannot procceed t\n");
+        return -1;
+    }
+    if (inode_number >= fs->meta_data->inodes) {
+        // Inode number is invalid (too high)
+        fprintf(stderr, "fs_read: Error inode_number is out of bounds, cannot procceed t\n");
+        return -1;
     }
+
+    // Pin the in-core inode for the duration of the read
+    Inode *target = icache_get(fs, inode_number);
+    if (target == NULL)
+    {
+        fprintf(stderr, "fs_read: Error reading has failed.\n");
+        return -1;
+    }
+    // Queue the blocks after this read while it is being served
+    fs_readahead(fs, inode_number, target, offset, length);
+    ssize_t bytes_read = fs_read_pinned(fs, inode_number, target, data, length, offset);
+    icache_put(fs, target);
     return bytes_read;
 }
 
 
-bool fs_remove(FileSystem *fs, size_t inode_number) 
+
+// Clears a released extent from the bitmap and queues it for discard
+static void fs_release_extent(FileSystem *fs, uint32_t start, uint32_t length)
+{
+    for (uint32_t j = 0; j < length; j++) {
+        set_bit(fs->bitmap->bits, start + j, 0);
+    }
+    discard_queue(fs, start, length);
+}
+
+// Extent tree visitor giving the extents and the nodes back
+static bool fs_release_visit(FileSystem *fs, void *arg, Extent extent, bool node)
+{
+    (void)arg; (void)node;
+    fs_release_extent(fs, extent.start, extent.length);
+    return true;
+}
+
+// Releases the extents in the extent tree of an inode and then the nodes of the tree
+static bool fs_release_extent_block(FileSystem *fs, Inode *target, const char *caller)
+{
+    if (!extent_tree_walk(fs, target->extent_block, fs_release_visit, NULL)) {
+        fprintf(stderr, "%s: Error releasing the extent tree has failed\n", caller);
+        return false;
+    }
+    target->extent_block = 0;
+    target->extent_count = 0;
+    return true;
+}
+
+static bool fs_remove_locked(FileSystem *fs, size_t inode_number) 
 {
     // Validation check
     if (fs == NULL || fs->disk == NULL) {
@@ -659,64 +1249,51 @@ bool fs_remove(FileSystem *fs, size_t inode_number)
 
     if (inode_number >= fs->meta_data->inodes) return false;
 
-    // Locate the inode
-    uint32_t inode_block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    uint32_t inode_offset_in_block = inode_number % INODES_PER_BLOCK;
-
-    // Read the block containing the inode
-    Block inode_buffer;
-    if (disk_read(fs->disk, inode_block_idx, inode_buffer.data) < 0) {
+    // Pin the in-core inode
+    Inode *target = icache_get(fs, inode_number);
+    if (target == NULL) {
         fprintf(stderr, "fs_remove: Error reading inode block has failed.\n");
         return false;
     }
-    Inode *target = &inode_buffer.inodes[inode_offset_in_block];
 
     if (!target->valid) {
         fprintf(stderr, "fs_remove: Inode is not valid.\n");
+        icache_put(fs, target);
         return false;
     }
 
-    // Cleaning the inode
+    // Names cached inside a removed directory go with it
+    if (target->valid == INODE_DIR) {
+        dcache_invalidate_dir(fs, (uint32_t)inode_number);
+    }
+
+    // Cleaning the inode, data still waiting for blocks never reaches the disk
+    delalloc_drop(fs, inode_number);
+    icache_extents_begin(fs);
     target->size = 0;
     target->valid = 0;
+    if (target->flags & INODE_INLINE) inline_clear(target);
     for(size_t i = 0; i < EXTENTS_PER_INODE; i++) 
     {
         if (target->extents[i].start != 0 && target->extents[i].length) {
-            for (size_t j = 0; j < target->extents[i].length; j++) {
-                set_bit(fs->bitmap->bits, target->extents[i].start + j, 0);
-            }
+            fs_release_extent(fs, target->extents[i].start, target->extents[i].length);
             target->extents[i].start = 0;
             target->extents[i].length = 0;
+            target->extents[i].logical = 0;
         }
     }
-    if (target->extent_block != 0) 
+    if (target->extent_block == 0) target->extent_count = 0;
+    bool released = target->extent_block == 0 || fs_release_extent_block(fs, target, "fs_remove");
+    icache_extents_end(fs, target, NULL);
+    if (!released)
     {
-        Block extents_buf;
-        if (disk_read(fs->disk, target->extent_block, extents_buf.data) < 0) {
-            return false;
-        }
-
-        for (size_t i = 0; i < EXTENTS_PER_BLOCK; i++) 
-        {
-            Extent *extent_ptr = &extents_buf.extents[i];
-            for (size_t j = 0; j < extent_ptr->length; j++)
-                set_bit(fs->bitmap->bits, extent_ptr->start + j, 0);
-        }
-
-        memset(extents_buf.data, 0, BLOCK_SIZE);
-        if (disk_write(fs->disk, target->extent_block, extents_buf.data) < 0) {
-            fprintf(stderr, "fs_remove: Error failed to write to disk\n");
-            return false;
-        }
-
-        set_bit(fs->bitmap->bits, target->extent_block, 0); 
-        target->extent_block = 0;
-        target->extent_count = 0;
-    }
-    // Write the modified inode back to disk
-    if (disk_write(fs->disk, inode_block_idx, inode_buffer.data) < 0) {
+        icache_dirty(target);
+        icache_put(fs, target);
         return false;
     }
+    // The cleared inode reaches the inode table when the inode cache is flushed
+    icache_dirty(target);
+    icache_put(fs, target);
 
     // Mark inode as free in ibitmap
     set_bit(fs->ibitmap, inode_number, 0);
@@ -726,6 +1303,15 @@ bool fs_remove(FileSystem *fs, size_t inode_number)
     return true;
 }
 
+// fs_remove under the fs lock
+bool fs_remove(FileSystem *fs, size_t inode_number)
+{
+    fs_lock(fs);
+    bool removed = fs_remove_locked(fs, inode_number);
+    fs_unlock_changed(fs);
+    return removed;
+}
+
 ssize_t fs_stat(FileSystem *fs, size_t inode_number) 
 {
     // Validation check
@@ -740,23 +1326,16 @@ ssize_t fs_stat(FileSystem *fs, size_t inode_number)
 
     if (inode_number >= fs->meta_data->inodes) return -1;
 
-    // Locate the inode
-    uint32_t inode_block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    uint32_t inode_offset_in_block = inode_number % INODES_PER_BLOCK;
-
-    // Read the block containing the inode
-    Block inode_buffer;
-    if (disk_read(fs->disk, inode_block_idx, inode_buffer.data) < 0) {
+    // Served from the in-core inode table
+    Inode *target = icache_get(fs, inode_number);
+    if (target == NULL) {
         fprintf(stderr, "fs_stat: Error reading inode block has failed.\n");
         return -1;
     }
-    Inode *target = &inode_buffer.inodes[inode_offset_in_block];
 
-    if (!target->valid) {
-        return -1;
-    } else {
-        return target->size;
-    }
+    ssize_t size = target->valid ? (ssize_t)target->size : -1;
+    icache_put(fs, target);
+    return size;
 }
 
 ssize_t fs_lookup(FileSystem *fs, const char *path) 
@@ -772,24 +1351,71 @@ ssize_t fs_lookup(FileSystem *fs, const char *path)
     }
     if (strcmp(path, "/") == 0) return 0; // root dir
 
-    char path_copy[256];
-    strncpy(path_copy, path, 255);
-    path_copy[255] = '\0';
+    // a path resolved before is answered as a whole while its dentries are unchanged
+    ssize_t cached;
+    if (dcache_path_find(fs, path, &cached)) return cached;
 
+    // Components are copied out one at a time instead of tokenizing a copy of
+    // the path with strtok, so concurrent lookups do not share any state
+    DcacheRef refs[DCACHE_PATH_DEPTH];
+    size_t depth = 0;
     size_t current_inode = 0; // start at root
-    char *token = strtok(path_copy, "/");
-
-    while (token != NULL) {
-        ssize_t next = dir_lookup(fs, current_inode, token);
-        if (next == -1) return -1; // component not found
+    const char *component = path;
+    while (*component != '\0') {
+        if (*component == '/') {
+            component++;
+            continue;
+        }
+        size_t length = strcspn(component, "/");
+        if (length >= DCACHE_NAME_MAX) {
+            fprintf(stderr, "fs_lookup: Error, name exceeds the possible length (28 Chars)\n");
+            return -1;
+        }
+        char name[DCACHE_NAME_MAX];
+        memcpy(name, component, length);
+        name[length] = '\0';
+        component += length;
+
+        ssize_t next = dir_lookup_ref(fs, current_inode, name, (depth < DCACHE_PATH_DEPTH) ? &refs[depth] : NULL);
+        depth++;
+        if (next == -1) {
+            dcache_path_insert(fs, path, -1, refs, depth); // component not found
+            return -1;
+        }
         current_inode = (size_t)next;
-        token = strtok (NULL, "/");
     }
+    dcache_path_insert(fs, path, (ssize_t)current_inode, refs, depth);
     return (ssize_t)current_inode;
 }
 
-uint32_t extent_lookup(FileSystem *fs, Inode *inode, uint32_t logical_block) 
+// Read-only view of a block: a pointer into the disk itself when the backend can
+// serve blocks in place, otherwise the block is read into scratch. NULL on failure.
+const Block *fs_block_view(FileSystem *fs, size_t block, Block *scratch)
+{
+    const char *mapped = disk_block_ptr(fs->disk, block);
+    if (mapped != NULL) {
+        return (const Block *)mapped;
+    }
+    if (disk_read(fs->disk, block, scratch->data) < 0) {
+        return NULL;
+    }
+    return scratch;
+}
+
+uint32_t extent_lookup(FileSystem *fs, const Inode *inode, uint32_t logical_block) 
 {
+    return extent_run(fs, inode, logical_block, NULL);
+}
+
+/* Physical block of logical_block like extent_lookup, and through run (when not NULL)
+ * how many blocks from there on are contiguous on the disk until the extent ends.
+ * In a hole it returns 0 with run the blocks up to the next extent, past the last
+ * extent run is 0 too. The extents are searched, for copies of an inode (such as
+ * fs_read_inode's) or with the fs lock held. Inodes pinned with icache_get are
+ * mapped through their decoded extent map by icache_extent_run. */
+uint32_t extent_run(FileSystem *fs, const Inode *inode, uint32_t logical_block, uint32_t *run) 
+{
+    if (run != NULL) *run = 0;
     if (fs == NULL || fs->disk == NULL) 
     {
         perror("extent_lookup: Error fs or disk is invalid (NULL)"); 
@@ -799,39 +1425,35 @@ uint32_t extent_lookup(FileSystem *fs, Inode *inode, uint32_t logical_block)
         perror("extent_lookup: Error inode is invalid"); 
         return 0;
     }
+    if (inode->flags & INODE_INLINE) return 0; // the extents space holds file data
 
-    uint32_t base = 0;
-
+    // the inline extents come first in logical order, the extent tree holds the rest
     for (uint32_t i = 0; i < inode->extent_count && i < EXTENTS_PER_INODE; i++) 
     {
-        if (logical_block >= base && logical_block < base + inode->extents[i].length) 
+        const Extent *extent = &inode->extents[i];
+        if (logical_block < extent->logical) {
+            if (run != NULL) *run = extent->logical - logical_block;
+            return 0; // hole
+        }
+        if (logical_block < extent->logical + extent->length) 
         {
-            return inode->extents[i].start + (logical_block - base);
+            if (run != NULL) *run = extent->logical + extent->length - logical_block;
+            return extent->start + (logical_block - extent->logical);
         }
-        base += inode->extents[i].length;
     }
 
-    // extents block
-    if (inode->extent_block != 0) {
-        Block buffer;
-        if (disk_read(fs->disk, inode->extent_block, buffer.data) < 0) {
-            perror("extent_lookup: Error reading from disk has failed"); 
-            return 0;
-        }
-        Extent *extents_ptr = (Extent *)buffer.data; // Pointer to traverse around the extents block
-        uint32_t overflow_count = inode->extent_count - EXTENTS_PER_INODE;
-
-        for (uint32_t i = 0; i < overflow_count; i++) 
-        {
-            if (logical_block >= base && logical_block < base + extents_ptr[i].length) {
-                return extents_ptr[i].start + (logical_block - base);
-            }
-            base += extents_ptr[i].length;
-        }
+    // extent tree
+    if (inode->extent_count > EXTENTS_PER_INODE && inode->extent_block != 0) {
+        return extent_tree_run(fs, inode->extent_block, logical_block, run);
     }
     return 0; // not found
 }
 
+// Copies handed out by fs_read_inode
+static SlabPool inode_copies = SLAB_POOL_INITIALIZER(sizeof(Inode), 128);
+
+/* Returns a copy of an inode, the caller releases it with fs_free_inode. Callers
+ * that only look at the inode should pin it with icache_get/icache_put instead. */
 Inode* fs_read_inode(FileSystem *fs, size_t inode_number) 
 {
     if (fs == NULL || fs->disk == NULL) 
@@ -839,28 +1461,28 @@ Inode* fs_read_inode(FileSystem *fs, size_t inode_number)
         perror("fs_read_inode: Error fs or disk is invalid (NULL)"); 
         return NULL;
     }
-    if (inode_number > fs->meta_data->inodes) {
-        perror("fs_read_inode: Error inode_number exceeds the total inodes count"); 
-        return NULL;
-    }
 
-    Block buffer;
-    size_t block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offset = inode_number % INODES_PER_BLOCK;
-    if (disk_read(fs->disk, block_idx, buffer.data) < 0) 
+    Inode *cached = icache_get(fs, inode_number);
+    if (cached == NULL) 
     {
         perror("fs_read_inode: Error reading from disk has failed"); 
         return NULL;
     }
-    Inode *inode = malloc(sizeof(Inode));
-    if (inode == NULL) 
+    Inode *inode = slab_alloc(&inode_copies);
+    if (inode != NULL) 
     {
-        return NULL;
+        *inode = *cached; // copy the struct
     }
-    *inode = buffer.inodes[offset]; // copy the struct
+    icache_put(fs, cached);
     return inode;
 }
 
+/* Releases a copy returned by fs_read_inode */
+void fs_free_inode(Inode *inode)
+{
+    slab_free(&inode_copies, inode);
+}
+
 bool fs_write_inode(FileSystem *fs, Inode* inode, int inode_number) 
 {
     if (fs == NULL || fs->disk == NULL) 
@@ -868,29 +1490,85 @@ bool fs_write_inode(FileSystem *fs, Inode* inode, int inode_number)
         perror("fs_write_inode: Error fs or disk is invalid (NULL)"); 
         return false;
     }
-    if (inode_number > fs->meta_data->inodes) {
-        perror("fs_write_inode: Error inode_number exceeds the total inodes count"); 
-        return false;
-    }
 
-    Block buffer;
-    size_t block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    size_t offset = inode_number % INODES_PER_BLOCK;
-    if (disk_read(fs->disk, block_idx, buffer.data) < 0) 
+    // replaces the in-core inode, written back when the inode cache is flushed
+    fs_lock(fs);
+    Inode *cached = icache_get(fs, inode_number);
+    if (cached == NULL) 
     {
         perror("fs_write_inode: Error reading from disk has failed"); 
+        fs_unlock(fs);
         return false;
     }
+    icache_extents_begin(fs);
+    if (cached != inode) {
+        *cached = *inode;
+    }
+    icache_extents_end(fs, cached, NULL);
+    icache_dirty(cached);
+    icache_put(fs, cached);
+    fs_unlock_changed(fs);
+    return true;
+}
 
-    buffer.inodes[offset] = *inode;
-    if (disk_write(fs->disk, block_idx, buffer.data) < 0) {
-        perror("fs_write_inode: Error writing to disk has failed"); 
+// Puts an extent among the inline extents in logical order, merged with a neighbour
+// it continues both in the file and on disk. Once they are taken the last one makes
+// room and moves into the extent tree, which holds everything after them.
+static bool extent_insert(FileSystem *fs, Inode *inode, Extent extent)
+{
+    uint32_t count = (inode->extent_count < EXTENTS_PER_INODE) ? inode->extent_count : EXTENTS_PER_INODE;
+    bool tree = inode->extent_count > EXTENTS_PER_INODE;
+    uint32_t position = 0;
+    while (position < count && inode->extents[position].logical < extent.logical) position++;
+
+    Extent *left = (position > 0) ? &inode->extents[position - 1] : NULL;
+    Extent *right = (position < count) ? &inode->extents[position] : NULL;
+    uint32_t end = extent.logical + extent.length;
+    if ((left != NULL && left->logical + left->length > extent.logical) || (right != NULL && end > right->logical)) {
+        fprintf(stderr, "extent_add: Error blocks %u..%u are mapped already\n", extent.logical, end - 1);
         return false;
     }
+    bool join_left = (left != NULL && left->logical + left->length == extent.logical &&
+                      left->start + left->length == extent.start);
+    bool join_right = (right != NULL && end == right->logical && extent.start + extent.length == right->start);
+
+    // filling the gap between two inline extents, the extent tree would have to
+    // give one back to keep them full, so with a tree only one side grows
+    if (join_left && join_right && !tree) {
+        left->length += extent.length + right->length;
+        memmove(right, right + 1, (count - position - 1) * sizeof(Extent));
+        memset(&inode->extents[count - 1], 0, sizeof(Extent));
+        inode->extent_count--;
+        return true;
+    }
+    if (join_left) {
+        left->length += extent.length;
+        return true;
+    }
+    if (join_right) {
+        right->start = extent.start;
+        right->logical = extent.logical;
+        right->length += extent.length;
+        return true;
+    }
+
+    // past the inline extents, the extent tree takes the rest
+    if (position == EXTENTS_PER_INODE || (position == count && tree)) return extent_tree_insert(fs, inode, extent);
+    if (count == EXTENTS_PER_INODE) {
+        // the last inline extent goes first in the tree, counted there
+        if (!extent_tree_insert(fs, inode, inode->extents[count - 1])) return false;
+        count--;
+    } else {
+        inode->extent_count++;
+    }
+    memmove(&inode->extents[position + 1], &inode->extents[position], (count - position) * sizeof(Extent));
+    inode->extents[position] = extent;
     return true;
 }
 
-bool extent_add(FileSystem *fs, Inode *inode, uint32_t start, uint32_t length)
+/* Maps length blocks at start to the file from block logical on. Holes around them
+ * stay holes, blocks mapped already make it fail. The inode is pinned with icache_get. */
+bool extent_add(FileSystem *fs, Inode *inode, uint32_t logical, uint32_t start, uint32_t length)
 {
     if (fs == NULL || fs->disk == NULL)
     {
@@ -906,106 +1584,16 @@ bool extent_add(FileSystem *fs, Inode *inode, uint32_t start, uint32_t length)
         perror("extent_add: Error given inode is invalid (NULL)");
         return false;
     }
-
-    // starting from the first extent if the extents are empty for an inode
-    if (inode->extent_count == 0)
-    {
-        inode->extents[0].start = start;
-        inode->extents[0].length = length;
-        inode->extent_count++;
-        return true;
-    }
-
-    // Merge into existing extent
-    if (inode->extent_count > 0 && inode->extent_count <= EXTENTS_PER_INODE)
-    {
-        Extent *last = &inode->extents[inode->extent_count-1]; // get the last extent
-        if (last->start + last->length == start) {
-            last->length += length;
-            return true;
-        }
-    }
-
-    if (inode->extent_count < EXTENTS_PER_INODE) {
-        inode->extents[inode->extent_count].start = start;
-        inode->extents[inode->extent_count].length = length;
-        inode->extent_count++;
-        return true;
-    }
-
-    // overflow case
-    if (inode->extent_count >= EXTENTS_PER_INODE) {
-        // allocate extents block if empty
-        if (inode->extent_block == 0) 
-        {
-            Block buffer;
-            memset(buffer.data, 0, BLOCK_SIZE);
-            Extent extent = fs_allocate(fs, 1, 0);
-            if (disk_write(fs->disk, extent.start, buffer.data) < 0) {
-                perror("extent_add: Error writing to disk has failed");
-                return false;
-            }
-            inode->extent_block = extent.start;
-        }
-        
-        Block extents_buf;
-        if (disk_read(fs->disk, inode->extent_block, extents_buf.data) < 0) {
-            perror("extent_add: Error reading from disk has failed");
-            return false;
-        }
-
-        
-        size_t overflow_count = inode->extent_count - EXTENTS_PER_INODE;
-        if (overflow_count > 0) {
-            Extent *extent_ptr = &extents_buf.extents[overflow_count - 1];
-
-            // contiguous case
-            if ((extent_ptr->start + extent_ptr->length) == start) 
-            {
-                extent_ptr->length += length;
-                if (disk_write(fs->disk, inode->extent_block, extents_buf.data) < 0 ) {
-                    perror("extent_add: Error writing to disk has failed");
-                    return false;
-                }
-                return true;
-            }
-            // non-contiguous case
-            else if (overflow_count < EXTENTS_PER_BLOCK) {
-                extent_ptr++;
-                extent_ptr->start = start;
-                extent_ptr->length = length;
-                inode->extent_count++;
-                if (disk_write(fs->disk, inode->extent_block, extents_buf.data) < 0) {
-                    perror("extent_add: Error writing to disk has failed");
-                    return false;
-                }
-                return true;
-            }
-            else {
-                perror("extent_add: Error extents block is full");
-                return false;
-            }
-        }
-        if (overflow_count == 0) 
-        {
-            Extent *extent_ptr = &extents_buf.extents[0];
-            extent_ptr->start = start;
-            extent_ptr->length = length;
-            inode->extent_count++;
-            if (disk_write(fs->disk, inode->extent_block, extents_buf.data) < 0) {
-                perror("extent_add: Error writing to disk has failed");
-                return false;
-            }
-            return true;
-        }
-
-    }
-
-    fprintf(stderr, "extent_add: No space left in extent block.\n");
-    return false;
+    if (length == 0) return true;
+    Extent extent = { start, length, logical };
+    // the decoded map takes the extent too, after a failure it is rebuilt on the next lookup
+    icache_extents_begin(fs);
+    bool inserted = extent_insert(fs, inode, extent);
+    icache_extents_end(fs, inode, inserted ? &extent : NULL);
+    return inserted;
 }
 
-bool fs_truncate(FileSystem *fs, size_t inode_number) {
+static bool fs_truncate_locked(FileSystem *fs, size_t inode_number) {
         // Validation check
     if (fs == NULL || fs->disk == NULL) {
         perror("fs_truncate: Error fs or disk is invalid (NULL)"); 
@@ -1018,65 +1606,141 @@ bool fs_truncate(FileSystem *fs, size_t inode_number) {
 
     if (inode_number >= fs->meta_data->inodes) return false;
 
-    // Locate the inode
-    uint32_t inode_block_idx = 1 + (inode_number / INODES_PER_BLOCK);
-    uint32_t inode_offset_in_block = inode_number % INODES_PER_BLOCK;
-
-    // Read the block containing the inode
-    Block inode_buffer;
-    if (disk_read(fs->disk, inode_block_idx, inode_buffer.data) < 0) {
+    // Pin the in-core inode
+    Inode *target = icache_get(fs, inode_number);
+    if (target == NULL) {
         fprintf(stderr, "fs_truncate: Error reading inode block has failed.\n");
         return false;
     }
-    Inode *target = &inode_buffer.inodes[inode_offset_in_block];
 
     if (!target->valid) {
         fprintf(stderr, "fs_truncate: Inode is not valid.\n");
+        icache_put(fs, target);
         return false;
     }
 
-    // Cleaning the inode
+    // Cleaning the inode, data still waiting for blocks never reaches the disk
+    delalloc_drop(fs, inode_number);
+    icache_extents_begin(fs);
     target->size = 0;
+    if (target->flags & INODE_INLINE) inline_clear(target);
     for(size_t i = 0; i < EXTENTS_PER_INODE; i++) 
     {
         if (target->extents[i].start != 0 && target->extents[i].length) {
-            for (size_t j = 0; j < target->extents[i].length; j++) {
-                set_bit(fs->bitmap->bits, target->extents[i].start + j, 0);
-            }
+            fs_release_extent(fs, target->extents[i].start, target->extents[i].length);
             target->extents[i].start = 0;
             target->extents[i].length = 0;
+            target->extents[i].logical = 0;
         }
     }
-    if (target->extent_block != 0) 
+    if (target->extent_block == 0) target->extent_count = 0;
+    bool released = target->extent_block == 0 || fs_release_extent_block(fs, target, "fs_truncate");
+    icache_extents_end(fs, target, NULL);
+    if (!released)
     {
-        Block extents_buf;
-        if (disk_read(fs->disk, target->extent_block, extents_buf.data) < 0) {
-            return false;
-        }
+        icache_dirty(target);
+        icache_put(fs, target);
+        return false;
+    }
+    // The cleared inode reaches the inode table when the inode cache is flushed
+    icache_dirty(target);
+    icache_put(fs, target);
 
-        for (size_t i = 0; i < EXTENTS_PER_BLOCK; i++) 
-        {
-            Extent *extent_ptr = &extents_buf.extents[i];
-            for (size_t j = 0; j < extent_ptr->length; j++)
-                set_bit(fs->bitmap->bits, extent_ptr->start + j, 0);
-        }
+    // Mark dirty — will be flushed on fs_unmount
+    fs->bitmap->dirty = true;
+    return true;
+}
 
-        memset(extents_buf.data, 0, BLOCK_SIZE);
-        if (disk_write(fs->disk, target->extent_block, extents_buf.data) < 0) {
-            fprintf(stderr, "fs_truncate: Error failed to write to disk\n");
-            return false;
-        }
+// fs_truncate under the fs lock
+bool fs_truncate(FileSystem *fs, size_t inode_number)
+{
+    fs_lock(fs);
+    bool truncated = fs_truncate_locked(fs, inode_number);
+    fs_unlock_changed(fs);
+    return truncated;
+}
+/* Punches the blocks freed since the last trim out of the backing image.
+ * Returns the amount of blocks handed back to the host, -1 on failure. */
+ssize_t fs_trim(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("fs_trim: Error fs or disk is invalid (NULL)");
+        return -1;
+    }
+    if (!fs->disk->mounted) {
+        fprintf(stderr, "fs_trim: Error disk is not mounted\n");
+        return -1;
+    }
+    fs_lock(fs);
+    ssize_t trimmed = discard_flush(fs);
+    fs_unlock(fs);
+    return trimmed;
+}
 
-        set_bit(fs->bitmap->bits, target->extent_block, 0); 
-        target->extent_block = 0;
-        target->extent_count = 0;
+/* Writes every dirty inode, the bitmap and all buffered blocks back and
+ * flushes the device. Returns false if anything could not be made durable. */
+bool fs_sync(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("fs_sync: Error fs or disk is invalid (NULL)");
+        return false;
     }
-    // Write the modified inode back to disk
-    if (disk_write(fs->disk, inode_block_idx, inode_buffer.data) < 0) {
+    if (!fs->disk->mounted) {
+        fprintf(stderr, "fs_sync: Error disk is not mounted\n");
         return false;
     }
+    return fs_writeback(fs, true);
+}
 
-    // Mark dirty — will be flushed on fs_unmount
-    fs->bitmap->dirty = true;
-    return true;
-}
\ No newline at end of file
+/* Makes one file durable: its inode, the bitmap its blocks are recorded in and
+ * its data. Buffered data is not tracked per file, so the data of other files
+ * pending in the write queue and buffer cache is flushed along with it. */
+bool fs_fsync(FileSystem *fs, size_t inode_number)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("fs_fsync: Error fs or disk is invalid (NULL)");
+        return false;
+    }
+    if (!fs->disk->mounted) {
+        fprintf(stderr, "fs_fsync: Error disk is not mounted\n");
+        return false;
+    }
+    if (inode_number >= fs->meta_data->inodes) {
+        fprintf(stderr, "fs_fsync: Error inode_number is out of bounds\n");
+        return false;
+    }
+
+    // data of the file waiting for blocks gets them first
+    bool ok = delalloc_flush(fs, inode_number);
+    pthread_mutex_lock(&fs->lock);
+    ok = icache_flush_inode(fs, inode_number) && ok;
+    if (fs->bitmap->dirty) {
+        ok = save_bitmap(fs) && ok;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return disk_sync(fs->disk) && ok;
+}
+
+/* Brackets a change to the metadata (bitmaps, inodes, directories) so it is
+ * serialised against other changes and the write-back flusher. Recursive.
+ * A section that changed something ends with fs_unlock_changed. */
+void fs_lock(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) return;
+    pthread_mutex_lock(&fs->lock);
+}
+
+// Releases the lock of a section that only looked at the metadata
+void fs_unlock(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) return;
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// Releases the lock and records the change for the flusher's age threshold
+void fs_unlock_changed(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) return;
+    fs_writeback_dirtied(fs);
+    pthread_mutex_unlock(&fs->lock);
+}
@@ -0,0 +1,544 @@
+#include "fs.h"
+#include "icache.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Inode Cache
+ * The in-core inode table. Inodes are looked up by number in a chained hash
+ * and handed out by pointer, a referenced inode stays pinned in memory and
+ * callers update it in place. Modified inodes are only marked dirty: they
+ * are written back a whole inode-table block at a time when the cache is
+ * flushed (sync, write-back, unmount) or when an unreferenced dirty inode is
+ * evicted, so many updates to neighbouring inodes cost a single block write. Entries are
+ * carved out of slabs and unreferenced ones are recycled in LRU order.
+ * A cached inode also carries its decoded extent map: the inline extents and
+ * the extent tree flattened into one array in logical order, so a logical
+ * block is found by binary search without reading the tree again. The map is
+ * built on the first lookup, updated in place when extent_add maps blocks and
+ * dropped on any other change. Changes to the extents are made between
+ * icache_extents_begin and icache_extents_end, under the lock the lookups take,
+ * so readers that do not hold the fs lock map through consistent extents. */
+
+#define ICACHE_FREE UINT32_MAX  // number of an entry sitting on the free list
+
+// One extent of a decoded map, blocks between two of them are a hole
+typedef struct ExtentSpan ExtentSpan;
+struct ExtentSpan {
+    uint32_t logical;   // First logical block
+    uint32_t end;       // Logical block right after the extent
+    uint32_t start;     // First physical block
+};
+
+typedef struct CachedInode CachedInode;
+struct CachedInode {
+    Inode       inode;      // First member, the Inode pointer handed out is the entry
+    uint32_t    number;     // Inode number, ICACHE_FREE when unused
+    uint32_t    refs;       // Holders, a referenced inode is never evicted
+    bool        dirty;      // Modified since it was loaded or written back
+    bool        mapped;     // map matches the extents
+    uint32_t    map_count;  // Extents in map
+    uint32_t    map_size;   // Extents map has room for, kept when the entry is recycled
+    ExtentSpan  *map;
+    CachedInode *next;      // Hash chain, or free list link
+    CachedInode *older;     // LRU of unreferenced inodes
+    CachedInode *newer;
+};
+
+typedef struct InodeSlab InodeSlab;
+struct InodeSlab {
+    InodeSlab   *next;
+    CachedInode entries[ICACHE_SLAB_INODES];
+};
+
+struct InodeCache {
+    CachedInode     **heads;    // Hash buckets
+    size_t          mask;
+    size_t          capacity;   // Inodes kept before unreferenced ones are evicted
+    size_t          count;      // Inodes cached
+    InodeSlab       *slabs;
+    CachedInode     *free;
+    CachedInode     *oldest;    // Next eviction candidate
+    CachedInode     *newest;
+    InodeCacheStats stats;
+    pthread_mutex_t lock;
+};
+
+static size_t icache_hash(uint32_t number, size_t mask)
+{
+    return (size_t)((number * 0x9E3779B97F4A7C15ULL) >> 23) & mask;
+}
+
+static CachedInode * icache_entry(Inode *inode)
+{
+    return (CachedInode *)inode;
+}
+
+/* Creates an empty inode table keeping up to capacity unreferenced inodes */
+InodeCache * icache_create(size_t capacity)
+{
+    if (capacity == 0) {
+        fprintf(stderr, "icache_create: Error capacity must be at least one inode\n");
+        return NULL;
+    }
+    InodeCache *icache = calloc(1, sizeof(InodeCache));
+    if (icache == NULL) {
+        perror("icache_create: Error allocating the inode cache has failed");
+        return NULL;
+    }
+
+    size_t buckets = 1;
+    while (buckets < capacity) buckets <<= 1;
+    icache->heads = calloc(buckets, sizeof(CachedInode *));
+    if (icache->heads == NULL) {
+        perror("icache_create: Error allocating the hash table has failed");
+        free(icache);
+        return NULL;
+    }
+    icache->mask     = buckets - 1;
+    icache->capacity = capacity;
+    pthread_mutex_init(&icache->lock, NULL);
+    return icache;
+}
+
+/* Frees the table, dirty inodes must have been flushed */
+void icache_destroy(InodeCache *icache)
+{
+    if (icache == NULL) return;
+    while (icache->slabs != NULL) {
+        InodeSlab *slab = icache->slabs;
+        icache->slabs = slab->next;
+        for (size_t i = 0; i < ICACHE_SLAB_INODES; i++) free(slab->entries[i].map);
+        free(slab);
+    }
+    pthread_mutex_destroy(&icache->lock);
+    free(icache->heads);
+    free(icache);
+}
+
+static CachedInode * icache_find(InodeCache *icache, uint32_t number)
+{
+    for (CachedInode *entry = icache->heads[icache_hash(number, icache->mask)]; entry != NULL; entry = entry->next) {
+        if (entry->number == number) return entry;
+    }
+    return NULL;
+}
+
+static void icache_lru_remove(InodeCache *icache, CachedInode *entry)
+{
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else icache->oldest = entry->newer;
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else icache->newest = entry->older;
+    entry->older = entry->newer = NULL;
+}
+
+static void icache_lru_append(InodeCache *icache, CachedInode *entry)
+{
+    entry->older = icache->newest;
+    entry->newer = NULL;
+    if (icache->newest != NULL) icache->newest->newer = entry;
+    else icache->oldest = entry;
+    icache->newest = entry;
+}
+
+static void icache_unlink(InodeCache *icache, CachedInode *entry)
+{
+    CachedInode **link = &icache->heads[icache_hash(entry->number, icache->mask)];
+    while (*link != NULL && *link != entry) link = &(*link)->next;
+    if (*link == entry) *link = entry->next;
+    entry->next = NULL;
+}
+
+// Copies the dirty cached inodes numbered first..last (one inode-table block) into
+// the block and writes it back through the buffer cache. The caller holds the lock.
+static bool icache_write_block(FileSystem *fs, InodeCache *icache, size_t block, uint32_t first, uint32_t last)
+{
+    Buffer *buffer = cache_bread(fs->disk, block);
+    if (buffer == NULL) {
+        fprintf(stderr, "icache_write_block: Error reading inode block %zu has failed\n", block);
+        return false;
+    }
+    Block *inode_block = (Block *)buffer->data;
+    cache_bmodify(fs->disk, buffer);
+    for (uint32_t number = first; number <= last; number++) {
+        CachedInode *entry = icache_find(icache, number);
+        if (entry == NULL || !entry->dirty) continue;
+        inode_block->inodes[number % INODES_PER_BLOCK] = entry->inode;
+        entry->dirty = false;
+    }
+    cache_bmodified(fs->disk, buffer);
+    cache_brelse(fs->disk, buffer);
+    icache->stats.writebacks++;
+    return true;
+}
+
+// Inode numbers sharing the inode-table block of number
+static void icache_block_range(FileSystem *fs, uint32_t number, uint32_t *first, uint32_t *last)
+{
+    *first = number - (number % INODES_PER_BLOCK);
+    *last  = *first + INODES_PER_BLOCK - 1;
+    if (*last >= fs->meta_data->inodes) *last = fs->meta_data->inodes - 1;
+}
+
+// Hands out an unused entry, evicting the least recently released inode once the
+// table is at capacity. Grows past capacity when every inode is referenced.
+static CachedInode * icache_alloc(FileSystem *fs, InodeCache *icache)
+{
+    if (icache->count >= icache->capacity && icache->oldest != NULL) {
+        CachedInode *victim = icache->oldest;
+        if (victim->dirty) {
+            uint32_t first, last;
+            icache_block_range(fs, victim->number, &first, &last);
+            if (!icache_write_block(fs, icache, 1 + victim->number / INODES_PER_BLOCK, first, last)) return NULL;
+        }
+        icache_lru_remove(icache, victim);
+        icache_unlink(icache, victim);
+        icache->count--;
+        icache->stats.evictions++;
+        victim->number = ICACHE_FREE;
+        return victim;
+    }
+
+    if (icache->free == NULL) {
+        InodeSlab *slab = malloc(sizeof(InodeSlab));
+        if (slab == NULL) {
+            perror("icache_alloc: Error allocating an inode slab has failed");
+            return NULL;
+        }
+        slab->next = icache->slabs;
+        icache->slabs = slab;
+        for (size_t i = 0; i < ICACHE_SLAB_INODES; i++) {
+            slab->entries[i].number = ICACHE_FREE;
+            slab->entries[i].map_size = 0;
+            slab->entries[i].map = NULL;
+            slab->entries[i].next = icache->free;
+            icache->free = &slab->entries[i];
+        }
+    }
+    CachedInode *entry = icache->free;
+    icache->free = entry->next;
+    return entry;
+}
+
+/* Returns the in-core copy of an inode, loading it from the inode table on a miss.
+ * The inode stays pinned until icache_put, changes go through icache_dirty. NULL on failure. */
+Inode * icache_get(FileSystem *fs, size_t inode_number)
+{
+    if (fs == NULL || fs->disk == NULL || fs->icache == NULL) {
+        perror("icache_get: Error fs, disk or inode cache is invalid (NULL)");
+        return NULL;
+    }
+    if (inode_number >= fs->meta_data->inodes) {
+        fprintf(stderr, "icache_get: Error inode %zu is out of bounds\n", inode_number);
+        return NULL;
+    }
+
+    InodeCache *icache = fs->icache;
+    pthread_mutex_lock(&icache->lock);
+    CachedInode *entry = icache_find(icache, (uint32_t)inode_number);
+    if (entry != NULL) {
+        if (entry->refs++ == 0) icache_lru_remove(icache, entry);
+        icache->stats.hits++;
+        pthread_mutex_unlock(&icache->lock);
+        return &entry->inode;
+    }
+
+    entry = icache_alloc(fs, icache);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&icache->lock);
+        return NULL;
+    }
+    Block scratch;
+    const Block *inode_block = fs_block_view(fs, 1 + inode_number / INODES_PER_BLOCK, &scratch);
+    if (inode_block == NULL) {
+        fprintf(stderr, "icache_get: Error reading inode %zu has failed\n", inode_number);
+        entry->next = icache->free;
+        icache->free = entry;
+        pthread_mutex_unlock(&icache->lock);
+        return NULL;
+    }
+    entry->inode  = inode_block->inodes[inode_number % INODES_PER_BLOCK];
+    entry->number = (uint32_t)inode_number;
+    entry->refs   = 1;
+    entry->dirty  = false;
+    entry->mapped = false;
+    entry->older  = entry->newer = NULL;
+    size_t bucket = icache_hash(entry->number, icache->mask);
+    entry->next = icache->heads[bucket];
+    icache->heads[bucket] = entry;
+    icache->count++;
+    icache->stats.misses++;
+    pthread_mutex_unlock(&icache->lock);
+    return &entry->inode;
+}
+
+/* Marks a referenced inode as modified, it is written back on flush or eviction */
+void icache_dirty(Inode *inode)
+{
+    if (inode == NULL) return;
+    icache_entry(inode)->dirty = true;
+}
+
+/* Drops a reference taken by icache_get */
+void icache_put(FileSystem *fs, Inode *inode)
+{
+    if (fs == NULL || fs->icache == NULL || inode == NULL) return;
+    InodeCache *icache = fs->icache;
+    CachedInode *entry = icache_entry(inode);
+    pthread_mutex_lock(&icache->lock);
+    if (entry->refs > 0 && --entry->refs == 0) {
+        icache_lru_append(icache, entry);
+    }
+    pthread_mutex_unlock(&icache->lock);
+}
+
+static int icache_compare(const void *a, const void *b)
+{
+    uint32_t x = (*(CachedInode * const *)a)->number;
+    uint32_t y = (*(CachedInode * const *)b)->number;
+    return (x > y) - (x < y);
+}
+
+/* Writes every dirty inode back into the inode table, one block write per
+ * inode-table block touched. Returns false if a block could not be written. */
+bool icache_flush(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL || fs->icache == NULL) return true;
+    InodeCache *icache = fs->icache;
+    pthread_mutex_lock(&icache->lock);
+
+    size_t dirty = 0;
+    for (InodeSlab *slab = icache->slabs; slab != NULL; slab = slab->next) {
+        for (size_t i = 0; i < ICACHE_SLAB_INODES; i++) {
+            if (slab->entries[i].number != ICACHE_FREE && slab->entries[i].dirty) dirty++;
+        }
+    }
+    if (dirty == 0) {
+        pthread_mutex_unlock(&icache->lock);
+        return true;
+    }
+
+    CachedInode **pending = malloc(dirty * sizeof(CachedInode *));
+    if (pending == NULL) {
+        perror("icache_flush: Error allocating the flush list has failed");
+        pthread_mutex_unlock(&icache->lock);
+        return false;
+    }
+    size_t count = 0;
+    for (InodeSlab *slab = icache->slabs; slab != NULL; slab = slab->next) {
+        for (size_t i = 0; i < ICACHE_SLAB_INODES; i++) {
+            if (slab->entries[i].number != ICACHE_FREE && slab->entries[i].dirty) pending[count++] = &slab->entries[i];
+        }
+    }
+    qsort(pending, count, sizeof(CachedInode *), icache_compare);
+
+    // the inodes of a block are adjacent once sorted, each block is written once
+    bool flushed = true;
+    for (size_t i = 0; i < count; ) {
+        size_t block = 1 + pending[i]->number / INODES_PER_BLOCK;
+        uint32_t first = pending[i]->number;
+        size_t j = i;
+        while (j + 1 < count && 1 + pending[j + 1]->number / INODES_PER_BLOCK == block) j++;
+        if (!icache_write_block(fs, icache, block, first, pending[j]->number)) flushed = false;
+        i = j + 1;
+    }
+    free(pending);
+    pthread_mutex_unlock(&icache->lock);
+    return flushed;
+}
+
+/* Writes the inode-table block holding inode_number back when it has dirty inodes */
+bool icache_flush_inode(FileSystem *fs, size_t inode_number)
+{
+    if (fs == NULL || fs->disk == NULL || fs->icache == NULL) return true;
+    if (inode_number >= fs->meta_data->inodes) return false;
+    InodeCache *icache = fs->icache;
+    pthread_mutex_lock(&icache->lock);
+    CachedInode *entry = icache_find(icache, (uint32_t)inode_number);
+    bool flushed = true;
+    if (entry != NULL && entry->dirty) {
+        uint32_t first, last;
+        icache_block_range(fs, entry->number, &first, &last);
+        flushed = icache_write_block(fs, icache, 1 + inode_number / INODES_PER_BLOCK, first, last);
+    }
+    pthread_mutex_unlock(&icache->lock);
+    return flushed;
+}
+
+// Extent tree visitor appending the extents to the map being built
+static bool icache_map_visit(FileSystem *fs, void *arg, Extent extent, bool node)
+{
+    (void)fs;
+    CachedInode *entry = arg;
+    if (node) return true;
+    if (entry->map_count == entry->inode.extent_count) {
+        fprintf(stderr, "icache_map_build: Error inode %u has more extents than it counts\n", entry->number);
+        return false;
+    }
+    entry->map[entry->map_count] = (ExtentSpan){ extent.logical, extent.logical + extent.length, extent.start };
+    entry->map_count++;
+    return true;
+}
+
+// Decodes the inline extents and the extent tree of an entry into its map.
+// The caller holds the lock.
+static bool icache_map_build(FileSystem *fs, InodeCache *icache, CachedInode *entry)
+{
+    const Inode *inode = &entry->inode;
+    uint32_t count = inode->extent_count;
+    if (count > entry->map_size) {
+        ExtentSpan *map = realloc(entry->map, count * sizeof(ExtentSpan));
+        if (map == NULL) {
+            perror("icache_map_build: Error allocating the extent map has failed");
+            return false;
+        }
+        entry->map = map;
+        entry->map_size = count;
+    }
+
+    entry->map_count = 0;
+    for (uint32_t i = 0; i < count && i < EXTENTS_PER_INODE; i++) {
+        const Extent *extent = &inode->extents[i];
+        entry->map[i] = (ExtentSpan){ extent->logical, extent->logical + extent->length, extent->start };
+        entry->map_count++;
+    }
+    if (count > EXTENTS_PER_INODE && inode->extent_block != 0 &&
+        !extent_tree_walk(fs, inode->extent_block, icache_map_visit, entry)) {
+        fprintf(stderr, "icache_map_build: Error reading the extent tree at %u has failed\n", inode->extent_block);
+        entry->map_count = 0;
+        return false;
+    }
+    entry->mapped = true;
+    icache->stats.maps++;
+    return true;
+}
+
+/* Maps logical_block of an inode handed out by icache_get like extent_run does,
+ * through its decoded extent map: the physical block, and through run (when not
+ * NULL) how many blocks from there on are contiguous until the extent ends. In a
+ * hole it returns 0 with run the blocks up to the next extent, 0 past the last one.
+ * The lookup holds the lock that changes to the extents are made under, so a
+ * reader without the fs lock never maps through extents being rewritten. */
+uint32_t icache_extent_run(FileSystem *fs, const Inode *inode, uint32_t logical_block, uint32_t *run)
+{
+    if (run != NULL) *run = 0;
+    if (fs == NULL || fs->icache == NULL || inode == NULL) return 0;
+    InodeCache *icache = fs->icache;
+    CachedInode *entry = icache_entry((Inode *)inode);
+    pthread_mutex_lock(&icache->lock);
+    if (inode->flags & INODE_INLINE) {
+        pthread_mutex_unlock(&icache->lock);
+        return 0;   // the extents space holds file data
+    }
+    if (!entry->mapped && !icache_map_build(fs, icache, entry)) {
+        // no map, the extents are searched, still under the lock
+        uint32_t block = extent_run(fs, inode, logical_block, run);
+        pthread_mutex_unlock(&icache->lock);
+        return block;
+    }
+
+    // first extent ending after logical_block
+    uint32_t low = 0, high = entry->map_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (entry->map[middle].end <= logical_block) low = middle + 1;
+        else high = middle;
+    }
+    uint32_t block = 0, mapped_run = 0;
+    if (low == entry->map_count) {
+        mapped_run = 0;
+    } else if (logical_block < entry->map[low].logical) {
+        mapped_run = entry->map[low].logical - logical_block;
+    } else {
+        block = entry->map[low].start + (logical_block - entry->map[low].logical);
+        mapped_run = entry->map[low].end - logical_block;
+    }
+    pthread_mutex_unlock(&icache->lock);
+    if (run != NULL) *run = mapped_run;
+    return block;
+}
+
+// Adds an extent extent_add mapped to the decoded map of an entry in logical order,
+// merged with a neighbour it continues in the file and on disk like extent_add does,
+// so filling a hole does not have the map rebuilt. The caller holds the lock.
+static void icache_map_add(CachedInode *entry, Extent extent)
+{
+    // first extent starting after the new one
+    uint32_t count = entry->map_count;
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (entry->map[middle].logical < extent.logical) low = middle + 1;
+        else high = middle;
+    }
+    ExtentSpan *left = (low > 0) ? &entry->map[low - 1] : NULL;
+    ExtentSpan *right = (low < count) ? &entry->map[low] : NULL;
+    uint32_t end = extent.logical + extent.length;
+    bool join_left = (left != NULL && left->end == extent.logical &&
+                      left->start + (left->end - left->logical) == extent.start);
+    bool join_right = (right != NULL && right->logical == end && extent.start + extent.length == right->start);
+    if ((left != NULL && left->end > extent.logical) || (right != NULL && end > right->logical)) {
+        entry->mapped = false;
+    } else if (join_left && join_right) {
+        left->end = right->end;
+        memmove(right, right + 1, (count - low - 1) * sizeof(ExtentSpan));
+        entry->map_count--;
+    } else if (join_left) {
+        left->end = end;
+    } else if (join_right) {
+        right->logical = extent.logical;
+        right->start = extent.start;
+    } else {
+        if (count == entry->map_size) {
+            uint32_t size = (count > 0) ? count * 2 : EXTENTS_PER_INODE;
+            ExtentSpan *map = realloc(entry->map, size * sizeof(ExtentSpan));
+            if (map != NULL) {
+                entry->map = map;
+                entry->map_size = size;
+            }
+        }
+        if (count < entry->map_size) {
+            memmove(&entry->map[low + 1], &entry->map[low], (count - low) * sizeof(ExtentSpan));
+            entry->map[low] = (ExtentSpan){ extent.logical, end, extent.start };
+            entry->map_count++;
+        } else {
+            entry->mapped = false;
+        }
+    }
+}
+
+/* Starts a change to the extents of an inode handed out by icache_get (the fs
+ * lock is held already). Extent map lookups wait until icache_extents_end. */
+void icache_extents_begin(FileSystem *fs)
+{
+    if (fs == NULL || fs->icache == NULL) return;
+    pthread_mutex_lock(&fs->icache->lock);
+}
+
+/* Ends the change begun by icache_extents_begin. When added is not NULL the
+ * change was extent_add mapping it and the decoded map takes it in, any other
+ * change drops the map and it is rebuilt on the next lookup. */
+void icache_extents_end(FileSystem *fs, Inode *inode, const Extent *added)
+{
+    if (fs == NULL || fs->icache == NULL) return;
+    if (inode != NULL) {
+        CachedInode *entry = icache_entry(inode);
+        if (added == NULL) entry->mapped = false;
+        else if (entry->mapped) icache_map_add(entry, *added);
+    }
+    pthread_mutex_unlock(&fs->icache->lock);
+}
+
+/* Snapshot of the inode cache counters */
+InodeCacheStats icache_stats(FileSystem *fs)
+{
+    InodeCacheStats stats = {0};
+    if (fs == NULL || fs->icache == NULL) return stats;
+    pthread_mutex_lock(&fs->icache->lock);
+    stats = fs->icache->stats;
+    stats.cached = fs->icache->count;
+    pthread_mutex_unlock(&fs->icache->lock);
+    return stats;
+}
@@ -0,0 +1,482 @@
+#include "fs.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Format migration
+ * fs_migrate converts the three older layouts in place:
+ *   MAGIC_NUMBER_V0  40-byte inodes, 102 a block, 8-byte extents and one overflow
+ *                    block holding the extents past the inline ones back to back
+ *   MAGIC_NUMBER_V1  the 64-byte inode with inline data, the same overflow block
+ *   MAGIC_NUMBER_V2  8-byte extents past the inline ones in a tree of 510-entry nodes
+ * In all of them the extents cover the file back to back, so the inline extents
+ * get the logical block their lengths add up to, and the extents past them are
+ * collected in memory and dropped from the inode. The whole table is converted
+ * in memory and every collected extent is added again, which builds a tree in the
+ * current layout in the blocks the old image leaves free. A V1 or V2 inode table
+ * keeps its layout. A V0 table gets 64 inodes a block over the same blocks, inode
+ * numbers do not change, so the table holds fewer inodes and an image using an
+ * inode past the new count is refused before anything is written.
+ * Until the converted table is in place the image stays the old one: the trees
+ * and a copy of the table are written to free blocks and synced, then a record
+ * of the copy goes into block 0 after the old superblock. From there the copy is
+ * moved over the old table and the current magic is written last, and an
+ * interrupted conversion is finished from the record by the next fs_migrate.
+ * The old overflow blocks and the copy are freed by the bitmap the first mount
+ * rebuilds. */
+
+#define LEGACY_NODE_MAGIC   (0xe7e7)
+#define LEGACY_NODE_ENTRIES ((BLOCK_SIZE - sizeof(ExtentNodeHeader)) / sizeof(LegacyExtent))
+#define LEGACY_BLOCK_EXTENTS (BLOCK_SIZE / sizeof(LegacyExtent))    // Overflow block of V0 and V1
+#define ORIGINAL_INODES_PER_BLOCK (BLOCK_SIZE / sizeof(OriginalInode))
+#define MIGRATION_RECORD_MAGIC (0x6d696772)
+
+typedef struct LegacyExtent LegacyExtent;
+struct LegacyExtent {
+    uint32_t start;
+    uint32_t length;
+};
+
+// V1 and V2 inode, 64 bytes like the current one
+typedef struct LegacyInode LegacyInode;
+struct LegacyInode {
+    uint32_t valid;
+    uint32_t size;
+    uint32_t extent_count;
+    uint32_t flags;
+    union {
+        struct {
+            LegacyExtent extents[EXTENTS_PER_INODE];
+            uint32_t extent_block;
+        };
+        char inline_data[INODE_INLINE_BYTES];
+    };
+};
+
+// V0 inode, before the flags and the inline data
+typedef struct OriginalInode OriginalInode;
+struct OriginalInode {
+    uint32_t valid;
+    uint32_t size;
+    uint32_t extent_count;
+    LegacyExtent extents[EXTENTS_PER_INODE];
+    uint32_t extent_block;
+};
+
+typedef struct LegacyNode LegacyNode;
+struct LegacyNode {
+    ExtentNodeHeader header;    // Same header, first and end were logical blocks already
+    union {
+        LegacyExtent extents[LEGACY_NODE_ENTRIES];  // Leaf: back to back from header.first on
+        ExtentIndex  index[LEGACY_NODE_ENTRIES];
+    };
+};
+
+// What an inode had past its inline extents, added back into a tree of the current layout
+typedef struct MigratedFile MigratedFile;
+struct MigratedFile {
+    uint32_t inode;
+    uint32_t extent_count;      // Extents in extents
+    uint32_t node_count;        // Old overflow blocks (tree nodes or the extents block) in nodes
+    Extent   *extents;
+    uint32_t *nodes;
+};
+
+// Follows the old superblock in block 0 once the converted table is staged
+typedef struct MigrationRecord MigrationRecord;
+struct MigrationRecord {
+    uint32_t magic;     // MIGRATION_RECORD_MAGIC
+    uint32_t table;     // First block of the staged copy of the converted table
+    uint32_t inodes;    // Inodes of the converted table
+};
+
+typedef struct Migration Migration;
+struct Migration {
+    MigratedFile *files;
+    size_t count;
+    size_t capacity;
+};
+
+static bool migrate_push(void **array, uint32_t *count, size_t size, const void *item)
+{
+    // room for 8 first, doubled whenever count reaches a power of two from there on
+    if (*count == 0 || (*count >= 8 && (*count & (*count - 1)) == 0)) {
+        void *grown = realloc(*array, (*count ? *count * 2 : 8) * size);
+        if (grown == NULL) {
+            perror("fs_migrate: Error allocating memory has failed");
+            return false;
+        }
+        *array = grown;
+    }
+    memcpy((char *)*array + *count * size, item, size);
+    (*count)++;
+    return true;
+}
+
+// Collects the extents and node blocks of an old extent tree, depth first
+static bool migrate_collect(Disk *disk, uint32_t block, int depth, MigratedFile *file, uint32_t *logical)
+{
+    if (depth >= EXTENT_TREE_LEVELS) {
+        fprintf(stderr, "fs_migrate: Error the extent tree of inode %u is too deep\n", file->inode);
+        return false;
+    }
+    if (block == 0 || block >= disk->blocks) {
+        fprintf(stderr, "fs_migrate: Error inode %u points at block %u\n", file->inode, block);
+        return false;
+    }
+    LegacyNode *node = (LegacyNode *)disk_buffer_get(disk);
+    if (node == NULL) {
+        perror("fs_migrate: Error borrowing a block buffer has failed");
+        return false;
+    }
+    bool collected = disk_read(disk, block, (char *)node) >= 0 && migrate_push((void **)&file->nodes, &file->node_count, sizeof(uint32_t), &block);
+    if (collected && (node->header.magic != LEGACY_NODE_MAGIC || node->header.count > LEGACY_NODE_ENTRIES)) {
+        fprintf(stderr, "fs_migrate: Error block %u of inode %u is not an extent tree node\n", block, file->inode);
+        collected = false;
+    }
+    for (uint32_t i = 0; collected && i < node->header.count; i++) {
+        if (node->header.level > 0) {
+            collected = migrate_collect(disk, node->index[i].block, depth + 1, file, logical);
+            continue;
+        }
+        Extent extent = { node->extents[i].start, node->extents[i].length, *logical };
+        *logical += extent.length;
+        collected = migrate_push((void **)&file->extents, &file->extent_count, sizeof(Extent), &extent);
+    }
+    disk_buffer_put(disk, (char *)node);
+    return collected;
+}
+
+// Collects the extents of a V0 or V1 overflow block, count of them back to back
+static bool migrate_collect_block(Disk *disk, uint32_t block, uint32_t count, MigratedFile *file, uint32_t *logical)
+{
+    if (block == 0 || block >= disk->blocks) {
+        fprintf(stderr, "fs_migrate: Error inode %u points at block %u\n", file->inode, block);
+        return false;
+    }
+    if (count > LEGACY_BLOCK_EXTENTS) {
+        fprintf(stderr, "fs_migrate: Error inode %u counts more extents than its extents block holds\n", file->inode);
+        return false;
+    }
+    LegacyExtent *extents = (LegacyExtent *)disk_buffer_get(disk);
+    if (extents == NULL) {
+        perror("fs_migrate: Error borrowing a block buffer has failed");
+        return false;
+    }
+    bool collected = disk_read(disk, block, (char *)extents) >= 0 && migrate_push((void **)&file->nodes, &file->node_count, sizeof(uint32_t), &block);
+    for (uint32_t i = 0; collected && i < count; i++) {
+        Extent extent = { extents[i].start, extents[i].length, *logical };
+        *logical += extent.length;
+        collected = migrate_push((void **)&file->extents, &file->extent_count, sizeof(Extent), &extent);
+    }
+    disk_buffer_put(disk, (char *)extents);
+    return collected;
+}
+
+/* Gives inode the extents of an old inode of format magic, the inline ones with
+ * their logical block and the ones past them collected into migration */
+static bool migrate_extents(Disk *disk, uint32_t magic, uint32_t number, const LegacyExtent *extents,
+                            uint32_t extent_count, uint32_t extent_block, Inode *inode, Migration *migration)
+{
+    uint32_t count = (extent_count < EXTENTS_PER_INODE) ? extent_count : EXTENTS_PER_INODE;
+    uint32_t logical = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    for (uint32_t e = 0; e < count; e++) {
+        inode->extents[e] = (Extent){ extents[e].start, extents[e].length, logical };
+        logical += extents[e].length;
+    }
+    inode->extent_count = count;
+    inode->extent_block = 0;
+    if (extent_count <= EXTENTS_PER_INODE || extent_block == 0) return true;
+
+    if (migration->count == migration->capacity) {
+        size_t capacity = migration->capacity ? migration->capacity * 2 : 16;
+        MigratedFile *files = realloc(migration->files, capacity * sizeof(MigratedFile));
+        if (files == NULL) {
+            perror("fs_migrate: Error allocating memory has failed");
+            return false;
+        }
+        migration->files = files;
+        migration->capacity = capacity;
+    }
+    MigratedFile *file = &migration->files[migration->count++];
+    memset(file, 0, sizeof(*file));
+    file->inode = number;
+    if (magic == MAGIC_NUMBER_V2) return migrate_collect(disk, extent_block, 0, file, &logical);
+    return migrate_collect_block(disk, extent_block, extent_count - EXTENTS_PER_INODE, file, &logical);
+}
+
+// Converts the V1 or V2 inodes of one inode table block, the old overflow extents go into migration
+static bool migrate_inodes(Disk *disk, uint32_t magic, Block *block, uint32_t first_inode, uint32_t inodes, Migration *migration)
+{
+    for (uint32_t j = 0; j < INODES_PER_BLOCK && first_inode + j < inodes; j++) {
+        LegacyInode old;
+        memcpy(&old, &block->inodes[j], sizeof(old));
+        if (!old.valid || (old.flags & INODE_INLINE)) continue;   // inline data stays where it is
+        if (!migrate_extents(disk, magic, first_inode + j, old.extents, old.extent_count, old.extent_block,
+                             &block->inodes[j], migration)) return false;
+    }
+    return true;
+}
+
+/* Converts a V0 inode table into table, all inode_blocks blocks of it in memory:
+ * the 64-byte inodes need more blocks than the 40-byte ones did, so each one is
+ * only written once every old block is read. superblock->inodes shrinks to the
+ * new count. */
+static bool migrate_original_table(Disk *disk, Block *block, Block *table, SuperBlock *superblock, Migration *migration)
+{
+    uint32_t inodes = superblock->inode_blocks * INODES_PER_BLOCK;
+    for (uint32_t b = 1; b <= superblock->inode_blocks; b++) {
+        if (disk_read(disk, b, block->data) < 0) {
+            perror("fs_migrate: Error reading the inode table has failed");
+            return false;
+        }
+        const OriginalInode *old = (const OriginalInode *)block->data;
+        for (uint32_t j = 0; j < ORIGINAL_INODES_PER_BLOCK; j++) {
+            uint32_t number = (b - 1) * ORIGINAL_INODES_PER_BLOCK + j;
+            if (number >= superblock->inodes) break;
+            if (!old[j].valid) continue;
+            if (number >= inodes) {
+                fprintf(stderr, "fs_migrate: Error inode %u does not fit the %u inodes of the converted table\n", number, inodes);
+                return false;
+            }
+            Inode *inode = &table[number / INODES_PER_BLOCK].inodes[number % INODES_PER_BLOCK];
+            inode->valid = old[j].valid;
+            inode->size = old[j].size;
+            if (!migrate_extents(disk, MAGIC_NUMBER_V0, number, old[j].extents, old[j].extent_count,
+                                 old[j].extent_block, inode, migration)) return false;
+        }
+    }
+    superblock->inodes = inodes;
+    return true;
+}
+
+static bool migrate_mark(uint32_t *bits, uint32_t blocks, uint32_t inode, uint32_t start, uint32_t length)
+{
+    if (start >= blocks || length > blocks - start) {
+        fprintf(stderr, "fs_migrate: Error inode %u maps blocks %u..%u past the end of the disk\n", inode, start, start + length - 1);
+        return false;
+    }
+    for (uint32_t b = 0; b < length; b++) set_bit(bits, start + b, 1);
+    return true;
+}
+
+/* Fills bits like the mount scan would for the converted table, with the old
+ * overflow blocks and the extents collected from them in use as well */
+static bool migrate_bitmap(const SuperBlock *superblock, const Block *table, const Migration *migration, uint32_t *bits)
+{
+    uint32_t meta_blocks = 2 + superblock->inode_blocks + superblock->bitmap_blocks;
+    for (uint32_t k = 0; k < meta_blocks; k++) set_bit(bits, k, 1);
+
+    for (uint32_t i = 0; i < superblock->inodes && i < superblock->inode_blocks * INODES_PER_BLOCK; i++) {
+        const Inode *inode = &table[i / INODES_PER_BLOCK].inodes[i % INODES_PER_BLOCK];
+        if (!inode->valid || (inode->flags & INODE_INLINE)) continue;
+        for (uint32_t e = 0; e < inode->extent_count && e < EXTENTS_PER_INODE; e++) {
+            if (!migrate_mark(bits, superblock->blocks, i, inode->extents[e].start, inode->extents[e].length)) return false;
+        }
+    }
+    for (size_t f = 0; f < migration->count; f++) {
+        const MigratedFile *file = &migration->files[f];
+        for (uint32_t e = 0; e < file->extent_count; e++) {
+            if (!migrate_mark(bits, superblock->blocks, file->inode, file->extents[e].start, file->extents[e].length)) return false;
+        }
+        for (uint32_t n = 0; n < file->node_count; n++) set_bit(bits, file->nodes[n], 1);
+    }
+    return true;
+}
+
+// Adds the collected extents to the converted inodes, their trees go into blocks staging has free
+static bool migrate_trees(FileSystem *staging, Block *table, Migration *migration)
+{
+    for (size_t f = 0; f < migration->count; f++) {
+        MigratedFile *file = &migration->files[f];
+        Inode *inode = &table[file->inode / INODES_PER_BLOCK].inodes[file->inode % INODES_PER_BLOCK];
+        for (uint32_t e = 0; e < file->extent_count; e++) {
+            Extent *extent = &file->extents[e];
+            if (!extent_add(staging, inode, extent->logical, extent->start, extent->length)) {
+                fprintf(stderr, "fs_migrate: Error adding the extents of inode %u has failed\n", file->inode);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Copies the staged table of record over the old one and writes the current
+ * magic last. Everything it writes is in the record, so after an interruption
+ * it runs again from the start. */
+static bool migrate_finish(Disk *disk, Block *block, SuperBlock superblock, MigrationRecord record)
+{
+    Block *chunk = aligned_alloc(DISK_ALIGNMENT, MOUNT_SCAN_BLOCKS * sizeof(Block));
+    if (chunk == NULL) {
+        perror("fs_migrate: Error allocating memory has failed");
+        return false;
+    }
+    bool copied = true;
+    for (uint32_t b = 0; b < superblock.inode_blocks && copied; b += MOUNT_SCAN_BLOCKS) {
+        size_t count = superblock.inode_blocks - b;
+        if (count > MOUNT_SCAN_BLOCKS) count = MOUNT_SCAN_BLOCKS;
+        copied = disk_read_blocks(disk, record.table + b, count, chunk->data) >= 0 &&
+                 disk_write_blocks(disk, 1 + b, count, chunk->data) >= 0;
+    }
+    free(chunk);
+    if (!copied) {
+        perror("fs_migrate: Error copying the converted inode table has failed");
+        return false;
+    }
+    // a cleared first bit makes fs_mount rebuild the bitmap from the converted
+    // table, which frees the staged copy and the old overflow blocks
+    if (disk_read(disk, superblock.inode_blocks + 1, block->data) < 0) {
+        perror("fs_migrate: Error reading the bitmap has failed");
+        return false;
+    }
+    set_bit((uint32_t *)block->data, 0, 0);
+    if (disk_write(disk, superblock.inode_blocks + 1, block->data) < 0 || !disk_sync(disk)) {
+        perror("fs_migrate: Error writing the bitmap has failed");
+        return false;
+    }
+
+    memset(block->data, 0, BLOCK_SIZE);
+    block->super = superblock;
+    block->super.magic_number = MAGIC_NUMBER;
+    block->super.inodes = record.inodes;
+    if (disk_write(disk, 0, block->data) < 0 || !disk_sync(disk)) {
+        perror("fs_migrate: Error writing the super block has failed");
+        return false;
+    }
+    return true;
+}
+
+/* Converts the image of superblock up to the record migrate_finish completes. The
+ * old table and overflow blocks are only read, the new trees and a converted
+ * copy of the table go into blocks the old image leaves free. */
+static bool migrate_convert(Disk *disk, Block *block, SuperBlock superblock)
+{
+    uint32_t magic = superblock.magic_number;
+    SuperBlock original = superblock;
+    size_t table_bytes = (size_t)superblock.inode_blocks * BLOCK_SIZE;
+    size_t bitmap_bytes = (size_t)superblock.bitmap_blocks * BLOCK_SIZE;
+    Block *table = aligned_alloc(DISK_ALIGNMENT, table_bytes);
+    Bitmap bitmap = { false, aligned_alloc(DISK_ALIGNMENT, bitmap_bytes) };
+    Migration migration = { NULL, 0, 0 };
+    bool migrated = table != NULL && bitmap.bits != NULL;
+    if (!migrated) {
+        perror("fs_migrate: Error allocating memory has failed");
+    } else {
+        memset(table, 0, table_bytes);
+        memset(bitmap.bits, 0, bitmap_bytes);
+    }
+
+    if (migrated && magic == MAGIC_NUMBER_V0) {
+        migrated = migrate_original_table(disk, block, table, &superblock, &migration);
+    } else if (migrated) {
+        migrated = disk_read_blocks(disk, 1, superblock.inode_blocks, table->data) >= 0;
+        for (uint32_t b = 0; b < superblock.inode_blocks && migrated; b++) {
+            migrated = migrate_inodes(disk, magic, &table[b], b * INODES_PER_BLOCK, superblock.inodes, &migration);
+        }
+    }
+    migrated = migrated && migrate_bitmap(&superblock, table, &migration, bitmap.bits);
+
+    // fs_allocate hands out the blocks of a mounted disk only, nothing else uses it meanwhile
+    FileSystem staging;
+    memset(&staging, 0, sizeof(staging));
+    staging.disk = disk;
+    staging.meta_data = &superblock;
+    staging.bitmap = &bitmap;
+    Extent staged = { 0, 0, 0 };
+    if (migrated) {
+        disk->mounted = true;
+        migrated = migrate_trees(&staging, table, &migration);
+        if (migrated) staged = fs_allocate(&staging, superblock.inode_blocks, 0);
+        disk->mounted = false;
+        migrated = migrated && staged.length == superblock.inode_blocks;
+    }
+    // the saved bitmap keeps the old overflow blocks, until the record is written the image is the old one
+    migrated = migrated && disk_write_blocks(disk, staged.start, superblock.inode_blocks, table->data) >= 0 &&
+               save_bitmap(&staging) && disk_sync(disk);
+    if (migrated) {
+        MigrationRecord record = { MIGRATION_RECORD_MAGIC, staged.start, superblock.inodes };
+        memset(block->data, 0, BLOCK_SIZE);
+        block->super = original;
+        memcpy(block->data + sizeof(SuperBlock), &record, sizeof(record));
+        migrated = disk_write(disk, 0, block->data) >= 0 && disk_sync(disk) &&
+                   migrate_finish(disk, block, original, record);
+    }
+
+    for (size_t f = 0; f < migration.count; f++) {
+        free(migration.files[f].extents);
+        free(migration.files[f].nodes);
+    }
+    free(migration.files);
+    free(bitmap.bits);
+    free(table);
+    return migrated;
+}
+
+/* Mounts disk like fs_mount, converting an image of an older format (see
+ * fs_older_format) to the current one in place first. A failed conversion
+ * leaves the image unmounted, in its old format or with a record of the
+ * conversion the next fs_migrate finishes. */
+bool fs_migrate(FileSystem *fs, Disk *disk)
+{
+    if (fs == NULL || disk == NULL) {
+        perror("fs_migrate: Error disk is invalid");
+        return false;
+    }
+    if (disk->mounted) {
+        fprintf(stderr, "fs_migrate: Error disk is mounted, aborting\n");
+        return false;
+    }
+    Block *block = (Block *)disk_buffer_get(disk);
+    if (block == NULL) {
+        perror("fs_migrate: Error borrowing a block buffer has failed");
+        return false;
+    }
+    if (disk_read(disk, 0, block->data) < 0) {
+        perror("fs_migrate: Failed to read super block from disk");
+        disk_buffer_put(disk, block->data);
+        return false;
+    }
+    SuperBlock superblock = block->super;
+    MigrationRecord record;
+    memcpy(&record, block->data + sizeof(SuperBlock), sizeof(record));
+    uint32_t magic = superblock.magic_number;
+    if (fs_older_format(magic) == NULL) {
+        // current already, or fs_mount reports what it is
+        disk_buffer_put(disk, block->data);
+        return fs_mount(fs, disk);
+    }
+    if (superblock.blocks != disk->blocks) {
+        fprintf(stderr, "fs_migrate: Error Super block amount of blocks (%u) mismatch the disk capacity (%zu), aborting...\n",
+                superblock.blocks, disk->blocks);
+        disk_buffer_put(disk, block->data);
+        return false;
+    }
+
+    // the buffer cache fs_mount sets up takes the tree nodes too, the syncs between the steps flush it
+    if (disk->cache == NULL && !cache_enable(disk, FS_CACHE_BLOCKS)) {
+        fprintf(stderr, "fs_migrate: Warning buffer cache is unavailable, the trees are written a node at a time\n");
+    }
+
+    bool migrated;
+    if (record.magic == MIGRATION_RECORD_MAGIC) {
+        fprintf(stderr, "fs_migrate: Finishing the interrupted conversion from %s\n", fs_older_format(magic));
+        uint32_t meta_blocks = 2 + superblock.inode_blocks + superblock.bitmap_blocks;
+        migrated = record.table >= meta_blocks && record.table <= superblock.blocks - superblock.inode_blocks &&
+                   migrate_finish(disk, block, superblock, record);
+    } else {
+        fprintf(stderr, "fs_migrate: Converting the image from %s\n", fs_older_format(magic));
+        migrated = migrate_convert(disk, block, superblock);
+    }
+    disk_buffer_put(disk, block->data);
+    if (!migrated) {
+        fprintf(stderr, "fs_migrate: Error converting the image has failed\n");
+        return false;
+    }
+
+    // the bitmap fs_mount rebuilt from the converted table is saved with the next sync
+    if (!fs_mount(fs, disk)) return false;
+    fs->bitmap->dirty = true;
+    return true;
+}
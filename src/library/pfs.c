@@ -10,12 +10,13 @@ bool pfs_format(Disk *disk)
     return fs_format(disk);
 }
 
-bool pfs_mount(pFileSystem *pfs, Disk *disk) 
+// Mounts the file system with mount (fs_mount or fs_migrate) and loads the extension stats
+static bool pfs_mount_with(pFileSystem *pfs, Disk *disk, bool (*mount)(FileSystem *, Disk *))
 {
     pfs->fs = calloc(1, sizeof(FileSystem));
     if (pfs->fs == NULL) return false;
 
-    bool flag = fs_mount(pfs->fs, disk);
+    bool flag = mount(pfs->fs, disk);
     if (flag) 
     {
         Block buffer;
@@ -30,6 +31,9 @@ bool pfs_mount(pFileSystem *pfs, Disk *disk)
         if (pfs->entries == NULL) {
             return false;
         }
+        pfs->live_files = NULL;
+        pfs->live_count = 0;
+        slab_pool_init(&pfs->live_pool, sizeof(LiveFileEntry), PFS_LIVE_SLAB);
         ExtensionEntry *ptr = (ExtensionEntry *)buffer.data;
 
         for (size_t i = 0; i < ENTRIES_PER_BLOCK; i++) {
@@ -41,6 +45,8 @@ bool pfs_mount(pFileSystem *pfs, Disk *disk)
     }
     else 
     {
+        // a mount that failed after mounting the image is released like pfs_unmount does
+        if (disk != NULL && disk->mounted) fs_unmount(pfs->fs);
         free(pfs->fs);
         free(pfs->entries);
         
@@ -48,6 +54,17 @@ bool pfs_mount(pFileSystem *pfs, Disk *disk)
     }
 }
 
+bool pfs_mount(pFileSystem *pfs, Disk *disk) 
+{
+    return pfs_mount_with(pfs, disk, fs_mount);
+}
+
+// pfs_mount for an image of an older format, converted in place first (see fs_migrate)
+bool pfs_migrate(pFileSystem *pfs, Disk *disk)
+{
+    return pfs_mount_with(pfs, disk, fs_migrate);
+}
+
 ssize_t pfs_create(pFileSystem *pfs, const char *path) 
 {
     if (pfs->fs == NULL) return false;
@@ -56,26 +73,27 @@ ssize_t pfs_create(pFileSystem *pfs, const char *path)
     // check if we managed to get allocated an inode
     if (inode_file != -1) {
         // File has been created and inode is given
-        // extract the file components
+        // extract the file components, the parent path lives in the thread's arena
+        ArenaMark mark = arena_mark();
         char *parentdir_path = extract_parentdir(path);
         char *filename = extract_filename(path);
         // validation checks
         if (parentdir_path == NULL || filename == NULL) 
         {
-            free(parentdir_path);
+            arena_release(mark);
             return -1;
         }
         // retrieve the parent directory inode
         ssize_t inode_parentdir = fs_lookup(pfs->fs, parentdir_path);
         if (inode_parentdir == -1) 
         {
-            free(parentdir_path);
+            arena_release(mark);
             return -1;
         }
         // adding the file entry into the directory
         if (dir_add(pfs->fs, inode_parentdir, filename, inode_file) < 0)
         {
-            free(parentdir_path);
+            arena_release(mark);
             return -1;
         }
 
@@ -88,7 +106,7 @@ ssize_t pfs_create(pFileSystem *pfs, const char *path)
             ExtensionEntry *entry = add_entry(pfs, &tempEntry);
             if (entry == NULL) 
             {
-                free(parentdir_path);
+                arena_release(mark);
                 return -1;
             }
             LiveFileEntry live_entry;
@@ -96,14 +114,14 @@ ssize_t pfs_create(pFileSystem *pfs, const char *path)
             live_entry.first_write_size = 0;
             strncpy(live_entry.extension, extension, 16);
             if (add_live_entry(pfs, &live_entry) == NULL) {
-                free(parentdir_path);
+                arena_release(mark);
                 return -1;
             }
             pfs->dirty = true;
 
         }
         // cleanup and return
-        free(parentdir_path);
+        arena_release(mark);
         return inode_file;
     }
     else {
@@ -133,16 +151,26 @@ ssize_t pfs_write(pFileSystem *pfs, size_t inode_number, const char *data, size_
             } else if (confidence >= LOW_CONFIDENCE) {
                 predicted_size = (uint32_t)(first_size * (1.0f + bucket->mean_ratio * 0.5f));
             }
-            if (predicted_size > first_size) {
+            // delayed allocation sees the real size at flush time, nothing to guess
+            if (predicted_size > first_size && pfs->fs->delalloc == NULL) {
                 uint32_t blocks = (predicted_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-                Inode *inode = fs_read_inode(pfs->fs, inode_number);
+                fs_lock(pfs->fs);
+                Inode *inode = icache_get(pfs->fs, inode_number);
                 if (inode != NULL) {
-                    Extent ext_alloc = fs_allocate(pfs->fs, blocks, 0);
+                    // a file spanning a full stripe starts on a stripe boundary so its writes cover whole stripes
+                    size_t stripe = pfs->fs->disk->stripe_width;
+                    Extent ext_alloc = (stripe > 0 && blocks >= stripe)
+                                     ? fs_allocate_aligned(pfs->fs, blocks, stripe)
+                                     : fs_allocate(pfs->fs, blocks, 0);
                     if (ext_alloc.start != 0) {
-                        extent_add(pfs->fs, inode, ext_alloc.start, ext_alloc.length);
+                        // the preallocated extent lands in the in-core inode fs_write picks up
+                        if (extent_add(pfs->fs, inode, extent_blocks(pfs->fs, inode), ext_alloc.start, ext_alloc.length)) {
+                            icache_dirty(inode);
+                        }
                     }
-                    free(inode);
+                    icache_put(pfs->fs, inode);
                 }
+                fs_unlock_changed(pfs->fs);
             }
         }
         live->first_write_size = first_size;
@@ -169,7 +197,8 @@ bool pfs_unmount(pFileSystem *pfs)
             return false;
         }
     }
-    free(pfs->live_files);
+    slab_pool_destroy(&pfs->live_pool);
+    pfs->live_files = NULL;
     fs_unmount(pfs->fs);
     free(pfs->entries);
     free(pfs->fs);
@@ -286,15 +315,13 @@ LiveFileEntry* add_live_entry(pFileSystem *pfs, LiveFileEntry *entry) {
         perror("add_live_entry: pfs given is invalid");
         return NULL;
     }
-    if (pfs->live_count == pfs->live_capacity) {
-        size_t new_capacity = (pfs->live_capacity == 0) ? 8 : pfs->live_capacity * 2;
-        LiveFileEntry *new_live = realloc(pfs->live_files, new_capacity * sizeof(LiveFileEntry));
-        if (new_live == NULL) return NULL;
-        pfs->live_files = new_live;
-        pfs->live_capacity = new_capacity;
-    }
-    pfs->live_files[pfs->live_count] = *entry;
-    return &pfs->live_files[pfs->live_count++];
+    LiveFileEntry *live = slab_alloc(&pfs->live_pool);
+    if (live == NULL) return NULL;
+    *live = *entry;
+    live->next = pfs->live_files;
+    pfs->live_files = live;
+    pfs->live_count++;
+    return live;
 }
 
 LiveFileEntry* find_live_entry(pFileSystem *pfs, size_t inode_number) {
@@ -305,10 +332,10 @@ LiveFileEntry* find_live_entry(pFileSystem *pfs, size_t inode_number) {
         return NULL;
     }
 
-    for (size_t i = 0; i < pfs->live_count; i++) 
+    for (LiveFileEntry *live = pfs->live_files; live != NULL; live = live->next) 
     {
-        if (inode_number == pfs->live_files[i].inode_number) {
-            return &pfs->live_files[i];
+        if (inode_number == live->inode_number) {
+            return live;
         }
     }
     // an entry file with the inode number is not found
@@ -322,10 +349,12 @@ void remove_live_entry(pFileSystem *pfs, size_t inode_number) {
         perror("remove_live_entry: live_files or pfs given is invalid");
         return;
     }
-    for (size_t i = 0; i < pfs->live_count; i++) {
-        if (inode_number == pfs->live_files[i].inode_number) 
+    for (LiveFileEntry **link = &pfs->live_files; *link != NULL; link = &(*link)->next) {
+        if (inode_number == (*link)->inode_number) 
         {
-            pfs->live_files[i] = pfs->live_files[pfs->live_count - 1];
+            LiveFileEntry *live = *link;
+            *link = live->next;
+            slab_free(&pfs->live_pool, live);
             pfs->live_count--;
             return;
         }
@@ -0,0 +1,300 @@
+#include "fs.h"
+#include "readahead.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Readahead
+ * Every fs_read is matched against the last read of its inode: a read that
+ * starts where the previous one ended (or one stride further) continues a
+ * sequential stream. Once less than a window is prefetched ahead of a
+ * stream the next window is mapped through the extent map into contiguous
+ * physical runs, so a window covers the rest of the current extent and the
+ * start of the next one. The buffers of a run are reserved in the cache
+ * right away and a worker thread reads them, a reader reaching them first
+ * waits for that read instead of issuing its own. A small read that finds
+ * nothing requested for it yet reads its window itself. The window doubles
+ * each time the reader consumes prefetched blocks and halves on a random
+ * read. A reader whose records span the window already makes requests as
+ * large as a window would and is left alone. The worker starts with the first prefetch, so a daemon that forks
+ * after mounting still gets it. Disks that expose their blocks in memory
+ * (mmap) are served in place and are not read ahead. */
+
+typedef struct ReadaheadStream ReadaheadStream;
+struct ReadaheadStream {
+    size_t   inode;     // Inode followed by this slot, SIZE_MAX when free
+    size_t   offset;    // Offset of the last read
+    size_t   length;    // Bytes it covered
+    size_t   stride;    // Distance between the last two reads, 0 when not moving forward
+    uint32_t window;    // Blocks in the next window
+    uint32_t ahead;     // First logical block not prefetched yet
+};
+
+typedef struct ReadaheadRun ReadaheadRun;
+struct ReadaheadRun {
+    size_t block;       // First physical block
+    size_t count;
+};
+
+// Buffers reserved for one run, waiting for the worker
+typedef struct ReadaheadLoad ReadaheadLoad;
+struct ReadaheadLoad {
+    BlockVec *vec;
+    size_t   count;
+};
+
+struct Readahead {
+    Disk            *disk;
+    SlabPool        vectors;    // Block vectors of reserved runs, READAHEAD_RUN_BLOCKS each
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    ReadaheadLoad   queue[READAHEAD_QUEUE_RUNS];    // Ring of reserved runs waiting for the worker
+    size_t          head;
+    size_t          count;
+    pthread_t       thread;
+    bool            started;
+    bool            failed;     // The worker could not start, runs are prefetched inline
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    ReadaheadStats  stats;
+};
+
+static void * readahead_thread(void *arg)
+{
+    Readahead *readahead = arg;
+
+    pthread_mutex_lock(&readahead->lock);
+    while (!readahead->stop) {
+        if (readahead->count == 0) {
+            pthread_cond_wait(&readahead->wake, &readahead->lock);
+            continue;
+        }
+        ReadaheadLoad load = readahead->queue[readahead->head];
+        readahead->head = (readahead->head + 1) % READAHEAD_QUEUE_RUNS;
+        readahead->count--;
+        pthread_mutex_unlock(&readahead->lock);
+
+        if (!cache_prefetch_complete(readahead->disk, load.vec, load.count, true)) {
+            fprintf(stderr, "readahead_thread: Error prefetching %zu blocks from %zu has failed\n",
+                    load.count, load.vec[0].block);
+        }
+        slab_free(&readahead->vectors, load.vec);
+        pthread_mutex_lock(&readahead->lock);
+    }
+    pthread_mutex_unlock(&readahead->lock);
+    return NULL;
+}
+
+// Splits logical blocks [start, *end) into contiguous physical runs. A window ending
+// a few blocks short of its extent takes the rest of the extent along, *end follows.
+static size_t readahead_map(FileSystem *fs, const Inode *inode, uint32_t start, uint32_t *end,
+                            uint32_t end_of_file, ReadaheadRun *runs)
+{
+    size_t count = 0;
+    uint32_t logical = start;
+    while (logical < *end && count < READAHEAD_QUEUE_RUNS) {
+        uint32_t run;
+        uint32_t block = icache_extent_run(fs, inode, logical, &run);
+        if (block == 0) break;  // hole or past the mapped extents
+        if (logical + run > end_of_file) run = end_of_file - logical;
+        if (logical + run > *end && logical + run - *end <= READAHEAD_MIN_BLOCKS) *end = logical + run;
+        if (logical + run > *end) run = *end - logical;
+        runs[count].block = block;
+        runs[count].count = run;
+        count++;
+        logical += run;
+    }
+    *end = logical;
+    return count;
+}
+
+// Reserves the buffers of every run and hands them to the worker, or reads them
+// right here when the reader needs them now or there is no worker
+static void readahead_issue(FileSystem *fs, Readahead *readahead, const ReadaheadRun *runs, size_t count, bool sync)
+{
+    for (size_t i = 0; i < count; i++) {
+        ReadaheadLoad load = { .vec = slab_alloc(&readahead->vectors), .count = 0 };
+        if (load.vec == NULL) {
+            perror("fs_readahead: Error allocating a prefetch vector has failed");
+            return;
+        }
+        load.count = cache_prefetch_reserve(fs->disk, runs[i].block, runs[i].count, load.vec);
+
+        bool queued = false;
+        if (load.count > 0 && !sync) {
+            pthread_mutex_lock(&readahead->lock);
+            if (readahead->started && readahead->count < READAHEAD_QUEUE_RUNS) {
+                readahead->queue[(readahead->head + readahead->count) % READAHEAD_QUEUE_RUNS] = load;
+                readahead->count++;
+                pthread_cond_signal(&readahead->wake);
+                queued = true;
+            } else {
+                readahead->stats.inline_runs++;
+            }
+            pthread_mutex_unlock(&readahead->lock);
+        }
+        if (!queued) {
+            if (!cache_prefetch_complete(fs->disk, load.vec, load.count, true)) {
+                fprintf(stderr, "fs_readahead: Error prefetching blocks %zu..%zu has failed\n",
+                        runs[i].block, runs[i].block + runs[i].count - 1);
+            }
+            slab_free(&readahead->vectors, load.vec);
+        }
+    }
+}
+
+/* Feeds a read of length bytes at offset of a pinned inode to the stream
+ * detector and queues the next window when the stream needs one */
+void fs_readahead(FileSystem *fs, size_t inode_number, const Inode *inode, size_t offset, size_t length)
+{
+    if (fs == NULL || fs->readahead == NULL || fs->disk == NULL || inode == NULL) return;
+    if (fs->disk->cache == NULL || fs->disk->ops->block_ptr != NULL) return;
+    if (length == 0 || offset >= inode->size) return;
+    if (offset + length > inode->size) length = inode->size - offset;
+
+    Readahead *readahead = fs->readahead;
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (offset + length - 1) / BLOCK_SIZE;
+    uint32_t end_of_file = (inode->size - 1) / BLOCK_SIZE + 1;
+
+    pthread_mutex_lock(&readahead->lock);
+    ReadaheadStream *stream = &readahead->streams[inode_number % READAHEAD_STREAMS];
+    bool sequential;
+    if (stream->inode != inode_number) {
+        // a stream is assumed from the start of a file, anywhere else it needs a second read
+        memset(stream, 0, sizeof(ReadaheadStream));
+        stream->inode  = inode_number;
+        stream->window = READAHEAD_MIN_BLOCKS;
+        sequential = (offset == 0);
+    } else {
+        size_t stride = (offset > stream->offset) ? offset - stream->offset : 0;
+        sequential = offset == stream->offset + stream->length ||
+                     (stride != 0 && stride == stream->stride && stride <= (size_t)stream->window * BLOCK_SIZE);
+        stream->stride = stride;
+    }
+    stream->offset = offset;
+    stream->length = length;
+
+    if (!sequential) {
+        readahead->stats.random++;
+        stream->window = (stream->window / 2 > READAHEAD_MIN_BLOCKS) ? stream->window / 2 : READAHEAD_MIN_BLOCKS;
+        stream->ahead  = last + 1;
+        pthread_mutex_unlock(&readahead->lock);
+        return;
+    }
+    readahead->stats.sequential++;
+
+    // A record spanning the whole window is read in one request by the reader
+    // itself, prefetching the next one would only add a copy through the cache
+    if (last - first + 1 >= stream->window && first >= stream->ahead) {
+        readahead->stats.covered++;
+        stream->ahead = last + 1;
+        pthread_mutex_unlock(&readahead->lock);
+        return;
+    }
+    // wait until less than a window is left ahead of the reader
+    if (stream->ahead > last + 1 + stream->window) {
+        pthread_mutex_unlock(&readahead->lock);
+        return;
+    }
+    // the reader is inside the previous window, so it paid off
+    if (first < stream->ahead) {
+        stream->window = (stream->window * 2 < READAHEAD_MAX_BLOCKS) ? stream->window * 2 : READAHEAD_MAX_BLOCKS;
+    }
+    // a window must fit in the cache next to the blocks being read
+    size_t room = cache_capacity(fs->disk) / 4;
+    if (stream->window > room) stream->window = (uint32_t)room;
+    uint32_t window = stream->window;
+
+    // A small read past everything requested so far fetches its window right
+    // away together with its own blocks, the reader would wait for them anyway.
+    // Otherwise the window after the one being read goes to the worker.
+    bool sync = first >= stream->ahead && last - first + 1 < window;
+    uint32_t start = sync ? first : (stream->ahead > last + 1) ? stream->ahead : last + 1;
+    if (window == 0 || start >= end_of_file) {
+        pthread_mutex_unlock(&readahead->lock);
+        return;
+    }
+    uint32_t end = (end_of_file - start > window) ? start + window : end_of_file;
+
+    ReadaheadRun runs[READAHEAD_QUEUE_RUNS];
+    size_t count = readahead_map(fs, inode, start, &end, end_of_file, runs);
+    stream->ahead = (end > start) ? end : start + (end_of_file - start < window ? end_of_file - start : window);
+    readahead->stats.windows++;
+    readahead->stats.runs += count;
+    for (size_t i = 0; i < count; i++) readahead->stats.blocks += runs[i].count;
+    if (sync) readahead->stats.inline_runs += count;
+
+    if (!sync && !readahead->started && !readahead->failed) {
+        if (pthread_create(&readahead->thread, NULL, readahead_thread, readahead) != 0) {
+            perror("fs_readahead: Error starting the readahead worker has failed, prefetching inline");
+            readahead->failed = true;
+        } else {
+            readahead->started = true;
+        }
+    }
+    pthread_mutex_unlock(&readahead->lock);
+
+    readahead_issue(fs, readahead, runs, count, sync);
+}
+
+/* Turns on sequential readahead for a file system, fs_mount does it by default */
+bool fs_readahead_enable(FileSystem *fs)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("fs_readahead_enable: Error fs or disk is invalid (NULL)");
+        return false;
+    }
+    if (fs->readahead != NULL) return true;
+
+    Readahead *readahead = calloc(1, sizeof(Readahead));
+    if (readahead == NULL) {
+        perror("fs_readahead_enable: Error allocating the stream table has failed");
+        return false;
+    }
+    readahead->disk = fs->disk;
+    slab_pool_init(&readahead->vectors, READAHEAD_RUN_BLOCKS * sizeof(BlockVec), READAHEAD_QUEUE_RUNS);
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) readahead->streams[i].inode = SIZE_MAX;
+    pthread_mutex_init(&readahead->lock, NULL);
+    pthread_cond_init(&readahead->wake, NULL);
+    fs->readahead = readahead;
+    return true;
+}
+
+/* Stops the worker, runs still queued are dropped */
+void fs_readahead_disable(FileSystem *fs)
+{
+    if (fs == NULL || fs->readahead == NULL) return;
+    Readahead *readahead = fs->readahead;
+
+    pthread_mutex_lock(&readahead->lock);
+    readahead->stop = true;
+    pthread_cond_signal(&readahead->wake);
+    pthread_mutex_unlock(&readahead->lock);
+    if (readahead->started) pthread_join(readahead->thread, NULL);
+
+    // reserved buffers nobody is going to read are handed back
+    for (; readahead->count > 0; readahead->count--) {
+        ReadaheadLoad *load = &readahead->queue[readahead->head];
+        cache_prefetch_complete(readahead->disk, load->vec, load->count, false);
+        slab_free(&readahead->vectors, load->vec);
+        readahead->head = (readahead->head + 1) % READAHEAD_QUEUE_RUNS;
+    }
+
+    fs->readahead = NULL;
+    slab_pool_destroy(&readahead->vectors);
+    pthread_cond_destroy(&readahead->wake);
+    pthread_mutex_destroy(&readahead->lock);
+    free(readahead);
+}
+
+/* Snapshot of the stream detector counters */
+ReadaheadStats fs_readahead_stats(FileSystem *fs)
+{
+    ReadaheadStats stats = {0};
+    if (fs == NULL || fs->readahead == NULL) return stats;
+    pthread_mutex_lock(&fs->readahead->lock);
+    stats = fs->readahead->stats;
+    pthread_mutex_unlock(&fs->readahead->lock);
+    return stats;
+}
@@ -0,0 +1,203 @@
+#include "fs.h"
+#include "writeback.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Write-back
+ * In write-back mode file data is buffered in the disk write queue and
+ * metadata in the buffer cache and inode cache, so bursts of small writes
+ * and overwrites are absorbed in memory. A flusher thread wakes up every
+ * interval and writes everything back once the oldest unwritten change is
+ * older than expire_ms, or once dirty_ratio percent of the cache and queue
+ * slots are dirty. That bounds what a crash can lose to roughly expire_ms of
+ * work, bitmap included. fs_sync and fs_fsync write back and flush the
+ * device on demand. With delalloc_blocks set, file data written past the
+ * end of a file also waits for its blocks until it is written back (see
+ * delalloc.c). */
+
+struct Writeback {
+    WritebackConfig config;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    bool            stop;
+    uint64_t        dirtied_ns;     // First change since the last write-back, 0 when clean
+    WritebackStats  stats;
+};
+
+static uint64_t writeback_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Percent of the cache, queue and delayed allocation slots holding unwritten blocks
+static uint32_t writeback_dirty_percent(FileSystem *fs)
+{
+    size_t cache_capacity, queue_capacity, delalloc_capacity;
+    size_t dirty = cache_dirty_count(fs->disk, &cache_capacity) + disk_queue_count(fs->disk, &queue_capacity)
+                 + delalloc_pending(fs, &delalloc_capacity);
+    size_t capacity = cache_capacity + queue_capacity + delalloc_capacity;
+    return capacity ? (uint32_t)(100 * dirty / capacity) : 0;
+}
+
+/* Writes the dirty inodes, the bitmap and every buffered block back to the
+ * backend, and makes them durable when durable is set */
+bool fs_writeback(FileSystem *fs, bool durable)
+{
+    if (fs == NULL || fs->disk == NULL) {
+        perror("fs_writeback: Error fs or disk is invalid (NULL)");
+        return false;
+    }
+
+    // the in-core metadata is copied into cache buffers under the fs lock,
+    // so the flusher never sees an inode or the bitmap halfway through an update
+    pthread_mutex_lock(&fs->lock);
+    if (fs->writeback != NULL) {
+        __atomic_store_n(&fs->writeback->dirtied_ns, 0, __ATOMIC_RELAXED);
+    }
+    bool ok = delalloc_flush_all(fs);
+    ok = icache_flush(fs) && ok;
+    if (fs->bitmap != NULL && fs->bitmap->dirty) {
+        ok = save_bitmap(fs) && ok;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (durable) {
+        if (fs->writeback != NULL) {
+            pthread_mutex_lock(&fs->writeback->lock);
+            fs->writeback->stats.syncs++;
+            pthread_mutex_unlock(&fs->writeback->lock);
+        }
+        return disk_sync(fs->disk) && ok;
+    }
+    return disk_writeback(fs->disk) && ok;
+}
+
+static void * writeback_thread(void *arg)
+{
+    FileSystem *fs = arg;
+    Writeback *writeback = fs->writeback;
+
+    pthread_mutex_lock(&writeback->lock);
+    while (!writeback->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t ns = deadline.tv_nsec + (uint64_t)writeback->config.interval_ms * 1000000ULL;
+        deadline.tv_sec  += ns / 1000000000ULL;
+        deadline.tv_nsec  = ns % 1000000000ULL;
+        while (!writeback->stop && pthread_cond_timedwait(&writeback->wake, &writeback->lock, &deadline) != ETIMEDOUT);
+        if (writeback->stop) break;
+        writeback->stats.wakeups++;
+        pthread_mutex_unlock(&writeback->lock);
+
+        uint64_t dirtied = __atomic_load_n(&writeback->dirtied_ns, __ATOMIC_RELAXED);
+        bool expired = dirtied != 0 && writeback_now() - dirtied >= (uint64_t)writeback->config.expire_ms * 1000000ULL;
+        bool ratio = !expired && writeback_dirty_percent(fs) >= writeback->config.dirty_ratio;
+        if ((expired || ratio) && !fs_writeback(fs, false)) {
+            fprintf(stderr, "writeback_thread: Error writing back dirty blocks has failed\n");
+        }
+
+        pthread_mutex_lock(&writeback->lock);
+        if (expired) writeback->stats.expired++;
+        if (ratio) writeback->stats.ratio++;
+    }
+    pthread_mutex_unlock(&writeback->lock);
+    return NULL;
+}
+
+/* Switches a mounted file system to write-back mode: data writes are buffered
+ * in a write queue (set up with config->queue_blocks slots when the disk has
+ * none) and a flusher thread writes back on age and dirty ratio. A NULL config
+ * takes the WRITEBACK_* defaults. */
+bool fs_writeback_enable(FileSystem *fs, const WritebackConfig *config)
+{
+    if (fs == NULL || fs->disk == NULL || !fs->disk->mounted) {
+        fprintf(stderr, "fs_writeback_enable: Error file system is not mounted\n");
+        return false;
+    }
+    if (fs->writeback != NULL) return true;
+
+    WritebackConfig defaults = {
+        .interval_ms  = WRITEBACK_INTERVAL_MS,
+        .expire_ms    = WRITEBACK_EXPIRE_MS,
+        .dirty_ratio  = WRITEBACK_DIRTY_RATIO,
+        .queue_blocks = WRITEBACK_QUEUE_BLOCKS,
+        .delalloc_blocks = WRITEBACK_DELALLOC_BLOCKS,
+    };
+    if (config == NULL) config = &defaults;
+    if (config->interval_ms == 0) {
+        fprintf(stderr, "fs_writeback_enable: Error the flusher interval must be positive\n");
+        return false;
+    }
+
+    Writeback *writeback = calloc(1, sizeof(Writeback));
+    if (writeback == NULL) {
+        perror("fs_writeback_enable: Error allocating the flusher has failed");
+        return false;
+    }
+    writeback->config = *config;
+    if (fs->disk->queue == NULL && config->queue_blocks > 0 && !disk_queue_enable(fs->disk, config->queue_blocks)) {
+        fprintf(stderr, "fs_writeback_enable: Warning write queue is unavailable, data is written through\n");
+    }
+    if (config->delalloc_blocks > 0 && !fs_delalloc_enable(fs, config->delalloc_blocks)) {
+        fprintf(stderr, "fs_writeback_enable: Warning delayed allocation is unavailable, blocks are allocated by fs_write\n");
+    }
+
+    pthread_mutex_init(&writeback->lock, NULL);
+    pthread_cond_init(&writeback->wake, NULL);
+    fs->writeback = writeback;
+    if (pthread_create(&writeback->thread, NULL, writeback_thread, fs) != 0) {
+        perror("fs_writeback_enable: Error starting the flusher thread has failed");
+        fs->writeback = NULL;
+        pthread_cond_destroy(&writeback->wake);
+        pthread_mutex_destroy(&writeback->lock);
+        free(writeback);
+        return false;
+    }
+    return true;
+}
+
+/* Stops the flusher thread and allocates the file data still waiting for blocks,
+ * buffered blocks stay where they are until the next sync */
+void fs_writeback_disable(FileSystem *fs)
+{
+    if (fs == NULL || fs->writeback == NULL) return;
+    Writeback *writeback = fs->writeback;
+
+    pthread_mutex_lock(&writeback->lock);
+    writeback->stop = true;
+    pthread_cond_signal(&writeback->wake);
+    pthread_mutex_unlock(&writeback->lock);
+    pthread_join(writeback->thread, NULL);
+    fs_delalloc_disable(fs);
+
+    fs->writeback = NULL;
+    pthread_cond_destroy(&writeback->wake);
+    pthread_mutex_destroy(&writeback->lock);
+    free(writeback);
+}
+
+/* Records a change for the flusher's age threshold, only the first change after a write-back counts */
+void fs_writeback_dirtied(FileSystem *fs)
+{
+    if (fs == NULL || fs->writeback == NULL) return;
+    uint64_t clean = 0;
+    __atomic_compare_exchange_n(&fs->writeback->dirtied_ns, &clean, writeback_now(), false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Snapshot of the flusher counters */
+WritebackStats fs_writeback_stats(FileSystem *fs)
+{
+    WritebackStats stats = {0};
+    if (fs == NULL || fs->writeback == NULL) return stats;
+    pthread_mutex_lock(&fs->writeback->lock);
+    stats = fs->writeback->stats;
+    pthread_mutex_unlock(&fs->writeback->lock);
+    return stats;
+}